@@ -0,0 +1,442 @@
+#include "block_compressed.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "cutils.h"
+
+#define CHUNK_CACHE_BUCKETS 4096
+
+typedef struct chunk_cache_entry chunk_cache_entry_t;
+struct chunk_cache_entry
+{
+  /* images are identified by file, so opening one twice shares entries */
+  dev_t dev;
+  ino_t ino;
+  uint64_t chunk;
+  uint32_t size;
+  uint8_t *data;
+  chunk_cache_entry_t *hash_next;
+  chunk_cache_entry_t *lru_prev;
+  chunk_cache_entry_t *lru_next;
+};
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  chunk_cache_entry_t *buckets[CHUNK_CACHE_BUCKETS];
+  chunk_cache_entry_t *lru_head; /* most recently used */
+  chunk_cache_entry_t *lru_tail;
+  uint64_t used;
+  uint64_t capacity;
+} chunk_cache_t;
+
+static chunk_cache_t chunk_cache = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .capacity = COMPRESSED_CACHE_SIZE,
+};
+
+typedef struct
+{
+  int fd;
+  dev_t dev;
+  ino_t ino;
+  int chunk_bits;
+  uint32_t chunk_size;
+  uint64_t virtual_size;
+  int64_t nb_sectors;
+  uint64_t chunk_count;
+  uint64_t *index;
+  uint64_t hits;
+  uint64_t misses;
+  char filename[PATH_MAX];
+} block_device_compressed_t;
+
+static unsigned chunk_cache_hash(dev_t dev, ino_t ino, uint64_t chunk)
+{
+  uint64_t h = ((uint64_t)dev * 31 + ino) * 0x9e3779b97f4a7c15ULL + chunk;
+  return (h ^ (h >> 29)) & (CHUNK_CACHE_BUCKETS - 1);
+}
+
+static void chunk_cache_lru_unlink(chunk_cache_t *cache, chunk_cache_entry_t *e)
+{
+  if (e->lru_prev)
+    e->lru_prev->lru_next = e->lru_next;
+  else
+    cache->lru_head = e->lru_next;
+  if (e->lru_next)
+    e->lru_next->lru_prev = e->lru_prev;
+  else
+    cache->lru_tail = e->lru_prev;
+}
+
+static void chunk_cache_lru_push(chunk_cache_t *cache, chunk_cache_entry_t *e)
+{
+  e->lru_prev = NULL;
+  e->lru_next = cache->lru_head;
+  if (cache->lru_head)
+    cache->lru_head->lru_prev = e;
+  else
+    cache->lru_tail = e;
+  cache->lru_head = e;
+}
+
+static void chunk_cache_evict(chunk_cache_t *cache)
+{
+  chunk_cache_entry_t *e = cache->lru_tail, **pe;
+
+  chunk_cache_lru_unlink(cache, e);
+  pe = &cache->buckets[chunk_cache_hash(e->dev, e->ino, e->chunk)];
+  while (*pe != e)
+    pe = &(*pe)->hash_next;
+  *pe = e->hash_next;
+  cache->used -= e->size;
+  free(e->data);
+  free(e);
+}
+
+/* copy part of a cached chunk out, must be called with the lock held */
+static bool chunk_cache_lookup(chunk_cache_t *cache, block_device_compressed_t *bc,
+    uint64_t chunk, uint32_t offset, uint8_t *buf, uint32_t len)
+{
+  chunk_cache_entry_t *e;
+
+  for (e = cache->buckets[chunk_cache_hash(bc->dev, bc->ino, chunk)]; e; e = e->hash_next)
+  {
+    if (e->chunk == chunk && e->ino == bc->ino && e->dev == bc->dev)
+    {
+      chunk_cache_lru_unlink(cache, e);
+      chunk_cache_lru_push(cache, e);
+      memcpy(buf, e->data + offset, len);
+      return true;
+    }
+  }
+  return false;
+}
+
+/* take ownership of data, must be called with the lock held */
+static void chunk_cache_insert(chunk_cache_t *cache, block_device_compressed_t *bc,
+    uint64_t chunk, uint8_t *data)
+{
+  chunk_cache_entry_t *e;
+  unsigned h = chunk_cache_hash(bc->dev, bc->ino, chunk);
+
+  for (e = cache->buckets[h]; e; e = e->hash_next)
+  {
+    if (e->chunk == chunk && e->ino == bc->ino && e->dev == bc->dev)
+    {
+      /* another device filled it meanwhile */
+      free(data);
+      return;
+    }
+  }
+  while (cache->lru_tail && cache->used + bc->chunk_size > cache->capacity)
+    chunk_cache_evict(cache);
+
+  e = mallocz(sizeof(*e));
+  e->dev = bc->dev;
+  e->ino = bc->ino;
+  e->chunk = chunk;
+  e->size = bc->chunk_size;
+  e->data = data;
+  e->hash_next = cache->buckets[h];
+  cache->buckets[h] = e;
+  chunk_cache_lru_push(cache, e);
+  cache->used += e->size;
+}
+
+static uint8_t *compressed_load_chunk(block_device_compressed_t *bc, uint64_t chunk)
+{
+  uint64_t start = bc->index[chunk], csize = bc->index[chunk + 1] - start;
+  uint8_t *data, *cbuf;
+  uLongf dlen;
+
+  data = mallocz(bc->chunk_size);
+  if (!data)
+    return NULL;
+  if (csize == 0)
+    return data;
+  if (csize == bc->chunk_size)
+  {
+    if (block_device_pread(bc->fd, data, csize, start) < 0)
+      goto fail;
+    return data;
+  }
+
+  cbuf = malloc(csize);
+  if (!cbuf || block_device_pread(bc->fd, cbuf, csize, start) < 0)
+  {
+    free(cbuf);
+    goto fail;
+  }
+  dlen = bc->chunk_size;
+  if (uncompress(data, &dlen, cbuf, csize) != Z_OK)
+  {
+    free(cbuf);
+    goto fail;
+  }
+  free(cbuf);
+  return data;
+
+fail:
+  free(data);
+  return NULL;
+}
+
+static int64_t compressed_get_sector_count(block_device_t *bs)
+{
+  block_device_compressed_t *bc = bs->opaque;
+  return bc->nb_sectors;
+}
+
+static int compressed_read_async(block_device_t *bs, uint64_t sector_num,
+    uint8_t *buf, int size,
+    block_device_complete_func *cb, void *opaque)
+{
+  block_device_compressed_t *bc = bs->opaque;
+  uint64_t offset, chunk;
+  uint32_t chunk_offset, len;
+  int64_t count;
+  uint8_t *data;
+  bool found;
+
+  if (block_device_out_of_range(sector_num, size, bc->nb_sectors))
+    return -1;
+
+  offset = sector_num * SECTOR_SIZE;
+  count = (int64_t)size * SECTOR_SIZE;
+  while (count > 0)
+  {
+    chunk = offset >> bc->chunk_bits;
+    chunk_offset = offset & (bc->chunk_size - 1);
+    len = bc->chunk_size - chunk_offset;
+    if (len > count)
+      len = count;
+
+    pthread_mutex_lock(&chunk_cache.lock);
+    found = chunk_cache_lookup(&chunk_cache, bc, chunk, chunk_offset, buf, len);
+    pthread_mutex_unlock(&chunk_cache.lock);
+    if (found)
+    {
+      bc->hits++;
+    }
+    else
+    {
+      bc->misses++;
+      data = compressed_load_chunk(bc, chunk);
+      if (!data)
+        return -1;
+      memcpy(buf, data + chunk_offset, len);
+      pthread_mutex_lock(&chunk_cache.lock);
+      chunk_cache_insert(&chunk_cache, bc, chunk, data);
+      pthread_mutex_unlock(&chunk_cache.lock);
+    }
+    offset += len;
+    buf += len;
+    count -= len;
+  }
+  return 0;
+}
+
+static int compressed_write_async(block_device_t *bs, uint64_t sector_num,
+    uint8_t *buf, int size,
+    block_device_complete_func *cb, void *opaque)
+{
+  return -1;
+}
+
+static void compressed_print_stats(block_device_t *bs, FILE *f)
+{
+  block_device_compressed_t *bc = bs->opaque;
+  uint64_t total = bc->hits + bc->misses;
+
+  fprintf(f, "compressed %s: chunk cache hits %" PRIu64 ", misses %" PRIu64
+      " (%.1f%% hit rate), cache %" PRIu64 "/%" PRIu64 " KiB\n",
+      bc->filename, bc->hits, bc->misses,
+      total ? 100.0 * bc->hits / total : 0.0,
+      chunk_cache.used / 1024, chunk_cache.capacity / 1024);
+}
+
+bool block_compressed_probe(const uint8_t *buf, int len)
+{
+  return len >= COMPRESSED_HEADER_SIZE && get_le32(buf) == COMPRESSED_MAGIC;
+}
+
+block_device_t *block_compressed_open(const char *filename, block_device_mode_enum mode)
+{
+  block_device_t *bs;
+  block_device_compressed_t *bc;
+  uint8_t header[COMPRESSED_HEADER_SIZE];
+  uint8_t *index_buf;
+  uint64_t i, index_offset;
+  struct stat st;
+  int fd;
+
+  if (mode == BF_MODE_RW)
+  {
+    printf("%s: compressed images are read-only\n", filename);
+    exit(1);
+  }
+  fd = open(filename, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0)
+  {
+    perror(filename);
+    exit(1);
+  }
+  if (block_device_pread(fd, header, sizeof(header), 0) < 0 ||
+      !block_compressed_probe(header, sizeof(header)) ||
+      get_le32(header + 4) != COMPRESSED_VERSION)
+  {
+    printf("%s: not a supported compressed image\n", filename);
+    exit(1);
+  }
+
+  bc = mallocz(sizeof(*bc));
+  bc->fd = fd;
+  bc->dev = st.st_dev;
+  bc->ino = st.st_ino;
+  pstrcpy(bc->filename, sizeof(bc->filename), filename);
+  bc->chunk_bits = get_le32(header + 8);
+  bc->virtual_size = get_le64(header + 16);
+  bc->chunk_count = get_le64(header + 24);
+  index_offset = get_le64(header + 32);
+  if (bc->chunk_bits < COMPRESSED_MIN_CHUNK_BITS ||
+      bc->chunk_bits > COMPRESSED_MAX_CHUNK_BITS ||
+      bc->chunk_count != (bc->virtual_size + (1 << bc->chunk_bits) - 1) >> bc->chunk_bits)
+  {
+    printf("%s: corrupted compressed image header\n", filename);
+    exit(1);
+  }
+  bc->chunk_size = 1 << bc->chunk_bits;
+  bc->nb_sectors = bc->virtual_size / SECTOR_SIZE;
+
+  bc->index = malloc((bc->chunk_count + 1) * sizeof(uint64_t));
+  index_buf = malloc((bc->chunk_count + 1) * 8);
+  if (!bc->index || !index_buf ||
+      block_device_pread(fd, index_buf, (bc->chunk_count + 1) * 8, index_offset) < 0)
+  {
+    printf("%s: could not read chunk index\n", filename);
+    exit(1);
+  }
+  for (i = 0; i <= bc->chunk_count; i++)
+  {
+    bc->index[i] = get_le64(index_buf + i * 8);
+    if (i > 0 && (bc->index[i] < bc->index[i - 1] ||
+          bc->index[i] - bc->index[i - 1] > bc->chunk_size))
+    {
+      printf("%s: corrupted chunk index\n", filename);
+      exit(1);
+    }
+  }
+  free(index_buf);
+
+  bs = mallocz(sizeof(*bs));
+  bs->opaque = bc;
+  bs->get_sector_count = compressed_get_sector_count;
+  bs->read_async = compressed_read_async;
+  bs->write_async = compressed_write_async;
+  bs->print_stats = compressed_print_stats;
+
+  return bs;
+}
+
+static bool is_zero(const uint8_t *buf, uint32_t len)
+{
+  uint32_t i;
+  for (i = 0; i < len; i++)
+  {
+    if (buf[i])
+      return false;
+  }
+  return true;
+}
+
+int block_compressed_create(const char *filename, block_device_t *src, int chunk_bits)
+{
+  uint8_t header[COMPRESSED_HEADER_SIZE];
+  uint8_t *index_buf, *chunk_buf, *cbuf;
+  uint64_t virtual_size, chunk_count, chunk, offset, index_size;
+  uint32_t chunk_size, sectors;
+  int64_t nb_sectors;
+  uLongf clen;
+  int fd, ret = -1;
+
+  if (chunk_bits < COMPRESSED_MIN_CHUNK_BITS || chunk_bits > COMPRESSED_MAX_CHUNK_BITS)
+  {
+    printf("invalid chunk size: %d bits\n", chunk_bits);
+    return -1;
+  }
+  chunk_size = 1 << chunk_bits;
+  nb_sectors = src->get_sector_count(src);
+  virtual_size = nb_sectors * SECTOR_SIZE;
+  chunk_count = (virtual_size + chunk_size - 1) >> chunk_bits;
+  index_size = (chunk_count + 1) * 8;
+
+  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    perror(filename);
+    return -1;
+  }
+  index_buf = mallocz(index_size);
+  chunk_buf = malloc(chunk_size);
+  cbuf = malloc(compressBound(chunk_size));
+  if (!index_buf || !chunk_buf || !cbuf)
+    goto done;
+
+  offset = COMPRESSED_HEADER_SIZE + index_size;
+  for (chunk = 0; chunk < chunk_count; chunk++)
+  {
+    put_le64(index_buf + chunk * 8, offset);
+    sectors = min_int(chunk_size / SECTOR_SIZE, nb_sectors - chunk * (chunk_size / SECTOR_SIZE));
+    memset(chunk_buf, 0, chunk_size);
+    if (src->read_async(src, chunk * (chunk_size / SECTOR_SIZE), chunk_buf, sectors, NULL, NULL) < 0)
+      goto done;
+    if (is_zero(chunk_buf, chunk_size))
+      continue;
+    clen = compressBound(chunk_size);
+    if (compress2(cbuf, &clen, chunk_buf, chunk_size, Z_BEST_COMPRESSION) != Z_OK)
+      goto done;
+    if (clen >= chunk_size)
+    {
+      /* incompressible: store as is */
+      if (block_device_pwrite(fd, chunk_buf, chunk_size, offset) < 0)
+        goto done;
+      offset += chunk_size;
+    }
+    else
+    {
+      if (block_device_pwrite(fd, cbuf, clen, offset) < 0)
+        goto done;
+      offset += clen;
+    }
+  }
+  put_le64(index_buf + chunk_count * 8, offset);
+
+  memset(header, 0, sizeof(header));
+  put_le32(header, COMPRESSED_MAGIC);
+  put_le32(header + 4, COMPRESSED_VERSION);
+  put_le32(header + 8, chunk_bits);
+  put_le64(header + 16, virtual_size);
+  put_le64(header + 24, chunk_count);
+  put_le64(header + 32, COMPRESSED_HEADER_SIZE);
+  if (block_device_pwrite(fd, index_buf, index_size, COMPRESSED_HEADER_SIZE) < 0 ||
+      block_device_pwrite(fd, header, sizeof(header), 0) < 0)
+    goto done;
+  ret = 0;
+
+done:
+  if (ret < 0)
+    perror(filename);
+  free(index_buf);
+  free(chunk_buf);
+  free(cbuf);
+  close(fd);
+  return ret;
+}
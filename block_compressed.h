@@ -0,0 +1,32 @@
+#ifndef __BLOCK_COMPRESSED_H__
+#define __BLOCK_COMPRESSED_H__
+
+#include "block_device.h"
+
+/*
+ * Read-only compressed image, all fields little endian:
+ *
+ *   0  magic "SCMP"          4  version
+ *   8  chunk_bits           12  reserved
+ *  16  virtual_size (bytes) 24  chunk_count
+ *  32  index_offset
+ *
+ * The index holds chunk_count + 1 file offsets: chunk i is stored in
+ * [index[i], index[i + 1]). Each chunk is an independent zlib stream,
+ * except that an empty chunk reads as zeros and a chunk as large as
+ * the chunk size is stored uncompressed.
+ */
+#define COMPRESSED_MAGIC 0x504d4353
+#define COMPRESSED_VERSION 1
+#define COMPRESSED_HEADER_SIZE 40
+#define COMPRESSED_DEFAULT_CHUNK_BITS 16
+#define COMPRESSED_MIN_CHUNK_BITS 12
+#define COMPRESSED_MAX_CHUNK_BITS 22
+
+/* decompressed chunks are cached in memory, shared by all images */
+#define COMPRESSED_CACHE_SIZE (64 << 20)
+
+extern bool block_compressed_probe(const uint8_t *buf, int len);
+extern block_device_t *block_compressed_open(const char *filename, block_device_mode_enum mode);
+extern int block_compressed_create(const char *filename, block_device_t *src, int chunk_bits);
+#endif
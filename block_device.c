@@ -0,0 +1,663 @@
+#define _GNU_SOURCE
+#include "block_device.h"
+#include "block_overlay.h"
+#include "block_qcow2.h"
+#include "block_compressed.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "cutils.h"
+
+int block_device_pread(int fd, uint8_t *buf, uint64_t len, uint64_t offset)
+{
+  ssize_t ret;
+  while (len > 0)
+  {
+    ret = pread(fd, buf, len, offset);
+    if (ret < 0)
+      return -1;
+    if (ret == 0)
+    {
+      /* past the end of file: unwritten area of a sparse image */
+      memset(buf, 0, len);
+      break;
+    }
+    buf += ret;
+    offset += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+int block_device_pwrite(int fd, const uint8_t *buf, uint64_t len, uint64_t offset)
+{
+  ssize_t ret;
+  while (len > 0)
+  {
+    ret = pwrite(fd, buf, len, offset);
+    if (ret <= 0)
+      return -1;
+    buf += ret;
+    offset += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+/* resolve a backing file name relative to the directory of the image using it */
+void block_device_backing_path(char *buf, int buf_size, const char *filename, const char *backing)
+{
+  const char *p;
+
+  if (backing[0] == '/' || !(p = strrchr(filename, '/')))
+  {
+    pstrcpy(buf, buf_size, backing);
+    return;
+  }
+  pstrcpy(buf, min_int(buf_size, p - filename + 2), filename);
+  pstrcat(buf, buf_size, backing);
+}
+
+int block_device_punch_hole(int fd, uint64_t offset, uint64_t len)
+{
+  return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+}
+
+int block_device_flush(block_device_t *bs)
+{
+  if (!bs->flush)
+    return 0;
+  return bs->flush(bs);
+}
+
+int block_device_discard(block_device_t *bs, uint64_t sector_num, int size)
+{
+  if (!bs->discard)
+    return 0;
+  return bs->discard(bs, sector_num, size);
+}
+
+int block_device_write_zeroes_fallback(block_device_t *bs, uint64_t sector_num, int size)
+{
+  static const uint8_t zero_buf[64 * SECTOR_SIZE];
+  int n;
+
+  while (size > 0)
+  {
+    n = min_int(size, sizeof(zero_buf) / SECTOR_SIZE);
+    if (bs->write_async(bs, sector_num, (uint8_t*)zero_buf, n, NULL, NULL) < 0)
+      return -1;
+    sector_num += n;
+    size -= n;
+  }
+  return 0;
+}
+
+int block_device_write_zeroes(block_device_t *bs, uint64_t sector_num, int size)
+{
+  if (!bs->write_zeroes)
+    return block_device_write_zeroes_fallback(bs, sector_num, size);
+  return bs->write_zeroes(bs, sector_num, size);
+}
+
+static int block_device_rw_vec(block_device_t *bs, uint64_t sector_num,
+    const struct iovec *iov, int iov_count, bool write)
+{
+  int i, n, ret;
+
+  for (i = 0; i < iov_count; i++)
+  {
+    n = iov[i].iov_len / SECTOR_SIZE;
+    if (write)
+      ret = bs->write_async(bs, sector_num, iov[i].iov_base, n, NULL, NULL);
+    else
+      ret = bs->read_async(bs, sector_num, iov[i].iov_base, n, NULL, NULL);
+    if (ret < 0)
+      return -1;
+    sector_num += n;
+  }
+  return 0;
+}
+
+int block_device_readv(block_device_t *bs, uint64_t sector_num,
+    const struct iovec *iov, int iov_count)
+{
+  if (!bs->readv)
+    return block_device_rw_vec(bs, sector_num, iov, iov_count, false);
+  return bs->readv(bs, sector_num, iov, iov_count);
+}
+
+int block_device_writev(block_device_t *bs, uint64_t sector_num,
+    const struct iovec *iov, int iov_count)
+{
+  if (!bs->writev)
+    return block_device_rw_vec(bs, sector_num, iov, iov_count, true);
+  return bs->writev(bs, sector_num, iov, iov_count);
+}
+
+/* raw image */
+static int64_t bf_get_sector_count(block_device_t *bs)
+{
+  block_device_file_t *bf = bs->opaque;
+  return bf->nb_sectors;
+}
+
+static int bf_read_async(block_device_t *bs, uint64_t sector_num,
+    uint8_t *buf, int size,
+    block_device_complete_func *cb, void *opaque)
+{
+  block_device_file_t *bf = bs->opaque;
+
+  if (bf->fd < 0)
+    return -1;
+  return block_device_pread(bf->fd, buf, (uint64_t)size * SECTOR_SIZE, sector_num * SECTOR_SIZE);
+}
+
+static int bf_write_async(block_device_t *bs, uint64_t sector_num, uint8_t *buf, int size, block_device_complete_func *cb, void *opaque)
+{
+  block_device_file_t *bf = bs->opaque;
+  int ret;
+
+  switch(bf->mode)
+  {
+    case BF_MODE_RO:
+      ret = -1;
+      break;
+    case BF_MODE_RW:
+      ret = block_device_pwrite(bf->fd, buf, (uint64_t)size * SECTOR_SIZE, sector_num * SECTOR_SIZE);
+      break;
+    default:
+      abort();
+  }
+
+  return ret;
+}
+
+/* one preadv/pwritev; a short transfer is finished buffer by buffer */
+static int bf_rw_vec(block_device_file_t *bf, uint64_t sector_num,
+    const struct iovec *iov, int iov_count, bool write)
+{
+  uint64_t offset = sector_num * SECTOR_SIZE, done, skip;
+  ssize_t ret;
+  int i;
+
+  if (bf->fd < 0 || (write && bf->mode != BF_MODE_RW))
+    return -1;
+  if (write)
+    ret = pwritev(bf->fd, iov, iov_count, offset);
+  else
+    ret = preadv(bf->fd, iov, iov_count, offset);
+  if (ret < 0)
+    return -1;
+  done = ret;
+  for (i = 0; i < iov_count; offset += iov[i].iov_len, i++)
+  {
+    skip = done < iov[i].iov_len ? done : iov[i].iov_len;
+    done -= skip;
+    if (skip == iov[i].iov_len)
+      continue;
+    if (write)
+      ret = block_device_pwrite(bf->fd, (uint8_t*)iov[i].iov_base + skip,
+          iov[i].iov_len - skip, offset + skip);
+    else
+      ret = block_device_pread(bf->fd, (uint8_t*)iov[i].iov_base + skip,
+          iov[i].iov_len - skip, offset + skip);
+    if (ret < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int bf_readv(block_device_t *bs, uint64_t sector_num,
+    const struct iovec *iov, int iov_count)
+{
+  return bf_rw_vec(bs->opaque, sector_num, iov, iov_count, false);
+}
+
+static int bf_writev(block_device_t *bs, uint64_t sector_num,
+    const struct iovec *iov, int iov_count)
+{
+  return bf_rw_vec(bs->opaque, sector_num, iov, iov_count, true);
+}
+
+static int bf_flush(block_device_t *bs)
+{
+  block_device_file_t *bf = bs->opaque;
+
+  if (bf->mode != BF_MODE_RW)
+    return 0;
+  return fdatasync(bf->fd);
+}
+
+static int bf_discard(block_device_t *bs, uint64_t sector_num, int size)
+{
+  block_device_file_t *bf = bs->opaque;
+
+  if (bf->mode != BF_MODE_RW)
+    return -1;
+  /* discard is only a hint: ignore filesystems without hole punching */
+  block_device_punch_hole(bf->fd, sector_num * SECTOR_SIZE, (uint64_t)size * SECTOR_SIZE);
+  return 0;
+}
+
+static int bf_write_zeroes(block_device_t *bs, uint64_t sector_num, int size)
+{
+  block_device_file_t *bf = bs->opaque;
+  uint64_t offset = sector_num * SECTOR_SIZE, len = (uint64_t)size * SECTOR_SIZE;
+
+  if (bf->mode != BF_MODE_RW)
+    return -1;
+  if (fallocate(bf->fd, FALLOC_FL_ZERO_RANGE, offset, len) == 0 ||
+      block_device_punch_hole(bf->fd, offset, len) == 0)
+    return 0;
+  return block_device_write_zeroes_fallback(bs, sector_num, size);
+}
+
+block_device_t *block_device_raw_open(const char *filename, block_device_mode_enum mode)
+{
+  block_device_t *bs;
+  block_device_file_t *bf;
+  int64_t file_size;
+  int fd;
+
+  fd = open(filename, mode == BF_MODE_RW ? O_RDWR : O_RDONLY);
+  if (fd < 0)
+  {
+    perror(filename);
+    exit(1);
+  }
+
+  file_size = lseek(fd, 0, SEEK_END);
+
+  bs = malloc(sizeof(*bs));
+  memset(bs, 0, sizeof(*bs));
+
+  bf = malloc(sizeof(*bf));
+  memset(bf, 0, sizeof(*bf));
+
+  bf->mode = (mode == BF_MODE_RW) ? BF_MODE_RW : BF_MODE_RO;
+  bf->nb_sectors = file_size / 512;
+  bf->fd = fd;
+
+  bs->opaque = bf;
+  bs->get_sector_count = bf_get_sector_count;
+  bs->read_async = bf_read_async;
+  bs->write_async = bf_write_async;
+  bs->flush = bf_flush;
+  bs->discard = bf_discard;
+  bs->write_zeroes = bf_write_zeroes;
+  bs->readv = bf_readv;
+  bs->writev = bf_writev;
+
+  return bs;
+}
+
+/* snapshot: guest writes are kept in memory on top of a read-only base */
+static int64_t snapshot_get_sector_count(block_device_t *bs)
+{
+  block_device_snapshot_t *bss = bs->opaque;
+  return bss->nb_sectors;
+}
+
+static uint8_t *snapshot_arena_alloc(snapshot_arena_t *arena)
+{
+  snapshot_arena_chunk_t *chunk;
+  uint8_t *ptr;
+
+  if (arena->free_list)
+  {
+    ptr = arena->free_list;
+    arena->free_list = *(uint8_t**)ptr;
+    return ptr;
+  }
+  if (!arena->chunks || arena->chunk_used == SNAPSHOT_ARENA_CLUSTERS)
+  {
+    chunk = malloc(sizeof(*chunk) + SNAPSHOT_ARENA_CLUSTERS * SNAPSHOT_CLUSTER_SIZE);
+    if (!chunk)
+      return NULL;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->chunk_used = 0;
+  }
+  return arena->chunks->data + (arena->chunk_used++) * SNAPSHOT_CLUSTER_SIZE;
+}
+
+static void snapshot_arena_free(snapshot_arena_t *arena, uint8_t *ptr)
+{
+  *(uint8_t**)ptr = arena->free_list;
+  arena->free_list = ptr;
+}
+
+/* clusters zeroed by the guest share this buffer until written again */
+static const uint8_t snapshot_zero_cluster[SNAPSHOT_CLUSTER_SIZE];
+
+static inline uint64_t snapshot_hash(uint64_t index)
+{
+  return index * 0x9e3779b97f4a7c15ULL;
+}
+
+static snapshot_cluster_t *snapshot_find(block_device_snapshot_t *bss, uint64_t index)
+{
+  uint64_t mask = bss->table_size - 1;
+  uint64_t i = snapshot_hash(index) & mask;
+  snapshot_cluster_t *c;
+
+  for (;;)
+  {
+    c = &bss->table[i];
+    if (!c->data)
+      return NULL;
+    if (c->index == index)
+      return c;
+    i = (i + 1) & mask;
+  }
+}
+
+static void snapshot_resize(block_device_snapshot_t *bss, uint64_t new_size)
+{
+  snapshot_cluster_t *old_table = bss->table;
+  uint64_t old_size = bss->table_size;
+  uint64_t i, j;
+
+  bss->table = mallocz(new_size * sizeof(bss->table[0]));
+  bss->table_size = new_size;
+  for (i = 0; i < old_size; i++)
+  {
+    if (!old_table[i].data)
+      continue;
+    j = snapshot_hash(old_table[i].index) & (new_size - 1);
+    while (bss->table[j].data)
+      j = (j + 1) & (new_size - 1);
+    bss->table[j] = old_table[i];
+  }
+  free(old_table);
+}
+
+static snapshot_cluster_t *snapshot_insert(block_device_snapshot_t *bss, uint64_t index)
+{
+  uint64_t mask, i;
+  snapshot_cluster_t *c;
+  uint8_t *data;
+
+  /* keep the load factor under 3/4 */
+  if ((bss->cluster_count + 1) * 4 > bss->table_size * 3)
+    snapshot_resize(bss, bss->table_size * 2);
+
+  data = snapshot_arena_alloc(&bss->arena);
+  if (!data)
+    return NULL;
+
+  mask = bss->table_size - 1;
+  i = snapshot_hash(index) & mask;
+  while (bss->table[i].data)
+    i = (i + 1) & mask;
+  c = &bss->table[i];
+  c->index = index;
+  c->data = data;
+  c->valid = 0;
+  bss->cluster_count++;
+  return c;
+}
+
+static void snapshot_remove(block_device_snapshot_t *bss, snapshot_cluster_t *c)
+{
+  uint64_t mask = bss->table_size - 1;
+  uint64_t i = c - bss->table, j = i, k;
+
+  if (c->data != snapshot_zero_cluster)
+    snapshot_arena_free(&bss->arena, c->data);
+  bss->cluster_count--;
+
+  /* backward shift deletion keeps the probe sequences intact */
+  for (;;)
+  {
+    j = (j + 1) & mask;
+    if (!bss->table[j].data)
+      break;
+    k = snapshot_hash(bss->table[j].index) & mask;
+    if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j)))
+    {
+      bss->table[i] = bss->table[j];
+      i = j;
+    }
+  }
+  bss->table[i].data = NULL;
+}
+
+static int snapshot_read_async(block_device_t *bs, uint64_t sector_num,
+    uint8_t *buf, int size,
+    block_device_complete_func *cb, void *opaque)
+{
+  block_device_snapshot_t *bss = bs->opaque;
+  block_device_t *base = bss->base;
+  snapshot_cluster_t *c;
+  int i, n, start, run;
+
+  if (block_device_out_of_range(sector_num, size, bss->nb_sectors))
+    return -1;
+  while (size > 0)
+  {
+    start = sector_num & (SNAPSHOT_CLUSTER_SECTORS - 1);
+    n = min_int(size, SNAPSHOT_CLUSTER_SECTORS - start);
+    c = snapshot_find(bss, sector_num / SNAPSHOT_CLUSTER_SECTORS);
+    if (!c)
+    {
+      if (base->read_async(base, sector_num, buf, n, NULL, NULL) < 0)
+        return -1;
+    }
+    else
+    {
+      for (i = 0; i < n; i += run)
+      {
+        if (c->valid & (1U << (start + i)))
+        {
+          memcpy(buf + i * SECTOR_SIZE, c->data + (start + i) * SECTOR_SIZE, SECTOR_SIZE);
+          run = 1;
+          continue;
+        }
+        /* read runs of unwritten sectors from the base in one go */
+        for (run = 1; i + run < n && !(c->valid & (1U << (start + i + run))); run++)
+          ;
+        if (base->read_async(base, sector_num + i, buf + i * SECTOR_SIZE, run, NULL, NULL) < 0)
+          return -1;
+      }
+    }
+    sector_num += n;
+    buf += n * SECTOR_SIZE;
+    size -= n;
+  }
+  return 0;
+}
+
+static int snapshot_write_async(block_device_t *bs, uint64_t sector_num,
+    uint8_t *buf, int size,
+    block_device_complete_func *cb, void *opaque)
+{
+  block_device_snapshot_t *bss = bs->opaque;
+  snapshot_cluster_t *c;
+  uint64_t index;
+  int n, start;
+
+  if (block_device_out_of_range(sector_num, size, bss->nb_sectors))
+    return -1;
+  while (size > 0)
+  {
+    start = sector_num & (SNAPSHOT_CLUSTER_SECTORS - 1);
+    n = min_int(size, SNAPSHOT_CLUSTER_SECTORS - start);
+    index = sector_num / SNAPSHOT_CLUSTER_SECTORS;
+    c = snapshot_find(bss, index);
+    if (!c)
+    {
+      c = snapshot_insert(bss, index);
+      if (!c)
+        return -1;
+    }
+    else if (c->data == snapshot_zero_cluster)
+    {
+      c->data = snapshot_arena_alloc(&bss->arena);
+      if (!c->data)
+      {
+        c->data = (uint8_t*)snapshot_zero_cluster;
+        return -1;
+      }
+      memset(c->data, 0, SNAPSHOT_CLUSTER_SIZE);
+    }
+    memcpy(c->data + start * SECTOR_SIZE, buf, n * SECTOR_SIZE);
+    c->valid |= ((n == 32) ? ~0U : ((1U << n) - 1)) << start;
+    sector_num += n;
+    buf += n * SECTOR_SIZE;
+    size -= n;
+  }
+  return 0;
+}
+
+/* apply fn to the clusters fully covered by a sector range */
+static int snapshot_for_each_cluster(block_device_snapshot_t *bss, uint64_t sector_num, int size,
+    int (*fn)(block_device_snapshot_t *bss, uint64_t index))
+{
+  uint64_t first, last, index;
+
+  if (block_device_out_of_range(sector_num, size, bss->nb_sectors))
+    return -1;
+  first = (sector_num + SNAPSHOT_CLUSTER_SECTORS - 1) / SNAPSHOT_CLUSTER_SECTORS;
+  last = (sector_num + size) / SNAPSHOT_CLUSTER_SECTORS;
+  for (index = first; index < last; index++)
+  {
+    if (fn(bss, index) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int snapshot_drop_cluster(block_device_snapshot_t *bss, uint64_t index)
+{
+  snapshot_cluster_t *c = snapshot_find(bss, index);
+  if (c)
+    snapshot_remove(bss, c);
+  return 0;
+}
+
+static int snapshot_zero_cluster_at(block_device_snapshot_t *bss, uint64_t index)
+{
+  snapshot_cluster_t *c = snapshot_find(bss, index);
+
+  if (!c)
+  {
+    c = snapshot_insert(bss, index);
+    if (!c)
+      return -1;
+  }
+  if (c->data != snapshot_zero_cluster)
+    snapshot_arena_free(&bss->arena, c->data);
+  c->data = (uint8_t*)snapshot_zero_cluster;
+  c->valid = (1ULL << SNAPSHOT_CLUSTER_SECTORS) - 1;
+  return 0;
+}
+
+static int snapshot_discard(block_device_t *bs, uint64_t sector_num, int size)
+{
+  /* reads of discarded sectors may return anything: fall back to the base */
+  return snapshot_for_each_cluster(bs->opaque, sector_num, size, snapshot_drop_cluster);
+}
+
+static int snapshot_write_zeroes(block_device_t *bs, uint64_t sector_num, int size)
+{
+  block_device_snapshot_t *bss = bs->opaque;
+  uint64_t first, last;
+
+  if (block_device_out_of_range(sector_num, size, bss->nb_sectors))
+    return -1;
+  first = (sector_num + SNAPSHOT_CLUSTER_SECTORS - 1) & ~(uint64_t)(SNAPSHOT_CLUSTER_SECTORS - 1);
+  last = (sector_num + size) & ~(uint64_t)(SNAPSHOT_CLUSTER_SECTORS - 1);
+  if (first >= last)
+    return block_device_write_zeroes_fallback(bs, sector_num, size);
+
+  /* unaligned head and tail are written, whole clusters are shared */
+  if (block_device_write_zeroes_fallback(bs, sector_num, first - sector_num) < 0 ||
+      block_device_write_zeroes_fallback(bs, last, sector_num + size - last) < 0)
+    return -1;
+  return snapshot_for_each_cluster(bss, first, last - first, snapshot_zero_cluster_at);
+}
+
+static void snapshot_print_stats(block_device_t *bs, FILE *f)
+{
+  block_device_snapshot_t *bss = bs->opaque;
+  fprintf(f, "snapshot: %" PRIu64 " clusters written (%" PRIu64 " KiB)\n",
+      bss->cluster_count, bss->cluster_count * SNAPSHOT_CLUSTER_SIZE / 1024);
+  block_device_print_stats(bss->base, f);
+}
+
+block_device_t *block_device_snapshot_new(block_device_t *base)
+{
+  block_device_t *bs;
+  block_device_snapshot_t *bss;
+
+  bs = mallocz(sizeof(*bs));
+  bss = mallocz(sizeof(*bss));
+
+  bss->base = base;
+  bss->nb_sectors = base->get_sector_count(base);
+  bss->table_size = 1024;
+  bss->table = mallocz(bss->table_size * sizeof(bss->table[0]));
+
+  bs->opaque = bss;
+  bs->get_sector_count = snapshot_get_sector_count;
+  bs->read_async = snapshot_read_async;
+  bs->write_async = snapshot_write_async;
+  bs->discard = snapshot_discard;
+  bs->write_zeroes = snapshot_write_zeroes;
+  bs->print_stats = snapshot_print_stats;
+
+  return bs;
+}
+
+void block_device_print_stats(block_device_t *bs, FILE *f)
+{
+  if (bs && bs->print_stats)
+    bs->print_stats(bs, f);
+}
+
+block_device_t *block_device_open(const char *filename, block_device_mode_enum mode)
+{
+  block_device_mode_enum open_mode;
+  block_device_t *bs;
+  uint8_t header[64];
+  FILE *f;
+  int len;
+
+  f = fopen(filename, "rb");
+  if (!f)
+  {
+    perror(filename);
+    exit(1);
+  }
+  memset(header, 0, sizeof(header));
+  len = fread(header, 1, sizeof(header), f);
+  fclose(f);
+
+  open_mode = (mode == BF_MODE_RW) ? BF_MODE_RW : BF_MODE_RO;
+  if (block_overlay_probe(header, len))
+  {
+    bs = block_overlay_open(filename, open_mode);
+  }
+  else if (block_qcow2_probe(header, len))
+  {
+    bs = block_qcow2_open(filename, open_mode);
+  }
+  else if (block_compressed_probe(header, len))
+  {
+    bs = block_compressed_open(filename, open_mode);
+  }
+  else
+  {
+    bs = block_device_raw_open(filename, open_mode);
+  }
+
+  if (mode == BF_MODE_SNAPSHOT)
+    bs = block_device_snapshot_new(bs);
+
+  return bs;
+}
@@ -0,0 +1,110 @@
+#ifndef __BLOCK_DEVICE_H__
+#define __BLOCK_DEVICE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "riscv_definations.h"
+
+#define SECTOR_SIZE 512
+typedef struct block_device block_device_t;
+typedef void block_device_complete_func(void *opaque, int ret);
+
+typedef enum {
+    BF_MODE_RO,
+    BF_MODE_RW,
+    BF_MODE_SNAPSHOT,
+    BF_MODE_RAM, /* whole image loaded into memory, writes discarded */
+} block_device_mode_enum;
+
+typedef struct block_device_file
+{
+  int fd;
+  int64_t nb_sectors;
+  block_device_mode_enum mode;
+} block_device_file_t;
+
+/* snapshot clusters hold SNAPSHOT_CLUSTER_SECTORS (at most 32) sectors each */
+#define SNAPSHOT_CLUSTER_BITS 12
+#define SNAPSHOT_CLUSTER_SIZE (1 << SNAPSHOT_CLUSTER_BITS)
+#define SNAPSHOT_CLUSTER_SECTORS (SNAPSHOT_CLUSTER_SIZE / SECTOR_SIZE)
+#define SNAPSHOT_ARENA_CLUSTERS 256
+
+typedef struct snapshot_cluster
+{
+  uint64_t index;
+  uint8_t *data;
+  uint32_t valid; /* one bit per sector written by the guest */
+} snapshot_cluster_t;
+
+typedef struct snapshot_arena_chunk snapshot_arena_chunk_t;
+struct snapshot_arena_chunk
+{
+  snapshot_arena_chunk_t *next;
+  uint8_t data[];
+};
+
+typedef struct snapshot_arena
+{
+  snapshot_arena_chunk_t *chunks;
+  int chunk_used;
+  uint8_t *free_list;
+} snapshot_arena_t;
+
+typedef struct block_device_snapshot
+{
+  block_device_t *base;
+  int64_t nb_sectors;
+  /* open addressing hash of written clusters, keyed by cluster index */
+  snapshot_cluster_t *table;
+  uint64_t table_size;
+  uint64_t cluster_count;
+  snapshot_arena_t arena;
+} block_device_snapshot_t;
+
+struct block_device
+{
+  int64_t (*get_sector_count)(block_device_t *bs);
+  int (*read_async)(block_device_t *bs, uint64_t sector_num,
+      uint8_t *buf, int size, block_device_complete_func *cb, void *opaque);
+  int (*write_async)(block_device_t *bs, uint64_t sector_num,
+      uint8_t *buf, int size, block_device_complete_func *cb, void *opaque);
+  /* optional, see the block_device_* wrappers for the fallbacks */
+  int (*flush)(block_device_t *bs);
+  int (*discard)(block_device_t *bs, uint64_t sector_num, int size);
+  int (*write_zeroes)(block_device_t *bs, uint64_t sector_num, int size);
+  /* one transfer over several buffers, each a whole number of sectors */
+  int (*readv)(block_device_t *bs, uint64_t sector_num, const struct iovec *iov, int iov_count);
+  int (*writev)(block_device_t *bs, uint64_t sector_num, const struct iovec *iov, int iov_count);
+  void (*print_stats)(block_device_t *bs, FILE *f);
+  void *opaque;
+};
+
+extern int block_device_pread(int fd, uint8_t *buf, uint64_t len, uint64_t offset);
+extern int block_device_pwrite(int fd, const uint8_t *buf, uint64_t len, uint64_t offset);
+extern void block_device_backing_path(char *buf, int buf_size, const char *filename, const char *backing);
+extern int block_device_punch_hole(int fd, uint64_t offset, uint64_t len);
+/* whether sectors [sector_num, sector_num + size) fall outside the
+ * device; a sector_num near 2^64 must not wrap back into range */
+static inline bool block_device_out_of_range(uint64_t sector_num, int size, uint64_t nb_sectors)
+{
+  return sector_num > nb_sectors || (uint64_t)size > nb_sectors - sector_num;
+}
+/* flush and discard are no-ops for backends without them, write_zeroes
+ * falls back to writing zero buffers */
+extern int block_device_flush(block_device_t *bs);
+extern int block_device_discard(block_device_t *bs, uint64_t sector_num, int size);
+extern int block_device_write_zeroes(block_device_t *bs, uint64_t sector_num, int size);
+extern int block_device_write_zeroes_fallback(block_device_t *bs, uint64_t sector_num, int size);
+/* without readv/writev every buffer becomes its own read or write */
+extern int block_device_readv(block_device_t *bs, uint64_t sector_num,
+    const struct iovec *iov, int iov_count);
+extern int block_device_writev(block_device_t *bs, uint64_t sector_num,
+    const struct iovec *iov, int iov_count);
+/* open an image, probing its format; the result is wrapped in an
+ * in-memory snapshot layer when mode is BF_MODE_SNAPSHOT */
+extern block_device_t *block_device_open(const char *filename, block_device_mode_enum mode);
+extern block_device_t *block_device_raw_open(const char *filename, block_device_mode_enum mode);
+extern block_device_t *block_device_snapshot_new(block_device_t *base);
+extern void block_device_print_stats(block_device_t *bs, FILE *f);
+#endif
@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#include "block_overlay.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include "cutils.h"
+
+typedef struct
+{
+  int fd;
+  block_device_mode_enum mode;
+  int cluster_bits;
+  uint32_t cluster_size;
+  uint64_t virtual_size;
+  int64_t nb_sectors;
+  uint64_t table_offset;
+  uint64_t table_entries;
+  uint64_t *table;
+  uint64_t alloc_offset;
+  block_device_t *backing;
+  uint8_t *cluster_buf;
+} block_device_overlay_t;
+
+/* read a byte range lying inside a single unallocated cluster */
+static int overlay_read_backing(block_device_overlay_t *bo, uint64_t offset, uint8_t *buf, uint32_t len)
+{
+  block_device_t *backing = bo->backing;
+  int64_t backing_sectors, sector_num, count;
+
+  memset(buf, 0, len);
+  if (!backing)
+    return 0;
+
+  backing_sectors = backing->get_sector_count(backing);
+  sector_num = offset / SECTOR_SIZE;
+  if (sector_num >= backing_sectors)
+    return 0;
+  count = len / SECTOR_SIZE;
+  if (sector_num + count > backing_sectors)
+    count = backing_sectors - sector_num;
+  return backing->read_async(backing, sector_num, buf, count, NULL, NULL);
+}
+
+static int64_t overlay_get_sector_count(block_device_t *bs)
+{
+  block_device_overlay_t *bo = bs->opaque;
+  return bo->nb_sectors;
+}
+
+static int overlay_read_async(block_device_t *bs, uint64_t sector_num,
+    uint8_t *buf, int size,
+    block_device_complete_func *cb, void *opaque)
+{
+  block_device_overlay_t *bo = bs->opaque;
+  uint64_t offset, cluster, cluster_offset;
+  uint32_t len;
+  int64_t count;
+
+  if (block_device_out_of_range(sector_num, size, bo->nb_sectors))
+    return -1;
+
+  offset = sector_num * SECTOR_SIZE;
+  count = (int64_t)size * SECTOR_SIZE;
+  while (count > 0)
+  {
+    cluster = offset >> bo->cluster_bits;
+    cluster_offset = offset & (bo->cluster_size - 1);
+    len = bo->cluster_size - cluster_offset;
+    if (len > count)
+      len = count;
+    if (bo->table[cluster])
+    {
+      if (block_device_pread(bo->fd, buf, len, bo->table[cluster] + cluster_offset) < 0)
+        return -1;
+    }
+    else
+    {
+      if (overlay_read_backing(bo, offset, buf, len) < 0)
+        return -1;
+    }
+    offset += len;
+    buf += len;
+    count -= len;
+  }
+  return 0;
+}
+
+static int overlay_alloc_cluster(block_device_overlay_t *bo, uint64_t cluster,
+    uint32_t cluster_offset, const uint8_t *buf, uint32_t len)
+{
+  uint64_t cluster_start, new_offset;
+  uint32_t fill_len;
+  uint8_t entry[8];
+  const uint8_t *data;
+
+  cluster_start = cluster << bo->cluster_bits;
+  new_offset = bo->alloc_offset;
+
+  if (len == bo->cluster_size)
+  {
+    data = buf;
+  }
+  else
+  {
+    /* copy-on-write: merge the guest data into the backing contents */
+    fill_len = bo->cluster_size;
+    if (cluster_start + fill_len > bo->virtual_size)
+      fill_len = bo->virtual_size - cluster_start;
+    memset(bo->cluster_buf, 0, bo->cluster_size);
+    if (overlay_read_backing(bo, cluster_start, bo->cluster_buf, fill_len) < 0)
+      return -1;
+    memcpy(bo->cluster_buf + cluster_offset, buf, len);
+    data = bo->cluster_buf;
+  }
+
+  /* data must reach the disk before the table entry points at it, or a
+   * crash could leave the entry pointing at a hole */
+  if (block_device_pwrite(bo->fd, data, bo->cluster_size, new_offset) < 0 ||
+      fdatasync(bo->fd) < 0)
+    return -1;
+  put_le64(entry, new_offset);
+  if (block_device_pwrite(bo->fd, entry, sizeof(entry), bo->table_offset + cluster * 8) < 0)
+    return -1;
+
+  bo->table[cluster] = new_offset;
+  bo->alloc_offset += bo->cluster_size;
+  return 0;
+}
+
+static int overlay_write_async(block_device_t *bs, uint64_t sector_num,
+    uint8_t *buf, int size,
+    block_device_complete_func *cb, void *opaque)
+{
+  block_device_overlay_t *bo = bs->opaque;
+  uint64_t offset, cluster, cluster_offset;
+  uint32_t len;
+  int64_t count;
+
+  if (bo->mode != BF_MODE_RW)
+    return -1;
+  if (block_device_out_of_range(sector_num, size, bo->nb_sectors))
+    return -1;
+
+  offset = sector_num * SECTOR_SIZE;
+  count = (int64_t)size * SECTOR_SIZE;
+  while (count > 0)
+  {
+    cluster = offset >> bo->cluster_bits;
+    cluster_offset = offset & (bo->cluster_size - 1);
+    len = bo->cluster_size - cluster_offset;
+    if (len > count)
+      len = count;
+    if (bo->table[cluster])
+    {
+      if (block_device_pwrite(bo->fd, buf, len, bo->table[cluster] + cluster_offset) < 0)
+        return -1;
+    }
+    else
+    {
+      if (overlay_alloc_cluster(bo, cluster, cluster_offset, buf, len) < 0)
+        return -1;
+    }
+    offset += len;
+    buf += len;
+    count -= len;
+  }
+  return 0;
+}
+
+static int overlay_flush(block_device_t *bs)
+{
+  block_device_overlay_t *bo = bs->opaque;
+
+  if (bo->mode != BF_MODE_RW)
+    return 0;
+  return fdatasync(bo->fd);
+}
+
+/* zero a whole cluster: allocated data is punched out, unallocated
+ * clusters over a backing file get a fresh cluster left as a hole */
+static int overlay_zero_cluster(block_device_overlay_t *bo, uint64_t cluster, bool discard)
+{
+  uint64_t new_offset;
+  uint8_t entry[8];
+
+  if (bo->table[cluster])
+  {
+    block_device_punch_hole(bo->fd, bo->table[cluster], bo->cluster_size);
+    return 0;
+  }
+  if (discard || !bo->backing)
+    return 0;
+
+  /* grow the file over the hole: alloc_offset is taken from the file
+   * size on open, so the cluster must not end past it */
+  new_offset = bo->alloc_offset;
+  if (ftruncate(bo->fd, new_offset + bo->cluster_size) < 0)
+    return -1;
+  put_le64(entry, new_offset);
+  if (block_device_pwrite(bo->fd, entry, sizeof(entry), bo->table_offset + cluster * 8) < 0)
+    return -1;
+  bo->table[cluster] = new_offset;
+  bo->alloc_offset += bo->cluster_size;
+  return 0;
+}
+
+static int overlay_zero_range(block_device_t *bs, uint64_t sector_num, int size, bool discard)
+{
+  block_device_overlay_t *bo = bs->opaque;
+  uint64_t start, end, first, last, cluster;
+
+  if (bo->mode != BF_MODE_RW)
+    return -1;
+  if (block_device_out_of_range(sector_num, size, bo->nb_sectors))
+    return -1;
+
+  start = sector_num * SECTOR_SIZE;
+  end = (sector_num + size) * SECTOR_SIZE;
+  first = (start + bo->cluster_size - 1) >> bo->cluster_bits;
+  last = end >> bo->cluster_bits;
+  if (end == bo->virtual_size)
+    last = bo->table_entries;
+
+  if (first >= last)
+  {
+    return discard ? 0 : block_device_write_zeroes_fallback(bs, sector_num, size);
+  }
+  if (!discard)
+  {
+    /* unaligned head and tail */
+    if (block_device_write_zeroes_fallback(bs, sector_num,
+          ((first << bo->cluster_bits) - start) / SECTOR_SIZE) < 0)
+      return -1;
+    if (last < bo->table_entries &&
+        block_device_write_zeroes_fallback(bs, (last << bo->cluster_bits) / SECTOR_SIZE,
+          (end - (last << bo->cluster_bits)) / SECTOR_SIZE) < 0)
+      return -1;
+  }
+  for (cluster = first; cluster < last; cluster++)
+  {
+    if (overlay_zero_cluster(bo, cluster, discard) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int overlay_discard(block_device_t *bs, uint64_t sector_num, int size)
+{
+  return overlay_zero_range(bs, sector_num, size, true);
+}
+
+static int overlay_write_zeroes(block_device_t *bs, uint64_t sector_num, int size)
+{
+  return overlay_zero_range(bs, sector_num, size, false);
+}
+
+bool block_overlay_probe(const uint8_t *buf, int len)
+{
+  return len >= OVERLAY_HEADER_SIZE && get_le32(buf) == OVERLAY_MAGIC;
+}
+
+block_device_t *block_overlay_open(const char *filename, block_device_mode_enum mode)
+{
+  block_device_t *bs;
+  block_device_overlay_t *bo;
+  uint8_t header[OVERLAY_HEADER_SIZE];
+  uint8_t *table_buf;
+  char backing_name[PATH_MAX], backing_path[PATH_MAX];
+  uint32_t backing_len;
+  uint64_t i;
+  off_t file_size;
+  int fd;
+
+  fd = open(filename, mode == BF_MODE_RW ? O_RDWR : O_RDONLY);
+  if (fd < 0)
+  {
+    perror(filename);
+    exit(1);
+  }
+
+  if (block_device_pread(fd, header, sizeof(header), 0) < 0 ||
+      !block_overlay_probe(header, sizeof(header)) ||
+      get_le32(header + 4) != OVERLAY_VERSION)
+  {
+    printf("%s: not a supported overlay image\n", filename);
+    exit(1);
+  }
+
+  bo = mallocz(sizeof(*bo));
+  bo->fd = fd;
+  bo->mode = mode;
+  bo->cluster_bits = get_le32(header + 8);
+  backing_len = get_le32(header + 12);
+  bo->virtual_size = get_le64(header + 16);
+  bo->table_offset = get_le64(header + 24);
+  bo->table_entries = get_le64(header + 32);
+
+  if (bo->cluster_bits < OVERLAY_MIN_CLUSTER_BITS ||
+      bo->cluster_bits > OVERLAY_MAX_CLUSTER_BITS ||
+      backing_len >= sizeof(backing_name) ||
+      bo->table_entries != (bo->virtual_size + (1 << bo->cluster_bits) - 1) >> bo->cluster_bits)
+  {
+    printf("%s: corrupted overlay header\n", filename);
+    exit(1);
+  }
+  bo->cluster_size = 1 << bo->cluster_bits;
+  bo->nb_sectors = bo->virtual_size / SECTOR_SIZE;
+  bo->cluster_buf = malloc(bo->cluster_size);
+
+  bo->table = malloc(bo->table_entries * sizeof(bo->table[0]));
+  table_buf = malloc(bo->table_entries * 8);
+  if (!bo->table || !table_buf ||
+      block_device_pread(fd, table_buf, bo->table_entries * 8, bo->table_offset) < 0)
+  {
+    printf("%s: could not read cluster table\n", filename);
+    exit(1);
+  }
+  for (i = 0; i < bo->table_entries; i++)
+    bo->table[i] = get_le64(table_buf + i * 8);
+  free(table_buf);
+
+  if (backing_len > 0)
+  {
+    if (block_device_pread(fd, (uint8_t*)backing_name, backing_len, OVERLAY_HEADER_SIZE) < 0)
+    {
+      printf("%s: could not read backing file name\n", filename);
+      exit(1);
+    }
+    backing_name[backing_len] = '\0';
+    block_device_backing_path(backing_path, sizeof(backing_path), filename, backing_name);
+    bo->backing = block_device_open(backing_path, BF_MODE_RO);
+  }
+
+  file_size = lseek(fd, 0, SEEK_END);
+  bo->alloc_offset = (file_size + bo->cluster_size - 1) & ~(uint64_t)(bo->cluster_size - 1);
+
+  bs = mallocz(sizeof(*bs));
+  bs->opaque = bo;
+  bs->get_sector_count = overlay_get_sector_count;
+  bs->read_async = overlay_read_async;
+  bs->write_async = overlay_write_async;
+  bs->flush = overlay_flush;
+  bs->discard = overlay_discard;
+  bs->write_zeroes = overlay_write_zeroes;
+
+  return bs;
+}
+
+int block_overlay_create(const char *filename, const char *backing, int cluster_bits)
+{
+  block_device_t *base;
+  uint8_t header[OVERLAY_HEADER_SIZE];
+  char backing_path[PATH_MAX];
+  uint64_t virtual_size, table_entries, table_offset, table_size, cluster_size;
+  int backing_len, fd;
+
+  if (cluster_bits < OVERLAY_MIN_CLUSTER_BITS || cluster_bits > OVERLAY_MAX_CLUSTER_BITS)
+  {
+    printf("invalid cluster size: %d bits\n", cluster_bits);
+    return -1;
+  }
+  cluster_size = 1 << cluster_bits;
+
+  backing_len = strlen(backing);
+  if (backing_len >= PATH_MAX)
+    return -1;
+  block_device_backing_path(backing_path, sizeof(backing_path), filename, backing);
+  base = block_device_open(backing_path, BF_MODE_RO);
+  virtual_size = base->get_sector_count(base) * SECTOR_SIZE;
+
+  table_entries = (virtual_size + cluster_size - 1) >> cluster_bits;
+  table_offset = (OVERLAY_HEADER_SIZE + backing_len + cluster_size - 1) & ~(cluster_size - 1);
+  table_size = (table_entries * 8 + cluster_size - 1) & ~(cluster_size - 1);
+
+  memset(header, 0, sizeof(header));
+  put_le32(header, OVERLAY_MAGIC);
+  put_le32(header + 4, OVERLAY_VERSION);
+  put_le32(header + 8, cluster_bits);
+  put_le32(header + 12, backing_len);
+  put_le64(header + 16, virtual_size);
+  put_le64(header + 24, table_offset);
+  put_le64(header + 32, table_entries);
+
+  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    perror(filename);
+    return -1;
+  }
+  /* the table is left as a hole, so creation cost does not depend on the image size */
+  if (block_device_pwrite(fd, header, sizeof(header), 0) < 0 ||
+      block_device_pwrite(fd, (const uint8_t*)backing, backing_len, OVERLAY_HEADER_SIZE) < 0 ||
+      ftruncate(fd, table_offset + table_size) < 0)
+  {
+    perror(filename);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
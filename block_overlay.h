@@ -0,0 +1,28 @@
+#ifndef __BLOCK_OVERLAY_H__
+#define __BLOCK_OVERLAY_H__
+
+#include "block_device.h"
+
+/*
+ * Copy-on-write overlay image, all fields little endian:
+ *
+ *   0  magic "SOVL"          4  version
+ *   8  cluster_bits         12  backing_len
+ *  16  virtual_size (bytes) 24  table_offset
+ *  32  table_entries        40  backing file name (backing_len bytes)
+ *
+ * The table holds one 64-bit file offset per cluster, 0 meaning the
+ * cluster is read from the backing image (or is zero without one).
+ * Allocated clusters are appended at the end of the file.
+ */
+#define OVERLAY_MAGIC 0x4c564f53
+#define OVERLAY_VERSION 1
+#define OVERLAY_HEADER_SIZE 40
+#define OVERLAY_DEFAULT_CLUSTER_BITS 16
+#define OVERLAY_MIN_CLUSTER_BITS 12
+#define OVERLAY_MAX_CLUSTER_BITS 21
+
+extern bool block_overlay_probe(const uint8_t *buf, int len);
+extern block_device_t *block_overlay_open(const char *filename, block_device_mode_enum mode);
+extern int block_overlay_create(const char *filename, const char *backing, int cluster_bits);
+#endif
@@ -0,0 +1,673 @@
+#define _GNU_SOURCE
+#include "block_qcow2.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <zlib.h>
+#include "cutils.h"
+
+#define QCOW_OFLAG_COPIED     (1ULL << 63)
+#define QCOW_OFLAG_COMPRESSED (1ULL << 62)
+#define QCOW_OFLAG_ZERO       (1ULL << 0)
+#define L1E_OFFSET_MASK       0x00fffffffffffe00ULL
+#define L2E_OFFSET_MASK       0x00fffffffffffe00ULL
+#define REFT_OFFSET_MASK      0xfffffffffffffe00ULL
+
+#define QCOW2_INCOMPAT_DIRTY   (1ULL << 0)
+#define QCOW2_INCOMPAT_CORRUPT (1ULL << 1)
+#define QCOW2_INCOMPAT_MASK    (QCOW2_INCOMPAT_DIRTY | QCOW2_INCOMPAT_CORRUPT)
+
+#define QCOW2_HEADER_SIZE 104
+
+typedef struct
+{
+  uint64_t offset; /* 0 if the slot is free */
+  uint64_t last_used;
+  uint8_t *table;  /* big endian, as stored in the file */
+} qcow2_l2_cache_entry_t;
+
+typedef struct
+{
+  int fd;
+  block_device_mode_enum mode;
+  int version;
+  int cluster_bits;
+  uint32_t cluster_size;
+  int l2_bits;
+  uint64_t virtual_size;
+  int64_t nb_sectors;
+
+  uint32_t l1_size;
+  uint64_t l1_table_offset;
+  uint64_t *l1_table;
+
+  qcow2_l2_cache_entry_t l2_cache[QCOW2_L2_CACHE_SIZE];
+  uint64_t l2_cache_clock;
+  uint64_t l2_cache_hits;
+  uint64_t l2_cache_misses;
+
+  uint64_t refcount_table_offset;
+  uint32_t refcount_table_size;
+  uint64_t *refcount_table;
+  int refcount_block_bits; /* log2 of entries per refcount block */
+  uint64_t refcount_block_offset;
+  uint8_t *refcount_block;
+
+  uint64_t alloc_offset;
+  uint64_t clusters_allocated;
+  uint8_t *cluster_buf;
+
+  /* last decompressed cluster */
+  uint64_t compressed_offset;
+  uint8_t *compressed_buf;
+  uint8_t *decompressed_buf;
+
+  block_device_t *backing;
+  char filename[PATH_MAX];
+} block_device_qcow2_t;
+
+static uint8_t *qcow2_get_l2_table(block_device_qcow2_t *bq, uint64_t l2_offset)
+{
+  qcow2_l2_cache_entry_t *e, *victim = NULL;
+  int i;
+
+  bq->l2_cache_clock++;
+  for (i = 0; i < QCOW2_L2_CACHE_SIZE; i++)
+  {
+    e = &bq->l2_cache[i];
+    if (e->offset == l2_offset)
+    {
+      e->last_used = bq->l2_cache_clock;
+      bq->l2_cache_hits++;
+      return e->table;
+    }
+    if (!victim || e->last_used < victim->last_used)
+      victim = e;
+  }
+
+  bq->l2_cache_misses++;
+  if (!victim->table)
+    victim->table = malloc(bq->cluster_size);
+  victim->offset = 0;
+  if (block_device_pread(bq->fd, victim->table, bq->cluster_size, l2_offset) < 0)
+    return NULL;
+  victim->offset = l2_offset;
+  victim->last_used = bq->l2_cache_clock;
+  return victim->table;
+}
+
+/* returns the raw L2 entry for a guest offset, 0 if unallocated */
+static int qcow2_get_l2_entry(block_device_qcow2_t *bq, uint64_t offset, uint64_t *pentry)
+{
+  uint64_t l1_index, l2_index, l2_offset;
+  uint8_t *l2_table;
+
+  l1_index = offset >> (bq->cluster_bits + bq->l2_bits);
+  l2_index = (offset >> bq->cluster_bits) & ((1 << bq->l2_bits) - 1);
+  *pentry = 0;
+  if (l1_index >= bq->l1_size)
+    return -1;
+  l2_offset = bq->l1_table[l1_index] & L1E_OFFSET_MASK;
+  if (!l2_offset)
+    return 0;
+  l2_table = qcow2_get_l2_table(bq, l2_offset);
+  if (!l2_table)
+    return -1;
+  *pentry = get_be64(l2_table + l2_index * 8);
+  return 0;
+}
+
+static int qcow2_read_backing(block_device_qcow2_t *bq, uint64_t offset, uint8_t *buf, uint32_t len)
+{
+  block_device_t *backing = bq->backing;
+  int64_t backing_sectors, sector_num, count;
+
+  memset(buf, 0, len);
+  if (!backing)
+    return 0;
+  backing_sectors = backing->get_sector_count(backing);
+  sector_num = offset / SECTOR_SIZE;
+  if (sector_num >= backing_sectors)
+    return 0;
+  count = len / SECTOR_SIZE;
+  if (sector_num + count > backing_sectors)
+    count = backing_sectors - sector_num;
+  return backing->read_async(backing, sector_num, buf, count, NULL, NULL);
+}
+
+static int qcow2_decompress_cluster(block_device_qcow2_t *bq, uint64_t entry)
+{
+  int csize_shift = 62 - (bq->cluster_bits - 8);
+  uint64_t coffset, nb_sectors, csize;
+  z_stream strm;
+  int ret;
+
+  coffset = entry & ((1ULL << csize_shift) - 1);
+  if (bq->compressed_offset == coffset)
+    return 0;
+
+  nb_sectors = ((entry & ~QCOW_OFLAG_COMPRESSED) >> csize_shift) + 1;
+  csize = nb_sectors * SECTOR_SIZE - (coffset & (SECTOR_SIZE - 1));
+  if (csize > 2 * bq->cluster_size)
+    return -1;
+  if (block_device_pread(bq->fd, bq->compressed_buf, csize, coffset) < 0)
+    return -1;
+
+  /* raw deflate stream, no zlib header */
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit2(&strm, -12) != Z_OK)
+    return -1;
+  strm.next_in = bq->compressed_buf;
+  strm.avail_in = csize;
+  strm.next_out = bq->decompressed_buf;
+  strm.avail_out = bq->cluster_size;
+  ret = inflate(&strm, Z_FINISH);
+  inflateEnd(&strm);
+  if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) || strm.avail_out != 0)
+    return -1;
+
+  bq->compressed_offset = coffset;
+  return 0;
+}
+
+/* read a byte range lying inside a single cluster */
+static int qcow2_read_cluster(block_device_qcow2_t *bq, uint64_t offset, uint8_t *buf, uint32_t len)
+{
+  uint64_t entry, cluster_offset;
+
+  if (qcow2_get_l2_entry(bq, offset, &entry) < 0)
+    return -1;
+  cluster_offset = offset & (bq->cluster_size - 1);
+
+  if (entry & QCOW_OFLAG_COMPRESSED)
+  {
+    if (qcow2_decompress_cluster(bq, entry) < 0)
+      return -1;
+    memcpy(buf, bq->decompressed_buf + cluster_offset, len);
+  }
+  else if (bq->version >= 3 && (entry & QCOW_OFLAG_ZERO))
+  {
+    memset(buf, 0, len);
+  }
+  else if (entry & L2E_OFFSET_MASK)
+  {
+    return block_device_pread(bq->fd, buf, len, (entry & L2E_OFFSET_MASK) + cluster_offset);
+  }
+  else
+  {
+    return qcow2_read_backing(bq, offset, buf, len);
+  }
+  return 0;
+}
+
+static int64_t qcow2_get_sector_count(block_device_t *bs)
+{
+  block_device_qcow2_t *bq = bs->opaque;
+  return bq->nb_sectors;
+}
+
+static int qcow2_read_async(block_device_t *bs, uint64_t sector_num,
+    uint8_t *buf, int size,
+    block_device_complete_func *cb, void *opaque)
+{
+  block_device_qcow2_t *bq = bs->opaque;
+  uint64_t offset;
+  uint32_t len;
+  int64_t count;
+
+  if (block_device_out_of_range(sector_num, size, bq->nb_sectors))
+    return -1;
+
+  offset = sector_num * SECTOR_SIZE;
+  count = (int64_t)size * SECTOR_SIZE;
+  while (count > 0)
+  {
+    len = bq->cluster_size - (offset & (bq->cluster_size - 1));
+    if (len > count)
+      len = count;
+    if (qcow2_read_cluster(bq, offset, buf, len) < 0)
+      return -1;
+    offset += len;
+    buf += len;
+    count -= len;
+  }
+  return 0;
+}
+
+static int qcow2_update_refcount(block_device_qcow2_t *bq, uint64_t host_offset, int delta);
+
+/* grab a cluster at the end of the file and account for it */
+static int64_t qcow2_alloc_cluster(block_device_qcow2_t *bq)
+{
+  uint64_t offset = bq->alloc_offset;
+
+  bq->alloc_offset += bq->cluster_size;
+  if (qcow2_update_refcount(bq, offset, 1) < 0)
+    return -1;
+  bq->clusters_allocated++;
+  return offset;
+}
+
+static int qcow2_load_refcount_block(block_device_qcow2_t *bq, uint64_t block_offset)
+{
+  if (bq->refcount_block_offset == block_offset)
+    return 0;
+  bq->refcount_block_offset = 0;
+  if (block_device_pread(bq->fd, bq->refcount_block, bq->cluster_size, block_offset) < 0)
+    return -1;
+  bq->refcount_block_offset = block_offset;
+  return 0;
+}
+
+/* returns the new refcount */
+static int qcow2_update_refcount(block_device_qcow2_t *bq, uint64_t host_offset, int delta)
+{
+  uint64_t cluster_index, table_index, block_index, block_offset;
+  uint8_t entry[8];
+  uint16_t refcount;
+
+  cluster_index = host_offset >> bq->cluster_bits;
+  table_index = cluster_index >> bq->refcount_block_bits;
+  block_index = cluster_index & ((1 << bq->refcount_block_bits) - 1);
+  if (table_index >= bq->refcount_table_size)
+  {
+    printf("%s: refcount table full\n", bq->filename);
+    return -1;
+  }
+
+  block_offset = bq->refcount_table[table_index] & REFT_OFFSET_MASK;
+  if (!block_offset)
+  {
+    /* the new refcount block is placed at the end of the file, so it
+     * is covered either by itself or by the next table entry */
+    block_offset = bq->alloc_offset;
+    bq->alloc_offset += bq->cluster_size;
+    memset(bq->refcount_block, 0, bq->cluster_size);
+    bq->refcount_block_offset = 0;
+    if (block_device_pwrite(bq->fd, bq->refcount_block, bq->cluster_size, block_offset) < 0)
+      return -1;
+    put_be64(entry, block_offset);
+    if (block_device_pwrite(bq->fd, entry, 8, bq->refcount_table_offset + table_index * 8) < 0)
+      return -1;
+    bq->refcount_table[table_index] = block_offset;
+    if (qcow2_update_refcount(bq, block_offset, 1) < 0)
+      return -1;
+  }
+
+  if (qcow2_load_refcount_block(bq, block_offset) < 0)
+    return -1;
+  refcount = get_be16(bq->refcount_block + block_index * 2) + delta;
+  put_be16(bq->refcount_block + block_index * 2, refcount);
+  if (block_device_pwrite(bq->fd, bq->refcount_block + block_index * 2, 2,
+        block_offset + block_index * 2) < 0)
+    return -1;
+  return refcount;
+}
+
+/* return the offset of a writable L2 table for a guest offset */
+static int64_t qcow2_get_l2_for_write(block_device_qcow2_t *bq, uint64_t offset)
+{
+  uint64_t l1_index, l2_offset;
+  int64_t new_offset;
+  uint8_t entry[8];
+  int i;
+
+  l1_index = offset >> (bq->cluster_bits + bq->l2_bits);
+  if (l1_index >= bq->l1_size)
+    return -1;
+  l2_offset = bq->l1_table[l1_index] & L1E_OFFSET_MASK;
+  if (l2_offset)
+    return l2_offset;
+
+  new_offset = qcow2_alloc_cluster(bq);
+  if (new_offset < 0)
+    return -1;
+  /* the zeroed table must be on disk before L1 points at it */
+  memset(bq->cluster_buf, 0, bq->cluster_size);
+  if (block_device_pwrite(bq->fd, bq->cluster_buf, bq->cluster_size, new_offset) < 0 ||
+      fdatasync(bq->fd) < 0)
+    return -1;
+  put_be64(entry, new_offset | QCOW_OFLAG_COPIED);
+  if (block_device_pwrite(bq->fd, entry, 8, bq->l1_table_offset + l1_index * 8) < 0)
+    return -1;
+  bq->l1_table[l1_index] = new_offset | QCOW_OFLAG_COPIED;
+
+  /* a stale cache slot may still hold this offset */
+  for (i = 0; i < QCOW2_L2_CACHE_SIZE; i++)
+  {
+    if (bq->l2_cache[i].offset == new_offset)
+      bq->l2_cache[i].offset = 0;
+  }
+  return new_offset;
+}
+
+static int qcow2_set_l2_entry(block_device_qcow2_t *bq, uint64_t offset, uint64_t value)
+{
+  uint64_t l2_index;
+  int64_t l2_offset;
+  uint8_t *l2_table;
+
+  l2_offset = qcow2_get_l2_for_write(bq, offset);
+  if (l2_offset < 0)
+    return -1;
+  l2_table = qcow2_get_l2_table(bq, l2_offset);
+  if (!l2_table)
+    return -1;
+  l2_index = (offset >> bq->cluster_bits) & ((1 << bq->l2_bits) - 1);
+  put_be64(l2_table + l2_index * 8, value);
+  return block_device_pwrite(bq->fd, l2_table + l2_index * 8, 8, l2_offset + l2_index * 8);
+}
+
+/* write a byte range lying inside a single cluster */
+static int qcow2_write_cluster(block_device_qcow2_t *bq, uint64_t offset, const uint8_t *buf, uint32_t len)
+{
+  uint64_t entry, cluster_start, cluster_offset, fill_len;
+  int64_t new_offset;
+  const uint8_t *data;
+
+  if (qcow2_get_l2_entry(bq, offset, &entry) < 0)
+    return -1;
+  cluster_start = offset & ~(uint64_t)(bq->cluster_size - 1);
+  cluster_offset = offset - cluster_start;
+
+  if ((entry & QCOW_OFLAG_COPIED) && !(entry & QCOW_OFLAG_COMPRESSED) &&
+      (entry & L2E_OFFSET_MASK) && !(entry & QCOW_OFLAG_ZERO))
+  {
+    return block_device_pwrite(bq->fd, buf, len, (entry & L2E_OFFSET_MASK) + cluster_offset);
+  }
+
+  /* copy-on-write into a fresh cluster. Clusters dropped here (compressed
+   * ones) keep their refcount: that leaks space but never corrupts. */
+  if (len == bq->cluster_size)
+  {
+    data = buf;
+  }
+  else
+  {
+    fill_len = bq->cluster_size;
+    if (cluster_start + fill_len > bq->virtual_size)
+      fill_len = bq->virtual_size - cluster_start;
+    memset(bq->cluster_buf, 0, bq->cluster_size);
+    if (qcow2_read_cluster(bq, cluster_start, bq->cluster_buf, fill_len) < 0)
+      return -1;
+    memcpy(bq->cluster_buf + cluster_offset, buf, len);
+    data = bq->cluster_buf;
+  }
+
+  if ((entry & QCOW_OFLAG_COPIED) && (entry & L2E_OFFSET_MASK) && !(entry & QCOW_OFLAG_COMPRESSED))
+  {
+    /* preallocated zero cluster: reuse it */
+    new_offset = entry & L2E_OFFSET_MASK;
+  }
+  else
+  {
+    new_offset = qcow2_alloc_cluster(bq);
+    if (new_offset < 0)
+      return -1;
+  }
+  /* as in the overlay: data first, or a crash leaves L2 pointing at a hole */
+  if (block_device_pwrite(bq->fd, data, bq->cluster_size, new_offset) < 0 ||
+      fdatasync(bq->fd) < 0)
+    return -1;
+  return qcow2_set_l2_entry(bq, offset, new_offset | QCOW_OFLAG_COPIED);
+}
+
+static int qcow2_write_async(block_device_t *bs, uint64_t sector_num,
+    uint8_t *buf, int size,
+    block_device_complete_func *cb, void *opaque)
+{
+  block_device_qcow2_t *bq = bs->opaque;
+  uint64_t offset;
+  uint32_t len;
+  int64_t count;
+
+  if (bq->mode != BF_MODE_RW)
+    return -1;
+  if (block_device_out_of_range(sector_num, size, bq->nb_sectors))
+    return -1;
+
+  offset = sector_num * SECTOR_SIZE;
+  count = (int64_t)size * SECTOR_SIZE;
+  while (count > 0)
+  {
+    len = bq->cluster_size - (offset & (bq->cluster_size - 1));
+    if (len > count)
+      len = count;
+    if (qcow2_write_cluster(bq, offset, buf, len) < 0)
+      return -1;
+    offset += len;
+    buf += len;
+    count -= len;
+  }
+  return 0;
+}
+
+static int qcow2_flush(block_device_t *bs)
+{
+  block_device_qcow2_t *bq = bs->opaque;
+
+  if (bq->mode != BF_MODE_RW)
+    return 0;
+  return fdatasync(bq->fd);
+}
+
+/* make a whole cluster read as zeroes and release its data */
+static int qcow2_zero_cluster(block_device_qcow2_t *bq, uint64_t offset)
+{
+  uint64_t entry, host_offset;
+  int refcount;
+
+  if (qcow2_get_l2_entry(bq, offset, &entry) < 0)
+    return -1;
+  if (!entry && !bq->backing)
+    return 0;
+  if (entry == QCOW_OFLAG_ZERO)
+    return 0;
+  if (qcow2_set_l2_entry(bq, offset, QCOW_OFLAG_ZERO) < 0)
+    return -1;
+
+  host_offset = entry & L2E_OFFSET_MASK;
+  if ((entry & QCOW_OFLAG_COPIED) && !(entry & QCOW_OFLAG_COMPRESSED) && host_offset)
+  {
+    refcount = qcow2_update_refcount(bq, host_offset, -1);
+    if (refcount < 0)
+      return -1;
+    if (refcount == 0)
+      block_device_punch_hole(bq->fd, host_offset, bq->cluster_size);
+  }
+  return 0;
+}
+
+static int qcow2_zero_range(block_device_t *bs, uint64_t sector_num, int size, bool discard)
+{
+  block_device_qcow2_t *bq = bs->opaque;
+  uint64_t start, end, first, last, offset;
+
+  if (bq->mode != BF_MODE_RW)
+    return -1;
+  if (block_device_out_of_range(sector_num, size, bq->nb_sectors))
+    return -1;
+
+  start = sector_num * SECTOR_SIZE;
+  end = (sector_num + size) * SECTOR_SIZE;
+  first = (start + bq->cluster_size - 1) & ~(uint64_t)(bq->cluster_size - 1);
+  last = end & ~(uint64_t)(bq->cluster_size - 1);
+  if (end == bq->virtual_size)
+    last = end;
+
+  /* zero clusters only exist from version 3 on */
+  if (bq->version < 3 || first >= last)
+    return discard ? 0 : block_device_write_zeroes_fallback(bs, sector_num, size);
+
+  if (!discard)
+  {
+    if (block_device_write_zeroes_fallback(bs, sector_num, (first - start) / SECTOR_SIZE) < 0 ||
+        block_device_write_zeroes_fallback(bs, last / SECTOR_SIZE, (end - last) / SECTOR_SIZE) < 0)
+      return -1;
+  }
+  for (offset = first; offset < last; offset += bq->cluster_size)
+  {
+    if (qcow2_zero_cluster(bq, offset) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int qcow2_discard(block_device_t *bs, uint64_t sector_num, int size)
+{
+  return qcow2_zero_range(bs, sector_num, size, true);
+}
+
+static int qcow2_write_zeroes(block_device_t *bs, uint64_t sector_num, int size)
+{
+  return qcow2_zero_range(bs, sector_num, size, false);
+}
+
+static void qcow2_print_stats(block_device_t *bs, FILE *f)
+{
+  block_device_qcow2_t *bq = bs->opaque;
+  uint64_t total = bq->l2_cache_hits + bq->l2_cache_misses;
+
+  fprintf(f, "qcow2 %s: L2 cache hits %" PRIu64 ", misses %" PRIu64 " (%.1f%% hit rate), "
+      "%" PRIu64 " clusters allocated\n",
+      bq->filename, bq->l2_cache_hits, bq->l2_cache_misses,
+      total ? 100.0 * bq->l2_cache_hits / total : 0.0,
+      bq->clusters_allocated);
+  block_device_print_stats(bq->backing, f);
+}
+
+bool block_qcow2_probe(const uint8_t *buf, int len)
+{
+  return len >= 8 && get_be32(buf) == QCOW2_MAGIC;
+}
+
+static void qcow2_fail(const char *filename, const char *msg)
+{
+  printf("%s: %s\n", filename, msg);
+  exit(1);
+}
+
+block_device_t *block_qcow2_open(const char *filename, block_device_mode_enum mode)
+{
+  block_device_t *bs;
+  block_device_qcow2_t *bq;
+  uint8_t header[QCOW2_HEADER_SIZE];
+  uint8_t *buf;
+  uint64_t backing_offset, incompat, i;
+  uint32_t backing_len, refcount_table_clusters, refcount_order;
+  char backing_name[PATH_MAX], backing_path[PATH_MAX];
+  off_t file_size;
+  int fd;
+
+  fd = open(filename, mode == BF_MODE_RW ? O_RDWR : O_RDONLY);
+  if (fd < 0)
+  {
+    perror(filename);
+    exit(1);
+  }
+  memset(header, 0, sizeof(header));
+  if (block_device_pread(fd, header, sizeof(header), 0) < 0 ||
+      !block_qcow2_probe(header, sizeof(header)))
+    qcow2_fail(filename, "not a qcow2 image");
+
+  bq = mallocz(sizeof(*bq));
+  bq->fd = fd;
+  bq->mode = mode;
+  pstrcpy(bq->filename, sizeof(bq->filename), filename);
+  bq->version = get_be32(header + 4);
+  backing_offset = get_be64(header + 8);
+  backing_len = get_be32(header + 16);
+  bq->cluster_bits = get_be32(header + 20);
+  bq->virtual_size = get_be64(header + 24);
+  bq->l1_size = get_be32(header + 36);
+  bq->l1_table_offset = get_be64(header + 40);
+  bq->refcount_table_offset = get_be64(header + 48);
+  refcount_table_clusters = get_be32(header + 56);
+  incompat = 0;
+  refcount_order = 4;
+  if (bq->version >= 3)
+  {
+    incompat = get_be64(header + 72);
+    refcount_order = get_be32(header + 96);
+  }
+
+  if (bq->version != 2 && bq->version != 3)
+    qcow2_fail(filename, "unsupported qcow2 version");
+  if (bq->cluster_bits < 9 || bq->cluster_bits > 21)
+    qcow2_fail(filename, "unsupported cluster size");
+  if (get_be32(header + 32) != 0)
+    qcow2_fail(filename, "encrypted images are not supported");
+  if (incompat & ~QCOW2_INCOMPAT_MASK)
+    qcow2_fail(filename, "unsupported incompatible features");
+  if (mode == BF_MODE_RW)
+  {
+    if (incompat & QCOW2_INCOMPAT_MASK)
+      qcow2_fail(filename, "image is dirty or corrupt, repair it before writing");
+    if (get_be32(header + 60) != 0)
+      qcow2_fail(filename, "images with internal snapshots can only be opened read-only");
+    if (refcount_order != 4)
+      qcow2_fail(filename, "only 16-bit refcounts are supported for writing");
+  }
+
+  bq->cluster_size = 1 << bq->cluster_bits;
+  bq->l2_bits = bq->cluster_bits - 3;
+  bq->nb_sectors = bq->virtual_size / SECTOR_SIZE;
+  if (bq->l1_size < (bq->virtual_size + (1ULL << (bq->cluster_bits + bq->l2_bits)) - 1) >>
+      (bq->cluster_bits + bq->l2_bits))
+    qcow2_fail(filename, "L1 table too small");
+
+  bq->l1_table = malloc(bq->l1_size * sizeof(uint64_t));
+  buf = malloc(bq->l1_size * 8);
+  if (!bq->l1_table || !buf ||
+      block_device_pread(fd, buf, bq->l1_size * 8, bq->l1_table_offset) < 0)
+    qcow2_fail(filename, "could not read L1 table");
+  for (i = 0; i < bq->l1_size; i++)
+    bq->l1_table[i] = get_be64(buf + i * 8);
+  free(buf);
+
+  bq->refcount_table_size = refcount_table_clusters * (bq->cluster_size / 8);
+  bq->refcount_table = malloc(bq->refcount_table_size * sizeof(uint64_t));
+  buf = malloc(bq->refcount_table_size * 8);
+  if (!bq->refcount_table || !buf ||
+      block_device_pread(fd, buf, bq->refcount_table_size * 8, bq->refcount_table_offset) < 0)
+    qcow2_fail(filename, "could not read refcount table");
+  for (i = 0; i < bq->refcount_table_size; i++)
+    bq->refcount_table[i] = get_be64(buf + i * 8);
+  free(buf);
+  bq->refcount_block_bits = bq->cluster_bits + 3 - refcount_order;
+  bq->refcount_block = malloc(bq->cluster_size);
+
+  bq->cluster_buf = malloc(bq->cluster_size);
+  bq->compressed_buf = malloc(2 * bq->cluster_size);
+  bq->decompressed_buf = malloc(bq->cluster_size);
+  bq->compressed_offset = (uint64_t)-1;
+
+  if (backing_offset && backing_len > 0)
+  {
+    if (backing_len >= sizeof(backing_name) ||
+        block_device_pread(fd, (uint8_t*)backing_name, backing_len, backing_offset) < 0)
+      qcow2_fail(filename, "could not read backing file name");
+    backing_name[backing_len] = '\0';
+    block_device_backing_path(backing_path, sizeof(backing_path), filename, backing_name);
+    bq->backing = block_device_open(backing_path, BF_MODE_RO);
+  }
+
+  file_size = lseek(fd, 0, SEEK_END);
+  bq->alloc_offset = (file_size + bq->cluster_size - 1) & ~(uint64_t)(bq->cluster_size - 1);
+
+  bs = mallocz(sizeof(*bs));
+  bs->opaque = bq;
+  bs->get_sector_count = qcow2_get_sector_count;
+  bs->read_async = qcow2_read_async;
+  bs->write_async = qcow2_write_async;
+  bs->flush = qcow2_flush;
+  bs->discard = qcow2_discard;
+  bs->write_zeroes = qcow2_write_zeroes;
+  bs->print_stats = qcow2_print_stats;
+
+  return bs;
+}
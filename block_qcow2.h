@@ -0,0 +1,11 @@
+#ifndef __BLOCK_QCOW2_H__
+#define __BLOCK_QCOW2_H__
+
+#include "block_device.h"
+
+#define QCOW2_MAGIC 0x514649fb /* "QFI\xfb" */
+#define QCOW2_L2_CACHE_SIZE 16
+
+extern bool block_qcow2_probe(const uint8_t *buf, int len);
+extern block_device_t *block_qcow2_open(const char *filename, block_device_mode_enum mode);
+#endif
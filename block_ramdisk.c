@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include "block_ramdisk.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "cutils.h"
+
+/* sectors copied from the source image per read */
+#define RAMDISK_LOAD_SECTORS 2048
+#define RAMDISK_PAGE_SIZE 4096
+
+typedef struct
+{
+  uint8_t *data;
+  uint64_t map_size;
+  int64_t nb_sectors;
+  bool hugetlb;
+  uint64_t load_ms;
+} block_device_ramdisk_t;
+
+static int64_t ramdisk_get_sector_count(block_device_t *bs)
+{
+  block_device_ramdisk_t *rd = bs->opaque;
+  return rd->nb_sectors;
+}
+
+static int ramdisk_read_async(block_device_t *bs, uint64_t sector_num,
+    uint8_t *buf, int size,
+    block_device_complete_func *cb, void *opaque)
+{
+  block_device_ramdisk_t *rd = bs->opaque;
+
+  if (block_device_out_of_range(sector_num, size, rd->nb_sectors))
+    return -1;
+  memcpy(buf, rd->data + sector_num * SECTOR_SIZE, (uint64_t)size * SECTOR_SIZE);
+  return 0;
+}
+
+static int ramdisk_write_async(block_device_t *bs, uint64_t sector_num,
+    uint8_t *buf, int size,
+    block_device_complete_func *cb, void *opaque)
+{
+  block_device_ramdisk_t *rd = bs->opaque;
+
+  if (block_device_out_of_range(sector_num, size, rd->nb_sectors))
+    return -1;
+  memcpy(rd->data + sector_num * SECTOR_SIZE, buf, (uint64_t)size * SECTOR_SIZE);
+  return 0;
+}
+
+static int ramdisk_write_zeroes(block_device_t *bs, uint64_t sector_num, int size)
+{
+  block_device_ramdisk_t *rd = bs->opaque;
+  uint64_t start, end, page_start, page_end;
+
+  if (block_device_out_of_range(sector_num, size, rd->nb_sectors))
+    return -1;
+  start = sector_num * SECTOR_SIZE;
+  end = start + (uint64_t)size * SECTOR_SIZE;
+
+  /* whole pages go back to the host and read as zeroes again */
+  page_start = (start + RAMDISK_PAGE_SIZE - 1) & ~(uint64_t)(RAMDISK_PAGE_SIZE - 1);
+  page_end = end & ~(uint64_t)(RAMDISK_PAGE_SIZE - 1);
+  if (!rd->hugetlb && page_start < page_end &&
+      madvise(rd->data + page_start, page_end - page_start, MADV_DONTNEED) == 0)
+  {
+    memset(rd->data + start, 0, page_start - start);
+    memset(rd->data + page_end, 0, end - page_end);
+  }
+  else
+  {
+    memset(rd->data + start, 0, end - start);
+  }
+  return 0;
+}
+
+static void ramdisk_print_stats(block_device_t *bs, FILE *f)
+{
+  block_device_ramdisk_t *rd = bs->opaque;
+  fprintf(f, "ramdisk: %" PRIu64 " MiB%s, loaded in %" PRIu64 " ms\n",
+      rd->map_size >> 20, rd->hugetlb ? " on hugepages" : "", rd->load_ms);
+}
+
+block_device_t *block_device_ramdisk_new(block_device_t *src, bool hugepages)
+{
+  block_device_t *bs;
+  block_device_ramdisk_t *rd;
+  int64_t sector_num;
+  uint64_t start;
+  int n;
+
+  bs = mallocz(sizeof(*bs));
+  rd = mallocz(sizeof(*rd));
+
+  rd->nb_sectors = src->get_sector_count(src);
+  rd->map_size = (rd->nb_sectors * SECTOR_SIZE + RAMDISK_HUGEPAGE_SIZE - 1) &
+    ~(uint64_t)(RAMDISK_HUGEPAGE_SIZE - 1);
+  if (!rd->map_size)
+    rd->map_size = RAMDISK_HUGEPAGE_SIZE;
+
+  rd->data = MAP_FAILED;
+  if (hugepages)
+  {
+    rd->data = mmap(NULL, rd->map_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (rd->data == MAP_FAILED)
+      printf("ramdisk: no hugepages available, using transparent huge pages\n");
+    else
+      rd->hugetlb = true;
+  }
+  if (rd->data == MAP_FAILED)
+  {
+    rd->data = mmap(NULL, rd->map_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (rd->data == MAP_FAILED)
+    {
+      perror("ramdisk: mmap");
+      exit(1);
+    }
+    if (hugepages)
+      madvise(rd->data, rd->map_size, MADV_HUGEPAGE);
+  }
+
+  start = get_time_ms();
+  for (sector_num = 0; sector_num < rd->nb_sectors; sector_num += n)
+  {
+    n = min_int(RAMDISK_LOAD_SECTORS, rd->nb_sectors - sector_num);
+    if (src->read_async(src, sector_num, rd->data + sector_num * SECTOR_SIZE, n, NULL, NULL) < 0)
+    {
+      printf("ramdisk: could not read the image at sector %" PRId64 "\n", sector_num);
+      exit(1);
+    }
+  }
+  rd->load_ms = get_time_ms() - start;
+
+  bs->opaque = rd;
+  bs->get_sector_count = ramdisk_get_sector_count;
+  bs->read_async = ramdisk_read_async;
+  bs->write_async = ramdisk_write_async;
+  bs->discard = ramdisk_write_zeroes;
+  bs->write_zeroes = ramdisk_write_zeroes;
+  bs->print_stats = ramdisk_print_stats;
+
+  return bs;
+}
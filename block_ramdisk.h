@@ -0,0 +1,16 @@
+#ifndef __BLOCK_RAMDISK_H__
+#define __BLOCK_RAMDISK_H__
+
+#include "block_device.h"
+
+/*
+ * RAM disk: the whole image is copied into anonymous memory when it is
+ * opened and every request is served with memcpy. Writes stay in memory
+ * and are lost at exit, like snapshot mode. With hugepages set the
+ * memory comes from MAP_HUGETLB, falling back to transparent huge pages
+ * when none are reserved.
+ */
+#define RAMDISK_HUGEPAGE_SIZE (2 << 20)
+
+extern block_device_t *block_device_ramdisk_new(block_device_t *src, bool hugepages);
+#endif
@@ -0,0 +1,340 @@
+#include "block_readahead.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "cutils.h"
+
+#define READAHEAD_MIN_SECTORS (READAHEAD_MIN_KB * 1024 / SECTOR_SIZE)
+
+typedef struct
+{
+  block_device_t *base;
+  int64_t nb_sectors;
+  /* serializes all accesses to base; taken before lock when both are held */
+  pthread_mutex_t base_lock;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+
+  /* sectors [buf_start, buf_start + buf_count) are valid in buf */
+  uint8_t *buf;
+  uint64_t buf_start;
+  int buf_count;
+
+  /* prefetch requested (pending) or running (fetching) into fetch_buf */
+  uint8_t *fetch_buf;
+  bool pending;
+  bool fetching;
+  bool fetch_stale; /* written to while fetching, drop the result */
+  uint64_t fetch_start;
+  int fetch_count;
+
+  /* stream detection */
+  uint64_t next_sector;
+  int seq_count;
+  int window;
+  int max_window;
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t prefetched;
+} block_device_readahead_t;
+
+static bool readahead_in_window(block_device_readahead_t *ra, uint64_t sector_num, int size)
+{
+  return sector_num >= ra->buf_start &&
+    sector_num + size <= ra->buf_start + ra->buf_count;
+}
+
+static bool readahead_in_fetch(block_device_readahead_t *ra, uint64_t sector_num, int size)
+{
+  return (ra->pending || ra->fetching) && sector_num >= ra->fetch_start &&
+    sector_num + size <= ra->fetch_start + ra->fetch_count;
+}
+
+/* called with lock held after a read ending at next_sector */
+static void readahead_schedule(block_device_readahead_t *ra, bool grow)
+{
+  uint64_t start = ra->next_sector;
+  uint64_t buf_end = ra->buf_start + ra->buf_count;
+  int64_t ahead = 0;
+
+  if (ra->seq_count < READAHEAD_TRIGGER || ra->pending || ra->fetching)
+    return;
+  if (start >= ra->buf_start && start < buf_end)
+    ahead = buf_end - start;
+  if (ahead > ra->window / 2)
+    return;
+  if (start >= ra->nb_sectors)
+    return;
+
+  if (grow && ra->window < ra->max_window)
+  {
+    ra->window *= 2;
+    if (ra->window > ra->max_window)
+      ra->window = ra->max_window;
+  }
+  ra->fetch_start = start;
+  ra->fetch_count = ra->window;
+  if (start + ra->fetch_count > ra->nb_sectors)
+    ra->fetch_count = ra->nb_sectors - start;
+  ra->pending = true;
+  pthread_cond_broadcast(&ra->cond);
+}
+
+static void *readahead_thread(void *opaque)
+{
+  block_device_readahead_t *ra = opaque;
+  block_device_t *base = ra->base;
+  uint64_t start;
+  int count, have, ret;
+  uint8_t *tmp;
+
+  pthread_mutex_lock(&ra->lock);
+  for(;;)
+  {
+    while (!ra->pending)
+      pthread_cond_wait(&ra->cond, &ra->lock);
+    ra->pending = false;
+    ra->fetching = true;
+    ra->fetch_stale = false;
+    start = ra->fetch_start;
+    count = ra->fetch_count;
+
+    /* keep what the current window already holds */
+    have = 0;
+    if (start >= ra->buf_start && start < ra->buf_start + ra->buf_count)
+    {
+      have = ra->buf_start + ra->buf_count - start;
+      if (have > count)
+        have = count;
+      memcpy(ra->fetch_buf, ra->buf + (start - ra->buf_start) * SECTOR_SIZE,
+          have * SECTOR_SIZE);
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    pthread_mutex_lock(&ra->base_lock);
+    ret = base->read_async(base, start + have, ra->fetch_buf + have * SECTOR_SIZE,
+        count - have, NULL, NULL);
+    pthread_mutex_unlock(&ra->base_lock);
+
+    pthread_mutex_lock(&ra->lock);
+    ra->fetching = false;
+    if (ret >= 0 && !ra->fetch_stale)
+    {
+      tmp = ra->buf;
+      ra->buf = ra->fetch_buf;
+      ra->fetch_buf = tmp;
+      ra->buf_start = start;
+      ra->buf_count = count;
+      ra->prefetched += count - have;
+    }
+    pthread_cond_broadcast(&ra->cond);
+  }
+  return NULL;
+}
+
+static int64_t readahead_get_sector_count(block_device_t *bs)
+{
+  block_device_readahead_t *ra = bs->opaque;
+  return ra->nb_sectors;
+}
+
+static int readahead_read_async(block_device_t *bs, uint64_t sector_num,
+    uint8_t *buf, int size,
+    block_device_complete_func *cb, void *opaque)
+{
+  block_device_readahead_t *ra = bs->opaque;
+  block_device_t *base = ra->base;
+  int ret;
+
+  if (block_device_out_of_range(sector_num, size, ra->nb_sectors))
+    return -1;
+
+  pthread_mutex_lock(&ra->lock);
+  if (sector_num == ra->next_sector)
+  {
+    ra->seq_count++;
+  }
+  else
+  {
+    ra->seq_count = 0;
+    ra->window = READAHEAD_MIN_SECTORS;
+  }
+  ra->next_sector = sector_num + size;
+
+  for(;;)
+  {
+    if (readahead_in_window(ra, sector_num, size))
+    {
+      memcpy(buf, ra->buf + (sector_num - ra->buf_start) * SECTOR_SIZE, size * SECTOR_SIZE);
+      ra->hits++;
+      readahead_schedule(ra, true);
+      pthread_mutex_unlock(&ra->lock);
+      return 0;
+    }
+    if (!readahead_in_fetch(ra, sector_num, size))
+      break;
+    /* already on its way: wait rather than read it twice */
+    pthread_cond_wait(&ra->cond, &ra->lock);
+  }
+  ra->misses++;
+  pthread_mutex_unlock(&ra->lock);
+
+  pthread_mutex_lock(&ra->base_lock);
+  ret = base->read_async(base, sector_num, buf, size, NULL, NULL);
+  pthread_mutex_unlock(&ra->base_lock);
+
+  pthread_mutex_lock(&ra->lock);
+  readahead_schedule(ra, false);
+  pthread_mutex_unlock(&ra->lock);
+  return ret;
+}
+
+/* called with both locks held once base has been modified; a NULL buf
+ * drops the overlapping part of the window */
+static void readahead_invalidate(block_device_readahead_t *ra, uint64_t sector_num, int size,
+    const uint8_t *buf)
+{
+  uint64_t start, end;
+
+  if ((ra->pending || ra->fetching) && sector_num < ra->fetch_start + ra->fetch_count &&
+      sector_num + size > ra->fetch_start)
+    ra->fetch_stale = true;
+
+  start = sector_num > ra->buf_start ? sector_num : ra->buf_start;
+  end = sector_num + size;
+  if (end > ra->buf_start + ra->buf_count)
+    end = ra->buf_start + ra->buf_count;
+  if (start >= end)
+    return;
+  if (buf)
+  {
+    /* write through so the window stays usable */
+    memcpy(ra->buf + (start - ra->buf_start) * SECTOR_SIZE,
+        buf + (start - sector_num) * SECTOR_SIZE, (end - start) * SECTOR_SIZE);
+  }
+  else
+  {
+    ra->buf_count = 0;
+  }
+}
+
+static int readahead_write_async(block_device_t *bs, uint64_t sector_num,
+    uint8_t *buf, int size,
+    block_device_complete_func *cb, void *opaque)
+{
+  block_device_readahead_t *ra = bs->opaque;
+  block_device_t *base = ra->base;
+  int ret;
+
+  pthread_mutex_lock(&ra->base_lock);
+  ret = base->write_async(base, sector_num, buf, size, NULL, NULL);
+  pthread_mutex_lock(&ra->lock);
+  readahead_invalidate(ra, sector_num, size, ret < 0 ? NULL : buf);
+  pthread_mutex_unlock(&ra->lock);
+  pthread_mutex_unlock(&ra->base_lock);
+  return ret;
+}
+
+static int readahead_flush(block_device_t *bs)
+{
+  block_device_readahead_t *ra = bs->opaque;
+  int ret;
+
+  pthread_mutex_lock(&ra->base_lock);
+  ret = block_device_flush(ra->base);
+  pthread_mutex_unlock(&ra->base_lock);
+  return ret;
+}
+
+static int readahead_discard(block_device_t *bs, uint64_t sector_num, int size)
+{
+  block_device_readahead_t *ra = bs->opaque;
+  int ret;
+
+  pthread_mutex_lock(&ra->base_lock);
+  ret = block_device_discard(ra->base, sector_num, size);
+  pthread_mutex_lock(&ra->lock);
+  readahead_invalidate(ra, sector_num, size, NULL);
+  pthread_mutex_unlock(&ra->lock);
+  pthread_mutex_unlock(&ra->base_lock);
+  return ret;
+}
+
+static int readahead_write_zeroes(block_device_t *bs, uint64_t sector_num, int size)
+{
+  block_device_readahead_t *ra = bs->opaque;
+  int ret;
+
+  pthread_mutex_lock(&ra->base_lock);
+  ret = block_device_write_zeroes(ra->base, sector_num, size);
+  pthread_mutex_lock(&ra->lock);
+  readahead_invalidate(ra, sector_num, size, NULL);
+  pthread_mutex_unlock(&ra->lock);
+  pthread_mutex_unlock(&ra->base_lock);
+  return ret;
+}
+
+static void readahead_print_stats(block_device_t *bs, FILE *f)
+{
+  block_device_readahead_t *ra = bs->opaque;
+  uint64_t total;
+
+  pthread_mutex_lock(&ra->base_lock);
+  pthread_mutex_lock(&ra->lock);
+  total = ra->hits + ra->misses;
+  fprintf(f, "readahead: hits %" PRIu64 ", misses %" PRIu64 " (%.1f%% hit rate), %"
+      PRIu64 " KiB prefetched, window %d KiB\n",
+      ra->hits, ra->misses, total ? 100.0 * ra->hits / total : 0.0,
+      ra->prefetched * SECTOR_SIZE / 1024, ra->window * SECTOR_SIZE / 1024);
+  pthread_mutex_unlock(&ra->lock);
+  block_device_print_stats(ra->base, f);
+  pthread_mutex_unlock(&ra->base_lock);
+}
+
+block_device_t *block_device_readahead_new(block_device_t *base, int max_kb)
+{
+  block_device_t *bs;
+  block_device_readahead_t *ra;
+
+  if (max_kb < READAHEAD_MIN_KB)
+    max_kb = READAHEAD_MIN_KB;
+
+  bs = mallocz(sizeof(*bs));
+  ra = mallocz(sizeof(*ra));
+
+  ra->base = base;
+  ra->nb_sectors = base->get_sector_count(base);
+  ra->max_window = max_kb * 1024 / SECTOR_SIZE;
+  ra->window = READAHEAD_MIN_SECTORS;
+  ra->buf = malloc(ra->max_window * SECTOR_SIZE);
+  ra->fetch_buf = malloc(ra->max_window * SECTOR_SIZE);
+  if (!ra->buf || !ra->fetch_buf)
+  {
+    printf("readahead: could not allocate %d KiB window\n", max_kb);
+    exit(1);
+  }
+  pthread_mutex_init(&ra->base_lock, NULL);
+  pthread_mutex_init(&ra->lock, NULL);
+  pthread_cond_init(&ra->cond, NULL);
+  if (pthread_create(&ra->thread, NULL, readahead_thread, ra))
+  {
+    perror("pthread_create");
+    exit(1);
+  }
+  pthread_detach(ra->thread);
+
+  bs->opaque = ra;
+  bs->get_sector_count = readahead_get_sector_count;
+  bs->read_async = readahead_read_async;
+  bs->write_async = readahead_write_async;
+  bs->flush = readahead_flush;
+  bs->discard = readahead_discard;
+  bs->write_zeroes = readahead_write_zeroes;
+  bs->print_stats = readahead_print_stats;
+
+  return bs;
+}
@@ -0,0 +1,19 @@
+#ifndef __BLOCK_READAHEAD_H__
+#define __BLOCK_READAHEAD_H__
+
+#include "block_device.h"
+
+/*
+ * Read-ahead layer. Reads that continue where the previous one ended
+ * are detected as a sequential stream; once READAHEAD_TRIGGER of them
+ * have been seen, a background thread fetches the sectors that follow
+ * into a window that later requests are served from. The window starts
+ * at READAHEAD_MIN_KB and doubles while the stream keeps hitting, up to
+ * the maximum given at creation.
+ */
+#define READAHEAD_TRIGGER 2
+#define READAHEAD_MIN_KB 64
+#define READAHEAD_DEFAULT_KB 1024
+
+extern block_device_t *block_device_readahead_new(block_device_t *base, int max_kb);
+#endif
@@ -0,0 +1,496 @@
+#include "block_writeback.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "cutils.h"
+
+#define WRITEBACK_CLUSTER_SIZE (1 << WRITEBACK_CLUSTER_BITS)
+#define WRITEBACK_CLUSTER_SECTORS (WRITEBACK_CLUSTER_SIZE / SECTOR_SIZE)
+#define WRITEBACK_BITMAP_WORDS (WRITEBACK_CLUSTER_SECTORS / 64)
+
+typedef struct writeback_cluster writeback_cluster_t;
+struct writeback_cluster
+{
+  uint64_t index;
+  uint8_t *data;
+  uint64_t dirty[WRITEBACK_BITMAP_WORDS]; /* one bit per sector */
+  uint64_t dirty_time; /* ms, when the cluster first became dirty */
+  uint64_t generation; /* bumped on every write */
+  bool flushing;       /* a copy is being written back */
+  bool failed;         /* the last write back failed; retried once aged again */
+  uint64_t flush_pass; /* last flush that tried to write it back */
+  writeback_cluster_t *hash_next;
+  writeback_cluster_t *prev; /* age order, oldest first */
+  writeback_cluster_t *next;
+};
+
+typedef struct
+{
+  block_device_t *base;
+  int64_t nb_sectors;
+  /* serializes all accesses to base; taken before lock when both are held */
+  pthread_mutex_t base_lock;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+
+  writeback_cluster_t **hash;
+  uint32_t hash_size;
+  writeback_cluster_t *oldest;
+  writeback_cluster_t *newest;
+  int cluster_count;
+  int max_clusters;
+  uint64_t flush_pass;
+
+  /* private copies for the background thread and for flush callers */
+  uint8_t *thread_buf;
+  uint8_t *flush_buf;
+
+  uint64_t writes;
+  uint64_t stalls;
+  uint64_t clusters_written;
+  uint64_t flushes;
+} block_device_writeback_t;
+
+static writeback_cluster_t **writeback_bucket(block_device_writeback_t *wb, uint64_t index)
+{
+  return &wb->hash[(index * 0x9e3779b97f4a7c15ULL >> 32) & (wb->hash_size - 1)];
+}
+
+static writeback_cluster_t *writeback_find(block_device_writeback_t *wb, uint64_t index)
+{
+  writeback_cluster_t *c;
+
+  for (c = *writeback_bucket(wb, index); c; c = c->hash_next)
+  {
+    if (c->index == index)
+      return c;
+  }
+  return NULL;
+}
+
+static void writeback_unlink_age(block_device_writeback_t *wb, writeback_cluster_t *c)
+{
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    wb->oldest = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+  else
+    wb->newest = c->prev;
+}
+
+static void writeback_append_age(block_device_writeback_t *wb, writeback_cluster_t *c)
+{
+  c->next = NULL;
+  c->prev = wb->newest;
+  if (wb->newest)
+    wb->newest->next = c;
+  else
+    wb->oldest = c;
+  wb->newest = c;
+}
+
+static void writeback_remove(block_device_writeback_t *wb, writeback_cluster_t *c)
+{
+  writeback_cluster_t **pc;
+
+  for (pc = writeback_bucket(wb, c->index); *pc != c; pc = &(*pc)->hash_next)
+    ;
+  *pc = c->hash_next;
+  writeback_unlink_age(wb, c);
+  wb->cluster_count--;
+  free(c->data);
+  free(c);
+}
+
+static writeback_cluster_t *writeback_insert(block_device_writeback_t *wb, uint64_t index)
+{
+  writeback_cluster_t **bucket = writeback_bucket(wb, index);
+  writeback_cluster_t *c;
+
+  c = mallocz(sizeof(*c));
+  c->data = malloc(WRITEBACK_CLUSTER_SIZE);
+  c->index = index;
+  c->dirty_time = get_time_ms();
+  c->hash_next = *bucket;
+  *bucket = c;
+  writeback_append_age(wb, c);
+  wb->cluster_count++;
+  return c;
+}
+
+static bool writeback_is_dirty(const uint64_t *dirty, int i)
+{
+  return (dirty[i >> 6] >> (i & 63)) & 1;
+}
+
+static bool writeback_is_clean(const uint64_t *dirty)
+{
+  int i;
+  for (i = 0; i < WRITEBACK_BITMAP_WORDS; i++)
+  {
+    if (dirty[i])
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Write a dirty cluster back to base through buf. Called and returns
+ * with lock held, dropping it around the write. The cluster stays
+ * visible to readers until base holds its data; if the write fails it
+ * stays dirty and goes to the young end of the age list for a retry.
+ */
+static void writeback_cluster(block_device_writeback_t *wb, writeback_cluster_t *c, uint8_t *buf)
+{
+  block_device_t *base = wb->base;
+  uint64_t dirty[WRITEBACK_BITMAP_WORDS];
+  uint64_t generation, sector_num;
+  int i, j, ret = 0;
+
+  c->flushing = true;
+  generation = c->generation;
+  memcpy(buf, c->data, WRITEBACK_CLUSTER_SIZE);
+  memcpy(dirty, c->dirty, sizeof(dirty));
+  sector_num = c->index * WRITEBACK_CLUSTER_SECTORS;
+  pthread_mutex_unlock(&wb->lock);
+
+  pthread_mutex_lock(&wb->base_lock);
+  for (i = 0; i < WRITEBACK_CLUSTER_SECTORS && ret >= 0; i = j)
+  {
+    if (!writeback_is_dirty(dirty, i))
+    {
+      j = i + 1;
+      continue;
+    }
+    for (j = i + 1; j < WRITEBACK_CLUSTER_SECTORS && writeback_is_dirty(dirty, j); j++)
+      ;
+    ret = base->write_async(base, sector_num + i, buf + i * SECTOR_SIZE, j - i, NULL, NULL);
+  }
+  pthread_mutex_unlock(&wb->base_lock);
+
+  pthread_mutex_lock(&wb->lock);
+  c->flushing = false;
+  c->failed = ret < 0;
+  if (ret < 0)
+  {
+    c->dirty_time = get_time_ms();
+    writeback_unlink_age(wb, c);
+    writeback_append_age(wb, c);
+  }
+  else
+  {
+    wb->clusters_written++;
+    /* rewritten meanwhile: keep it dirty for the next round */
+    if (c->generation == generation)
+      writeback_remove(wb, c);
+  }
+  pthread_cond_broadcast(&wb->cond);
+}
+
+static writeback_cluster_t *writeback_next(block_device_writeback_t *wb)
+{
+  writeback_cluster_t *c;
+
+  for (c = wb->oldest; c; c = c->next)
+  {
+    if (!c->flushing)
+      return c;
+  }
+  return NULL;
+}
+
+static void *writeback_thread(void *opaque)
+{
+  block_device_writeback_t *wb = opaque;
+  writeback_cluster_t *c;
+  struct timespec ts;
+  uint64_t now, deadline;
+
+  pthread_mutex_lock(&wb->lock);
+  for(;;)
+  {
+    now = get_time_ms();
+    c = writeback_next(wb);
+    /* failed clusters wait for their age again rather than spin */
+    if (c && ((!c->failed && wb->cluster_count * 2 >= wb->max_clusters) ||
+          now >= c->dirty_time + WRITEBACK_MAX_AGE_MS))
+    {
+      writeback_cluster(wb, c, wb->thread_buf);
+      continue;
+    }
+
+    deadline = (c ? c->dirty_time : now) + WRITEBACK_MAX_AGE_MS;
+    ts.tv_sec = deadline / 1000;
+    ts.tv_nsec = (deadline % 1000) * 1000000;
+    pthread_cond_timedwait(&wb->cond, &wb->lock, &ts);
+  }
+  return NULL;
+}
+
+static int64_t writeback_get_sector_count(block_device_t *bs)
+{
+  block_device_writeback_t *wb = bs->opaque;
+  return wb->nb_sectors;
+}
+
+static int writeback_read_async(block_device_t *bs, uint64_t sector_num,
+    uint8_t *buf, int size,
+    block_device_complete_func *cb, void *opaque)
+{
+  block_device_writeback_t *wb = bs->opaque;
+  block_device_t *base = wb->base;
+  writeback_cluster_t *c;
+  uint64_t index, end = sector_num + size;
+  uint64_t first, last, s;
+  int ret;
+
+  if (block_device_out_of_range(sector_num, size, wb->nb_sectors))
+    return -1;
+
+  /* base first, then whatever is still dirty on top of it */
+  pthread_mutex_lock(&wb->base_lock);
+  ret = base->read_async(base, sector_num, buf, size, NULL, NULL);
+  if (ret >= 0)
+  {
+    pthread_mutex_lock(&wb->lock);
+    if (wb->cluster_count)
+    {
+      first = sector_num / WRITEBACK_CLUSTER_SECTORS;
+      last = (end - 1) / WRITEBACK_CLUSTER_SECTORS;
+      for (index = first; index <= last; index++)
+      {
+        c = writeback_find(wb, index);
+        if (!c)
+          continue;
+        for (s = index * WRITEBACK_CLUSTER_SECTORS; s < (index + 1) * WRITEBACK_CLUSTER_SECTORS; s++)
+        {
+          if (s >= sector_num && s < end && writeback_is_dirty(c->dirty, s % WRITEBACK_CLUSTER_SECTORS))
+          {
+            memcpy(buf + (s - sector_num) * SECTOR_SIZE,
+                c->data + (s % WRITEBACK_CLUSTER_SECTORS) * SECTOR_SIZE, SECTOR_SIZE);
+          }
+        }
+      }
+    }
+    pthread_mutex_unlock(&wb->lock);
+  }
+  pthread_mutex_unlock(&wb->base_lock);
+  return ret;
+}
+
+static int writeback_write_async(block_device_t *bs, uint64_t sector_num,
+    uint8_t *buf, int size,
+    block_device_complete_func *cb, void *opaque)
+{
+  block_device_writeback_t *wb = bs->opaque;
+  writeback_cluster_t *c;
+  uint64_t index;
+  int offset, n, i;
+
+  if (block_device_out_of_range(sector_num, size, wb->nb_sectors))
+    return -1;
+
+  pthread_mutex_lock(&wb->lock);
+  wb->writes++;
+  while (size > 0)
+  {
+    index = sector_num / WRITEBACK_CLUSTER_SECTORS;
+    offset = sector_num % WRITEBACK_CLUSTER_SECTORS;
+    n = min_int(size, WRITEBACK_CLUSTER_SECTORS - offset);
+
+    c = writeback_find(wb, index);
+    if (!c)
+    {
+      if (wb->cluster_count >= wb->max_clusters)
+      {
+        /* full: wait for the thread to make room */
+        wb->stalls++;
+        pthread_cond_broadcast(&wb->cond);
+        pthread_cond_wait(&wb->cond, &wb->lock);
+        continue;
+      }
+      c = writeback_insert(wb, index);
+    }
+    memcpy(c->data + offset * SECTOR_SIZE, buf, n * SECTOR_SIZE);
+    for (i = offset; i < offset + n; i++)
+      c->dirty[i >> 6] |= 1ULL << (i & 63);
+    c->generation++;
+
+    sector_num += n;
+    buf += n * SECTOR_SIZE;
+    size -= n;
+  }
+  if (wb->cluster_count * 2 >= wb->max_clusters)
+    pthread_cond_broadcast(&wb->cond);
+  pthread_mutex_unlock(&wb->lock);
+  return 0;
+}
+
+static int writeback_flush(block_device_t *bs)
+{
+  block_device_writeback_t *wb = bs->opaque;
+  writeback_cluster_t *c;
+  int ret;
+
+  pthread_mutex_lock(&wb->lock);
+  wb->flushes++;
+  wb->flush_pass++;
+  /* try every cluster once; whatever is left failed and fails the flush */
+  for (;;)
+  {
+    for (c = wb->oldest; c; c = c->next)
+    {
+      if (c->flushing || c->flush_pass != wb->flush_pass)
+        break;
+    }
+    if (!c)
+      break;
+    if (c->flushing)
+    {
+      pthread_cond_wait(&wb->cond, &wb->lock);
+      continue;
+    }
+    c->flush_pass = wb->flush_pass;
+    writeback_cluster(wb, c, wb->flush_buf);
+  }
+  ret = wb->cluster_count ? -1 : 0;
+  pthread_mutex_unlock(&wb->lock);
+
+  pthread_mutex_lock(&wb->base_lock);
+  if (block_device_flush(wb->base) < 0)
+    ret = -1;
+  pthread_mutex_unlock(&wb->base_lock);
+  return ret;
+}
+
+/*
+ * Forget cached sectors in a range before it is discarded or zeroed on
+ * base. Clusters being written back are waited for, so that no stale
+ * copy lands on base after the operation.
+ */
+static void writeback_drop_range(block_device_writeback_t *wb, uint64_t sector_num, int size)
+{
+  writeback_cluster_t *c;
+  uint64_t index, first, last, end = sector_num + size;
+  uint64_t s;
+  int i;
+
+  pthread_mutex_lock(&wb->lock);
+  first = sector_num / WRITEBACK_CLUSTER_SECTORS;
+  last = (end - 1) / WRITEBACK_CLUSTER_SECTORS;
+  for (index = first; index <= last && wb->cluster_count; index++)
+  {
+    c = writeback_find(wb, index);
+    while (c && c->flushing)
+    {
+      pthread_cond_wait(&wb->cond, &wb->lock);
+      c = writeback_find(wb, index);
+    }
+    if (!c)
+      continue;
+    for (i = 0; i < WRITEBACK_CLUSTER_SECTORS; i++)
+    {
+      s = index * WRITEBACK_CLUSTER_SECTORS + i;
+      if (s >= sector_num && s < end)
+        c->dirty[i >> 6] &= ~(1ULL << (i & 63));
+    }
+    c->generation++;
+    if (writeback_is_clean(c->dirty))
+      writeback_remove(wb, c);
+  }
+  pthread_mutex_unlock(&wb->lock);
+}
+
+static int writeback_discard(block_device_t *bs, uint64_t sector_num, int size)
+{
+  block_device_writeback_t *wb = bs->opaque;
+  int ret;
+
+  if (size <= 0)
+    return 0;
+  writeback_drop_range(wb, sector_num, size);
+  pthread_mutex_lock(&wb->base_lock);
+  ret = block_device_discard(wb->base, sector_num, size);
+  pthread_mutex_unlock(&wb->base_lock);
+  return ret;
+}
+
+static int writeback_write_zeroes(block_device_t *bs, uint64_t sector_num, int size)
+{
+  block_device_writeback_t *wb = bs->opaque;
+  int ret;
+
+  if (size <= 0)
+    return 0;
+  writeback_drop_range(wb, sector_num, size);
+  pthread_mutex_lock(&wb->base_lock);
+  ret = block_device_write_zeroes(wb->base, sector_num, size);
+  pthread_mutex_unlock(&wb->base_lock);
+  return ret;
+}
+
+static void writeback_print_stats(block_device_t *bs, FILE *f)
+{
+  block_device_writeback_t *wb = bs->opaque;
+
+  pthread_mutex_lock(&wb->base_lock);
+  pthread_mutex_lock(&wb->lock);
+  fprintf(f, "writeback: %" PRIu64 " writes, %" PRIu64 " clusters written back, %"
+      PRIu64 " flushes, %" PRIu64 " stalls, %d KiB dirty\n",
+      wb->writes, wb->clusters_written, wb->flushes, wb->stalls,
+      wb->cluster_count * (WRITEBACK_CLUSTER_SIZE / 1024));
+  pthread_mutex_unlock(&wb->lock);
+  block_device_print_stats(wb->base, f);
+  pthread_mutex_unlock(&wb->base_lock);
+}
+
+block_device_t *block_device_writeback_new(block_device_t *base, int max_mb)
+{
+  block_device_t *bs;
+  block_device_writeback_t *wb;
+  pthread_condattr_t attr;
+
+  bs = mallocz(sizeof(*bs));
+  wb = mallocz(sizeof(*wb));
+
+  wb->base = base;
+  wb->nb_sectors = base->get_sector_count(base);
+  wb->max_clusters = ((uint64_t)max_mb << 20) / WRITEBACK_CLUSTER_SIZE;
+  if (wb->max_clusters < 2)
+    wb->max_clusters = 2;
+  for (wb->hash_size = 64; wb->hash_size < wb->max_clusters * 2; wb->hash_size *= 2)
+    ;
+  wb->hash = mallocz(wb->hash_size * sizeof(wb->hash[0]));
+  wb->thread_buf = malloc(WRITEBACK_CLUSTER_SIZE);
+  wb->flush_buf = malloc(WRITEBACK_CLUSTER_SIZE);
+
+  pthread_mutex_init(&wb->base_lock, NULL);
+  pthread_mutex_init(&wb->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&wb->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  if (pthread_create(&wb->thread, NULL, writeback_thread, wb))
+  {
+    perror("pthread_create");
+    exit(1);
+  }
+  pthread_detach(wb->thread);
+
+  bs->opaque = wb;
+  bs->get_sector_count = writeback_get_sector_count;
+  bs->read_async = writeback_read_async;
+  bs->write_async = writeback_write_async;
+  bs->flush = writeback_flush;
+  bs->discard = writeback_discard;
+  bs->write_zeroes = writeback_write_zeroes;
+  bs->print_stats = writeback_print_stats;
+
+  return bs;
+}
@@ -0,0 +1,18 @@
+#ifndef __BLOCK_WRITEBACK_H__
+#define __BLOCK_WRITEBACK_H__
+
+#include "block_device.h"
+
+/*
+ * Write-back cache. Guest writes land in dirty clusters in memory and
+ * return at once; a background thread writes clusters back once they
+ * are older than WRITEBACK_MAX_AGE_MS or half of the cache is dirty.
+ * Writers stall only when the cache is full. A flush writes back every
+ * dirty cluster and then flushes the base device, so data written
+ * before a guest FLUSH is durable when the FLUSH completes.
+ */
+#define WRITEBACK_CLUSTER_BITS 16
+#define WRITEBACK_MAX_AGE_MS 1000
+
+extern block_device_t *block_device_writeback_new(block_device_t *base, int max_mb);
+#endif
@@ -7,8 +7,12 @@
 #include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <assert.h>
 #include "regs.h"
 #include "machine.h"
+#include "cutils.h"
 #include <sys/ioctl.h>
 
 static struct termios oldtty;
@@ -53,13 +57,6 @@ static void term_resize_handler(int sig)
     global_stdio_device->resize_pending = true;
 }
 
-static int_t console_write(void *opaque, const uint8_t *buf, int len)
-{
-    fwrite(buf, 1, len, stdout);
-    fflush(stdout);
-    return len;
-}
-
 static int_t console_read(void *opaque, uint8_t *buf, int len)
 {
     stdio_device_t *s = opaque;
@@ -136,7 +133,6 @@ character_device_t *console_init(bool allow_ctrlc)
   sigaction(SIGWINCH, &sig, NULL);
 
   cdev->opaque = stdio_device;
-  cdev->write_data = console_write;
   cdev->read_data  = console_read;
 
   return cdev;
@@ -150,9 +146,157 @@ static int console_item_init(address_item_t *handler)
 static void console_release(address_item_t *handler)
 {
   virtio_console_device_t *vcd = (virtio_console_device_t*)handler->entity;
+  int i;
+
+  for (i = 0; i < vcd->nr_ports; i++)
+  {
+    console_out_flush(&vcd->ports[i].out, true);
+    if (vcd->ports[i].name)
+      close(vcd->ports[i].out.fd);
+    free(vcd->ports[i].out.buf);
+  }
+  free(vcd->bounce);
   free(vcd);
 }
 
+void console_out_init(console_out_t *out, int fd)
+{
+  memset(out, 0, sizeof(*out));
+  out->fd = fd;
+  out->buf = malloc(VIRTIO_CONSOLE_OUT_BUF_SIZE);
+  assert(out->buf != NULL);
+}
+
+/*
+ * Write all of iov. stdout shares its file description with the
+ * non-blocking stdin when both are the terminal, so wait for room
+ * instead of dropping output.
+ */
+static void console_out_writev(console_out_t *out, struct iovec *iov, int count)
+{
+  struct pollfd pfd;
+  ssize_t ret;
+
+  while (count > 0)
+  {
+    ret = writev(out->fd, iov, count);
+    if (ret < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN)
+        return;
+      pfd.fd = out->fd;
+      pfd.events = POLLOUT;
+      poll(&pfd, 1, -1);
+      continue;
+    }
+    out->writes++;
+    while (count > 0 && (size_t)ret >= iov->iov_len)
+    {
+      ret -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0)
+    {
+      iov->iov_base = (uint8_t*)iov->iov_base + ret;
+      iov->iov_len -= ret;
+    }
+  }
+}
+
+void console_out_write(console_out_t *out, const struct iovec *iov, int count)
+{
+  struct iovec vec[VIRTIO_CONSOLE_MAX_IOV + 1];
+  size_t total = 0;
+  int i;
+
+  for (i = 0; i < count; i++)
+    total += iov[i].iov_len;
+  out->bytes += total;
+  if (out->len + total <= VIRTIO_CONSOLE_OUT_BUF_SIZE)
+  {
+    if (out->len == 0)
+      out->first_ms = get_time_ms();
+    for (i = 0; i < count; i++)
+    {
+      memcpy(out->buf + out->len, iov[i].iov_base, iov[i].iov_len);
+      out->len += iov[i].iov_len;
+    }
+    return;
+  }
+
+  /* it does not fit: what is buffered and the new output go out together */
+  vec[0].iov_base = out->buf;
+  vec[0].iov_len = out->len;
+  memcpy(vec + 1, iov, count * sizeof(*iov));
+  console_out_writev(out, vec, count + 1);
+  out->len = 0;
+}
+
+/* without wait, whatever the fd does not take now stays buffered */
+void console_out_flush(console_out_t *out, bool wait)
+{
+  struct iovec iov;
+  ssize_t ret;
+
+  if (out->len == 0)
+    return;
+  if (wait)
+  {
+    iov.iov_base = out->buf;
+    iov.iov_len = out->len;
+    console_out_writev(out, &iov, 1);
+    out->len = 0;
+    return;
+  }
+  ret = write(out->fd, out->buf, out->len);
+  if (ret < 0)
+  {
+    /* nobody left to write to */
+    if (errno != EAGAIN && errno != EINTR)
+      out->len = 0;
+    return;
+  }
+  out->writes++;
+  memmove(out->buf, out->buf + ret, out->len - ret);
+  out->len -= ret;
+}
+
+/* called from the main loop; idle means the guest is waiting for something */
+void virtio_console_flush(virtio_console_device_t *vcd, bool idle)
+{
+  uint64_t now = 0;
+  console_out_t *out;
+  int i;
+
+  for (i = 0; i < vcd->nr_ports; i++)
+  {
+    out = &vcd->ports[i].out;
+    if (out->len == 0)
+      continue;
+    if (!idle && !now)
+      now = get_time_ms();
+    if (idle || now - out->first_ms >= CONSOLE_FLUSH_MS)
+      console_out_flush(out, false);
+  }
+}
+
+void virtio_console_print_stats(virtio_console_device_t *vcd, FILE *f)
+{
+  console_out_t *out;
+  int i;
+
+  for (i = 0; i < vcd->nr_ports; i++)
+  {
+    out = &vcd->ports[i].out;
+    fprintf(f, "virtio-console port %d%s%s: %" PRIu64 " KiB in %" PRIu64 " writes\n", i,
+        vcd->ports[i].name ? " " : "", vcd->ports[i].name ? vcd->ports[i].name : "",
+        out->bytes / 1024, out->writes);
+  }
+}
+
 void console_get_size(stdio_device_t *dev, int *pw, int *ph)
 {
   struct winsize ws;
@@ -177,16 +321,49 @@ static address_item_t console_item =
   .release = console_release
 };
 
-void virtual_console_device_init(cpu_state_t *state, virtual_io_bus_t *bus)
+void virtual_console_device_init(cpu_state_t *state, const virtio_console_config_t *config,
+    virtual_io_bus_t *bus)
 {
   virtio_console_device_t *vcd;
+  virtio_console_port_t *port;
+  int i, fd;
 
   vcd = malloc(sizeof(*vcd));
   memset(vcd, 0, sizeof(*vcd));
   vcd->cs = console_init(true);
-  virtio_init(state, &console_item, &vcd->common, bus, 3, 4, virtio_console_recv_request);
-  vcd->common.device_features = (1 << 0);
+  vcd->bounce = malloc(VIRTIO_CONSOLE_OUT_BUF_SIZE);
+  assert(vcd->bounce != NULL);
+  console_out_init(&vcd->ports[0].out, 1);
+  /* named ports append what the guest writes to a host file */
+  for (i = 0; i < config->count; i++)
+  {
+    fd = open(config->path[i], O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+    {
+      perror(config->path[i]);
+      exit(1);
+    }
+    port = &vcd->ports[i + 1];
+    port->name = config->name[i];
+    console_out_init(&port->out, fd);
+  }
+  vcd->nr_ports = config->count + 1;
+
+  virtio_init(state, &console_item, &vcd->common, bus, 3, VIRTIO_CONSOLE_CONFIG_SIZE,
+      virtio_console_recv_request);
+  vcd->common.device_features = VIRTIO_CONSOLE_F_SIZE;
+  vcd->common.device_recv_done = virtio_console_recv_done;
+  /* without named ports the guest keeps the plain single port console */
+  if (config->count)
+  {
+    vcd->common.device_features |= VIRTIO_CONSOLE_F_MULTIPORT;
+    put_le32(vcd->common.config_space + 4, vcd->nr_ports);
+  }
+  /* receive queues are only filled when there is input */
   vcd->common.queue[0].manual_recv = true;
+  vcd->common.queue[VIRTIO_CONSOLE_CTRL_RX_Q].manual_recv = true;
+  for (i = 1; i < vcd->nr_ports; i++)
+    vcd->common.queue[2 * i + 2].manual_recv = true;
 
   riscv_machine.console = vcd;
 
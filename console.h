@@ -1,11 +1,12 @@
 #ifndef __CONSOLE_H__
 #define __CONSOLE_H__
+#include <stdio.h>
+#include <sys/uio.h>
 #include "virtio_interface.h"
 
 typedef struct 
 {
   void *opaque;
-  int_t (*write_data)(void *opaque, const uint8_t *buf, int len);
   int_t (*read_data)(void *opaque, uint8_t *buf, int len);
 } character_device_t;
 
@@ -16,12 +17,60 @@ typedef struct
   bool resize_pending;
 } stdio_device_t;
 
+/*
+ * Guest output is gathered here and written with one system call when
+ * the guest goes idle, after CONSOLE_FLUSH_MS, or when it no longer
+ * fits; output that does not fit goes out together with the buffer in
+ * a single writev().
+ */
+#define CONSOLE_FLUSH_MS 10
+
+typedef struct
+{
+  int fd;
+  uint8_t *buf;
+  int len;
+  uint64_t first_ms; /* when the oldest buffered byte came in */
+
+  uint64_t bytes;
+  uint64_t writes;
+} console_out_t;
+
+typedef struct
+{
+  const char *name; /* NULL for the console port */
+  console_out_t out;
+  bool ready; /* the guest set the port up */
+} virtio_console_port_t;
+
+typedef struct
+{
+  const char *name[VIRTIO_CONSOLE_MAX_PORTS - 1];
+  const char *path[VIRTIO_CONSOLE_MAX_PORTS - 1];
+  int count;
+} virtio_console_config_t;
+
 typedef struct virtio_console_device
 {
   virtual_io_device_t common;
   character_device_t *cs;
+  virtio_console_port_t ports[VIRTIO_CONSOLE_MAX_PORTS];
+  int nr_ports;
+  uint8_t *bounce; /* for output that is not in plain guest RAM */
+
+  /* control messages waiting for buffers on the control receive queue */
+  uint8_t ctrl[VIRTIO_CONSOLE_MAX_CTRL][VIRTIO_CONSOLE_CTRL_MAX_LEN];
+  int ctrl_len[VIRTIO_CONSOLE_MAX_CTRL];
+  int ctrl_first;
+  int ctrl_count;
 } virtio_console_device_t;
 
-extern void virtual_console_device_init(cpu_state_t *state, virtual_io_bus_t *bus);
+extern void virtual_console_device_init(cpu_state_t *state, const virtio_console_config_t *config,
+    virtual_io_bus_t *bus);
 extern void console_get_size(stdio_device_t *dev, int *pw, int *ph);
+extern void console_out_init(console_out_t *out, int fd);
+extern void console_out_write(console_out_t *out, const struct iovec *iov, int count);
+extern void console_out_flush(console_out_t *out, bool wait);
+extern void virtio_console_flush(virtio_console_device_t *vcd, bool idle);
+extern void virtio_console_print_stats(virtio_console_device_t *vcd, FILE *f);
 #endif
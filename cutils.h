@@ -129,9 +129,25 @@ static inline void put_le64(uint8_t *ptr, uint64_t v)
     put_le32(ptr + 4, v >> 32);
 }
 
+static inline uint16_t get_be16(const uint8_t *d)
+{
+    return (d[0] << 8) | d[1];
+}
+
+static inline void put_be16(uint8_t *d, uint16_t v)
+{
+    d[0] = v >> 8;
+    d[1] = v;
+}
+
 static inline uint32_t get_be32(const uint8_t *d)
 {
-    return (d[0] << 24) | (d[1] << 16) | (d[2] << 8) | d[3];
+    return ((uint32_t)d[0] << 24) | (d[1] << 16) | (d[2] << 8) | d[3];
+}
+
+static inline uint64_t get_be64(const uint8_t *d)
+{
+    return ((uint64_t)get_be32(d) << 32) | get_be32(d + 4);
 }
 
 static inline void put_be32(uint8_t *d, uint32_t v)
@@ -178,6 +194,7 @@ void *mallocz(size_t size);
 void pstrcpy(char *buf, int buf_size, const char *str);
 char *pstrcat(char *buf, int buf_size, const char *s);
 int strstart(const char *str, const char *val, const char **ptr);
+uint64_t get_time_ms(void);
 
 typedef struct {
     uint8_t *buf;
@@ -10,6 +10,7 @@
 #include <byteswap.h>
 #include <assert.h>
 #include "fdt.h"
+#include "machine.h"
 #include "cutils.h"
 
 
@@ -288,6 +289,98 @@ void fdt_free(fdt_state_t *fdt_s)
   free(fdt_s);
 }
 
+/*
+ * Generic ECAM host bridge with one bus. The mmio window is identity
+ * mapped, and INTx of slot s pin p goes to PLIC line PCI_IRQ + (s + p - 2) % 4,
+ * the swizzle pci.c applies.
+ */
+static void fdt_pci_host(fdt_state_t *fdt_s, int plic_handler)
+{
+  uint32_t ranges[7], map[4 * 4 * 6], mask[4];
+  int slot, pin, n;
+
+  fdt_begin_node_num(fdt_s, "pci", PCI_ECAM_BASE_ADDR);
+  fdt_prop_str(fdt_s, "compatible", "pci-host-ecam-generic");
+  fdt_prop_str(fdt_s, "device_type", "pci");
+  fdt_prop_u32(fdt_s, "#address-cells", 3);
+  fdt_prop_u32(fdt_s, "#size-cells", 2);
+  fdt_prop_u32(fdt_s, "#interrupt-cells", 1);
+  fdt_prop_tab_u64_2(fdt_s, "reg", PCI_ECAM_BASE_ADDR, PCI_ECAM_SIZE);
+  ranges[0] = 0x02000000; /* 32-bit memory space */
+  ranges[1] = 0;
+  ranges[2] = PCI_MMIO_BASE_ADDR;
+  ranges[3] = 0;
+  ranges[4] = PCI_MMIO_BASE_ADDR;
+  ranges[5] = 0;
+  ranges[6] = PCI_MMIO_SIZE;
+  fdt_prop_tab_u32(fdt_s, "ranges", ranges, 7);
+  ranges[0] = 0;
+  ranges[1] = 0;
+  fdt_prop_tab_u32(fdt_s, "bus-range", ranges, 2);
+  fdt_prop(fdt_s, "dma-coherent", NULL, 0);
+
+  n = 0;
+  for (slot = 0; slot < 4; slot++)
+  {
+    for (pin = 1; pin <= 4; pin++)
+    {
+      map[n++] = slot << 11;
+      map[n++] = 0;
+      map[n++] = 0;
+      map[n++] = pin;
+      map[n++] = plic_handler;
+      map[n++] = PCI_IRQ + ((slot + pin + 2) & 3);
+    }
+  }
+  fdt_prop_tab_u32(fdt_s, "interrupt-map", map, n);
+  mask[0] = 3 << 11;
+  mask[1] = 0;
+  mask[2] = 0;
+  mask[3] = 7;
+  fdt_prop_tab_u32(fdt_s, "interrupt-map-mask", mask, 4);
+  fdt_end_node(fdt_s); /* pci */
+}
+
+/*
+ * Registers first, then the shared memory. There is no standard binding;
+ * the guest can hand it to uio_pdrv_genirq with of_id=space,shmem.
+ */
+static void fdt_shmem(fdt_state_t *fdt_s, int plic_handler)
+{
+  uint32_t reg[8], tab[2];
+
+  fdt_begin_node_num(fdt_s, "shmem", SHMEM_BASE_ADDR);
+  fdt_prop_str(fdt_s, "compatible", "space,shmem");
+  reg[0] = (uint64_t)SHMEM_BASE_ADDR >> 32;
+  reg[1] = SHMEM_BASE_ADDR;
+  reg[2] = 0;
+  reg[3] = SHMEM_SIZE;
+  reg[4] = (uint64_t)SHMEM_MEM_BASE_ADDR >> 32;
+  reg[5] = SHMEM_MEM_BASE_ADDR;
+  reg[6] = 0;
+  reg[7] = riscv_machine.shmem->mem_item.size;
+  fdt_prop_tab_u32(fdt_s, "reg", reg, 8);
+  tab[0] = plic_handler;
+  tab[1] = SHMEM_IRQ;
+  fdt_prop_tab_u32(fdt_s, "interrupts-extended", tab, 2);
+  fdt_end_node(fdt_s); /* shmem */
+}
+
+/* Linux simplefb takes the mode from here and never touches a register */
+static void fdt_framebuffer(fdt_state_t *fdt_s)
+{
+  fb_device_t *fb = riscv_machine.fb;
+
+  fdt_begin_node_num(fdt_s, "framebuffer", FRAMEBUFFER_BASE_ADDR);
+  fdt_prop_str(fdt_s, "compatible", "simple-framebuffer");
+  fdt_prop_tab_u64_2(fdt_s, "reg", FRAMEBUFFER_BASE_ADDR, fb->size);
+  fdt_prop_u32(fdt_s, "width", fb->width);
+  fdt_prop_u32(fdt_s, "height", fb->height);
+  fdt_prop_u32(fdt_s, "stride", fb->stride);
+  fdt_prop_str(fdt_s, "format", "a8r8g8b8");
+  fdt_end_node(fdt_s); /* framebuffer */
+}
+
 int build_fdt(cpu_state_t *state, uint8_t *dst, uint64_t kernel_start, uint64_t kernel_size, const char *cmd_line)
 {
   fdt_state_t *fdt_s;
@@ -335,8 +428,8 @@ int build_fdt(cpu_state_t *state, uint8_t *dst, uint64_t kernel_start, uint64_t
   fdt_prop_u32(fdt_s, "clock-frequency", 2000000000);
 
   fdt_begin_node(fdt_s, "interrupt-controller");
-  fdt_prop_u32(fdt_s, "#interrput-cells", 1);
-  fdt_prop(fdt_s, "interrput-controller", NULL, 0);
+  fdt_prop_u32(fdt_s, "#interrupt-cells", 1);
+  fdt_prop(fdt_s, "interrupt-controller", NULL, 0);
   fdt_prop_str(fdt_s, "compatible", "riscv,cpu-intc");
   intc_phandler = cur_phandler++;
   fdt_prop_u32(fdt_s, "phandle", intc_phandler);
@@ -360,7 +453,7 @@ int build_fdt(cpu_state_t *state, uint8_t *dst, uint64_t kernel_start, uint64_t
 
   fdt_begin_node(fdt_s, "soc");
   fdt_prop_u32(fdt_s, "#address-cells", 2);
-  fdt_prop_u32(fdt_s, "size-cells", 2);
+  fdt_prop_u32(fdt_s, "#size-cells", 2);
   fdt_prop_tab_str(fdt_s, "compatible", "ucbbar,riscvemu-bar-soc", "simple-bus", NULL);
   fdt_prop(fdt_s, "ranges", NULL, 0);
 
@@ -376,6 +469,7 @@ int build_fdt(cpu_state_t *state, uint8_t *dst, uint64_t kernel_start, uint64_t
 
   fdt_begin_node_num(fdt_s, "plic", PLIC_BASE_ADDR);
   fdt_prop_u32(fdt_s, "#interrupt-cells", 1);
+  fdt_prop_u32(fdt_s, "#address-cells", 0);
   fdt_prop(fdt_s, "interrupt-controller", NULL, 0);
   fdt_prop_str(fdt_s, "compatible", "riscv,plic0");
   fdt_prop_u32(fdt_s, "riscv,ndev", 31);
@@ -384,12 +478,12 @@ int build_fdt(cpu_state_t *state, uint8_t *dst, uint64_t kernel_start, uint64_t
   tab[1] = 9;
   tab[2] = intc_phandler;
   tab[3] = 11;
-  fdt_prop_tab_u32(fdt_s, "interrputs-extended", tab, 4);
+  fdt_prop_tab_u32(fdt_s, "interrupts-extended", tab, 4);
   plic_handler = cur_phandler++;
   fdt_prop_u32(fdt_s, "phandle", plic_handler);
   fdt_end_node(fdt_s); /* plic */
 
-  for(i = 0; i < 2; i++)
+  for(i = 0; i < riscv_machine.virtio_count; i++)
   {
     fdt_begin_node_num(fdt_s, "virtio", VIRTIO_BASE_ADDR + i * VIRTIO_SIZE);
     fdt_prop_str(fdt_s, "compatible", "virtio,mmio");
@@ -401,6 +495,13 @@ int build_fdt(cpu_state_t *state, uint8_t *dst, uint64_t kernel_start, uint64_t
     fdt_end_node(fdt_s); /* virtio */
   }
 
+  if (riscv_machine.pci_bus)
+    fdt_pci_host(fdt_s, plic_handler);
+  if (riscv_machine.shmem)
+    fdt_shmem(fdt_s, plic_handler);
+  if (riscv_machine.fb)
+    fdt_framebuffer(fdt_s);
+
   fdt_end_node(fdt_s); /* soc */
 
   fdt_begin_node(fdt_s, "chosen");
@@ -414,19 +515,7 @@ int build_fdt(cpu_state_t *state, uint8_t *dst, uint64_t kernel_start, uint64_t
   fdt_end_node(fdt_s); /* chosen */
   fdt_end_node(fdt_s); /* / */
 
-#if 1
-  {
-    FILE *f;
-    f = fopen("../tinyemu/riscvemu.dtb", "rb");
-    fseek(f, 0, SEEK_END);
-    size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    fread(dst, 1, size, f);
-    fclose(f);
-  }
-#endif
-
-  //size = fdt_output(fdt_s, dst);
+  size = fdt_output(fdt_s, dst);
 #if 1
   {
     FILE *f;
@@ -0,0 +1,224 @@
+#include "framebuffer.h"
+#include "machine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "cutils.h"
+
+/* rectangles one refresh copies; beyond that the last one grows */
+#define FB_MAX_RECTS 64
+
+static void fb_mark_dirty(fb_device_t *fb, uint_t start, uint_t len)
+{
+  uint_t page, last = (start + len - 1) >> FB_PAGE_SHIFT;
+
+  for (page = start >> FB_PAGE_SHIFT; page <= last; page++)
+    fb->dirty[page / 64] |= (uint64_t)1 << (page % 64);
+}
+
+static int fb_init(address_item_t *handler)
+{
+  return true;
+}
+
+static int_t fb_read(address_item_t *handler, uint_t src, uint_t size, uint8_t *dst)
+{
+  if (dst == NULL || src + size > handler->start_address + handler->size)
+    return -1;
+  memcpy(dst, handler->entity + (src - handler->start_address), size);
+  return size;
+}
+
+static int_t fb_write(address_item_t *handler, uint8_t *src, uint_t size, uint_t dst)
+{
+  fb_device_t *fb = (fb_device_t*)handler; /* the item comes first */
+  uint_t pos = dst - handler->start_address;
+
+  if (src == NULL || size == 0 || dst + size > handler->start_address + handler->size)
+    return -1;
+  memcpy(handler->entity + pos, src, size);
+  fb_mark_dirty(fb, pos, size);
+  return size;
+}
+
+static void fb_release(address_item_t *handler)
+{
+  fb_device_t *fb = (fb_device_t*)handler;
+
+  if (fb->dump_fd >= 0)
+  {
+    /* the last frame may not have made it past the rate limit */
+    fb->last_refresh_ms = 0;
+    fb_refresh(fb);
+    close(fb->dump_fd);
+  }
+  free(fb->dirty);
+  free(handler->entity);
+  free(fb);
+}
+
+/* add the byte range [start, end) of the framebuffer to rects */
+static int fb_add_range(fb_device_t *fb, fb_rect_t *rects, int count, int max_rects,
+    uint32_t start, uint32_t end)
+{
+  fb_rect_t r, *last;
+  int x1, y1;
+
+  r.y = start / fb->stride;
+  y1 = (end - 1) / fb->stride;
+  if (r.y >= fb->height)
+    return count;
+  y1 = min_int(y1, fb->height - 1);
+  r.height = y1 - r.y + 1;
+  r.x = 0;
+  r.width = fb->width;
+  /* within one row the columns are known too */
+  if (r.height == 1)
+  {
+    r.x = min_int((start % fb->stride) / FB_BYTES_PER_PIXEL, fb->width);
+    x1 = min_int(((end - 1) % fb->stride) / FB_BYTES_PER_PIXEL, fb->width - 1);
+    if (x1 < r.x)
+      return count;
+    r.width = x1 - r.x + 1;
+  }
+
+  last = count > 0 ? &rects[count - 1] : NULL;
+  if (last && (r.y <= last->y + last->height || count == max_rects))
+  {
+    /* touching the previous band, or out of room: grow it */
+    x1 = max_int(last->x + last->width, r.x + r.width);
+    last->x = min_int(last->x, r.x);
+    last->width = x1 - last->x;
+    last->height = max_int(last->y + last->height, r.y + r.height) - last->y;
+    return count;
+  }
+  rects[count] = r;
+  return count + 1;
+}
+
+/*
+ * Turn the dirty pages into rectangles and clear them. Returns how many
+ * rectangles were filled in.
+ */
+int fb_get_dirty(fb_device_t *fb, fb_rect_t *rects, int max_rects)
+{
+  int page, first, count = 0;
+  uint64_t word;
+
+  page = 0;
+  while (page < fb->page_count)
+  {
+    word = fb->dirty[page / 64] >> (page % 64);
+    if (word == 0)
+    {
+      page = (page / 64 + 1) * 64;
+      continue;
+    }
+    page += __builtin_ctzll(word);
+    if (page >= fb->page_count)
+      break;
+    first = page;
+    while (page < fb->page_count && (fb->dirty[page / 64] >> (page % 64)) & 1)
+      page++;
+    count = fb_add_range(fb, rects, count, max_rects, (uint32_t)first << FB_PAGE_SHIFT,
+        min_int((uint32_t)page << FB_PAGE_SHIFT, fb->size));
+  }
+  memset(fb->dirty, 0, ((fb->page_count + 63) / 64) * sizeof(uint64_t));
+  return count;
+}
+
+/* called from the main loop: bring the dump file up to date now and then */
+void fb_refresh(fb_device_t *fb)
+{
+  fb_rect_t rects[FB_MAX_RECTS];
+  uint64_t now;
+  uint32_t offset, len;
+  int i, y, count;
+
+  if (fb->dump_fd < 0)
+    return;
+  now = get_time_ms();
+  if (now - fb->last_refresh_ms < FB_REFRESH_MS)
+    return;
+  fb->last_refresh_ms = now;
+  count = fb_get_dirty(fb, rects, FB_MAX_RECTS);
+  if (count == 0)
+    return;
+  fb->refreshes++;
+  for (i = 0; i < count; i++)
+  {
+    /* full rows are contiguous in both places */
+    if (rects[i].width == fb->width)
+    {
+      offset = rects[i].y * fb->stride;
+      len = rects[i].height * fb->stride;
+      if (pwrite(fb->dump_fd, fb->item.entity + offset, len, offset) == len)
+        fb->copied_bytes += len;
+      continue;
+    }
+    for (y = rects[i].y; y < rects[i].y + rects[i].height; y++)
+    {
+      offset = y * fb->stride + rects[i].x * FB_BYTES_PER_PIXEL;
+      len = rects[i].width * FB_BYTES_PER_PIXEL;
+      if (pwrite(fb->dump_fd, fb->item.entity + offset, len, offset) == len)
+        fb->copied_bytes += len;
+    }
+  }
+}
+
+void framebuffer_module_init(cpu_state_t *state, const fb_config_t *config)
+{
+  fb_device_t *fb;
+  uint64_t size;
+
+  size = (uint64_t)config->width * config->height * FB_BYTES_PER_PIXEL;
+  if (config->width <= 0 || config->height <= 0 || size > FRAMEBUFFER_MAX_SIZE)
+  {
+    printf("framebuffer must be between 1x1 and %d MiB\n", FRAMEBUFFER_MAX_SIZE >> 20);
+    exit(1);
+  }
+
+  fb = malloc(sizeof(*fb));
+  memset(fb, 0, sizeof(*fb));
+  fb->width = config->width;
+  fb->height = config->height;
+  fb->stride = config->width * FB_BYTES_PER_PIXEL;
+  fb->size = size;
+  fb->page_count = (size + (1 << FB_PAGE_SHIFT) - 1) >> FB_PAGE_SHIFT;
+  fb->dirty = calloc((fb->page_count + 63) / 64, sizeof(uint64_t));
+  fb->dump_fd = -1;
+  if (config->path)
+  {
+    fb->dump_fd = open(config->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fb->dump_fd < 0 || ftruncate(fb->dump_fd, size) < 0)
+    {
+      perror(config->path);
+      exit(1);
+    }
+  }
+
+  fb->item.name = "framebuffer";
+  fb->item.start_address = FRAMEBUFFER_BASE_ADDR;
+  fb->item.size = size;
+  fb->item.entity = calloc(1, size);
+  if (!fb->dirty || !fb->item.entity)
+  {
+    printf("framebuffer: malloc error\n");
+    exit(1);
+  }
+  fb->item.init = fb_init;
+  fb->item.read_bytes = fb_read;
+  fb->item.write_bytes = fb_write;
+  fb->item.release = fb_release;
+  riscv_machine.fb = fb;
+  iomap_manager.register_address(state, &fb->item);
+}
+
+void fb_print_stats(fb_device_t *fb, FILE *f)
+{
+  fprintf(f, "framebuffer %dx%d: %" PRIu64 " refreshes, %" PRIu64 " KiB copied, "
+      "%" PRIu64 " KiB as full frames\n", fb->width, fb->height, fb->refreshes,
+      fb->copied_bytes / 1024, fb->refreshes * fb->size / 1024);
+}
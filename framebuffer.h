@@ -0,0 +1,57 @@
+#ifndef __FRAMEBUFFER_H__
+#define __FRAMEBUFFER_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "regs.h"
+#include "iomap.h"
+#include "riscv_definations.h"
+
+#define FB_BYTES_PER_PIXEL 4 /* a8r8g8b8 */
+#define FB_PAGE_SHIFT 12
+/* how often changed rectangles are copied out to the dump file */
+#define FB_REFRESH_MS 40
+
+typedef struct
+{
+  int width;
+  int height;
+  const char *path; /* raw dump kept up to date, NULL for none */
+} fb_config_t;
+
+typedef struct
+{
+  int x;
+  int y;
+  int width;
+  int height;
+} fb_rect_t;
+
+/*
+ * A simple-framebuffer at FRAMEBUFFER_BASE_ADDR. Every write marks the
+ * pages it touches dirty, so a consumer only copies the rectangles the
+ * guest changed since it last looked. The region is not marked as RAM,
+ * which keeps device DMA going through fb_write() and the dirty bits.
+ */
+typedef struct fb_device
+{
+  address_item_t item; /* first, handlers cast it back */
+  int width;
+  int height;
+  int stride;
+  uint32_t size;
+  uint64_t *dirty; /* one bit per page */
+  int page_count;
+
+  int dump_fd;
+  uint64_t last_refresh_ms;
+
+  uint64_t refreshes;
+  uint64_t copied_bytes;
+} fb_device_t;
+
+extern void framebuffer_module_init(cpu_state_t *state, const fb_config_t *config);
+extern int fb_get_dirty(fb_device_t *fb, fb_rect_t *rects, int max_rects);
+extern void fb_refresh(fb_device_t *fb);
+extern void fb_print_stats(fb_device_t *fb, FILE *f);
+#endif
@@ -20,8 +20,10 @@ static void htif_cmd_handler(cpu_state_t *state)
   else if (device == 1 && cmd == 1)
   {
     uint8_t buf[1];
+    struct iovec iov = { buf, 1 };
     buf[0] = state->htif_tohost & 0xff;
-    riscv_machine.console->cs->write_data(riscv_machine.console->cs->opaque, buf, 1);
+    /* share the console's batched output so the two stay in order */
+    console_out_write(&riscv_machine.console->ports[0].out, &iov, 1);
     state->htif_tohost =  0;
     state->htif_fromhost = ((uint64_t)device << 56) | ((uint64_t)cmd << 48);
   }
@@ -2201,7 +2201,7 @@ JUMP:
 void machine_loop()
 {
   fd_set rfds, wfds, efds;
-  int stdin_fd, fd_max, ret, delay;
+  int stdin_fd, net_fd, bell_fd, fd_max, ret, delay, i;
   struct timeval tv;
 
   delay = machine_get_sleep_duration(&cpu_state, MAX_DELAY_TIME);
@@ -2210,11 +2210,35 @@ void machine_loop()
   FD_ZERO(&wfds);
   FD_ZERO(&efds);
   fd_max = -1;
+  stdin_fd = -1;
+  net_fd = -1;
+  bell_fd = -1;
+  /* block I/O threads wake us up when a request completes */
+  for (i = 0; i < riscv_machine.block_count; i++)
+  {
+    FD_SET(riscv_machine.block[i]->wake_fd[0], &rfds);
+    fd_max = max_int(fd_max, riscv_machine.block[i]->wake_fd[0]);
+  }
+  if (riscv_machine.net && virtio_net_can_receive(riscv_machine.net))
+  {
+    net_fd = riscv_machine.net->backend.fd;
+    FD_SET(net_fd, &rfds);
+    fd_max = max_int(fd_max, net_fd);
+  }
+  if (riscv_machine.vsock)
+    fd_max = virtio_vsock_set_fds(riscv_machine.vsock, &rfds, &wfds, fd_max);
+  if (riscv_machine.shmem && riscv_machine.shmem->bell_fd >= 0)
+  {
+    bell_fd = riscv_machine.shmem->bell_fd;
+    FD_SET(bell_fd, &rfds);
+    fd_max = max_int(fd_max, bell_fd);
+  }
   if (virtio_console_can_write_data((virtual_io_device_t*)riscv_machine.console))
   {
     stdio_device_t *stdio_device = riscv_machine.console->cs->opaque;
     stdin_fd = stdio_device->stdin_fd;
     FD_SET(stdin_fd, &rfds);
+    fd_max = max_int(fd_max, stdin_fd);
     
     if (stdio_device->resize_pending)
     {
@@ -2225,12 +2249,25 @@ void machine_loop()
     }
   }
 
+  /* console output goes out before we sleep, or once it is old enough */
+  virtio_console_flush(riscv_machine.console, delay > 0);
+  if (riscv_machine.fb)
+    fb_refresh(riscv_machine.fb);
+
   tv.tv_sec = delay / 1000;
   tv.tv_usec = (delay % 1000) * 1000;
   ret = select(fd_max + 1, &rfds, &wfds, &efds, &tv);
+  for (i = 0; i < riscv_machine.block_count; i++)
+    virtual_block_poll(riscv_machine.block[i]);
   if (ret > 0)
   {
-    if (riscv_machine.console && FD_ISSET(stdin_fd, &rfds))
+    if (net_fd >= 0 && FD_ISSET(net_fd, &rfds))
+      virtio_net_poll(riscv_machine.net);
+    if (riscv_machine.vsock)
+      virtio_vsock_poll(riscv_machine.vsock, &rfds, &wfds);
+    if (bell_fd >= 0 && FD_ISSET(bell_fd, &rfds))
+      shmem_poll(riscv_machine.shmem);
+    if (stdin_fd >= 0 && FD_ISSET(stdin_fd, &rfds))
     {
       uint8_t buf[128];
       int ret, len;
@@ -0,0 +1,61 @@
+#ifndef __IO_RING_H__
+#define __IO_RING_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "riscv_definations.h"
+
+/*
+ * Bounded single-producer single-consumer ring of pointers. Exactly one
+ * thread pushes and one thread pops; head and tail are each written by
+ * one side only, so no lock is needed. The size is a power of two.
+ */
+typedef struct
+{
+  void **slots;
+  uint32_t mask;
+  uint32_t head; /* next slot to pop, written by the consumer */
+  uint32_t tail; /* next slot to fill, written by the producer */
+} io_ring_t;
+
+static inline bool io_ring_init(io_ring_t *ring, uint32_t size)
+{
+  ring->slots = calloc(size, sizeof(void*));
+  ring->mask = size - 1;
+  ring->head = 0;
+  ring->tail = 0;
+  return ring->slots != NULL;
+}
+
+/* producer side, false when full */
+static inline bool io_ring_push(io_ring_t *ring, void *ptr)
+{
+  uint32_t tail = ring->tail;
+
+  if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask)
+    return false;
+  ring->slots[tail & ring->mask] = ptr;
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/* consumer side, NULL when empty */
+static inline void *io_ring_pop(io_ring_t *ring)
+{
+  uint32_t head = ring->head;
+  void *ptr;
+
+  if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  ptr = ring->slots[head & ring->mask];
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return ptr;
+}
+
+/* either side; only a hint for the other side's view */
+static inline bool io_ring_empty(io_ring_t *ring)
+{
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+    __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+#endif
@@ -474,6 +474,24 @@ static address_item_t *get_address_item(cpu_state_t *state, uint_t address)
   return NULL;
 }
 
+/* host pointer to [address, address + size) when it lies in one RAM region */
+static uint8_t *get_ram_ptr(uint_t address, uint_t size)
+{
+  int i = 0;
+  for (; i < ADDRESS_ITEM_COUNT; i++)
+  {
+    if (address_items[i] == NULL)
+      break;
+
+    if (address_items[i]->ram && check_in(address_items[i], address, size))
+    {
+      return address_items[i]->entity + (address - address_items[i]->start_address);
+    }
+  }
+
+  return NULL;
+}
+
 iomap_t iomap_manager = {
   .register_address = register_address_manager,
   .release = release_address_manager,
@@ -482,5 +500,6 @@ iomap_t iomap_manager = {
   .write_vaddr = write_vaddr,
   .read_vaddr = read_vaddr,
   .code_vaddr = code_vaddr,
-  .get_address_item = get_address_item
+  .get_address_item = get_address_item,
+  .get_ram_ptr = get_ram_ptr
 };
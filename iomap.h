@@ -10,6 +10,7 @@ typedef struct address_item
   uint_t start_address;
   uint_t size;
   uint8_t *entity;
+  int ram; /* entity is plain memory that devices may access directly */
   cpu_state_t *cpu_state;
   int (*init)(address_item_t *handler);
   int_t (*read_bytes)(address_item_t *handler, uint_t src, uint_t size, uint8_t *dst);
@@ -27,6 +28,7 @@ typedef struct iomap
   int_t (*read_vaddr)(cpu_state_t *state, uint_t vaddress, uint_t size, uint8_t *dst);
   int_t (*code_vaddr)(cpu_state_t *state, uint_t vaddress, uint_t size, uint8_t *dst);
   address_item_t *(*get_address_item)(cpu_state_t *state, uint_t address);
+  uint8_t *(*get_ram_ptr)(uint_t address, uint_t size);
 } iomap_t;
 
 extern iomap_t iomap_manager;
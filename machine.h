@@ -2,13 +2,31 @@
 #define __MACHINE_H__
 #include "regs.h"
 #include "virtio_block_device.h"
+#include "virtio_net_device.h"
+#include "virtio_9p_device.h"
+#include "virtio_balloon_device.h"
+#include "virtio_vsock_device.h"
+#include "virtio_pmem_device.h"
 #include "console.h"
+#include "shmem.h"
+#include "framebuffer.h"
+#include "pci.h"
 
 typedef struct
 {
   cpu_state_t *cpu_state;
   virtio_console_device_t *console;
-  virtual_io_block_device_t *block;
+  virtual_io_block_device_t *block[MAX_BLOCK_DEVICES];
+  int block_count;
+  virtio_net_device_t *net;
+  virtio_9p_device_t *p9;
+  virtio_balloon_device_t *balloon;
+  virtio_vsock_device_t *vsock;
+  virtio_pmem_device_t *pmem;
+  int virtio_count; /* virtio-mmio slots in use, in address order */
+  shmem_device_t *shmem;
+  fb_device_t *fb;
+  pci_bus_t *pci_bus; /* NULL unless virtio devices sit on pci */
 } machine_t;
 
 extern machine_t riscv_machine;
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include "riscv_definations.h"
 
 static int check_valid(uint_t max, uint_t size)
@@ -11,7 +12,7 @@ static int check_valid(uint_t max, uint_t size)
   return (size <= max);
 }
 
-static int_t memory_write(address_item_t *handler, uint8_t *src, uint_t size, uint_t dst)
+int_t memory_write(address_item_t *handler, uint8_t *src, uint_t size, uint_t dst)
 {
   uint_t origin_size = size;
   if (src == NULL || !check_valid(handler->size, (dst + size) - handler->start_address))
@@ -32,7 +33,7 @@ static int_t memory_write(address_item_t *handler, uint8_t *src, uint_t size, ui
   return origin_size;
 }
 
-static int_t memory_read(address_item_t *handler, uint_t src, uint_t size, uint8_t *dst)
+int_t memory_read(address_item_t *handler, uint_t src, uint_t size, uint8_t *dst)
 {
   uint_t origin_size = size;
   if (dst == NULL || !check_valid(handler->size, (src + size) - handler->start_address))
@@ -61,17 +62,23 @@ static int memory_init(address_item_t *handler)
   if (handler->entity != NULL)
     return true;
 
-  handler->entity = malloc(handler->size);
-  if (handler->entity == NULL)
+  /*
+   * Anonymous pages are only backed once touched, and ranges the guest
+   * hands back through the balloon can be dropped with madvise().
+   */
+  handler->entity = mmap(NULL, handler->size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (handler->entity == MAP_FAILED)
+  {
+    handler->entity = NULL;
     return false;
-
-  memset(handler->entity, 0, handler->size);
+  }
   return true;
 }
 
 void memory_release(address_item_t *handler)
 {
-  free(handler->entity);
+  munmap(handler->entity, handler->size);
   return;
 }
 
@@ -80,6 +87,7 @@ static address_item_t memory_item = {
   .start_address = RAM_BASE_ADDR,
   .size = MEMORY_SIZE,
   .entity = NULL,
+  .ram = true,
   .init = memory_init,
   .write_bytes = memory_write,
   .read_bytes = memory_read,
@@ -91,6 +99,7 @@ static address_item_t low_memory_item = {
   .start_address = 0,
   .size = LOW_RAM_SIZE,
   .entity = NULL,
+  .ram = true,
   .init = memory_init,
   .write_bytes = memory_write,
   .read_bytes = memory_read,
@@ -2,8 +2,12 @@
 #define __MEMORY_H__
 
 #include "regs.h"
+#include "iomap.h"
 #define MEMORY_SIZE (256 * (1 << 20))
 
 extern void memory_module_init(cpu_state_t *state);
+/* accessors for any address item whose entity is plain host memory */
+extern int_t memory_write(address_item_t *handler, uint8_t *src, uint_t size, uint_t dst);
+extern int_t memory_read(address_item_t *handler, uint_t src, uint_t size, uint8_t *dst);
 
 #endif
@@ -13,8 +13,11 @@ typedef struct
   uint32_t size;
   uint8_t type;
   bool enabled;
+  uint32_t addr; /* valid while enabled */
   void *opaque;
   pci_bar_set_function *bar_set;
+  pci_bar_read_function *bar_read;
+  pci_bar_write_function *bar_write;
 } pci_io_region_t;
 
 struct pci_device
@@ -34,6 +37,8 @@ struct pci_bus
   pci_device_t *device[256];
   uint32_t irq_state[4][8];
   irq_signal_t irq[4];
+  address_item_t ecam_item;
+  address_item_t mmio_item;
 };
 
 static int bus_map_irq(pci_device_t *device, int irq_num)
@@ -169,7 +174,9 @@ static uint32_t pci_device_config_read(pci_device_t *device, uint32_t addr, int
   return value;
 }
 
-void pci_register_bar(pci_device_t *device, uint32_t bar_num, uint32_t size, int type, void *opaque, pci_bar_set_function *bar_set)
+void pci_register_bar(pci_device_t *device, uint32_t bar_num, uint32_t size, int type,
+    void *opaque, pci_bar_set_function *bar_set,
+    pci_bar_read_function *bar_read, pci_bar_write_function *bar_write)
 {
   pci_io_region_t *region;
   uint32_t value = 0;
@@ -185,6 +192,8 @@ void pci_register_bar(pci_device_t *device, uint32_t bar_num, uint32_t size, int
   region->enabled = false;
   region->opaque = opaque;
   region->bar_set = bar_set;
+  region->bar_read = bar_read;
+  region->bar_write = bar_write;
 
   if (bar_num == PCI_ROM_SLOT)
   {
@@ -254,13 +263,17 @@ static void pci_update_mappings(pci_device_t *device)
     {
       ptr = &device->config[offset];
       new_addr = ptr[0] | ptr[1] << 8 | ptr[2] << 16 | ptr[3] << 24;
-      region->bar_set(region->opaque, i, new_addr, true);
+      new_addr &= (i == PCI_ROM_SLOT) ? ~1u : ~0xfu;
+      region->addr = new_addr;
       region->enabled = true;
+      if (region->bar_set)
+        region->bar_set(region->opaque, i, new_addr, true);
     }
     else if (region->enabled)
     {
-      region->bar_set(region->opaque, i, 0, false);
       region->enabled = false;
+      if (region->bar_set)
+        region->bar_set(region->opaque, i, 0, false);
     }
   }
 }
@@ -360,7 +373,6 @@ static void pci_device_config_write8(pci_device_t *device, uint32_t addr, uint32
 
 static void pci_device_config_write(pci_device_t *device, uint32_t addr, uint32_t data, int size)
 {
-  int size = 0;
   int i = 0;
   uint32_t addr1 = 0;
 
@@ -401,7 +413,7 @@ static void pci_data_write(pci_bus_t *bus, uint32_t addr, uint32_t data, int siz
     return;
 
   devfn = (addr >> 8) & 0xff;
-  device->bus->device[devfn];
+  device = bus->device[devfn];
   if (!device)
     return;
   config_addr = addr & 0xff;
@@ -418,7 +430,7 @@ static uint32_t pci_data_read(pci_bus_t *bus, uint32_t addr, int size)
   {
     switch(size)
     {
-      case 0:
+      case 1:
         return 0xff;
       case 2:
         return 0xffff;
@@ -435,7 +447,7 @@ static uint32_t pci_data_read(pci_bus_t *bus, uint32_t addr, int size)
   {
     switch(size)
     {
-      case 0:
+      case 1:
         return 0xff;
       case 2:
         return 0xffff;
@@ -475,8 +487,140 @@ int pci_add_capability(pci_device_t *device, const uint8_t *buf, int size)
   device->next_cap_offset += size;
   device->config[PCI_STATUS] |= PCI_STATUS_CAP_LIST;
   memcpy(device->config + offset, buf, size);
-  device->config[offset + 1] = device->config[PCI_STATUS_CAP_LIST];
+  device->config[offset + 1] = device->config[PCI_CAPABILITY_LIST];
   device->config[PCI_CAPABILITY_LIST] = offset;
   return offset;
 }
 
+/* ECAM: bus in bits 20..27, devfn in bits 12..19, register below */
+static int ecam_decode(address_item_t *handler, uint_t address, uint_t size, uint32_t *addr)
+{
+  pci_bus_t *bus = (pci_bus_t*)handler->entity;
+  uint_t offset = address - handler->start_address;
+  uint32_t reg = offset & 0xfff;
+
+  if ((size != 1 && size != 2 && size != 4) || (reg & (size - 1)) != 0)
+    return -1;
+  *addr = ((bus->bus_num + (offset >> 20)) << 16) | (((offset >> 12) & 0xff) << 8) | reg;
+  /* only the legacy 256 bytes of each function are implemented */
+  return reg < 256;
+}
+
+static int_t pci_ecam_read(address_item_t *handler, uint_t src, uint_t size, uint8_t *dst)
+{
+  uint32_t addr, value = 0;
+  int ret, i;
+
+  ret = ecam_decode(handler, src, size, &addr);
+  if (ret < 0)
+    return -1;
+  if (ret)
+    value = pci_data_read((pci_bus_t*)handler->entity, addr, size);
+  for (i = 0; i < size; i++)
+    dst[i] = value >> (i * 8);
+  return size;
+}
+
+static int_t pci_ecam_write(address_item_t *handler, uint8_t *src, uint_t size, uint_t dst)
+{
+  uint32_t addr, value = 0;
+  int ret, i;
+
+  ret = ecam_decode(handler, dst, size, &addr);
+  if (ret < 0)
+    return -1;
+  for (i = 0; i < size; i++)
+    value |= src[i] << (i * 8);
+  if (ret)
+    pci_data_write((pci_bus_t*)handler->entity, addr, value, size);
+  return size;
+}
+
+static pci_io_region_t *pci_find_region(pci_bus_t *bus, uint_t address, uint_t size, int *bar_num)
+{
+  pci_device_t *device;
+  pci_io_region_t *region;
+  int devfn, i;
+
+  for (devfn = 0; devfn < 256; devfn++)
+  {
+    device = bus->device[devfn];
+    if (!device)
+      continue;
+    for (i = 0; i < PCI_NUM_REGIONS; i++)
+    {
+      region = &device->io_regions[i];
+      if (region->enabled && !(region->type & PCI_ADDRESS_SPACE_IO) &&
+          address >= region->addr && address + size <= (uint_t)region->addr + region->size)
+      {
+        *bar_num = i;
+        return region;
+      }
+    }
+  }
+  return NULL;
+}
+
+static int_t pci_mmio_read(address_item_t *handler, uint_t src, uint_t size, uint8_t *dst)
+{
+  pci_io_region_t *region;
+  int bar_num;
+
+  region = pci_find_region((pci_bus_t*)handler->entity, src, size, &bar_num);
+  if (!region || !region->bar_read)
+  {
+    memset(dst, 0xff, size);
+    return size;
+  }
+  return region->bar_read(region->opaque, bar_num, src - region->addr, size, dst);
+}
+
+static int_t pci_mmio_write(address_item_t *handler, uint8_t *src, uint_t size, uint_t dst)
+{
+  pci_io_region_t *region;
+  int bar_num;
+
+  region = pci_find_region((pci_bus_t*)handler->entity, dst, size, &bar_num);
+  if (!region || !region->bar_write)
+    return size;
+  return region->bar_write(region->opaque, bar_num, dst - region->addr, size, src);
+}
+
+pci_bus_t *pci_bus_new(cpu_state_t *state, int bus_num, irq_signal_t *irqs)
+{
+  pci_bus_t *bus;
+  int i;
+
+  bus = malloc(sizeof(pci_bus_t));
+  if (!bus)
+  {
+    printf("pci bus malloc error\n");
+    exit(1);
+  }
+  memset(bus, 0, sizeof(pci_bus_t));
+  bus->bus_num = bus_num;
+  for (i = 0; i < 4; i++)
+    bus->irq[i] = irqs[i];
+
+  bus->ecam_item.name = "pci ecam";
+  bus->ecam_item.start_address = PCI_ECAM_BASE_ADDR;
+  bus->ecam_item.size = PCI_ECAM_SIZE;
+  bus->ecam_item.entity = (uint8_t*)bus;
+  bus->ecam_item.read_bytes = pci_ecam_read;
+  bus->ecam_item.write_bytes = pci_ecam_write;
+  iomap_manager.register_address(state, &bus->ecam_item);
+
+  bus->mmio_item.name = "pci mmio";
+  bus->mmio_item.start_address = PCI_MMIO_BASE_ADDR;
+  bus->mmio_item.size = PCI_MMIO_SIZE;
+  bus->mmio_item.entity = (uint8_t*)bus;
+  bus->mmio_item.read_bytes = pci_mmio_read;
+  bus->mmio_item.write_bytes = pci_mmio_write;
+  iomap_manager.register_address(state, &bus->mmio_item);
+
+  /* the host bridge sits in slot 0, devices start at slot 1 */
+  pci_register_device(bus, "host bridge", 0, PCI_VENDOR_ID_REDHAT,
+      PCI_DEVICE_ID_REDHAT_HOST, 0, PCI_CLASS_BRIDGE_HOST);
+  return bus;
+}
+
@@ -27,8 +27,37 @@
 #define PCI_INTERRUPT_LINE	0x3c    /* 8 bits */
 #define PCI_INTERRUPT_PIN	0x3d    /* 8 bits */
 
+#define PCI_VENDOR_ID_REDHAT	0x1b36
+#define PCI_DEVICE_ID_REDHAT_HOST 0x0008
+#define PCI_CLASS_BRIDGE_HOST	0x0600
+
+/* 4 KiB of configuration space per function, 1 MiB per bus */
+#define PCI_ECAM_SIZE		0x00100000
+
 typedef struct pci_device pci_device_t;
 typedef struct pci_bus pci_bus_t;
 typedef void pci_bar_set_function(void *opaque, int bar_num, uint32_t addr, bool enable);
+/* accesses to an enabled memory bar, offset is relative to the bar */
+typedef int_t pci_bar_read_function(void *opaque, int bar_num, uint32_t offset,
+    uint_t size, uint8_t *dst);
+typedef int_t pci_bar_write_function(void *opaque, int bar_num, uint32_t offset,
+    uint_t size, uint8_t *src);
+
+/*
+ * irqs are the four INTx lines of the bus. The bus answers configuration
+ * accesses at PCI_ECAM_BASE_ADDR and forwards the PCI_MMIO window to the
+ * memory bars the guest has placed there.
+ */
+extern pci_bus_t *pci_bus_new(cpu_state_t *state, int bus_num, irq_signal_t *irqs);
+extern pci_device_t *pci_register_device(pci_bus_t *bus, const char *name, int devfn,
+    uint16_t vendor_id, uint16_t device_id, uint8_t revision, uint16_t class_id);
+extern irq_signal_t *pci_device_get_irq(pci_device_t *device, uint32_t irq_num);
+extern void pci_register_bar(pci_device_t *device, uint32_t bar_num, uint32_t size, int type,
+    void *opaque, pci_bar_set_function *bar_set,
+    pci_bar_read_function *bar_read, pci_bar_write_function *bar_write);
+extern void pci_device_set_config8(pci_device_t *device, uint8_t addr, uint8_t val);
+extern void pci_device_set_config16(pci_device_t *device, uint8_t addr, uint16_t val);
+extern int pci_device_get_devfn(pci_device_t *device);
+extern int pci_add_capability(pci_device_t *device, const uint8_t *buf, int size);
 
 #endif
@@ -21,8 +21,9 @@ static void plic_update_mip(cpu_state_t *state)
   }
 }
 
-void plic_set_irq(cpu_state_t *state, int irq_num, int flag)
+void plic_set_irq(void *opaque, int irq_num, int flag)
 {
+  cpu_state_t *state = opaque;
   uint32_t mask = 1 << (irq_num - 1);
   if (flag)
     state->plic_pending_irq |= mask;
@@ -5,14 +5,14 @@
 #include "riscv_definations.h"
 
 typedef struct cpu_state cpu_state_t;
-typedef void set_irq_func(cpu_state_t* state, int irq_num, int flag);
+typedef void set_irq_func(void *opaque, int irq_num, int flag);
 
 #pragma pack(push)
 #pragma pack(1)
 typedef struct
 {
   set_irq_func *set_irq;
-  cpu_state_t *opaque;
+  void *opaque;
   int irq_num;
 } irq_signal_t;
 #pragma pack(pop)
@@ -22,7 +22,7 @@ static inline void set_irq(irq_signal_t *irq, int level)
   irq->set_irq(irq->opaque, irq->irq_num, level);
 }
 
-static inline void irq_init(irq_signal_t *irq, set_irq_func *set_irq, cpu_state_t *opaque, int irq_num)
+static inline void irq_init(irq_signal_t *irq, set_irq_func *set_irq, void *opaque, int irq_num)
 {
     irq->set_irq = set_irq;
     irq->opaque = opaque;
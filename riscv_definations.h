@@ -143,6 +143,18 @@ typedef int bool;
 #define PLIC_BASE_ADDR 0x40100000
 #define PLIC_SIZE      0x00400000
 #define FRAMEBUFFER_BASE_ADDR 0x41000000
+#define FRAMEBUFFER_MAX_SIZE  0x01000000
+#define PCI_ECAM_BASE_ADDR 0x30000000
+#define PCI_MMIO_BASE_ADDR 0x60000000
+#define PCI_MMIO_SIZE      0x20000000
+#define PMEM_BASE_ADDR     0xa0000000
+#define PMEM_MAX_SIZE      0x40000000
+#define SHMEM_BASE_ADDR     0x40500000
+#define SHMEM_SIZE          0x1000
+#define SHMEM_MEM_BASE_ADDR 0xe0000000
+#define SHMEM_MAX_SIZE      0x10000000
+#define SHMEM_IRQ           24
+#define PCI_IRQ            20 /* INTA..INTD take four lines from here */
 
 #define RTC_FREQ 10000000
 #define RTC_FREQ_DIV 16 /* arbitrary, relative to CPU freq to have a
@@ -0,0 +1,222 @@
+#include "shmem.h"
+#include "memory.h"
+#include "machine.h"
+#include "riscv_definations.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include "cutils.h"
+
+static void shmem_update_irq(shmem_device_t *shm)
+{
+  set_irq(shm->irq, (shm->intr_status & shm->intr_mask) != 0);
+}
+
+static void shmem_ring_host(shmem_device_t *shm, uint32_t value)
+{
+  uint8_t buf[4];
+
+  shm->guest_rings++;
+  put_le32(buf, value);
+  if (shm->bell_fd < 0 || shm->peer_len == 0 ||
+      sendto(shm->bell_fd, buf, 4, MSG_DONTWAIT, (struct sockaddr*)&shm->peer, shm->peer_len) != 4)
+    shm->lost_rings++;
+}
+
+static int shmem_init(address_item_t *handler)
+{
+  return true;
+}
+
+static int_t shmem_read(address_item_t *handler, uint_t src, uint_t size, uint8_t *dst)
+{
+  shmem_device_t *shm = (shmem_device_t*)handler->entity;
+  uint32_t value;
+
+  if (size != 4)
+    return -1;
+  switch (src - handler->start_address)
+  {
+    case SHMEM_INTR_MASK:
+      value = shm->intr_mask;
+      break;
+    case SHMEM_INTR_STATUS:
+      value = shm->intr_status;
+      break;
+    default:
+      value = 0;
+      break;
+  }
+  put_le32(dst, value);
+  return 4;
+}
+
+static int_t shmem_write(address_item_t *handler, uint8_t *src, uint_t size, uint_t dst)
+{
+  shmem_device_t *shm = (shmem_device_t*)handler->entity;
+  uint32_t value;
+
+  if (size != 4)
+    return -1;
+  value = get_le32(src);
+  switch (dst - handler->start_address)
+  {
+    case SHMEM_INTR_MASK:
+      shm->intr_mask = value;
+      shmem_update_irq(shm);
+      break;
+    case SHMEM_INTR_STATUS:
+      shm->intr_status &= ~value;
+      shmem_update_irq(shm);
+      break;
+    case SHMEM_DOORBELL:
+      shmem_ring_host(shm, value);
+      break;
+    default:
+      break;
+  }
+  return 4;
+}
+
+static void shmem_release(address_item_t *handler)
+{
+  shmem_device_t *shm = (shmem_device_t*)handler->entity;
+
+  if (shm->bell_fd >= 0)
+  {
+    close(shm->bell_fd);
+    unlink(shm->bell_path);
+  }
+  shmdt(shm->mem_item.entity);
+  /* a segment we made goes away once host tools detach too */
+  if (shm->created)
+    shmctl(shm->shm_id, IPC_RMID, NULL);
+  free(shm);
+}
+
+/* rings from the host side; the last sender is who the guest rings back */
+void shmem_poll(shmem_device_t *shm)
+{
+  uint8_t buf[64];
+  struct sockaddr_un addr;
+  socklen_t addr_len;
+  uint32_t value;
+  ssize_t ret;
+
+  for (;;)
+  {
+    addr_len = sizeof(addr);
+    ret = recvfrom(shm->bell_fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*)&addr, &addr_len);
+    if (ret < 0)
+      break;
+    if (addr_len > sizeof(sa_family_t))
+    {
+      shm->peer = addr;
+      shm->peer_len = addr_len;
+    }
+    value = ret >= 4 ? get_le32(buf) : 1;
+    shm->intr_status |= value ? value : 1;
+    shm->host_rings++;
+  }
+  shmem_update_irq(shm);
+}
+
+static void shmem_open_doorbell(shmem_device_t *shm, const char *path)
+{
+  struct sockaddr_un local;
+
+  memset(&local, 0, sizeof(local));
+  local.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(local.sun_path))
+  {
+    printf("doorbell socket path too long: %s\n", path);
+    exit(1);
+  }
+  strcpy(local.sun_path, path);
+  shm->bell_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (shm->bell_fd < 0)
+  {
+    perror("socket");
+    exit(1);
+  }
+  unlink(path);
+  if (bind(shm->bell_fd, (struct sockaddr*)&local, sizeof(local)) < 0)
+  {
+    perror(path);
+    exit(1);
+  }
+  fcntl(shm->bell_fd, F_SETFL, O_NONBLOCK);
+  shm->bell_path = path;
+}
+
+void shmem_module_init(cpu_state_t *state, const shmem_config_t *config)
+{
+  shmem_device_t *shm;
+  uint32_t size;
+  void *addr;
+
+  size = (config->size + 4095) & ~4095;
+  if (size == 0 || size > SHMEM_MAX_SIZE)
+  {
+    printf("shared memory size must be between 4 KiB and %d MiB\n", SHMEM_MAX_SIZE >> 20);
+    exit(1);
+  }
+
+  shm = malloc(sizeof(*shm));
+  memset(shm, 0, sizeof(*shm));
+  shm->irq = &state->plic_irq[SHMEM_IRQ];
+  shm->bell_fd = -1;
+
+  /* create it if we can, otherwise share the one host tools made */
+  shm->shm_id = shmget(config->key, size, 0666 | IPC_CREAT | IPC_EXCL);
+  if (shm->shm_id >= 0)
+    shm->created = true;
+  else if (errno == EEXIST)
+    shm->shm_id = shmget(config->key, size, 0666);
+  if (shm->shm_id < 0)
+  {
+    perror("shmget");
+    exit(1);
+  }
+  addr = shmat(shm->shm_id, NULL, 0);
+  if (addr == (void*)-1)
+  {
+    perror("shmat");
+    exit(1);
+  }
+  if (config->doorbell)
+    shmem_open_doorbell(shm, config->doorbell);
+
+  shm->mem_item.name = "shared memory";
+  shm->mem_item.start_address = SHMEM_MEM_BASE_ADDR;
+  shm->mem_item.size = size;
+  shm->mem_item.entity = addr;
+  shm->mem_item.ram = true;
+  shm->mem_item.read_bytes = memory_read;
+  shm->mem_item.write_bytes = memory_write;
+  iomap_manager.register_address(state, &shm->mem_item);
+
+  shm->reg_item.name = "shared memory doorbell";
+  shm->reg_item.start_address = SHMEM_BASE_ADDR;
+  shm->reg_item.size = SHMEM_SIZE;
+  shm->reg_item.entity = (uint8_t*)shm;
+  shm->reg_item.init = shmem_init;
+  shm->reg_item.read_bytes = shmem_read;
+  shm->reg_item.write_bytes = shmem_write;
+  shm->reg_item.release = shmem_release;
+  iomap_manager.register_address(state, &shm->reg_item);
+
+  riscv_machine.shmem = shm;
+}
+
+void shmem_print_stats(shmem_device_t *shm, FILE *f)
+{
+  fprintf(f, "shmem: %" PRIu64 " KiB, %" PRIu64 " rings from the host, %" PRIu64 " to the host, "
+      "%" PRIu64 " unheard\n", (uint64_t)shm->mem_item.size >> 10, shm->host_rings,
+      shm->guest_rings, shm->lost_rings);
+}
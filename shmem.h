@@ -0,0 +1,57 @@
+#ifndef __SHMEM_H__
+#define __SHMEM_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "regs.h"
+#include "iomap.h"
+#include "riscv_definations.h"
+
+/* registers, laid out like BAR0 of ivshmem */
+#define SHMEM_INTR_MASK   0x00
+#define SHMEM_INTR_STATUS 0x04 /* write ones to clear */
+#define SHMEM_IV_POSITION 0x08 /* the guest is peer 0, the host side peer 1 */
+#define SHMEM_DOORBELL    0x0c
+
+typedef struct
+{
+  key_t key;             /* SysV shared memory key, as space_gui uses */
+  uint32_t size;
+  const char *doorbell;  /* UNIX datagram socket, NULL for none */
+} shmem_config_t;
+
+/*
+ * A host SysV shared memory segment mapped at SHMEM_MEM_BASE_ADDR, plus
+ * a doorbell. A datagram sent to the doorbell socket ORs its first four
+ * bytes (1 if shorter) into INTR_STATUS and raises SHMEM_IRQ while any
+ * unmasked bit is set. A guest write to DOORBELL sends the value to
+ * whoever rang last.
+ */
+typedef struct shmem_device
+{
+  address_item_t reg_item;
+  address_item_t mem_item; /* entity is the attached segment */
+  irq_signal_t *irq;
+  int shm_id;
+  bool created; /* ours to remove at exit */
+
+  int bell_fd;
+  const char *bell_path;
+  struct sockaddr_un peer;
+  socklen_t peer_len;
+
+  uint32_t intr_mask;
+  uint32_t intr_status;
+
+  uint64_t guest_rings;
+  uint64_t host_rings;
+  uint64_t lost_rings; /* guest rings nobody was there to hear */
+} shmem_device_t;
+
+extern void shmem_module_init(cpu_state_t *state, const shmem_config_t *config);
+extern void shmem_poll(shmem_device_t *shm);
+extern void shmem_print_stats(shmem_device_t *shm, FILE *f);
+#endif
@@ -10,15 +10,42 @@
 #include "fdt.h"
 #include "virtio_interface.h"
 #include "virtio_block_device.h"
+#include "virtio_net_device.h"
+#include "virtio_9p_device.h"
+#include "virtio_balloon_device.h"
+#include "virtio_vsock_device.h"
+#include "virtio_pmem_device.h"
+#include "pci.h"
+#include "shmem.h"
+#include "framebuffer.h"
+#include "block_readahead.h"
 #include "console.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 #include "machine.h"
 
 const char *bios_path = "./images/bbl64.bin";
 const char *kernel_path = "./images/kernel-riscv64.bin";
-const char *device = "./images/root-riscv64.bin";
+const char *default_device = "./images/root-riscv64.bin";
+char *devices[MAX_BLOCK_DEVICES];
+int device_count = 0;
 const char *cmdline = "console=hvc0 root=/dev/vda rw";
+block_device_mode_enum device_mode = BF_MODE_SNAPSHOT;
+bool print_stats = false;
+int readahead_kb = READAHEAD_DEFAULT_KB;
+int writeback_mb = 0;
+bool hugepages = false;
+int queue_size = VIRTIO_DEFAULT_QUEUE_NUM;
+bool use_pci = false;
+char *net_spec = NULL;
+char *fs_spec = NULL;
+int balloon_mb = -1;
+char *vsock_spec = NULL;
+char *pmem_spec = NULL;
+char *shmem_spec = NULL;
+virtio_console_config_t console_config;
+char *fb_spec = NULL;
 
 #define BIOS_INDEX 0
 #define KERNEL_INDEX 1
@@ -159,13 +186,429 @@ static void copy_bin(cpu_state_t *state, const uint8_t *buf, int buf_len)
   q[1] = 0x00028067; /* jalr zero, t0, jump_addr */
 }
 
+static void usage(const char *name)
+{
+  printf("usage: %s [options] [binary]\n"
+         "  -d image[,option...]\n"
+         "             add a block device (default %s), may be repeated;\n"
+         "             options mode=, readahead=, writeback=, queue= and hugepages\n"
+         "             override -m, -r, -w, -q and -H for that device\n"
+         "  -m mode    block device mode: ro, rw, snapshot or ram (default snapshot);\n"
+         "             ram loads the whole image into memory and discards writes\n"
+         "  -H         back ram block devices with hugepages\n"
+         "  -r KiB     maximum block device read-ahead window, 0 disables\n"
+         "             (default %d)\n"
+         "  -w MiB     write-back cache for rw block devices, 0 disables\n"
+         "             (default 0)\n"
+         "  -q N       virtqueue size of block devices, a power of two up to %d\n"
+         "             (default %d)\n"
+         "  -n tap:IFNAME[,mac=..] | unix:LOCAL:PEER[,mac=..]\n"
+         "             add a virtio-net device exchanging frames with a tap\n"
+         "             interface or over a UNIX datagram socket\n"
+         "  -f DIR[,tag=TAG]\n"
+         "             share a host directory through virtio-9p; the guest\n"
+         "             mounts it with -t 9p -o trans=virtio TAG (default host)\n"
+         "  -b MiB     add a virtio-balloon device asking the guest to give up\n"
+         "             MiB of RAM; free pages it reports go back to the host\n"
+         "  -v PATH[,cid=N]\n"
+         "             add a virtio-vsock device with guest CID N (default 3);\n"
+         "             guest connections to host port P open PATH_P, host\n"
+         "             programs connect to PATH and send \"CONNECT P\\n\" to\n"
+         "             reach guest port P\n"
+         "  -P FILE[,ro]\n"
+         "             map FILE into guest memory as a virtio-pmem device the\n"
+         "             guest can mount with -o dax; with ro guest writes are\n"
+         "             discarded\n"
+         "  -s KEY[,size=KiB][,doorbell=PATH]\n"
+         "             map the SysV shared memory segment KEY (default 1024 KiB)\n"
+         "             into guest memory; datagrams sent to PATH interrupt the\n"
+         "             guest, and guest doorbell writes go back to the sender\n"
+         "  -c NAME=FILE\n"
+         "             add a virtio-console port the guest sees as\n"
+         "             /dev/virtio-ports/NAME; its output is appended to FILE.\n"
+         "             May be given %d times\n"
+         "  -F WIDTHxHEIGHT[,file=PATH]\n"
+         "             add a simple-framebuffer (a8r8g8b8); with file, PATH\n"
+         "             holds the raw pixels, rewritten where they changed\n"
+         "  -p         attach virtio devices to a PCIe host bridge instead of\n"
+         "             virtio-mmio\n"
+         "  -S         print device statistics at exit\n",
+         name, default_device, READAHEAD_DEFAULT_KB, MAX_QUEUE_NUM, VIRTIO_DEFAULT_QUEUE_NUM,
+         VIRTIO_CONSOLE_MAX_PORTS - 1);
+  exit(1);
+}
+
+static void print_device_stats(void)
+{
+  int i;
+  virtio_console_print_stats(riscv_machine.console, stderr);
+  for (i = 0; i < riscv_machine.block_count; i++)
+    virtual_block_print_stats(riscv_machine.block[i], stderr);
+  if (riscv_machine.net)
+    virtio_net_print_stats(riscv_machine.net, stderr);
+  if (riscv_machine.p9)
+    virtio_9p_print_stats(riscv_machine.p9, stderr);
+  if (riscv_machine.balloon)
+    virtio_balloon_print_stats(riscv_machine.balloon, stderr);
+  if (riscv_machine.vsock)
+    virtio_vsock_print_stats(riscv_machine.vsock, stderr);
+  if (riscv_machine.pmem)
+    virtio_pmem_print_stats(riscv_machine.pmem, stderr);
+  if (riscv_machine.shmem)
+    shmem_print_stats(riscv_machine.shmem, stderr);
+  if (riscv_machine.fb)
+    fb_print_stats(riscv_machine.fb, stderr);
+}
+
+/* guest output may still be waiting for its batch to fill */
+static void flush_console_output(void)
+{
+  int i;
+  for (i = 0; i < riscv_machine.console->nr_ports; i++)
+    console_out_flush(&riscv_machine.console->ports[i].out, true);
+}
+
+/* do not lose data still sitting in a write-back cache */
+static void flush_block_devices(void)
+{
+  int i;
+  for (i = 0; i < riscv_machine.block_count; i++)
+  {
+    virtual_block_drain(riscv_machine.block[i]);
+    block_device_flush(riscv_machine.block[i]->bs);
+  }
+}
+
+static block_device_mode_enum parse_block_mode(const char *name, const char *str)
+{
+  if (!strcmp(str, "ro"))
+    return BF_MODE_RO;
+  if (!strcmp(str, "rw"))
+    return BF_MODE_RW;
+  if (!strcmp(str, "snapshot"))
+    return BF_MODE_SNAPSHOT;
+  if (!strcmp(str, "ram"))
+    return BF_MODE_RAM;
+  printf("unknown block device mode: %s\n", str);
+  usage(name);
+  return BF_MODE_SNAPSHOT;
+}
+
+static int parse_queue_size(const char *name, const char *str)
+{
+  int num = atoi(str);
+
+  if (num <= 0 || num > MAX_QUEUE_NUM || (num & (num - 1)) != 0)
+  {
+    printf("invalid virtqueue size: %s\n", str);
+    usage(name);
+  }
+  return num;
+}
+
+/* "backend[,mac=aa:bb:cc:dd:ee:ff]" */
+static void parse_net_device(const char *name, char *spec, virtio_net_config_t *config)
+{
+  static const uint8_t default_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+  unsigned int mac[6];
+  char *opt;
+  int i;
+
+  config->backend = strtok(spec, ",");
+  memcpy(config->mac, default_mac, 6);
+  if (!config->backend)
+    usage(name);
+  while ((opt = strtok(NULL, ",")) != NULL)
+  {
+    if (sscanf(opt, "mac=%x:%x:%x:%x:%x:%x", &mac[0], &mac[1], &mac[2],
+          &mac[3], &mac[4], &mac[5]) == 6)
+    {
+      for (i = 0; i < 6; i++)
+        config->mac[i] = mac[i];
+    }
+    else
+    {
+      printf("unknown network device option: %s\n", opt);
+      usage(name);
+    }
+  }
+}
+
+/* "dir[,tag=..]" */
+static void parse_fs_device(const char *name, char *spec, virtio_9p_config_t *config)
+{
+  char *opt;
+
+  config->root = strtok(spec, ",");
+  config->tag = "host";
+  if (!config->root)
+    usage(name);
+  while ((opt = strtok(NULL, ",")) != NULL)
+  {
+    if (!strncmp(opt, "tag=", 4) && opt[4])
+    {
+      config->tag = opt + 4;
+    }
+    else
+    {
+      printf("unknown shared directory option: %s\n", opt);
+      usage(name);
+    }
+  }
+}
+
+static void parse_vsock_device(const char *name, char *spec, virtio_vsock_config_t *config)
+{
+  char *opt;
+
+  config->path = strtok(spec, ",");
+  config->guest_cid = 3;
+  if (!config->path)
+    usage(name);
+  while ((opt = strtok(NULL, ",")) != NULL)
+  {
+    if (!strncmp(opt, "cid=", 4) && opt[4])
+    {
+      config->guest_cid = strtoull(opt + 4, NULL, 0);
+      /* 0-2 are reserved, the top of the range is VMADDR_CID_ANY */
+      if (config->guest_cid < 3 || config->guest_cid >= 0xffffffff)
+      {
+        printf("invalid guest cid: %s\n", opt + 4);
+        usage(name);
+      }
+    }
+    else
+    {
+      printf("unknown vsock option: %s\n", opt);
+      usage(name);
+    }
+  }
+}
+
+static void parse_pmem_device(const char *name, char *spec, virtio_pmem_config_t *config)
+{
+  char *opt;
+
+  config->path = strtok(spec, ",");
+  config->readonly = false;
+  if (!config->path)
+    usage(name);
+  while ((opt = strtok(NULL, ",")) != NULL)
+  {
+    if (!strcmp(opt, "ro"))
+    {
+      config->readonly = true;
+    }
+    else
+    {
+      printf("unknown pmem option: %s\n", opt);
+      usage(name);
+    }
+  }
+}
+
+static void parse_shmem_device(const char *name, char *spec, shmem_config_t *config)
+{
+  char *opt, *end;
+
+  opt = strtok(spec, ",");
+  if (!opt)
+    usage(name);
+  config->key = strtol(opt, &end, 0);
+  if (*end)
+  {
+    printf("invalid shared memory key: %s\n", opt);
+    usage(name);
+  }
+  config->size = 1024 << 10;
+  config->doorbell = NULL;
+  while ((opt = strtok(NULL, ",")) != NULL)
+  {
+    if (!strncmp(opt, "size=", 5) && opt[5])
+    {
+      config->size = atoi(opt + 5) << 10;
+    }
+    else if (!strncmp(opt, "doorbell=", 9) && opt[9])
+    {
+      config->doorbell = opt + 9;
+    }
+    else
+    {
+      printf("unknown shared memory option: %s\n", opt);
+      usage(name);
+    }
+  }
+}
+
+static void parse_console_port(const char *name, char *spec, virtio_console_config_t *config)
+{
+  char *path = strchr(spec, '=');
+
+  if (config->count == VIRTIO_CONSOLE_MAX_PORTS - 1)
+  {
+    printf("too many console ports, at most %d are supported\n", VIRTIO_CONSOLE_MAX_PORTS - 1);
+    exit(1);
+  }
+  if (!path || path == spec || !path[1] || path - spec > VIRTIO_CONSOLE_MAX_NAME)
+  {
+    printf("invalid console port: %s\n", spec);
+    usage(name);
+  }
+  *path++ = '\0';
+  config->name[config->count] = spec;
+  config->path[config->count] = path;
+  config->count++;
+}
+
+static void parse_framebuffer(const char *name, char *spec, fb_config_t *config)
+{
+  char *opt;
+
+  opt = strtok(spec, ",");
+  config->path = NULL;
+  if (!opt || sscanf(opt, "%dx%d", &config->width, &config->height) != 2)
+  {
+    printf("invalid framebuffer size: %s\n", spec);
+    usage(name);
+  }
+  while ((opt = strtok(NULL, ",")) != NULL)
+  {
+    if (!strncmp(opt, "file=", 5) && opt[5])
+    {
+      config->path = opt + 5;
+    }
+    else
+    {
+      printf("unknown framebuffer option: %s\n", opt);
+      usage(name);
+    }
+  }
+}
+
+/* "image[,mode=..][,readahead=..][,writeback=..][,queue=..][,hugepages]" */
+static void parse_block_device(const char *name, char *spec, virtual_block_config_t *config)
+{
+  char *opt, *value;
+
+  config->filename = strtok(spec, ",");
+  config->mode = device_mode;
+  config->readahead_kb = readahead_kb;
+  config->writeback_mb = writeback_mb;
+  config->hugepages = hugepages;
+  config->queue_size = queue_size;
+  if (!config->filename)
+    usage(name);
+  while ((opt = strtok(NULL, ",")) != NULL)
+  {
+    value = strchr(opt, '=');
+    if (value)
+      *value++ = '\0';
+    if (!strcmp(opt, "mode") && value)
+      config->mode = parse_block_mode(name, value);
+    else if (!strcmp(opt, "readahead") && value)
+      config->readahead_kb = atoi(value);
+    else if (!strcmp(opt, "writeback") && value)
+      config->writeback_mb = atoi(value);
+    else if (!strcmp(opt, "queue") && value)
+      config->queue_size = parse_queue_size(name, value);
+    else if (!strcmp(opt, "hugepages") && !value)
+      config->hugepages = true;
+    else
+    {
+      printf("unknown block device option: %s\n", opt);
+      usage(name);
+    }
+  }
+}
+
 int main(int argc, char *argv[])
 {
+  virtual_block_config_t config;
+  virtio_net_config_t net_config;
+  virtio_9p_config_t fs_config;
+  virtio_vsock_config_t vsock_config;
+  virtio_pmem_config_t pmem_config;
+  shmem_config_t shmem_config;
+  fb_config_t fb_config;
+  const char *bin_path = NULL;
+  int c;
+
+  while ((c = getopt(argc, argv, "d:m:r:w:q:n:f:b:v:P:s:c:F:pHSh")) != -1)
+  {
+    switch(c)
+    {
+      case 'd':
+        if (device_count == MAX_BLOCK_DEVICES)
+        {
+          printf("too many block devices, at most %d are supported\n", MAX_BLOCK_DEVICES);
+          exit(1);
+        }
+        devices[device_count++] = optarg;
+        break;
+      case 'm':
+        device_mode = parse_block_mode(argv[0], optarg);
+        break;
+      case 'r':
+        readahead_kb = atoi(optarg);
+        break;
+      case 'w':
+        writeback_mb = atoi(optarg);
+        break;
+      case 'q':
+        queue_size = parse_queue_size(argv[0], optarg);
+        break;
+      case 'n':
+        net_spec = optarg;
+        break;
+      case 'f':
+        fs_spec = optarg;
+        break;
+      case 'b':
+        balloon_mb = atoi(optarg);
+        if (balloon_mb < 0 || balloon_mb >= MEMORY_SIZE >> 20)
+        {
+          printf("invalid balloon size: %s\n", optarg);
+          usage(argv[0]);
+        }
+        break;
+      case 'v':
+        vsock_spec = optarg;
+        break;
+      case 'P':
+        pmem_spec = optarg;
+        break;
+      case 's':
+        shmem_spec = optarg;
+        break;
+      case 'c':
+        parse_console_port(argv[0], optarg, &console_config);
+        break;
+      case 'F':
+        fb_spec = optarg;
+        break;
+      case 'p':
+        use_pci = true;
+        break;
+      case 'H':
+        hugepages = true;
+        break;
+      case 'S':
+        print_stats = true;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind < argc)
+    bin_path = argv[optind];
+  if (!device_count)
+    devices[device_count++] = (char*)default_device;
+
   cpu_state_reset();  
   riscv_machine.cpu_state = &cpu_state;
-  if (argc > 1)
+  if (bin_path)
   {
-    load_file(argv[1], &pfs[BIN_INDEX]);
+    load_file(bin_path, &pfs[BIN_INDEX]);
   }
   load_file(bios_path, &pfs[BIOS_INDEX]);
   load_file(kernel_path, &pfs[KERNEL_INDEX]);
@@ -186,16 +629,87 @@ int main(int argc, char *argv[])
   if (!bus)
     return -1;
   memset(bus, 0, sizeof(*bus));
+  if (use_pci)
+  {
+    riscv_machine.pci_bus = pci_bus_new(&cpu_state, 0, &cpu_state.plic_irq[PCI_IRQ]);
+    bus->pci_bus = riscv_machine.pci_bus;
+  }
   bus->addr = VIRTIO_BASE_ADDR;
   bus->irq = &cpu_state.plic_irq[irq_num++];
-  virtual_console_device_init(&cpu_state, bus);
+  virtual_console_device_init(&cpu_state, &console_config, bus);
+  if (!use_pci)
+    riscv_machine.virtio_count++;
 
-  /* change addr and irq for next devie */
-  bus->addr += VIRTIO_SIZE;
-  bus->irq = &cpu_state.plic_irq[irq_num++];
-  virtual_block_device_init(&cpu_state, device, BF_MODE_SNAPSHOT, bus);
+  for (i = 0; i < device_count; i++)
+  {
+    /* change addr and irq for next devie */
+    bus->addr += VIRTIO_SIZE;
+    bus->irq = &cpu_state.plic_irq[irq_num++];
+    parse_block_device(argv[0], strdup(devices[i]), &config);
+    virtual_block_device_init(&cpu_state, &config, bus);
+    if (!use_pci)
+      riscv_machine.virtio_count++;
+  }
+  if (net_spec)
+  {
+    bus->addr += VIRTIO_SIZE;
+    bus->irq = &cpu_state.plic_irq[irq_num++];
+    parse_net_device(argv[0], net_spec, &net_config);
+    virtio_net_device_init(&cpu_state, &net_config, bus);
+    if (!use_pci)
+      riscv_machine.virtio_count++;
+  }
+  if (fs_spec)
+  {
+    bus->addr += VIRTIO_SIZE;
+    bus->irq = &cpu_state.plic_irq[irq_num++];
+    parse_fs_device(argv[0], fs_spec, &fs_config);
+    virtio_9p_device_init(&cpu_state, &fs_config, bus);
+    if (!use_pci)
+      riscv_machine.virtio_count++;
+  }
+  if (balloon_mb >= 0)
+  {
+    bus->addr += VIRTIO_SIZE;
+    bus->irq = &cpu_state.plic_irq[irq_num++];
+    virtio_balloon_device_init(&cpu_state, balloon_mb, bus);
+    if (!use_pci)
+      riscv_machine.virtio_count++;
+  }
+  if (vsock_spec)
+  {
+    bus->addr += VIRTIO_SIZE;
+    bus->irq = &cpu_state.plic_irq[irq_num++];
+    parse_vsock_device(argv[0], vsock_spec, &vsock_config);
+    virtio_vsock_device_init(&cpu_state, &vsock_config, bus);
+    if (!use_pci)
+      riscv_machine.virtio_count++;
+  }
+  if (pmem_spec)
+  {
+    bus->addr += VIRTIO_SIZE;
+    bus->irq = &cpu_state.plic_irq[irq_num++];
+    parse_pmem_device(argv[0], pmem_spec, &pmem_config);
+    virtio_pmem_device_init(&cpu_state, &pmem_config, bus);
+    if (!use_pci)
+      riscv_machine.virtio_count++;
+  }
+  if (shmem_spec)
+  {
+    parse_shmem_device(argv[0], shmem_spec, &shmem_config);
+    shmem_module_init(&cpu_state, &shmem_config);
+  }
+  if (fb_spec)
+  {
+    parse_framebuffer(argv[0], fb_spec, &fb_config);
+    framebuffer_module_init(&cpu_state, &fb_config);
+  }
+  if (print_stats)
+    atexit(print_device_stats);
+  atexit(flush_block_devices);
+  atexit(flush_console_output);
 
-  if (argc > 1)
+  if (bin_path)
   {
     copy_bin(&cpu_state, pfs[BIN_INDEX].buf, pfs[BIN_INDEX].size);
   }
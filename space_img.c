@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "block_device.h"
+#include "block_overlay.h"
+#include "block_compressed.h"
+
+static void usage(void)
+{
+  printf("usage: space-img command [options]\n"
+         "  create [-c cluster_bits] -b backing overlay\n"
+         "         create a copy-on-write overlay on top of backing; a relative\n"
+         "         backing name is resolved from the directory of the overlay\n"
+         "  compress [-c chunk_bits] input output\n"
+         "         write a read-only compressed copy of any supported image\n");
+  exit(1);
+}
+
+static int cmd_create(int argc, char *argv[])
+{
+  const char *backing = NULL;
+  int cluster_bits = OVERLAY_DEFAULT_CLUSTER_BITS;
+  int c;
+
+  while ((c = getopt(argc, argv, "b:c:")) != -1)
+  {
+    switch(c)
+    {
+      case 'b':
+        backing = optarg;
+        break;
+      case 'c':
+        cluster_bits = atoi(optarg);
+        break;
+      default:
+        usage();
+    }
+  }
+  if (!backing || optind + 1 != argc)
+    usage();
+
+  return block_overlay_create(argv[optind], backing, cluster_bits) < 0 ? 1 : 0;
+}
+
+static int cmd_compress(int argc, char *argv[])
+{
+  block_device_t *src;
+  int chunk_bits = COMPRESSED_DEFAULT_CHUNK_BITS;
+  int c;
+
+  while ((c = getopt(argc, argv, "c:")) != -1)
+  {
+    switch(c)
+    {
+      case 'c':
+        chunk_bits = atoi(optarg);
+        break;
+      default:
+        usage();
+    }
+  }
+  if (optind + 2 != argc)
+    usage();
+
+  src = block_device_open(argv[optind], BF_MODE_RO);
+  return block_compressed_create(argv[optind + 1], src, chunk_bits) < 0 ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2)
+    usage();
+
+  if (!strcmp(argv[1], "create"))
+    return cmd_create(argc - 1, argv + 1);
+  if (!strcmp(argv[1], "compress"))
+    return cmd_compress(argc - 1, argv + 1);
+
+  usage();
+  return 1;
+}
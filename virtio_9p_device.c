@@ -0,0 +1,1174 @@
+#define _GNU_SOURCE
+#include "virtio_9p_device.h"
+#include "virtio_interface.h"
+#include "machine.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include "cutils.h"
+
+/* qid types */
+#define P9_QTDIR     0x80
+#define P9_QTSYMLINK 0x02
+#define P9_QTFILE    0x00
+
+#define P9_MAXWELEM 16
+#define P9_GETATTR_BASIC 0x7ff
+#define P9_MAGIC 0x01021997
+
+/* Tsetattr valid bits */
+#define P9_SETATTR_MODE      0x001
+#define P9_SETATTR_UID       0x002
+#define P9_SETATTR_GID       0x004
+#define P9_SETATTR_SIZE      0x008
+#define P9_SETATTR_ATIME     0x010
+#define P9_SETATTR_MTIME     0x020
+#define P9_SETATTR_ATIME_SET 0x080
+#define P9_SETATTR_MTIME_SET 0x100
+
+#define P9_AT_REMOVEDIR 0x200
+#define P9_LOCK_SUCCESS 0
+#define P9_LOCK_TYPE_UNLCK 2
+
+/* open flags on the wire are the generic Linux ones, not the host's */
+static const struct
+{
+  uint32_t dotl;
+  int host;
+} p9_open_flags[] =
+{
+  {00000100, O_CREAT},
+  {00000200, O_EXCL},
+  {00001000, O_TRUNC},
+  {00002000, O_APPEND},
+  {00004000, O_NONBLOCK},
+  {00010000, O_DSYNC},
+  {00200000, O_DIRECTORY},
+  {00400000, O_NOFOLLOW},
+  {04000000, O_SYNC},
+};
+
+int p9_init(address_item_t *handler)
+{
+  return true;
+}
+
+void p9_release(address_item_t *handler)
+{
+  virtio_9p_device_t *p9 = (virtio_9p_device_t*)handler->entity;
+  free(p9->req_buf);
+  free(p9->reply_buf);
+  free(p9);
+}
+
+address_item_t p9_item =
+{
+  .name = "9p",
+  .init = p9_init,
+  .release = p9_release
+};
+
+/* message decoding; a short message sets error and reads as zeros */
+static const uint8_t *p9_get(p9_buf_t *b, int len)
+{
+  static const uint8_t zeros[8];
+  const uint8_t *ptr;
+
+  if (b->error || b->pos + len > b->size)
+  {
+    b->error = true;
+    return zeros;
+  }
+  ptr = b->data + b->pos;
+  b->pos += len;
+  return ptr;
+}
+
+static uint8_t p9_get_u8(p9_buf_t *b)
+{
+  return *p9_get(b, 1);
+}
+
+static uint16_t p9_get_u16(p9_buf_t *b)
+{
+  return get_le16(p9_get(b, 2));
+}
+
+static uint32_t p9_get_u32(p9_buf_t *b)
+{
+  return get_le32(p9_get(b, 4));
+}
+
+static uint64_t p9_get_u64(p9_buf_t *b)
+{
+  return get_le64(p9_get(b, 8));
+}
+
+/* returns a malloc'ed copy, NULL if the message is short */
+static char *p9_get_str(p9_buf_t *b)
+{
+  int len = p9_get_u16(b);
+  const uint8_t *ptr = p9_get(b, len);
+
+  if (b->error)
+    return NULL;
+  return strndup((const char*)ptr, len);
+}
+
+/* message encoding; overflowing the reply sets error */
+static uint8_t *p9_put(p9_buf_t *b, int len)
+{
+  static uint8_t sink[8];
+  uint8_t *ptr;
+
+  if (b->error || b->pos + len > b->size)
+  {
+    b->error = true;
+    return sink;
+  }
+  ptr = b->data + b->pos;
+  b->pos += len;
+  return ptr;
+}
+
+static void p9_put_u8(p9_buf_t *b, uint8_t v)
+{
+  *p9_put(b, 1) = v;
+}
+
+static void p9_put_u16(p9_buf_t *b, uint16_t v)
+{
+  put_le16(p9_put(b, 2), v);
+}
+
+static void p9_put_u32(p9_buf_t *b, uint32_t v)
+{
+  put_le32(p9_put(b, 4), v);
+}
+
+static void p9_put_u64(p9_buf_t *b, uint64_t v)
+{
+  put_le64(p9_put(b, 8), v);
+}
+
+static void p9_put_str(p9_buf_t *b, const char *str)
+{
+  int len = strlen(str);
+  uint8_t *ptr;
+
+  p9_put_u16(b, len);
+  ptr = p9_put(b, len);
+  if (!b->error)
+    memcpy(ptr, str, len);
+}
+
+static uint8_t p9_qid_type(mode_t mode)
+{
+  if (S_ISDIR(mode))
+    return P9_QTDIR;
+  if (S_ISLNK(mode))
+    return P9_QTSYMLINK;
+  return P9_QTFILE;
+}
+
+static void p9_put_qid(p9_buf_t *b, const struct stat *st)
+{
+  p9_put_u8(b, p9_qid_type(st->st_mode));
+  p9_put_u32(b, st->st_mtime ^ (st->st_size << 8));
+  p9_put_u64(b, st->st_ino);
+}
+
+/* fids */
+static p9_fid_t *p9_fid_find(virtio_9p_device_t *p9, uint32_t fid)
+{
+  p9_fid_t *f;
+
+  for (f = p9->fids[fid % P9_FID_HASH_SIZE]; f; f = f->next)
+  {
+    if (f->fid == fid)
+      return f;
+  }
+  return NULL;
+}
+
+/* takes ownership of dirfd, name and path */
+static p9_fid_t *p9_fid_new(virtio_9p_device_t *p9, uint32_t fid, int dirfd, char *name,
+    char *path)
+{
+  p9_fid_t *f = malloc(sizeof(*f));
+
+  assert(f != NULL);
+  f->fid = fid;
+  f->dirfd = dirfd;
+  f->name = name;
+  f->path = path;
+  f->fd = -1;
+  f->dir = NULL;
+  f->next = p9->fids[fid % P9_FID_HASH_SIZE];
+  p9->fids[fid % P9_FID_HASH_SIZE] = f;
+  return f;
+}
+
+/* points f at name in dirfd, taking ownership of all three */
+static void p9_fid_set(p9_fid_t *f, int dirfd, char *name, char *path)
+{
+  close(f->dirfd);
+  free(f->name);
+  free(f->path);
+  f->dirfd = dirfd;
+  f->name = name;
+  f->path = path;
+}
+
+static void p9_fid_close(p9_fid_t *f)
+{
+  /* the directory stream owns a dup of fd */
+  if (f->dir)
+    closedir(f->dir);
+  if (f->fd >= 0)
+    close(f->fd);
+  f->dir = NULL;
+  f->fd = -1;
+}
+
+static int p9_fid_free(virtio_9p_device_t *p9, uint32_t fid)
+{
+  p9_fid_t **pf, *f;
+
+  for (pf = &p9->fids[fid % P9_FID_HASH_SIZE]; (f = *pf) != NULL; pf = &f->next)
+  {
+    if (f->fid == fid)
+    {
+      *pf = f->next;
+      p9_fid_close(f);
+      close(f->dirfd);
+      free(f->name);
+      free(f->path);
+      free(f);
+      return 0;
+    }
+  }
+  return -EBADF;
+}
+
+static void p9_fid_free_all(virtio_9p_device_t *p9)
+{
+  p9_fid_t *f;
+  int i;
+
+  for (i = 0; i < P9_FID_HASH_SIZE; i++)
+  {
+    while ((f = p9->fids[i]) != NULL)
+      p9_fid_free(p9, f->fid);
+  }
+}
+
+static char *p9_join(const char *path, const char *name)
+{
+  char *joined;
+
+  if (!path[0])
+    return strdup(name);
+  if (asprintf(&joined, "%s/%s", path, name) < 0)
+    return NULL;
+  return joined;
+}
+
+/*
+ * After a rename, fids naming the old entry move to the new one. Fids
+ * below it keep their directory fds, which moved with it; only the paths
+ * they walk ".." by change.
+ */
+static void p9_fid_rename(virtio_9p_device_t *p9, const char *from, const p9_entry_t *to)
+{
+  int from_len = strlen(from);
+  p9_fid_t *f;
+  char *path;
+  int i, dirfd;
+
+  for (i = 0; i < P9_FID_HASH_SIZE; i++)
+  {
+    for (f = p9->fids[i]; f; f = f->next)
+    {
+      if (strncmp(f->path, from, from_len) ||
+          (f->path[from_len] != '\0' && f->path[from_len] != '/'))
+        continue;
+      if (asprintf(&path, "%s%s", to->path, f->path + from_len) < 0)
+        continue;
+      if (f->path[from_len] == '/' || (dirfd = dup(to->dirfd)) < 0)
+      {
+        free(f->path);
+        f->path = path;
+        continue;
+      }
+      p9_fid_set(f, dirfd, strdup(to->name), path);
+    }
+  }
+}
+
+/*
+ * Host files are only ever named by one component in a directory held
+ * open, and looked up without following links: the guest resolves
+ * symbolic links itself, and whatever it does to the names above a fid
+ * cannot make that fid reach outside the shared root.
+ */
+static bool p9_valid_name(const char *name)
+{
+  return name[0] && !strchr(name, '/') && strcmp(name, ".") && strcmp(name, "..");
+}
+
+/* the directory a fid names, opened for lookups below it */
+static int p9_open_dir(int dirfd, const char *name)
+{
+  int fd = openat(dirfd, name, O_PATH | O_DIRECTORY | O_NOFOLLOW);
+
+  return fd < 0 ? -errno : fd;
+}
+
+/* e = path, resolved one component at a time from the root */
+static int p9_lookup(virtio_9p_device_t *p9, const char *path, p9_entry_t *e)
+{
+  const char *name = path, *slash;
+  char *dir;
+  int fd, dirfd = dup(p9->root_fd);
+
+  if (dirfd < 0)
+    return -errno;
+  while (path[0] && (slash = strchr(name, '/')) != NULL)
+  {
+    dir = strndup(name, slash - name);
+    fd = dir ? p9_open_dir(dirfd, dir) : -ENOMEM;
+    free(dir);
+    close(dirfd);
+    if (fd < 0)
+      return fd;
+    dirfd = fd;
+    name = slash + 1;
+  }
+  e->dirfd = dirfd;
+  e->name = strdup(path[0] ? name : ".");
+  e->path = strdup(path);
+  return 0;
+}
+
+static void p9_entry_free(p9_entry_t *e)
+{
+  close(e->dirfd);
+  free(e->name);
+  free(e->path);
+}
+
+/* e = the entry name in the directory e currently names */
+static int p9_entry_walk(virtio_9p_device_t *p9, p9_entry_t *e, const char *name)
+{
+  p9_entry_t next;
+  const char *slash;
+  char *path;
+  int err;
+
+  if (!strcmp(name, "."))
+    return 0;
+  if (!strcmp(name, ".."))
+  {
+    slash = strrchr(e->path, '/');
+    path = slash ? strndup(e->path, slash - e->path) : strdup("");
+    err = path ? p9_lookup(p9, path, &next) : -ENOMEM;
+    free(path);
+  }
+  else
+  {
+    if (!p9_valid_name(name))
+      return -EINVAL;
+    err = next.dirfd = p9_open_dir(e->dirfd, e->name);
+    if (err >= 0)
+    {
+      next.name = strdup(name);
+      next.path = p9_join(e->path, name);
+    }
+  }
+  if (err < 0)
+    return err;
+  p9_entry_free(e);
+  *e = next;
+  return 0;
+}
+
+static int p9_host_open_flags(uint32_t flags)
+{
+  int i, host = flags & O_ACCMODE;
+
+  for (i = 0; i < countof(p9_open_flags); i++)
+  {
+    if (flags & p9_open_flags[i].dotl)
+      host |= p9_open_flags[i].host;
+  }
+  return host;
+}
+
+/* requests; each returns -errno, or the payload bytes moved through iov */
+static int p9_version(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  uint32_t msize = p9_get_u32(req);
+  char *version = p9_get_str(req);
+
+  if (!version)
+    return -EINVAL;
+  p9_fid_free_all(p9);
+  p9->msize = max_int(min_int(msize, VIRTIO_9P_MAX_MSIZE), 4096);
+  p9_put_u32(reply, p9->msize);
+  p9_put_str(reply, strncmp(version, "9P2000.L", 8) ? "unknown" : "9P2000.L");
+  free(version);
+  return 0;
+}
+
+static int p9_attach(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  uint32_t fid = p9_get_u32(req);
+  p9_entry_t root;
+  struct stat st;
+  int err;
+
+  if (req->error)
+    return -EINVAL;
+  if (p9_fid_find(p9, fid))
+    return -EEXIST;
+  if (fstat(p9->root_fd, &st) < 0)
+    return -errno;
+  err = p9_lookup(p9, "", &root);
+  if (err < 0)
+    return err;
+  p9_fid_new(p9, fid, root.dirfd, root.name, root.path);
+  p9_put_qid(reply, &st);
+  return 0;
+}
+
+static int p9_walk(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  uint32_t fid = p9_get_u32(req);
+  uint32_t newfid = p9_get_u32(req);
+  int nwname = p9_get_u16(req);
+  p9_fid_t *f = p9_fid_find(p9, fid);
+  p9_entry_t e;
+  char *name;
+  struct stat st;
+  int i, nwqid_pos, err = 0;
+
+  if (!f)
+    return -EBADF;
+  if (req->error || nwname > P9_MAXWELEM)
+    return -EINVAL;
+  if (newfid != fid && p9_fid_find(p9, newfid))
+    return -EEXIST;
+
+  e.dirfd = dup(f->dirfd);
+  if (e.dirfd < 0)
+    return -errno;
+  e.name = strdup(f->name);
+  e.path = strdup(f->path);
+  nwqid_pos = reply->pos;
+  p9_put_u16(reply, 0);
+  for (i = 0; i < nwname; i++)
+  {
+    name = p9_get_str(req);
+    err = name ? p9_entry_walk(p9, &e, name) : -EINVAL;
+    free(name);
+    if (err == 0 && fstatat(e.dirfd, e.name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+      err = -errno;
+    if (err < 0)
+      break;
+    p9_put_qid(reply, &st);
+  }
+
+  /* an error on the first name is reported; later ones end a short walk */
+  if (i == 0 && err < 0)
+  {
+    p9_entry_free(&e);
+    return err;
+  }
+  if (!reply->error)
+    put_le16(reply->data + nwqid_pos, i);
+  if (i < nwname)
+  {
+    p9_entry_free(&e);
+    return 0;
+  }
+  if (newfid == fid)
+    p9_fid_set(f, e.dirfd, e.name, e.path);
+  else
+    p9_fid_new(p9, newfid, e.dirfd, e.name, e.path);
+  return 0;
+}
+
+static int p9_lopen(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  p9_fid_t *f = p9_fid_find(p9, p9_get_u32(req));
+  uint32_t flags = p9_get_u32(req);
+  struct stat st;
+
+  if (!f)
+    return -EBADF;
+  if (f->fd >= 0)
+    return -EBUSY;
+  f->fd = openat(f->dirfd, f->name,
+      (p9_host_open_flags(flags) & ~(O_CREAT | O_EXCL)) | O_NOFOLLOW);
+  if (f->fd < 0 || fstat(f->fd, &st) < 0)
+    return -errno;
+  p9_put_qid(reply, &st);
+  p9_put_u32(reply, 0); /* iounit: let the driver use msize */
+  return 0;
+}
+
+static int p9_lcreate(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  p9_fid_t *f = p9_fid_find(p9, p9_get_u32(req));
+  char *name = p9_get_str(req);
+  uint32_t flags = p9_get_u32(req);
+  uint32_t mode = p9_get_u32(req);
+  struct stat st;
+  int dirfd, fd;
+
+  p9_get_u32(req); /* gid */
+  if (!f || !name || req->error || !p9_valid_name(name))
+  {
+    free(name);
+    return f ? -EINVAL : -EBADF;
+  }
+  if (f->fd >= 0)
+  {
+    free(name);
+    return -EBUSY;
+  }
+  dirfd = p9_open_dir(f->dirfd, f->name);
+  if (dirfd < 0)
+  {
+    free(name);
+    return dirfd;
+  }
+  fd = openat(dirfd, name, p9_host_open_flags(flags) | O_CREAT | O_NOFOLLOW, mode & 07777);
+  if (fd < 0)
+  {
+    fd = -errno;
+    free(name);
+    close(dirfd);
+    return fd;
+  }
+  fstat(fd, &st);
+  /* the directory fid now stands for the new, open file */
+  p9_fid_set(f, dirfd, name, p9_join(f->path, name));
+  f->fd = fd;
+  p9_put_qid(reply, &st);
+  p9_put_u32(reply, 0);
+  return 0;
+}
+
+static int p9_read(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply,
+    struct iovec *iov, int iov_count)
+{
+  p9_fid_t *f = p9_fid_find(p9, p9_get_u32(req));
+  uint64_t offset = p9_get_u64(req);
+  ssize_t ret = 0;
+
+  if (!f || f->fd < 0)
+    return -EBADF;
+  if (iov_count < 0)
+    return -EFAULT;
+  if (iov_count > 0)
+    ret = preadv(f->fd, iov, iov_count, offset);
+  if (ret < 0)
+    return -errno;
+  p9_put_u32(reply, ret);
+  p9->read_bytes += ret;
+  return ret;
+}
+
+static int p9_write(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply,
+    struct iovec *iov, int iov_count)
+{
+  p9_fid_t *f = p9_fid_find(p9, p9_get_u32(req));
+  uint64_t offset = p9_get_u64(req);
+  ssize_t ret = 0;
+
+  if (!f || f->fd < 0)
+    return -EBADF;
+  if (iov_count < 0)
+    return -EFAULT;
+  if (iov_count > 0)
+    ret = pwritev(f->fd, iov, iov_count, offset);
+  if (ret < 0)
+    return -errno;
+  p9_put_u32(reply, ret);
+  p9->write_bytes += ret;
+  return 0;
+}
+
+static int p9_clunk(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  return p9_fid_free(p9, p9_get_u32(req));
+}
+
+static int p9_remove(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  uint32_t fid = p9_get_u32(req);
+  p9_fid_t *f = p9_fid_find(p9, fid);
+  struct stat st;
+  int err = 0;
+
+  if (!f)
+    return -EBADF;
+  if (fstatat(f->dirfd, f->name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+      unlinkat(f->dirfd, f->name, S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0) < 0)
+    err = -errno;
+  /* the fid goes away even if the file could not be removed */
+  p9_fid_free(p9, fid);
+  return err;
+}
+
+static int p9_getattr(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  p9_fid_t *f = p9_fid_find(p9, p9_get_u32(req));
+  struct stat st;
+
+  if (!f)
+    return -EBADF;
+  if (fstatat(f->dirfd, f->name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+    return -errno;
+  p9_put_u64(reply, P9_GETATTR_BASIC);
+  p9_put_qid(reply, &st);
+  p9_put_u32(reply, st.st_mode);
+  p9_put_u32(reply, st.st_uid);
+  p9_put_u32(reply, st.st_gid);
+  p9_put_u64(reply, st.st_nlink);
+  p9_put_u64(reply, st.st_rdev);
+  p9_put_u64(reply, st.st_size);
+  p9_put_u64(reply, st.st_blksize);
+  p9_put_u64(reply, st.st_blocks);
+  p9_put_u64(reply, st.st_atim.tv_sec);
+  p9_put_u64(reply, st.st_atim.tv_nsec);
+  p9_put_u64(reply, st.st_mtim.tv_sec);
+  p9_put_u64(reply, st.st_mtim.tv_nsec);
+  p9_put_u64(reply, st.st_ctim.tv_sec);
+  p9_put_u64(reply, st.st_ctim.tv_nsec);
+  p9_put_u64(reply, 0); /* btime */
+  p9_put_u64(reply, 0);
+  p9_put_u64(reply, 0); /* gen */
+  p9_put_u64(reply, 0); /* data_version */
+  return 0;
+}
+
+static int p9_setattr(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  p9_fid_t *f = p9_fid_find(p9, p9_get_u32(req));
+  uint32_t valid = p9_get_u32(req);
+  uint32_t mode = p9_get_u32(req);
+  uint32_t uid = p9_get_u32(req);
+  uint32_t gid = p9_get_u32(req);
+  uint64_t size = p9_get_u64(req);
+  struct timespec ts[2];
+  struct stat st;
+  int fd, err;
+
+  ts[0].tv_sec = p9_get_u64(req);
+  ts[0].tv_nsec = p9_get_u64(req);
+  ts[1].tv_sec = p9_get_u64(req);
+  ts[1].tv_nsec = p9_get_u64(req);
+  if (!f)
+    return -EBADF;
+  if (req->error)
+    return -EINVAL;
+
+  /* fchmodat follows a link in the last component, so refuse links */
+  if (valid & P9_SETATTR_MODE)
+  {
+    if (fstatat(f->dirfd, f->name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+      return -errno;
+    if (S_ISLNK(st.st_mode))
+      return -ELOOP;
+    if (fchmodat(f->dirfd, f->name, mode & 07777, 0) < 0)
+      return -errno;
+  }
+  if ((valid & (P9_SETATTR_UID | P9_SETATTR_GID)) &&
+      fchownat(f->dirfd, f->name, (valid & P9_SETATTR_UID) ? uid : (uid_t)-1,
+        (valid & P9_SETATTR_GID) ? gid : (gid_t)-1, AT_SYMLINK_NOFOLLOW) < 0)
+    return -errno;
+  if (valid & P9_SETATTR_SIZE)
+  {
+    fd = openat(f->dirfd, f->name, O_WRONLY | O_NONBLOCK | O_NOFOLLOW);
+    if (fd < 0)
+      return -errno;
+    err = ftruncate(fd, size) < 0 ? -errno : 0;
+    close(fd);
+    if (err < 0)
+      return err;
+  }
+  if (valid & (P9_SETATTR_ATIME | P9_SETATTR_MTIME))
+  {
+    if (!(valid & P9_SETATTR_ATIME))
+      ts[0].tv_nsec = UTIME_OMIT;
+    else if (!(valid & P9_SETATTR_ATIME_SET))
+      ts[0].tv_nsec = UTIME_NOW;
+    if (!(valid & P9_SETATTR_MTIME))
+      ts[1].tv_nsec = UTIME_OMIT;
+    else if (!(valid & P9_SETATTR_MTIME_SET))
+      ts[1].tv_nsec = UTIME_NOW;
+    if (utimensat(f->dirfd, f->name, ts, AT_SYMLINK_NOFOLLOW) < 0)
+      return -errno;
+  }
+  return 0;
+}
+
+/*
+ * Entries are qid[13] offset[8] type[1] name[s]. The offset of an entry
+ * is the telldir() cookie of the one after it, where the next Treaddir
+ * continues.
+ */
+static int p9_readdir(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  p9_fid_t *f = p9_fid_find(p9, p9_get_u32(req));
+  uint64_t offset = p9_get_u64(req);
+  uint32_t count = p9_get_u32(req);
+  struct dirent *de;
+  struct stat st;
+  p9_buf_t out;
+  long pos;
+  int fd, len;
+
+  if (!f || f->fd < 0)
+    return -EBADF;
+  if (!f->dir)
+  {
+    fd = dup(f->fd);
+    if (fd < 0)
+      return -errno;
+    f->dir = fdopendir(fd);
+    if (!f->dir)
+    {
+      close(fd);
+      return -errno;
+    }
+  }
+  if (offset == 0)
+    rewinddir(f->dir);
+  else
+    seekdir(f->dir, offset);
+
+  /* entries go after count[4], which is filled in last */
+  out.data = reply->data + reply->pos + 4;
+  out.pos = 0;
+  out.size = min_int(count, reply->size - reply->pos - 4);
+  out.error = false;
+  for (;;)
+  {
+    pos = telldir(f->dir);
+    errno = 0;
+    de = readdir(f->dir);
+    if (!de)
+      break;
+    len = 13 + 8 + 1 + 2 + strlen(de->d_name);
+    if (out.pos + len > out.size)
+    {
+      seekdir(f->dir, pos);
+      break;
+    }
+    memset(&st, 0, sizeof(st));
+    st.st_ino = de->d_ino;
+    st.st_mode = de->d_type == DT_DIR ? S_IFDIR : de->d_type == DT_LNK ? S_IFLNK : S_IFREG;
+    p9_put_qid(&out, &st);
+    p9_put_u64(&out, telldir(f->dir));
+    p9_put_u8(&out, de->d_type);
+    p9_put_str(&out, de->d_name);
+  }
+  if (!de && errno)
+    return -errno;
+  p9_put_u32(reply, out.pos);
+  p9_put(reply, out.pos);
+  return 0;
+}
+
+static int p9_statfs(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  p9_fid_t *f = p9_fid_find(p9, p9_get_u32(req));
+  struct statvfs sv;
+  int fd, err;
+
+  if (!f)
+    return -EBADF;
+  fd = openat(f->dirfd, f->name, O_PATH | O_NOFOLLOW);
+  if (fd < 0)
+    return -errno;
+  err = fstatvfs(fd, &sv) < 0 ? -errno : 0;
+  close(fd);
+  if (err < 0)
+    return err;
+  p9_put_u32(reply, P9_MAGIC);
+  p9_put_u32(reply, sv.f_bsize);
+  p9_put_u64(reply, sv.f_blocks);
+  p9_put_u64(reply, sv.f_bfree);
+  p9_put_u64(reply, sv.f_bavail);
+  p9_put_u64(reply, sv.f_files);
+  p9_put_u64(reply, sv.f_ffree);
+  p9_put_u64(reply, sv.f_fsid);
+  p9_put_u32(reply, sv.f_namemax);
+  return 0;
+}
+
+static int p9_fsync(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  p9_fid_t *f = p9_fid_find(p9, p9_get_u32(req));
+  uint32_t datasync = p9_get_u32(req);
+
+  if (!f || f->fd < 0)
+    return -EBADF;
+  if ((datasync ? fdatasync(f->fd) : fsync(f->fd)) < 0)
+    return -errno;
+  return 0;
+}
+
+/* e = a new name in directory fid dir; takes ownership of name */
+static int p9_dir_name(p9_fid_t *dir, char *name, p9_entry_t *e)
+{
+  int err;
+
+  if (!dir)
+    err = -EBADF;
+  else if (!name || !p9_valid_name(name))
+    err = -EINVAL;
+  else
+    err = e->dirfd = p9_open_dir(dir->dirfd, dir->name);
+  if (err < 0)
+  {
+    free(name);
+    return err;
+  }
+  e->name = name;
+  e->path = p9_join(dir->path, name);
+  return 0;
+}
+
+/* fid, then a new name in the directory fid */
+static int p9_get_dir_name(virtio_9p_device_t *p9, p9_buf_t *req, p9_entry_t *e)
+{
+  p9_fid_t *dir = p9_fid_find(p9, p9_get_u32(req));
+
+  return p9_dir_name(dir, p9_get_str(req), e);
+}
+
+static int p9_reply_qid(p9_buf_t *reply, const p9_entry_t *e)
+{
+  struct stat st;
+
+  if (fstatat(e->dirfd, e->name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+    return -errno;
+  p9_put_qid(reply, &st);
+  return 0;
+}
+
+static int p9_mkdir(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  p9_entry_t e;
+  uint32_t mode;
+  int err = p9_get_dir_name(p9, req, &e);
+
+  if (err < 0)
+    return err;
+  mode = p9_get_u32(req);
+  if (mkdirat(e.dirfd, e.name, mode & 07777) < 0)
+    err = -errno;
+  else
+    err = p9_reply_qid(reply, &e);
+  p9_entry_free(&e);
+  return err;
+}
+
+static int p9_symlink(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  p9_entry_t e;
+  char *target;
+  int err = p9_get_dir_name(p9, req, &e);
+
+  if (err < 0)
+    return err;
+  target = p9_get_str(req);
+  if (!target)
+    err = -EINVAL;
+  else if (symlinkat(target, e.dirfd, e.name) < 0)
+    err = -errno;
+  else
+    err = p9_reply_qid(reply, &e);
+  free(target);
+  p9_entry_free(&e);
+  return err;
+}
+
+static int p9_mknod(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  p9_entry_t e;
+  uint32_t mode, major, minor;
+  int err = p9_get_dir_name(p9, req, &e);
+
+  if (err < 0)
+    return err;
+  mode = p9_get_u32(req);
+  major = p9_get_u32(req);
+  minor = p9_get_u32(req);
+  /* a device node would open host devices from inside the tree */
+  if (S_ISCHR(mode) || S_ISBLK(mode))
+    err = -EPERM;
+  else if (mknodat(e.dirfd, e.name, mode, makedev(major, minor)) < 0)
+    err = -errno;
+  else
+    err = p9_reply_qid(reply, &e);
+  p9_entry_free(&e);
+  return err;
+}
+
+static int p9_link(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  p9_fid_t *dir = p9_fid_find(p9, p9_get_u32(req));
+  p9_fid_t *f = p9_fid_find(p9, p9_get_u32(req));
+  p9_entry_t e;
+  int err = p9_dir_name(dir, p9_get_str(req), &e);
+
+  if (err < 0)
+    return err;
+  if (!f)
+    err = -EBADF;
+  else if (linkat(f->dirfd, f->name, e.dirfd, e.name, 0) < 0)
+    err = -errno;
+  p9_entry_free(&e);
+  return err;
+}
+
+static int p9_readlink(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  p9_fid_t *f = p9_fid_find(p9, p9_get_u32(req));
+  char target[PATH_MAX];
+  ssize_t len;
+
+  if (!f)
+    return -EBADF;
+  len = readlinkat(f->dirfd, f->name, target, sizeof(target) - 1);
+  if (len < 0)
+    return -errno;
+  target[len] = '\0';
+  p9_put_str(reply, target);
+  return 0;
+}
+
+static int p9_do_rename(virtio_9p_device_t *p9, int dirfd, const char *name, const char *path,
+    const p9_entry_t *to)
+{
+  if (renameat(dirfd, name, to->dirfd, to->name) < 0)
+    return -errno;
+  p9_fid_rename(p9, path, to);
+  return 0;
+}
+
+static int p9_rename(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  p9_fid_t *f = p9_fid_find(p9, p9_get_u32(req));
+  p9_entry_t to;
+  char *from;
+  int err = p9_get_dir_name(p9, req, &to);
+
+  if (err < 0)
+    return err;
+  if (!f)
+    err = -EBADF;
+  else if (!strcmp(f->name, "."))
+    err = -EBUSY; /* the root */
+  else
+  {
+    /* f itself is among the fids that move */
+    from = strdup(f->path);
+    err = p9_do_rename(p9, f->dirfd, f->name, from, &to);
+    free(from);
+  }
+  p9_entry_free(&to);
+  return err;
+}
+
+static int p9_renameat(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  p9_entry_t from, to;
+  int err = p9_get_dir_name(p9, req, &from);
+
+  if (err < 0)
+    return err;
+  err = p9_get_dir_name(p9, req, &to);
+  if (err == 0)
+  {
+    err = p9_do_rename(p9, from.dirfd, from.name, from.path, &to);
+    p9_entry_free(&to);
+  }
+  p9_entry_free(&from);
+  return err;
+}
+
+static int p9_unlinkat(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  p9_entry_t e;
+  uint32_t flags;
+  int err = p9_get_dir_name(p9, req, &e);
+
+  if (err < 0)
+    return err;
+  flags = p9_get_u32(req);
+  if (unlinkat(e.dirfd, e.name, (flags & P9_AT_REMOVEDIR) ? AT_REMOVEDIR : 0) < 0)
+    err = -errno;
+  p9_entry_free(&e);
+  return err;
+}
+
+/* there is only one client, so every lock is granted */
+static int p9_lock(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  if (!p9_fid_find(p9, p9_get_u32(req)))
+    return -EBADF;
+  p9_put_u8(reply, P9_LOCK_SUCCESS);
+  return 0;
+}
+
+static int p9_getlock(virtio_9p_device_t *p9, p9_buf_t *req, p9_buf_t *reply)
+{
+  uint64_t start, length;
+  uint32_t proc_id;
+  char *client_id;
+
+  if (!p9_fid_find(p9, p9_get_u32(req)))
+    return -EBADF;
+  p9_get_u8(req);
+  start = p9_get_u64(req);
+  length = p9_get_u64(req);
+  proc_id = p9_get_u32(req);
+  client_id = p9_get_str(req);
+  if (!client_id)
+    return -EINVAL;
+  p9_put_u8(reply, P9_LOCK_TYPE_UNLCK);
+  p9_put_u64(reply, start);
+  p9_put_u64(reply, length);
+  p9_put_u32(reply, proc_id);
+  p9_put_str(reply, client_id);
+  free(client_id);
+  return 0;
+}
+
+/*
+ * Handle one request whose header has been read. The reply header is
+ * written here too, except for its size. Returns the length of the whole
+ * reply, including any payload already placed through iov.
+ */
+int virtio_9p_handle(virtio_9p_device_t *p9, int type, p9_buf_t *req, p9_buf_t *reply,
+    struct iovec *iov, int iov_count)
+{
+  uint16_t tag = get_le16(req->data + 5);
+  int ret;
+
+  p9->requests++;
+  reply->pos = P9_HDR_SIZE;
+  switch (type)
+  {
+    case P9_TVERSION: ret = p9_version(p9, req, reply); break;
+    case P9_TATTACH: ret = p9_attach(p9, req, reply); break;
+    case P9_TWALK: ret = p9_walk(p9, req, reply); break;
+    case P9_TLOPEN: ret = p9_lopen(p9, req, reply); break;
+    case P9_TLCREATE: ret = p9_lcreate(p9, req, reply); break;
+    case P9_TREAD: ret = p9_read(p9, req, reply, iov, iov_count); break;
+    case P9_TWRITE: ret = p9_write(p9, req, reply, iov, iov_count); break;
+    case P9_TCLUNK: ret = p9_clunk(p9, req, reply); break;
+    case P9_TREMOVE: ret = p9_remove(p9, req, reply); break;
+    case P9_TGETATTR: ret = p9_getattr(p9, req, reply); break;
+    case P9_TSETATTR: ret = p9_setattr(p9, req, reply); break;
+    case P9_TREADDIR: ret = p9_readdir(p9, req, reply); break;
+    case P9_TSTATFS: ret = p9_statfs(p9, req, reply); break;
+    case P9_TFSYNC: ret = p9_fsync(p9, req, reply); break;
+    case P9_TMKDIR: ret = p9_mkdir(p9, req, reply); break;
+    case P9_TSYMLINK: ret = p9_symlink(p9, req, reply); break;
+    case P9_TMKNOD: ret = p9_mknod(p9, req, reply); break;
+    case P9_TLINK: ret = p9_link(p9, req, reply); break;
+    case P9_TREADLINK: ret = p9_readlink(p9, req, reply); break;
+    case P9_TRENAME: ret = p9_rename(p9, req, reply); break;
+    case P9_TRENAMEAT: ret = p9_renameat(p9, req, reply); break;
+    case P9_TUNLINKAT: ret = p9_unlinkat(p9, req, reply); break;
+    case P9_TLOCK: ret = p9_lock(p9, req, reply); break;
+    case P9_TGETLOCK: ret = p9_getlock(p9, req, reply); break;
+    /* requests are answered in order, so there is never one to cancel */
+    case P9_TFLUSH: ret = 0; break;
+    default: ret = -EOPNOTSUPP; break;
+  }
+  if (ret >= 0 && reply->error)
+    ret = -ERANGE;
+
+  reply->error = false;
+  if (ret < 0)
+  {
+    reply->pos = P9_HDR_SIZE;
+    p9_put_u32(reply, -ret);
+    type = P9_RLERROR - 1;
+    ret = 0;
+  }
+  put_le32(reply->data, reply->pos + ret);
+  reply->data[4] = type + 1;
+  put_le16(reply->data + 5, tag);
+  return reply->pos + ret;
+}
+
+void virtio_9p_device_init(cpu_state_t *state, const virtio_9p_config_t *config,
+    virtual_io_bus_t *bus)
+{
+  virtio_9p_device_t *p9;
+  int tag_len = strlen(config->tag);
+
+  if (tag_len > VIRTIO_9P_MAX_TAG)
+  {
+    printf("9p mount tag too long: %s\n", config->tag);
+    exit(1);
+  }
+  p9 = malloc(sizeof(*p9));
+  memset(p9, 0, sizeof(*p9));
+  p9->root = realpath(config->root, NULL);
+  if (!p9->root)
+  {
+    perror(config->root);
+    exit(1);
+  }
+  p9->root_fd = open(p9->root, O_PATH | O_DIRECTORY);
+  if (p9->root_fd < 0)
+  {
+    perror(p9->root);
+    exit(1);
+  }
+  p9->msize = VIRTIO_9P_MAX_MSIZE;
+  p9->req_buf = malloc(VIRTIO_9P_MAX_MSIZE);
+  p9->reply_buf = malloc(VIRTIO_9P_MAX_MSIZE);
+  if (!p9->req_buf || !p9->reply_buf)
+  {
+    printf("virtio-9p: malloc error\n");
+    exit(1);
+  }
+
+  p9->item = p9_item;
+  virtio_init(state, &p9->item, &p9->common, bus, 9, VIRTIO_9P_CONFIG_SIZE, virtio_9p_recv_request);
+  p9->common.device_features = VIRTIO_9P_F_MOUNT_TAG;
+  p9->common.device_recv_done = virtio_9p_recv_done;
+  put_le16(p9->common.config_space, tag_len);
+  memcpy(p9->common.config_space + 2, config->tag, tag_len);
+
+  riscv_machine.p9 = p9;
+}
+
+void virtio_9p_print_stats(virtio_9p_device_t *p9, FILE *f)
+{
+  fprintf(f, "virtio-9p %s: %" PRIu64 " requests, %" PRIu64 " KiB read, %" PRIu64 " KiB written, "
+      "%" PRIu64 " notifies, %" PRIu64 " interrupts\n",
+      p9->root, p9->requests, p9->read_bytes / 1024, p9->write_bytes / 1024,
+      p9->common.notify_count, p9->common.irq_count);
+}
@@ -0,0 +1,117 @@
+#ifndef __VIRTIO_9P_H__
+#define __VIRTIO_9P_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/uio.h>
+#include "virtio_interface.h"
+#include "riscv_definations.h"
+
+/* 9P2000.L message types; each reply is its request type plus one */
+#define P9_RLERROR    7
+#define P9_TSTATFS    8
+#define P9_TLOPEN     12
+#define P9_TLCREATE   14
+#define P9_TSYMLINK   16
+#define P9_TMKNOD     18
+#define P9_TRENAME    20
+#define P9_TREADLINK  22
+#define P9_TGETATTR   24
+#define P9_TSETATTR   26
+#define P9_TXATTRWALK 30
+#define P9_TREADDIR   40
+#define P9_TFSYNC     50
+#define P9_TLOCK      52
+#define P9_TGETLOCK   54
+#define P9_TLINK      70
+#define P9_TMKDIR     72
+#define P9_TRENAMEAT  74
+#define P9_TUNLINKAT  76
+#define P9_TVERSION   100
+#define P9_TATTACH    104
+#define P9_TFLUSH     108
+#define P9_TWALK      110
+#define P9_TREAD      116
+#define P9_TWRITE     118
+#define P9_TCLUNK     120
+#define P9_TREMOVE    122
+
+/* size[4] type[1] tag[2] */
+#define P9_HDR_SIZE 7
+/* Tread and Twrite up to their payload, and Rread up to its payload */
+#define P9_TREAD_SIZE 23
+#define P9_TWRITE_HDR_SIZE 23
+#define P9_RREAD_HDR_SIZE 11
+#define P9_RLERROR_SIZE 11
+
+#define P9_FID_HASH_SIZE 64
+
+typedef struct
+{
+  const char *root; /* host directory shared with the guest */
+  const char *tag;  /* mount tag the guest names it by */
+} virtio_9p_config_t;
+
+/*
+ * A file the guest holds a fid for: a name in a directory held open with
+ * O_PATH, so that later changes to the names above it cannot redirect it.
+ */
+typedef struct p9_fid
+{
+  uint32_t fid;
+  int dirfd;
+  char *name; /* "." for the root */
+  char *path; /* relative to the root, "" for the root; walks ".." by it */
+  int fd; /* -1 until opened */
+  DIR *dir; /* set once the directory has been read */
+  struct p9_fid *next;
+} p9_fid_t;
+
+/* a name in a directory, as a fid holds it */
+typedef struct
+{
+  int dirfd;
+  char *name;
+  char *path;
+} p9_entry_t;
+
+/* a 9P message being decoded or built, with a sticky overflow flag */
+typedef struct
+{
+  uint8_t *data;
+  int pos;
+  int size;
+  bool error;
+} p9_buf_t;
+
+/*
+ * 9P2000.L server for one host directory. Requests are handled on the
+ * main thread as they are taken from the queue. Read and write payloads
+ * move between the file and guest memory directly through iovecs that
+ * point into guest RAM; only the message headers are copied.
+ */
+typedef struct virtio_9p_device
+{
+  virtual_io_device_t common;
+  address_item_t item;
+  const char *root;
+  int root_fd;
+  uint32_t msize;
+  p9_fid_t *fids[P9_FID_HASH_SIZE];
+
+  /* scratch space for one request and one reply, msize bytes each */
+  uint8_t *req_buf;
+  uint8_t *reply_buf;
+
+  uint64_t requests;
+  uint64_t read_bytes;
+  uint64_t write_bytes;
+} virtio_9p_device_t;
+
+extern void virtio_9p_device_init(cpu_state_t *state, const virtio_9p_config_t *config,
+    virtual_io_bus_t *bus);
+extern int virtio_9p_handle(virtio_9p_device_t *p9, int type, p9_buf_t *req, p9_buf_t *reply,
+    struct iovec *iov, int iov_count);
+extern void virtio_9p_print_stats(virtio_9p_device_t *p9, FILE *f);
+#endif
@@ -0,0 +1,68 @@
+#include "virtio_balloon_device.h"
+#include "virtio_interface.h"
+#include "machine.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "cutils.h"
+
+int balloon_init(address_item_t *handler)
+{
+  return true;
+}
+
+void balloon_release(address_item_t *handler)
+{
+  virtio_balloon_device_t *vb = (virtio_balloon_device_t*)handler->entity;
+  free(vb);
+}
+
+address_item_t balloon_item =
+{
+  .name = "balloon",
+  .init = balloon_init,
+  .release = balloon_release
+};
+
+/* give the whole host pages inside [ptr, ptr + len) back to the host */
+void virtio_balloon_release(virtio_balloon_device_t *vb, uint8_t *ptr, size_t len)
+{
+  uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  uintptr_t start = ((uintptr_t)ptr + page_size - 1) & ~(page_size - 1);
+  uintptr_t end = ((uintptr_t)ptr + len) & ~(page_size - 1);
+
+  if (start < end && madvise((void*)start, end - start, MADV_DONTNEED) == 0)
+    vb->released_bytes += end - start;
+}
+
+void virtio_balloon_device_init(cpu_state_t *state, uint32_t target_mb,
+    virtual_io_bus_t *bus)
+{
+  virtio_balloon_device_t *vb;
+
+  vb = malloc(sizeof(*vb));
+  memset(vb, 0, sizeof(*vb));
+
+  vb->item = balloon_item;
+  virtio_init(state, &vb->item, &vb->common, bus, 5, VIRTIO_BALLOON_CONFIG_SIZE,
+      virtio_balloon_recv_request);
+  vb->common.device_features = VIRTIO_BALLOON_F_DEFLATE_ON_OOM | VIRTIO_BALLOON_F_REPORTING;
+  vb->common.device_recv_done = virtio_balloon_recv_done;
+  /* num_pages: how much the guest is asked to give up */
+  put_le32(vb->common.config_space, target_mb << (20 - VIRTIO_BALLOON_PAGE_SHIFT));
+
+  riscv_machine.balloon = vb;
+}
+
+void virtio_balloon_print_stats(virtio_balloon_device_t *vb, FILE *f)
+{
+  uint32_t actual = get_le32(vb->common.config_space + 4);
+
+  fprintf(f, "virtio-balloon: %u MiB in the balloon, %" PRIu64 " pages inflated, %" PRIu64 " deflated, "
+      "%" PRIu64 " MiB reported free, %" PRIu64 " MiB released to the host\n",
+      actual >> (20 - VIRTIO_BALLOON_PAGE_SHIFT), vb->inflated_pages, vb->deflated_pages,
+      vb->reported_bytes >> 20, vb->released_bytes >> 20);
+}
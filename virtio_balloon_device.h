@@ -0,0 +1,30 @@
+#ifndef __VIRTIO_BALLOON_H__
+#define __VIRTIO_BALLOON_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "virtio_interface.h"
+#include "riscv_definations.h"
+
+/*
+ * Pages the guest puts in the balloon, and free pages it reports, are
+ * dropped from the RAM mapping with MADV_DONTNEED. The host gets the
+ * memory back and the guest reads zeroes if it touches them again.
+ */
+typedef struct virtio_balloon_device
+{
+  virtual_io_device_t common;
+  address_item_t item;
+
+  uint64_t inflated_pages;
+  uint64_t deflated_pages;
+  uint64_t reported_bytes;
+  uint64_t released_bytes; /* what madvise() accepted */
+} virtio_balloon_device_t;
+
+extern void virtio_balloon_device_init(cpu_state_t *state, uint32_t target_mb,
+    virtual_io_bus_t *bus);
+extern void virtio_balloon_release(virtio_balloon_device_t *vb, uint8_t *ptr, size_t len);
+extern void virtio_balloon_print_stats(virtio_balloon_device_t *vb, FILE *f);
+#endif
@@ -1,143 +1,18 @@
 #include "virtio_block_device.h"
 #include "virtio_interface.h"
+#include "block_readahead.h"
+#include "block_writeback.h"
+#include "block_ramdisk.h"
 #include "machine.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
 #include "cutils.h"
 
-static int64_t bf_get_sector_count(block_device_t *bs)
-{
-  block_device_file_t *bf = bs->opaque;
-  return bf->nb_sectors;
-}
-
-static int bf_read_async(block_device_t *bs, uint64_t sector_num,
-    uint8_t *buf, int size,
-    block_device_complete_func *cb, void *opaque)
-{
-  block_device_file_t *bf = bs->opaque;
-
-  if (!bf->f)
-    return -1;
-  if (bf->mode == BF_MODE_SNAPSHOT)
-  {
-    int i;
-    for (i = 0; i < size; i++)
-    {
-      if (!bf->sector_table[sector_num])
-      {
-        fseek(bf->f, sector_num * SECTOR_SIZE, SEEK_SET);
-        fread(buf, 1, SECTOR_SIZE, bf->f);
-      }
-      else
-      {
-        memcpy(buf, bf->sector_table[sector_num], SECTOR_SIZE);
-      }
-      sector_num++;
-      buf += SECTOR_SIZE;
-    }
-  }
-  else
-  {
-    fseek(bf->f, sector_num * SECTOR_SIZE, SEEK_SET);
-    fread(buf, 1, size * SECTOR_SIZE, bf->f);
-  }
-  return 0;
-}
-
-static int bf_write_async(block_device_t *bs, uint64_t sector_num, uint8_t *buf, int size, block_device_complete_func *cb, void *opaque)
-{
-  block_device_file_t *bf = bs->opaque;
-  int ret;
-
-  switch(bf->mode)
-  {
-    case BF_MODE_RO:
-      ret = -1;
-      break;
-    case BF_MODE_RW:
-      fseek(bf->f, sector_num * SECTOR_SIZE, SEEK_SET);
-      fwrite(buf, 1, size * SECTOR_SIZE, bf->f);
-      ret = 0;
-      break;
-    case BF_MODE_SNAPSHOT:
-      {
-        int i;
-        if ((sector_num + size) > bf->nb_sectors)
-          return -1;
-        for (i = 0; i < size; i++)
-        {
-          if (!bf->sector_table[sector_num])
-          {
-            bf->sector_table[sector_num] = malloc(SECTOR_SIZE);
-          }
-          memcpy(bf->sector_table[sector_num], buf, SECTOR_SIZE);
-          sector_num++;
-          buf += SECTOR_SIZE;
-        }
-        ret = 0;
-      }
-      break;
-    default:
-      abort();
-  }
-
-  return ret;
-}
-
-static block_device_t *block_device_init(const char *filename, block_device_mode_enum mode)
-{
-  block_device_t *bs;
-  block_device_file_t *bf;
-  int64_t file_size;
-  FILE *f;
-  const char *mode_str;
-
-  if (mode == BF_MODE_RW)
-  {
-    mode_str = "r+b";
-  }
-  else
-  {
-    mode_str = "rb";
-  }
-
-  f = fopen(filename, mode_str);
-  if (!f)
-  {
-    perror(filename);
-    exit(1);
-  }
-
-  fseek(f, 0, SEEK_END);
-  file_size = ftell(f);
-
-  bs = malloc(sizeof(*bs));
-  memset(bs, 0, sizeof(*bs));
-
-  bf = malloc(sizeof(*bf));
-  memset(bf, 0, sizeof(*bf));
-
-  bf->mode = mode;
-  bf->nb_sectors = file_size / 512;
-  bf->f = f;
-
-  if (mode == BF_MODE_SNAPSHOT)
-  {
-    bf->sector_table = malloc(sizeof(bf->sector_table[0]) * bf->nb_sectors);
-    memset(bf->sector_table, 0, sizeof(bf->sector_table[0]) * bf->nb_sectors);
-  }
-
-  bs->opaque = bf;
-  bs->get_sector_count = bf_get_sector_count;
-  bs->read_async = bf_read_async;
-  bs->write_async = bf_write_async;
-
-  return bs;
-}
-
 int block_init(address_item_t *handler)
 {
   return true;
@@ -156,22 +31,92 @@ address_item_t block_item =
   .release = block_release
 };
 
-void virtual_block_device_init(cpu_state_t *state, const char *filename, block_device_mode_enum mode, virtual_io_bus_t *bus)
+void virtual_block_device_init(cpu_state_t *state, const virtual_block_config_t *config,
+    virtual_io_bus_t *bus)
 {
   virtual_io_block_device_t *vbd;
   uint64_t nb_sectors;
 
+  if (riscv_machine.block_count >= MAX_BLOCK_DEVICES)
+  {
+    printf("too many block devices, at most %d are supported\n", MAX_BLOCK_DEVICES);
+    exit(1);
+  }
+
   vbd = malloc(sizeof(*vbd));
   memset(vbd, 0, sizeof(*vbd));
-  vbd->bs = block_device_init(filename, mode);
-  virtio_init(state, &block_item, &vbd->common, bus, 2, 8, virtual_block_recv_request);
+  vbd->filename = config->filename;
+  if (config->mode == BF_MODE_RAM)
+  {
+    /* already in memory: nothing to read ahead */
+    vbd->bs = block_device_ramdisk_new(block_device_open(config->filename, BF_MODE_RO),
+        config->hugepages);
+  }
+  else
+  {
+    vbd->bs = block_device_open(config->filename, config->mode);
+    if (config->writeback_mb > 0 && config->mode == BF_MODE_RW)
+      vbd->bs = block_device_writeback_new(vbd->bs, config->writeback_mb);
+    if (config->readahead_kb > 0)
+      vbd->bs = block_device_readahead_new(vbd->bs, config->readahead_kb);
+  }
 
+  /* every device needs its own mmio window */
+  vbd->item = block_item;
+  virtio_init(state, &vbd->item, &vbd->common, bus, 2, VIRTIO_BLK_CONFIG_SIZE, virtual_block_recv_request);
+
+  virtio_set_queue_num_max(&vbd->common, config->queue_size);
   vbd->common.debug = 1;
+  vbd->common.device_recv_done = virtual_block_recv_done;
+  vbd->common.device_features = VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_DISCARD | VIRTIO_BLK_F_WRITE_ZEROES;
   nb_sectors = vbd->bs->get_sector_count(vbd->bs);
   put_le32(vbd->common.config_space, nb_sectors);
   put_le32(vbd->common.config_space + 4, nb_sectors >> 32);
+  /* max_discard_sectors, max_discard_seg, discard_sector_alignment */
+  put_le32(vbd->common.config_space + 36, VIRTIO_BLK_MAX_DISCARD_SECTORS);
+  put_le32(vbd->common.config_space + 40, VIRTIO_BLK_MAX_DISCARD_SEG);
+  put_le32(vbd->common.config_space + 44, 1);
+  /* max_write_zeroes_sectors, max_write_zeroes_seg, write_zeroes_may_unmap */
+  put_le32(vbd->common.config_space + 48, VIRTIO_BLK_MAX_DISCARD_SECTORS);
+  put_le32(vbd->common.config_space + 52, VIRTIO_BLK_MAX_DISCARD_SEG);
+  vbd->common.config_space[56] = 1;
+
+  if (!io_ring_init(&vbd->submit_ring, VIRTIO_BLK_RING_SIZE) ||
+      !io_ring_init(&vbd->done_ring, VIRTIO_BLK_RING_SIZE))
+  {
+    printf("virtio-blk: ring malloc error\n");
+    exit(1);
+  }
+  vbd->kick_fd = eventfd(0, 0);
+  if (vbd->kick_fd < 0)
+  {
+    perror("eventfd");
+    exit(1);
+  }
+  if (pipe(vbd->wake_fd) < 0)
+  {
+    perror("pipe");
+    exit(1);
+  }
+  fcntl(vbd->wake_fd[0], F_SETFL, O_NONBLOCK);
+  if (pthread_create(&vbd->thread, NULL, virtual_block_io_thread, vbd))
+  {
+    perror("pthread_create");
+    exit(1);
+  }
+  pthread_detach(vbd->thread);
 
-  riscv_machine.block = vbd;
+  riscv_machine.block[riscv_machine.block_count++] = vbd;
 
   return;
 }
+
+void virtual_block_print_stats(virtual_io_block_device_t *vbd, FILE *f)
+{
+  virtual_block_drain(vbd);
+  fprintf(f, "virtio-blk %s: %" PRIu64 " requests in %" PRIu64 " backend operations, "
+      "%" PRIu64 " notifies, %" PRIu64 " interrupts\n",
+      vbd->filename, vbd->requests, vbd->backend_ops,
+      vbd->common.notify_count, vbd->common.irq_count);
+  block_device_print_stats(vbd->bs, f);
+}
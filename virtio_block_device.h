@@ -3,45 +3,67 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
 #include "virtio_interface.h"
+#include "block_device.h"
+#include "io_ring.h"
 #include "riscv_definations.h"
 
-#define SECTOR_SIZE 512
-typedef struct block_device block_device_t;
-typedef void block_device_complete_func(void *opaque, int ret);
+#define MAX_BLOCK_DEVICES 8
+/* batches in flight per direction; more than a full queue can produce */
+#define VIRTIO_BLK_RING_SIZE MAX_QUEUE_NUM
 
-typedef enum {
-    BF_MODE_RO,
-    BF_MODE_RW,
-    BF_MODE_SNAPSHOT,
-} block_device_mode_enum;
-
-typedef struct block_device_file
+typedef struct
 {
-  FILE *f;
-  int64_t nb_sectors;
+  const char *filename;
   block_device_mode_enum mode;
-  uint8_t **sector_table;
-} block_device_file_t;
+  int readahead_kb;
+  int writeback_mb;
+  bool hugepages;
+  int queue_size; /* power of two up to MAX_QUEUE_NUM */
+} virtual_block_config_t;
+
+/* requests gathered during one queue notify */
+typedef struct
+{
+  block_request_t reqs[VIRTIO_BLK_MAX_BATCH];
+  int count;
+} block_batch_t;
 
+/*
+ * Each device runs its backend on its own I/O thread, so disks do not
+ * wait on each other. Guest memory is only touched by the main thread:
+ * requests are copied in when they are gathered and completed from
+ * virtual_block_poll().
+ *
+ * Batches go to the thread through submit_ring and come back through
+ * done_ring, without locks. An idle thread sleeps on kick_fd, an eventfd
+ * the main thread only writes when io_sleeping is set.
+ */
 typedef struct virtual_io_block_device
 {
   virtual_io_device_t common;
+  address_item_t item;
   block_device_t *bs;
+  const char *filename;
 
-  bool req_in_progress;
-  block_request_t req;
+  block_batch_t *cur;
+  pthread_t thread;
+  io_ring_t submit_ring;
+  io_ring_t done_ring;
+  int kick_fd;
+  bool io_sleeping;
+  int inflight; /* batches submitted and not yet completed, main thread only */
+  int wake_fd[2]; /* written by the I/O thread when a batch is done */
+
+  uint64_t requests;
+  uint64_t backend_ops;
 } virtual_io_block_device_t;
 
-struct block_device
-{
-  int64_t (*get_sector_count)(block_device_t *bs);
-  int (*read_async)(block_device_t *bs, uint64_t sector_num,
-      uint8_t *buf, int size, block_device_complete_func *cb, void *opaque);
-  int (*write_async)(block_device_t *bs, uint64_t sector_num,
-      uint8_t *buf, int size, block_device_complete_func *cb, void *opaque);
-  void *opaque;
-};
-
-extern void virtual_block_device_init(cpu_state_t *state, const char *filename, block_device_mode_enum mode, virtual_io_bus_t *bus);
+extern void virtual_block_device_init(cpu_state_t *state, const virtual_block_config_t *config,
+    virtual_io_bus_t *bus);
+extern void *virtual_block_io_thread(void *opaque);
+extern void virtual_block_poll(virtual_io_block_device_t *vbd);
+extern void virtual_block_drain(virtual_io_block_device_t *vbd);
+extern void virtual_block_print_stats(virtual_io_block_device_t *vbd, FILE *f);
 #endif
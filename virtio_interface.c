@@ -1,5 +1,10 @@
 #include "virtio_interface.h"
 #include "virtio_block_device.h"
+#include "virtio_net_device.h"
+#include "virtio_9p_device.h"
+#include "virtio_balloon_device.h"
+#include "virtio_vsock_device.h"
+#include "virtio_pmem_device.h"
 #include "console.h"
 #include "riscv_definations.h"
 #include "iomap.h"
@@ -9,6 +14,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <poll.h>
 #include "cutils.h"
 
 
@@ -18,22 +27,158 @@ static void virtual_io_reset(virtual_io_device_t *device)
   device->status = 0;
   device->queue_select = 0;
   device->device_features_select = 0;
+  device->driver_features_select = 0;
+  device->driver_features = 0;
   device->int_status = 0;
   for (i = 0; i < MAX_QUEUE; i++)
   {
     queue_state_t *qs = &device->queue[i];
     qs->ready = 0;
-    qs->num = MAX_QUEUE_NUM;
+    qs->num = device->queue_num_max;
     qs->desc_addr = 0;
     qs->avail_addr = 0;
     qs->used_addr = 0;
+    qs->desc_ptr = qs->avail_ptr = qs->used_ptr = NULL;
     qs->last_avail_idx = 0;
+    qs->used_pending = 0;
+    qs->signalled_used_valid = false;
+    qs->avail_wrap_counter = true;
+    qs->used_wrap_counter = true;
+    qs->used_idx = 0;
   }
 }
 
+static uint64_t virtual_device_features(virtual_io_device_t *device)
+{
+  return device->device_features | VIRTIO_RING_F_INDIRECT_DESC |
+    VIRTIO_RING_F_EVENT_IDX | VIRTIO_F_VERSION_1 | VIRTIO_F_RING_PACKED;
+}
+
+static bool virtual_event_idx(virtual_io_device_t *device)
+{
+  return (device->driver_features & VIRTIO_RING_F_EVENT_IDX) != 0;
+}
+
+static bool virtual_packed(virtual_io_device_t *device)
+{
+  return (device->driver_features & VIRTIO_F_RING_PACKED) != 0;
+}
+
+/*
+ * Ring fields are shared with the driver: index and flag loads acquire
+ * and stores release, so the entries they publish are seen in order.
+ */
+static uint16_t ring_load16(const uint8_t *ptr)
+{
+  return __atomic_load_n((const uint16_t*)ptr, __ATOMIC_ACQUIRE);
+}
+
+static void ring_store16(uint8_t *ptr, uint16_t value)
+{
+  __atomic_store_n((uint16_t*)ptr, value, __ATOMIC_RELEASE);
+}
+
+/*
+ * Resolve the three ring areas to host pointers when the driver marks
+ * the queue ready; they must lie in RAM.
+ */
+static int virtual_map_queue(virtual_io_device_t *device, queue_state_t *qs)
+{
+  uint_t avail_size, used_size;
+
+  if (virtual_packed(device))
+  {
+    avail_size = used_size = 4;
+  }
+  else
+  {
+    avail_size = 6 + qs->num * 2;
+    used_size = 6 + qs->num * 8;
+  }
+  qs->desc_ptr = iomap_manager.get_ram_ptr(qs->desc_addr, qs->num * sizeof(virtual_io_desc_t));
+  qs->avail_ptr = iomap_manager.get_ram_ptr(qs->avail_addr, avail_size);
+  qs->used_ptr = iomap_manager.get_ram_ptr(qs->used_addr, used_size);
+  if (!qs->desc_ptr || !qs->avail_ptr || !qs->used_ptr)
+  {
+    printf("virtio: queue rings are not in RAM\n");
+    qs->desc_ptr = qs->avail_ptr = qs->used_ptr = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/* true when new_idx has moved past event_idx since old */
+static bool vring_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old)
+{
+  return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old);
+}
+
+/*
+ * With EVENT_IDX the driver asks for a kick only once the avail index
+ * passes avail_event, which sits after the used ring.
+ */
+static void virtual_update_avail_event(virtual_io_device_t *device, queue_state_t *qs)
+{
+  if (!virtual_event_idx(device))
+    return;
+  if (!virtual_packed(device))
+  {
+    ring_store16(qs->used_ptr + 4 + qs->num * 8, qs->last_avail_idx);
+    return;
+  }
+  /* packed: the device event suppression area holds off_wrap and flags */
+  ring_store16(qs->used_ptr, qs->last_avail_idx | (qs->avail_wrap_counter << 15));
+  ring_store16(qs->used_ptr + 2, VRING_PACKED_EVENT_FLAG_DESC);
+}
+
+/* decide whether completing up to used_idx must interrupt the driver */
+static bool virtual_need_interrupt(virtual_io_device_t *device, queue_state_t *qs, uint16_t used_idx)
+{
+  uint16_t flags, event, old;
+  bool valid;
+
+  if (virtual_packed(device))
+  {
+    /* packed: the driver event suppression area holds off_wrap and flags */
+    event = ring_load16(qs->avail_ptr);
+    flags = ring_load16(qs->avail_ptr + 2);
+    if (flags != VRING_PACKED_EVENT_FLAG_DESC)
+      return flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+    if ((event >> 15) != qs->used_wrap_counter)
+      event = (event & 0x7fff) - qs->num;
+    else
+      event &= 0x7fff;
+  }
+  else if (!virtual_event_idx(device))
+  {
+    flags = ring_load16(qs->avail_ptr);
+    return !(flags & VRING_AVAIL_F_NO_INTERRUPT);
+  }
+  else
+  {
+    event = ring_load16(qs->avail_ptr + 4 + qs->num * 2);
+  }
+  old = qs->signalled_used;
+  valid = qs->signalled_used_valid;
+  /* packed indices restart every lap: put old in the current lap */
+  if (virtual_packed(device) && qs->signalled_used_wrap != qs->used_wrap_counter)
+    old -= qs->num;
+  qs->signalled_used = used_idx;
+  qs->signalled_used_wrap = qs->used_wrap_counter;
+  qs->signalled_used_valid = true;
+  return !valid || vring_need_event(event, used_idx, old);
+}
+
 static int virtio_memcpy_from_ram(virtual_io_device_t *device, uint8_t *buf, uint_t addr, int count)
 {
+  uint8_t *ptr = iomap_manager.get_ram_ptr(addr, count);
   int len;
+
+  if (ptr)
+  {
+    memcpy(buf, ptr, count);
+    return 0;
+  }
   while(count > 0)
   {
     len = min_int(count, VIRTIO_PAGE_SIZE - (addr & (VIRTIO_PAGE_SIZE - 1)));
@@ -47,7 +192,14 @@ static int virtio_memcpy_from_ram(virtual_io_device_t *device, uint8_t *buf, uin
 
 static int virtio_memcpy_to_ram(virtual_io_device_t *device, uint_t addr, const uint8_t *buf, int count)
 {
+  uint8_t *ptr = iomap_manager.get_ram_ptr(addr, count);
   int len;
+
+  if (ptr)
+  {
+    memcpy(ptr, buf, count);
+    return 0;
+  }
   while(count > 0)
   {
     len = min_int(count, VIRTIO_PAGE_SIZE - (addr & (VIRTIO_PAGE_SIZE - 1)));
@@ -59,56 +211,153 @@ static int virtio_memcpy_to_ram(virtual_io_device_t *device, uint_t addr, const
   return 0;
 }
 
-static int get_desc(virtual_io_device_t *device, virtual_io_desc_t *desc, int queue_idx, int desc_idx)
+/* the table a chain's descriptors live in: the ring itself or an indirect table */
+typedef struct
 {
-  queue_state_t *qs = &device->queue[queue_idx];
-  return virtio_memcpy_from_ram(device, (void*)desc,
-      qs->desc_addr + desc_idx * sizeof(virtual_io_desc_t),
-      sizeof(virtual_io_desc_t));
+  uint8_t *ptr;
+  uint32_t num;
+  bool packed;
+  bool indirect;
+} desc_table_t;
+
+/* the flags are loaded first: they publish the rest of the descriptor */
+static void get_packed_desc(virtual_io_packed_desc_t *desc, const uint8_t *table, int desc_idx)
+{
+  const uint8_t *ptr = table + desc_idx * sizeof(virtual_io_packed_desc_t);
+
+  desc->flags = ring_load16(ptr + offsetof(virtual_io_packed_desc_t, flags));
+  memcpy(desc, ptr, offsetof(virtual_io_packed_desc_t, flags));
 }
 
-static int virtual_memcpy_to_from_queue(virtual_io_device_t *device, uint8_t *buf,
-    int queue_idx, int desc_idx, int offset,
-    int count, bool to_queue)
+/*
+ * Packed descriptors are returned in the split layout: a chain runs on
+ * to the following slot, wrapping in the ring, and an indirect table is
+ * one chain from its first entry to its last.
+ */
+static int get_desc(virtual_io_device_t *device, virtual_io_desc_t *desc,
+    const desc_table_t *table, int desc_idx)
 {
-  virtual_io_desc_t desc;
-  int len, f_write_flag;
+  virtual_io_packed_desc_t pdesc;
 
-  if (count == 0)
+  if (desc_idx >= table->num)
+    return -1;
+  if (!table->packed)
+  {
+    memcpy(desc, table->ptr + desc_idx * sizeof(virtual_io_desc_t), sizeof(virtual_io_desc_t));
+    return 0;
+  }
+
+  get_packed_desc(&pdesc, table->ptr, desc_idx);
+  desc->addr = pdesc.addr;
+  desc->len = pdesc.len;
+  desc->flags = pdesc.flags & (VRING_DESC_F_NEXT | VRING_DESC_F_WRITE | VRING_DESC_F_INDIRECT);
+  desc->next = desc_idx + 1;
+  if (table->indirect)
+  {
+    desc->flags &= ~VRING_DESC_F_NEXT;
+    if (desc->next < table->num)
+      desc->flags |= VRING_DESC_F_NEXT;
+  }
+  else if (desc->next == table->num)
+  {
+    desc->next = 0;
+  }
+  return 0;
+}
+
+/* read the first descriptor of a chain, following an indirect head */
+static int get_chain_head(virtual_io_device_t *device, virtual_io_desc_t *desc,
+    desc_table_t *table, int queue_idx, int desc_idx)
+{
+  queue_state_t *qs = &device->queue[queue_idx];
+
+  table->ptr = qs->desc_ptr;
+  table->num = qs->num;
+  table->packed = virtual_packed(device);
+  table->indirect = false;
+  if (get_desc(device, desc, table, desc_idx) < 0)
+    return -1;
+  if (!(desc->flags & VRING_DESC_F_INDIRECT))
     return 0;
+  if (desc->len == 0 || (desc->len % sizeof(virtual_io_desc_t)) != 0 ||
+      (desc->flags & VRING_DESC_F_NEXT))
+    return -1;
+  table->ptr = iomap_manager.get_ram_ptr(desc->addr, desc->len);
+  if (!table->ptr)
+    return -1;
+  table->num = desc->len / sizeof(virtual_io_desc_t);
+  table->indirect = true;
+  return get_desc(device, desc, table, 0);
+}
+
+/*
+ * Find the descriptor holding byte offset of the chain's readable part,
+ * or of its writable part if to_queue; offset becomes relative to it.
+ */
+static int queue_seek(virtual_io_device_t *device, virtual_io_desc_t *desc,
+    desc_table_t *table, int queue_idx, int desc_idx, int *offset, bool to_queue)
+{
+  int f_write_flag = to_queue ? VRING_DESC_F_WRITE : 0;
 
-  get_desc(device, &desc, queue_idx, desc_idx);
+  if (get_chain_head(device, desc, table, queue_idx, desc_idx) < 0)
+    return -1;
 
   if (to_queue)
   {
-    f_write_flag = VRING_DESC_F_WRITE;
     for(;;)
     {
-      if ((desc.flags & VRING_DESC_F_WRITE) == f_write_flag)
+      if ((desc->flags & VRING_DESC_F_WRITE) == f_write_flag)
         break;
-      if (!(desc.flags & VRING_DESC_F_NEXT))
+      if (!(desc->flags & VRING_DESC_F_NEXT))
+        return -1;
+      desc_idx = desc->next;
+      if (get_desc(device, desc, table, desc_idx) < 0)
         return -1;
-      desc_idx = desc.next;
-      get_desc(device, &desc, queue_idx, desc_idx);
     }
   }
-  else
-  {
-    f_write_flag = 0;
-  }
 
   for(;;)
   {
-    if ((desc.flags & VRING_DESC_F_WRITE) != f_write_flag)
+    if ((desc->flags & VRING_DESC_F_WRITE) != f_write_flag)
       return -1;
-    if (offset < desc.len)
+    if (*offset < desc->len)
       break;
-    if (!(desc.flags & VRING_DESC_F_NEXT))
+    if (!(desc->flags & VRING_DESC_F_NEXT))
+      return -1;
+    desc_idx = desc->next;
+    *offset -= desc->len;
+    if (get_desc(device, desc, table, desc_idx) < 0)
       return -1;
-    desc_idx = desc.next;
-    offset = desc.len;
-    get_desc(device, &desc, queue_idx, desc_idx);
   }
+  return 0;
+}
+
+/* step to the next descriptor of the same direction */
+static int queue_next(virtual_io_device_t *device, virtual_io_desc_t *desc,
+    desc_table_t *table, bool to_queue)
+{
+  if (!(desc->flags & VRING_DESC_F_NEXT))
+    return -1;
+  if (get_desc(device, desc, table, desc->next) < 0)
+    return -1;
+  if ((desc->flags & VRING_DESC_F_WRITE) != (to_queue ? VRING_DESC_F_WRITE : 0))
+    return -1;
+  return 0;
+}
+
+static int virtual_memcpy_to_from_queue(virtual_io_device_t *device, uint8_t *buf,
+    int queue_idx, int desc_idx, int offset,
+    int count, bool to_queue)
+{
+  virtual_io_desc_t desc;
+  desc_table_t table;
+  int len;
+
+  if (count == 0)
+    return 0;
+
+  if (queue_seek(device, &desc, &table, queue_idx, desc_idx, &offset, to_queue) < 0)
+    return -1;
 
   for(;;)
   {
@@ -124,11 +373,7 @@ static int virtual_memcpy_to_from_queue(virtual_io_device_t *device, uint8_t *bu
     buf += len;
     if (offset == desc.len)
     {
-      if (!(desc.flags & VRING_DESC_F_NEXT))
-        return -1;
-      desc_idx = desc.next;
-      get_desc(device, &desc, queue_idx, desc_idx);
-      if ((desc.flags & VRING_DESC_F_WRITE) != f_write_flag)
+      if (queue_next(device, &desc, &table, to_queue) < 0)
         return -1;
       offset = 0;
     }
@@ -137,6 +382,45 @@ static int virtual_memcpy_to_from_queue(virtual_io_device_t *device, uint8_t *bu
   return 0;
 }
 
+/*
+ * Describe count bytes of a chain from offset with host pointers into
+ * guest RAM, so a backend can read or write them in place. Returns the
+ * number of iovecs, or -1 if the range is not all RAM or needs more
+ * than max_iov pieces.
+ */
+int virtual_queue_iov(virtual_io_device_t *device, int queue_idx, int desc_idx,
+    int offset, int count, bool to_queue, struct iovec *iov, int max_iov)
+{
+  virtual_io_desc_t desc;
+  desc_table_t table;
+  int len, n = 0;
+
+  if (count == 0)
+    return 0;
+
+  if (queue_seek(device, &desc, &table, queue_idx, desc_idx, &offset, to_queue) < 0)
+    return -1;
+
+  for(;;)
+  {
+    len = min_int(count, desc.len - offset);
+    if (n == max_iov)
+      return -1;
+    iov[n].iov_base = iomap_manager.get_ram_ptr(desc.addr + offset, len);
+    if (!iov[n].iov_base)
+      return -1;
+    iov[n++].iov_len = len;
+    count -= len;
+    if (count == 0)
+      break;
+    if (queue_next(device, &desc, &table, to_queue) < 0)
+      return -1;
+    offset = 0;
+  }
+
+  return n;
+}
+
 int virtual_memcpy_to_queue(virtual_io_device_t *device,
     int queue_idx, int desc_idx, int offset, const void *buf, int count)
 {
@@ -154,21 +438,28 @@ static int get_desc_rw_size(cpu_state_t *state, virtual_io_device_t *device,
     int queue_idx, int desc_idx)
 {
   virtual_io_desc_t desc;
+  desc_table_t table;
   int read_size, write_size;
+  uint32_t count = 1;
 
   read_size = 0;
   write_size = 0;
-  get_desc(device, &desc, queue_idx, desc_idx);
+  if (get_chain_head(device, &desc, &table, queue_idx, desc_idx) < 0)
+    return -1;
 
   for(;;)
   {
     if(desc.flags & VRING_DESC_F_WRITE)
       break;
-    read_size = desc.len;
+    read_size += desc.len;
     if (!(desc.flags & VRING_DESC_F_NEXT))
       goto done;
+    /* a chain can not be longer than its table; anything else is a loop */
+    if (count++ >= table.num)
+      return -1;
     desc_idx = desc.next;
-    get_desc(device, &desc, queue_idx, desc_idx);
+    if (get_desc(device, &desc, &table, desc_idx) < 0)
+      return -1;
   }
 
   for(;;)
@@ -178,8 +469,11 @@ static int get_desc_rw_size(cpu_state_t *state, virtual_io_device_t *device,
     write_size += desc.len;
     if(!(desc.flags & VRING_DESC_F_NEXT))
       break;
+    if (count++ >= table.num)
+      return -1;
     desc_idx = desc.next;
-    get_desc(device, &desc, queue_idx, desc_idx);
+    if (get_desc(device, &desc, &table, desc_idx) < 0)
+      return -1;
   }
 
 done:
@@ -188,28 +482,73 @@ done:
   return 0;
 }
   
-static void queue_notify(virtual_io_device_t *device, int queue_idx)
+static bool packed_desc_is_avail(uint16_t flags, bool wrap_counter)
 {
-  queue_state_t *qs = &device->queue[queue_idx];
-  uint16_t avail_idx;
-  int desc_idx, read_size, write_size;
+  return !!(flags & VRING_PACKED_DESC_F_AVAIL) == wrap_counter &&
+    !!(flags & VRING_PACKED_DESC_F_USED) != wrap_counter;
+}
 
-  if (qs->manual_recv)
-    return;
+/* head of the next chain the driver made available, or -1 if there is none */
+static int virtual_next_avail(virtual_io_device_t *device, int queue_idx)
+{
+  queue_state_t *qs = &device->queue[queue_idx];
+  virtual_io_packed_desc_t desc;
+  uint16_t desc_idx;
+  int head, n;
 
-  int_t status = iomap_manager.read(qs->avail_addr + 2, 2, (uint8_t*)&avail_idx);
-  if (status < 0)
+  if (!virtual_packed(device))
   {
-    abort();
+    if (qs->last_avail_idx == ring_load16(qs->avail_ptr + 2))
+      return -1;
+    return ring_load16(qs->avail_ptr + 4 + (qs->last_avail_idx & (qs->num - 1)) * 2);
   }
-  while(qs->last_avail_idx != avail_idx)
+
+  head = desc_idx = qs->last_avail_idx;
+  get_packed_desc(&desc, qs->desc_ptr, desc_idx);
+  if (!packed_desc_is_avail(desc.flags, qs->avail_wrap_counter))
+    return -1;
+  /* the buffer id is carried by the last descriptor of the chain */
+  for (n = 1; (desc.flags & VRING_DESC_F_NEXT) && n < qs->num; n++)
   {
-    status = iomap_manager.read(qs->avail_addr + 4 + (qs->last_avail_idx & (qs->num - 1)) * 2, 2, (uint8_t*)&desc_idx);
-    if (status < 0)
-    {
-      printf("desc_idx fetch failed\n");
+    if (++desc_idx == qs->num)
       desc_idx = 0;
-    }
+    get_packed_desc(&desc, qs->desc_ptr, desc_idx);
+  }
+  qs->packed_id[head] = desc.id;
+  qs->packed_ndesc[head] = n;
+  return head;
+}
+
+/* step past the chain returned by virtual_next_avail() */
+static void virtual_pop_avail(virtual_io_device_t *device, int queue_idx, int head)
+{
+  queue_state_t *qs = &device->queue[queue_idx];
+
+  if (!virtual_packed(device))
+  {
+    qs->last_avail_idx++;
+    return;
+  }
+  qs->last_avail_idx += qs->packed_ndesc[head];
+  if (qs->last_avail_idx >= qs->num)
+  {
+    qs->last_avail_idx -= qs->num;
+    qs->avail_wrap_counter = !qs->avail_wrap_counter;
+  }
+}
+
+static void queue_notify(virtual_io_device_t *device, int queue_idx)
+{
+  queue_state_t *qs = &device->queue[queue_idx];
+  int desc_idx;
+  int read_size, write_size;
+
+  if (!qs->ready)
+    return;
+
+  /* manual queues are only told that the driver added buffers */
+  while(!qs->manual_recv && (desc_idx = virtual_next_avail(device, queue_idx)) >= 0)
+  {
     if (!get_desc_rw_size(device->cpu_state, device, &read_size, &write_size, queue_idx, desc_idx))
     {
 #ifdef DEBUG_VIRTIO
@@ -222,8 +561,12 @@ static void queue_notify(virtual_io_device_t *device, int queue_idx)
       if (device->device_recv(device, queue_idx, desc_idx, read_size, write_size) < 0)
         break;
     }
-    qs->last_avail_idx++;
+    virtual_pop_avail(device, queue_idx, desc_idx);
   }
+  if (!qs->manual_recv)
+    virtual_update_avail_event(device, qs);
+  if (device->device_recv_done)
+    device->device_recv_done(device, queue_idx);
 }
 
 static uint32_t virtual_config_read(virtual_io_device_t *device, uint32_t offset, int size)
@@ -298,6 +641,75 @@ static void virtual_config_write(virtual_io_device_t *device, uint32_t offset ,
   }
 }
 
+static void set_low32(uint64_t *addr, uint32_t value)
+{
+  *addr = (*addr & ~(uint64_t)0xffffffff) | value;
+}
+
+static void set_high32(uint64_t *addr, uint32_t value)
+{
+  *addr = (*addr & 0xffffffff) | ((uint64_t)value << 32);
+}
+
+/* register semantics shared by the mmio and pci transports */
+static uint32_t virtual_read_device_features(virtual_io_device_t *device)
+{
+  switch(device->device_features_select)
+  {
+    case 0:
+      return virtual_device_features(device);
+    case 1:
+      return virtual_device_features(device) >> 32;
+    default:
+      return 0;
+  }
+}
+
+static void virtual_write_driver_features(virtual_io_device_t *device, uint32_t value)
+{
+  if (device->driver_features_select == 0)
+    set_low32(&device->driver_features, value);
+  else if (device->driver_features_select == 1)
+    set_high32(&device->driver_features, value);
+}
+
+static void virtual_set_queue_num(virtual_io_device_t *device, uint32_t value)
+{
+  /* split rings are indexed with a mask, packed ones need not be */
+  if (value > 0 && value <= device->queue_num_max &&
+      ((value & (value - 1)) == 0 || virtual_packed(device)))
+  {
+    device->queue[device->queue_select].num = value;
+  }
+}
+
+static void virtual_set_queue_ready(virtual_io_device_t *device, uint32_t value)
+{
+  queue_state_t *qs = &device->queue[device->queue_select];
+
+  qs->ready = (value & 1) && virtual_map_queue(device, qs) == 0;
+  qs->signalled_used_valid = false;
+}
+
+static void virtual_set_status(virtual_io_device_t *device, uint32_t value)
+{
+  device->status = value;
+  if (value == 0)
+  {
+    set_irq(device->irq, 0);
+    virtual_io_reset(device);
+  }
+}
+
+static void virtual_notify(virtual_io_device_t *device, uint32_t queue_idx)
+{
+  if (queue_idx < MAX_QUEUE)
+  {
+    device->notify_count++;
+    queue_notify(device, queue_idx);
+  }
+}
+
 int_t virtual_mmio_read_sub(address_item_t *handler, uint_t src, uint_t size, uint8_t *dst)
 {
   if (handler == NULL || dst == NULL)
@@ -307,9 +719,10 @@ int_t virtual_mmio_read_sub(address_item_t *handler, uint_t src, uint_t size, ui
   uint32_t offset = src - handler->start_address;
   int i = 0;
   if (offset >= VIRTIO_MMIO_CONFIG)
-    return virtual_config_read(device, offset - VIRTIO_MMIO_CONFIG, size);
-
-  if (size == 4)
+  {
+    value = virtual_config_read(device, offset - VIRTIO_MMIO_CONFIG, size);
+  }
+  else if (size == 4)
   {
     switch(offset)
     {
@@ -326,18 +739,7 @@ int_t virtual_mmio_read_sub(address_item_t *handler, uint_t src, uint_t size, ui
         value = device->vendor_id;
         break;
       case VIRTIO_MMIO_DEVICE_FEATURES:
-        switch(device->device_features_select)
-        {
-          case 0:
-            value = device->device_features;
-            break;
-          case 1:
-            value = 1;
-            break;
-          default:
-            value = 0;
-            break;
-        }
+        value = virtual_read_device_features(device);
         break;
       case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
         value = device->device_features_select;
@@ -346,7 +748,7 @@ int_t virtual_mmio_read_sub(address_item_t *handler, uint_t src, uint_t size, ui
         value = device->queue_select;
         break;
       case VIRTIO_MMIO_QUEUE_NUM_MAX:
-        value = MAX_QUEUE_NUM;
+        value = device->queue_num_max;
         break;
       case VIRTIO_MMIO_QUEUE_NUM:
         value = device->queue[device->queue_select].num;
@@ -415,6 +817,9 @@ int_t virtual_mmio_read(address_item_t *handler, uint_t src, uint_t size, uint8_
     dst += 4;
     cp_size -= 4;
   }
+  /* byte and half-word accesses are only meaningful in the config space */
+  if (cp_size > 0)
+    ret_size += virtual_mmio_read_sub(handler, src, cp_size, dst);
   if (ret_size != size)
   {
     return -1;
@@ -423,16 +828,6 @@ int_t virtual_mmio_read(address_item_t *handler, uint_t src, uint_t size, uint8_
   return size;
 }
 
-static void set_low32(uint64_t *addr, uint32_t value)
-{
-  *addr = (*addr & ~(uint64_t)0xffffffff) | value;
-}
-
-static void set_high32(uint64_t *addr, uint32_t value)
-{
-  *addr = (*addr & 0xffffffff) | ((uint64_t)value << 32);
-}
-
 int_t virtual_mmio_write_sub(address_item_t *handler, uint8_t *src, uint_t size, uint_t dst)
 {
   if (handler == NULL || src == NULL)
@@ -461,15 +856,18 @@ int_t virtual_mmio_write_sub(address_item_t *handler, uint8_t *src, uint_t size,
       case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
         device->device_features_select = value;
         break;
+      case VIRTIO_MMIO_DRIVER_FEATURES:
+        virtual_write_driver_features(device, value);
+        break;
+      case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+        device->driver_features_select = value;
+        break;
       case VIRTIO_MMIO_QUEUE_SEL:
         if (value < MAX_QUEUE)
           device->queue_select = value;
         break;
       case VIRTIO_MMIO_QUEUE_NUM:
-        if ((value & (value - 1)) == 0 && value > 0)
-        {
-          device->queue[device->queue_select].num = value;
-        }
+        virtual_set_queue_num(device, value);
         break;
       case VIRTIO_MMIO_QUEUE_DESC_LOW:
         set_low32(&device->queue[device->queue_select].desc_addr, value);
@@ -490,19 +888,13 @@ int_t virtual_mmio_write_sub(address_item_t *handler, uint8_t *src, uint_t size,
         set_high32(&device->queue[device->queue_select].used_addr, value);
         break;
       case VIRTIO_MMIO_STATUS:
-        device->status = value;
-        if (value == 0)
-        {
-          set_irq(device->irq, 0);
-          virtual_io_reset(device);
-        }
+        virtual_set_status(device, value);
         break;
       case VIRTIO_MMIO_QUEUE_READY:
-        device->queue[device->queue_select].ready = value & 1;
+        virtual_set_queue_ready(device, value);
         break;
       case VIRTIO_MMIO_QUEUE_NOTIFY:
-        if (value < MAX_QUEUE)
-          queue_notify(device, value);
+        virtual_notify(device, value);
         break;
       case VIRTIO_MMIO_INTERRUPT_ACK:
         device->int_status &= ~value;
@@ -541,166 +933,799 @@ int_t virtual_mmio_write(address_item_t *handler, uint8_t *src, uint_t size, uin
   return size;
 }
 
-void virtual_consume_desc(virtual_io_device_t *device, int queue_idx, int desc_idx, int desc_len)
+static uint32_t virtio_pci_common_read(virtual_io_device_t *device, uint32_t offset)
 {
-  queue_state_t *qs = &device->queue[queue_idx];
-  uint64_t addr;
-  uint32_t index = 0;
-
-  addr = qs->used_addr + 2;
-  iomap_manager.read(addr, 2, (uint8_t*)&index);
-  index += 1;
-  iomap_manager.write(addr, 2, (uint8_t*)&index);
-  index -= 1;
-
-  addr = qs->used_addr + 4 + (index & (qs->num - 1)) * 8;
-  iomap_manager.write(addr, 4, (uint8_t*)&desc_idx);
-  iomap_manager.write(addr + 4, 4, (uint8_t*)&desc_len);
-
-  device->int_status |= 1;
-  set_irq(device->irq, 1);
+  queue_state_t *qs = &device->queue[device->queue_select];
 
-  return;
+  switch(offset)
+  {
+    case VIRTIO_PCI_DEVICE_FEATURE_SEL:
+      return device->device_features_select;
+    case VIRTIO_PCI_DEVICE_FEATURE:
+      return virtual_read_device_features(device);
+    case VIRTIO_PCI_GUEST_FEATURE_SEL:
+      return device->driver_features_select;
+    case VIRTIO_PCI_GUEST_FEATURE:
+      if (device->driver_features_select == 0)
+        return device->driver_features;
+      if (device->driver_features_select == 1)
+        return device->driver_features >> 32;
+      return 0;
+    case VIRTIO_PCI_MSIX_CONFIG:
+    case VIRTIO_PCI_QUEUE_MSIX_VECTOR:
+      return VIRTIO_MSI_NO_VECTOR;
+    case VIRTIO_PCI_NUM_QUEUES:
+      return MAX_QUEUE;
+    case VIRTIO_PCI_DEVICE_STATUS:
+      return device->status;
+    case VIRTIO_PCI_CONFIG_GENERATION:
+      return 0;
+    case VIRTIO_PCI_QUEUE_SEL:
+      return device->queue_select;
+    case VIRTIO_PCI_QUEUE_SIZE:
+      return qs->num;
+    case VIRTIO_PCI_QUEUE_ENABLE:
+      return qs->ready;
+    case VIRTIO_PCI_QUEUE_NOTIFY_OFF:
+      return device->queue_select;
+    case VIRTIO_PCI_QUEUE_DESC_LOW:
+      return qs->desc_addr;
+    case VIRTIO_PCI_QUEUE_DESC_HIGH:
+      return qs->desc_addr >> 32;
+    case VIRTIO_PCI_QUEUE_AVAIL_LOW:
+      return qs->avail_addr;
+    case VIRTIO_PCI_QUEUE_AVAIL_HIGH:
+      return qs->avail_addr >> 32;
+    case VIRTIO_PCI_QUEUE_USED_LOW:
+      return qs->used_addr;
+    case VIRTIO_PCI_QUEUE_USED_HIGH:
+      return qs->used_addr >> 32;
+    default:
+      return 0;
+  }
 }
 
-static void virtual_block_req_end(virtual_io_device_t *device, int ret)
+static void virtio_pci_common_write(virtual_io_device_t *device, uint32_t offset, uint32_t value)
 {
-  virtual_io_block_device_t *vbd = (virtual_io_block_device_t*)device;
-  int write_size;
-  int queue_idx = vbd->req.queue_idx;
-  int desc_idx = vbd->req.desc_idx;
-  uint8_t *buf, buf1[1];
+  queue_state_t *qs = &device->queue[device->queue_select];
 
-  switch(vbd->req.type)
+  switch(offset)
   {
-    case VIRTIO_BLK_T_IN:
-      write_size = vbd->req.write_size;
-      buf = vbd->req.buf;
-      if (ret < 0)
-      {
-        buf[write_size - 1] = VIRTIO_BLK_S_IOERR;
-      }
-      else
-      {
-        buf[write_size - 1] = VIRTIO_BLK_S_OK;
-      }
-      virtual_memcpy_to_queue(device, queue_idx, desc_idx, 0, buf, write_size);
-      free(buf);
-      virtual_consume_desc(device, queue_idx, desc_idx, write_size);
+    case VIRTIO_PCI_DEVICE_FEATURE_SEL:
+      device->device_features_select = value;
       break;
-    case VIRTIO_BLK_T_OUT:
-      if (ret < 0)
-        buf1[0] = VIRTIO_BLK_S_IOERR;
-      else
-        buf1[0] = VIRTIO_BLK_S_OK;
-      virtual_memcpy_to_queue(device, queue_idx, desc_idx, 0, buf1, sizeof(buf1));
-      virtual_consume_desc(device, queue_idx, desc_idx, 1);
+    case VIRTIO_PCI_GUEST_FEATURE_SEL:
+      device->driver_features_select = value;
+      break;
+    case VIRTIO_PCI_GUEST_FEATURE:
+      virtual_write_driver_features(device, value);
+      break;
+    case VIRTIO_PCI_DEVICE_STATUS:
+      virtual_set_status(device, value);
+      break;
+    case VIRTIO_PCI_QUEUE_SEL:
+      if (value < MAX_QUEUE)
+        device->queue_select = value;
+      break;
+    case VIRTIO_PCI_QUEUE_SIZE:
+      virtual_set_queue_num(device, value);
+      break;
+    case VIRTIO_PCI_QUEUE_ENABLE:
+      virtual_set_queue_ready(device, value);
+      break;
+    case VIRTIO_PCI_QUEUE_DESC_LOW:
+      set_low32(&qs->desc_addr, value);
+      break;
+    case VIRTIO_PCI_QUEUE_DESC_HIGH:
+      set_high32(&qs->desc_addr, value);
+      break;
+    case VIRTIO_PCI_QUEUE_AVAIL_LOW:
+      set_low32(&qs->avail_addr, value);
+      break;
+    case VIRTIO_PCI_QUEUE_AVAIL_HIGH:
+      set_high32(&qs->avail_addr, value);
+      break;
+    case VIRTIO_PCI_QUEUE_USED_LOW:
+      set_low32(&qs->used_addr, value);
+      break;
+    case VIRTIO_PCI_QUEUE_USED_HIGH:
+      set_high32(&qs->used_addr, value);
       break;
     default:
-      abort();
+      /* msix vectors stay VIRTIO_MSI_NO_VECTOR, the rest is read-only */
+      break;
   }
 }
-static void virtual_io_block_req_cb(void *opaque, int ret)
+
+static int_t virtio_pci_read_sub(virtual_io_device_t *device, uint32_t offset, uint_t size, uint8_t *dst)
 {
-  virtual_io_device_t *device = (virtual_io_device_t*)opaque;
-  virtual_io_block_device_t *vbd = (virtual_io_block_device_t*)device;
+  uint32_t value = 0;
+  int i;
+
+  switch(offset & ~(VIRTIO_PCI_ISR_OFFSET - 1))
+  {
+    case VIRTIO_PCI_CFG_OFFSET:
+      value = virtio_pci_common_read(device, offset);
+      break;
+    case VIRTIO_PCI_ISR_OFFSET:
+      /* reading the isr acknowledges it */
+      value = device->int_status;
+      device->int_status = 0;
+      set_irq(device->irq, 0);
+      break;
+    case VIRTIO_PCI_CONFIG_OFFSET:
+      value = virtual_config_read(device, offset - VIRTIO_PCI_CONFIG_OFFSET, size);
+      break;
+    default:
+      value = 0;
+      break;
+  }
+#ifdef DEBUG_VIRTIO
+  if (device->debug)
+    printf("virtio_pci_read: offset=0x%x, val=0x%x, size=%lu\n",
+          offset, value, size);
+#endif
+  for (i = 0; i < size; i++)
+    dst[i] = value >> (i * 8);
+  return size;
+}
+
+static int_t virtio_pci_write_sub(virtual_io_device_t *device, uint32_t offset, uint_t size, uint8_t *src)
+{
+  uint32_t value = 0;
+  int i;
+
+  for (i = 0; i < size; i++)
+    value |= src[i] << (i * 8);
+  switch(offset & ~(VIRTIO_PCI_ISR_OFFSET - 1))
+  {
+    case VIRTIO_PCI_CFG_OFFSET:
+      virtio_pci_common_write(device, offset, value);
+      break;
+    case VIRTIO_PCI_CONFIG_OFFSET:
+      virtual_config_write(device, offset - VIRTIO_PCI_CONFIG_OFFSET, value, size);
+      break;
+    case VIRTIO_PCI_NOTIFY_OFFSET:
+      /* notify_off_multiplier is 0: every queue writes its index here */
+      virtual_notify(device, value);
+      break;
+  }
+#ifdef DEBUG_VIRTIO
+  if (device->debug)
+    printf("virtio_pci_write: offset=0x%x, val=0x%x, size=%lu\n",
+          offset, value, size);
+#endif
+  return size;
+}
+
+static int_t virtio_pci_read(void *opaque, int bar_num, uint32_t offset, uint_t size, uint8_t *dst)
+{
+  virtual_io_device_t *device = opaque;
+
+  if (size <= 4)
+    return virtio_pci_read_sub(device, offset, size, dst);
+  /* 64-bit accesses are split like the driver would */
+  virtio_pci_read_sub(device, offset, 4, dst);
+  virtio_pci_read_sub(device, offset + 4, size - 4, dst + 4);
+  return size;
+}
+
+static int_t virtio_pci_write(void *opaque, int bar_num, uint32_t offset, uint_t size, uint8_t *src)
+{
+  virtual_io_device_t *device = opaque;
+
+  if (size <= 4)
+    return virtio_pci_write_sub(device, offset, size, src);
+  virtio_pci_write_sub(device, offset, 4, src);
+  virtio_pci_write_sub(device, offset + 4, size - 4, src + 4);
+  return size;
+}
 
-  virtual_block_req_end(device, ret);
+static void virtio_pci_add_capability(virtual_io_device_t *device, int cfg_type,
+    uint32_t offset, uint32_t len)
+{
+  uint8_t cap[VIRTIO_PCI_NOTIFY_CAP_LEN];
+  int cap_len;
 
-  vbd->req_in_progress = false;
+  cap_len = (cfg_type == VIRTIO_PCI_CAP_NOTIFY_CFG) ? VIRTIO_PCI_NOTIFY_CAP_LEN : VIRTIO_PCI_CAP_LEN;
+  memset(cap, 0, cap_len);
+  cap[0] = 0x09; /* vendor specific */
+  cap[2] = cap_len;
+  cap[3] = cfg_type;
+  cap[4] = 0; /* bar */
+  put_le32(cap + 8, offset);
+  put_le32(cap + 12, len);
+  /* notify_off_multiplier stays 0 */
+  pci_add_capability(device->pci_dev, cap, cap_len);
+}
 
-  queue_notify(device, vbd->req.queue_idx);
+static uint16_t virtio_pci_class(uint32_t device_id)
+{
+  switch(device_id)
+  {
+    case 1:
+      return 0x0200; /* network */
+    case 2:
+      return 0x0100; /* mass storage */
+    case 3:
+      return 0x0780; /* communication */
+    default:
+      return 0x00ff;
+  }
+}
+
+/* modern virtio-pci: one memory bar holding the four register blocks */
+static void virtio_pci_init(virtual_io_device_t *device, pci_bus_t *bus, const char *name)
+{
+  device->pci_dev = pci_register_device(bus, name, -1, VIRTIO_PCI_VENDOR_ID,
+      VIRTIO_PCI_DEVICE_ID_BASE + device->device_id, 0x01, virtio_pci_class(device->device_id));
+  if (!device->pci_dev)
+  {
+    printf("virtio: no free pci slot for %s\n", name);
+    exit(1);
+  }
+  pci_device_set_config16(device->pci_dev, PCI_SUBSYSTEM_VENDOR_ID, VIRTIO_PCI_VENDOR_ID);
+  pci_device_set_config16(device->pci_dev, PCI_SUBSYSTEM_ID, device->device_id);
+  pci_device_set_config8(device->pci_dev, PCI_INTERRUPT_PIN, 1);
+  pci_register_bar(device->pci_dev, 0, VIRTIO_PCI_BAR_SIZE, PCI_ADDRESS_SPACE_MEM,
+      device, NULL, virtio_pci_read, virtio_pci_write);
+
+  virtio_pci_add_capability(device, VIRTIO_PCI_CAP_COMMON_CFG, VIRTIO_PCI_CFG_OFFSET, 0x1000);
+  virtio_pci_add_capability(device, VIRTIO_PCI_CAP_ISR_CFG, VIRTIO_PCI_ISR_OFFSET, 0x1000);
+  virtio_pci_add_capability(device, VIRTIO_PCI_CAP_DEVICE_CFG, VIRTIO_PCI_CONFIG_OFFSET, 0x1000);
+  virtio_pci_add_capability(device, VIRTIO_PCI_CAP_NOTIFY_CFG, VIRTIO_PCI_NOTIFY_OFFSET, 0x1000);
+
+  device->irq = pci_device_get_irq(device->pci_dev, 0);
+}
+
+/* write a used element; the driver sees it after virtual_publish_used() */
+void virtual_push_used(virtual_io_device_t *device, int queue_idx, int desc_idx, int desc_len)
+{
+  queue_state_t *qs = &device->queue[queue_idx];
+  uint8_t *ptr;
+  uint16_t flags;
+  uint32_t elem[2];
+
+  if (virtual_packed(device))
+  {
+    /* elements go in the next used slots; the first one is flagged last */
+    ptr = qs->desc_ptr + qs->used_idx * sizeof(virtual_io_packed_desc_t);
+    memcpy(ptr + offsetof(virtual_io_packed_desc_t, len), &desc_len, 4);
+    memcpy(ptr + offsetof(virtual_io_packed_desc_t, id), &qs->packed_id[desc_idx], 2);
+    flags = qs->used_wrap_counter ? VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED : 0;
+    if (qs->used_pending == 0)
+    {
+      qs->pending_flags_slot = qs->used_idx;
+      qs->pending_flags = flags;
+    }
+    else
+    {
+      ring_store16(ptr + offsetof(virtual_io_packed_desc_t, flags), flags);
+    }
+    qs->used_idx += qs->packed_ndesc[desc_idx];
+    if (qs->used_idx >= qs->num)
+    {
+      qs->used_idx -= qs->num;
+      qs->used_wrap_counter = !qs->used_wrap_counter;
+    }
+  }
+  else
+  {
+    /* only the device writes the used index, so a plain load is enough */
+    if (qs->used_pending == 0)
+      memcpy(&qs->shadow_used_idx, qs->used_ptr + 2, 2);
+    elem[0] = desc_idx;
+    elem[1] = desc_len;
+    memcpy(qs->used_ptr + 4 + (qs->shadow_used_idx & (qs->num - 1)) * 8, elem, 8);
+    qs->shadow_used_idx++;
+  }
+  qs->used_pending++;
+}
+
+/*
+ * Make every pushed element visible with one index (or flags) store per
+ * queue, and raise at most one interrupt for all of them.
+ */
+void virtual_publish_used(virtual_io_device_t *device)
+{
+  queue_state_t *qs;
+  uint16_t index;
+  bool notify = false;
+  int i;
+
+  for (i = 0; i < MAX_QUEUE; i++)
+  {
+    qs = &device->queue[i];
+    if (!qs->used_pending)
+      continue;
+    if (virtual_packed(device))
+    {
+      ring_store16(qs->desc_ptr + qs->pending_flags_slot * sizeof(virtual_io_packed_desc_t) +
+          offsetof(virtual_io_packed_desc_t, flags), qs->pending_flags);
+      index = qs->used_idx;
+    }
+    else
+    {
+      ring_store16(qs->used_ptr + 2, qs->shadow_used_idx);
+      index = qs->shadow_used_idx;
+    }
+    qs->used_pending = 0;
+    if (virtual_need_interrupt(device, qs, index))
+      notify = true;
+  }
+
+  if (!notify)
+    return;
+  device->int_status |= 1;
+  device->irq_count++;
+  set_irq(device->irq, 1);
+}
+
+void virtual_consume_desc(virtual_io_device_t *device, int queue_idx, int desc_idx, int desc_len)
+{
+  virtual_push_used(device, queue_idx, desc_idx, desc_len);
+  virtual_publish_used(device);
+}
+
+/* I/O thread: run a batch against the backend, no guest memory access */
+static int virtual_block_zero_segments(block_device_t *bs, block_request_t *req)
+{
+  block_discard_segment_t seg;
+  int64_t nb_sectors = bs->get_sector_count(bs);
+  int i, ret;
+
+  if (req->nb_sectors < 1 || req->nb_sectors > VIRTIO_BLK_MAX_DISCARD_SEG)
+    return VIRTIO_BLK_S_IOERR;
+  for (i = 0; i < req->nb_sectors; i++)
+  {
+    memcpy(&seg, req->buf + i * sizeof(seg), sizeof(seg));
+    if (seg.num_sectors > VIRTIO_BLK_MAX_DISCARD_SECTORS ||
+        block_device_out_of_range(seg.sector_num, seg.num_sectors, nb_sectors))
+      return VIRTIO_BLK_S_IOERR;
+    if (req->type == VIRTIO_BLK_T_DISCARD)
+    {
+      if (seg.flags)
+        return VIRTIO_BLK_S_UNSUPP;
+      ret = block_device_discard(bs, seg.sector_num, seg.num_sectors);
+    }
+    else
+    {
+      if (seg.flags & ~VIRTIO_BLK_WRITE_ZEROES_F_UNMAP)
+        return VIRTIO_BLK_S_UNSUPP;
+      ret = block_device_write_zeroes(bs, seg.sector_num, seg.num_sectors);
+    }
+    if (ret < 0)
+      return VIRTIO_BLK_S_IOERR;
+  }
+  return VIRTIO_BLK_S_OK;
+}
+
+/*
+ * Runs of same-direction requests on contiguous sectors go to the
+ * backend as one vectored operation over the request buffers; every
+ * request still gets its own status.
+ */
+static void virtual_block_run_batch(virtual_io_block_device_t *vbd, block_batch_t *batch)
+{
+  block_device_t *bs = vbd->bs;
+  block_request_t *reqs = batch->reqs;
+  struct iovec iov[VIRTIO_BLK_MAX_BATCH];
+  int i, j, k, total, ret;
+
+  for (i = 0; i < batch->count; i = j)
+  {
+    j = i + 1;
+    if (reqs[i].rejected)
+      continue;
+    switch(reqs[i].type)
+    {
+      case VIRTIO_BLK_T_IN:
+      case VIRTIO_BLK_T_OUT:
+        break;
+      case VIRTIO_BLK_T_FLUSH:
+        reqs[i].status = block_device_flush(bs) < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+        continue;
+      case VIRTIO_BLK_T_DISCARD:
+      case VIRTIO_BLK_T_WRITE_ZEROES:
+        reqs[i].status = virtual_block_zero_segments(bs, &reqs[i]);
+        continue;
+      default:
+        reqs[i].status = VIRTIO_BLK_S_UNSUPP;
+        continue;
+    }
+
+    total = reqs[i].nb_sectors;
+    for (; j < batch->count; j++)
+    {
+      if (reqs[j].rejected || reqs[j].type != reqs[i].type ||
+          reqs[j].sector_num != reqs[j - 1].sector_num + reqs[j - 1].nb_sectors ||
+          total + reqs[j].nb_sectors > VIRTIO_BLK_MAX_MERGE_SECTORS)
+        break;
+      total += reqs[j].nb_sectors;
+    }
+
+    for (k = i; k < j; k++)
+    {
+      iov[k - i].iov_base = reqs[k].buf;
+      iov[k - i].iov_len = reqs[k].nb_sectors * SECTOR_SIZE;
+    }
+    if (reqs[i].type == VIRTIO_BLK_T_IN)
+      ret = block_device_readv(bs, reqs[i].sector_num, iov, j - i);
+    else
+      ret = block_device_writev(bs, reqs[i].sector_num, iov, j - i);
+    vbd->backend_ops++;
+
+    for (k = i; k < j; k++)
+      reqs[k].status = ret < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+  }
+}
+
+void *virtual_block_io_thread(void *opaque)
+{
+  virtual_io_block_device_t *vbd = opaque;
+  block_batch_t *batch;
+  uint64_t kicks;
+  uint8_t c = 0;
+
+  for(;;)
+  {
+    while ((batch = io_ring_pop(&vbd->submit_ring)) != NULL)
+    {
+      virtual_block_run_batch(vbd, batch);
+      /* the main thread completes a batch before submitting past the ring size */
+      while (!io_ring_push(&vbd->done_ring, batch))
+        sched_yield();
+      if (write(vbd->wake_fd[1], &c, 1) < 0)
+        perror("virtio-blk wake");
+    }
+
+    /* announce the sleep, then look again so a racing submit is not missed */
+    __atomic_store_n(&vbd->io_sleeping, true, __ATOMIC_SEQ_CST);
+    if (io_ring_empty(&vbd->submit_ring))
+    {
+      if (read(vbd->kick_fd, &kicks, sizeof(kicks)) < 0)
+        perror("virtio-blk kick");
+    }
+    __atomic_store_n(&vbd->io_sleeping, false, __ATOMIC_SEQ_CST);
+  }
+  return NULL;
+}
+
+/* main thread: hand a gathered batch over and complete finished ones */
+static void virtual_block_submit(virtual_io_block_device_t *vbd)
+{
+  block_batch_t *batch = vbd->cur;
+  uint64_t kick = 1;
+
+  if (!batch)
+    return;
+  vbd->cur = NULL;
+  while (!io_ring_push(&vbd->submit_ring, batch))
+  {
+    /* every slot is in flight: make room by completing some */
+    sched_yield();
+    virtual_block_poll(vbd);
+  }
+  vbd->inflight++;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&vbd->io_sleeping, __ATOMIC_SEQ_CST) &&
+      write(vbd->kick_fd, &kick, sizeof(kick)) < 0)
+    perror("virtio-blk kick");
+}
+
+static void virtual_block_req_end(virtual_io_device_t *device, block_request_t *req)
+{
+  if (req->type == VIRTIO_BLK_T_IN && !req->rejected)
+  {
+    req->buf[req->write_size - 1] = req->status;
+    virtual_memcpy_to_queue(device, req->queue_idx, req->desc_idx, 0, req->buf, req->write_size);
+  }
+  else if (req->write_size >= 1)
+  {
+    virtual_memcpy_to_queue(device, req->queue_idx, req->desc_idx, req->write_size - 1, &req->status, 1);
+  }
+  virtual_push_used(device, req->queue_idx, req->desc_idx, max_int(req->write_size, 0));
+  free(req->buf);
+}
+
+void virtual_block_poll(virtual_io_block_device_t *vbd)
+{
+  block_batch_t *batch;
+  uint8_t buf[64];
+  int i;
+
+  if (io_ring_empty(&vbd->done_ring))
+    return;
+  while (read(vbd->wake_fd[0], buf, sizeof(buf)) > 0)
+    ;
+  while ((batch = io_ring_pop(&vbd->done_ring)) != NULL)
+  {
+    for (i = 0; i < batch->count; i++)
+      virtual_block_req_end(&vbd->common, &batch->reqs[i]);
+    free(batch);
+    vbd->inflight--;
+  }
+  virtual_publish_used(&vbd->common);
+}
+
+/* wait until the I/O thread has finished everything and complete it */
+void virtual_block_drain(virtual_io_block_device_t *vbd)
+{
+  struct pollfd pfd;
+
+  virtual_block_submit(vbd);
+  pfd.fd = vbd->wake_fd[0];
+  pfd.events = POLLIN;
+  while (vbd->inflight > 0)
+  {
+    if (io_ring_empty(&vbd->done_ring))
+      poll(&pfd, 1, -1);
+    virtual_block_poll(vbd);
+  }
+}
+
+void virtual_block_recv_done(virtual_io_device_t *device, int queue_idx)
+{
+  virtual_block_submit((virtual_io_block_device_t*)device);
 }
 
 int virtual_block_recv_request(virtual_io_device_t *device, int queue_idx,
     int desc_idx, int read_size, int write_size)
 {
   virtual_io_block_device_t *vbd = (virtual_io_block_device_t*)device;
-  block_device_t *bs = vbd->bs;
   block_request_header_t header;
-  uint8_t *buf = NULL;
-  int len, ret;
+  block_request_t *req;
+  int len;
 
-  if (vbd->req_in_progress)
-    return -1;
-  if (virtual_memcpy_from_queue(device, &header, queue_idx, desc_idx, 0, sizeof(header)) < 0)
+  vbd->requests++;
+
+  if (vbd->cur && vbd->cur->count == VIRTIO_BLK_MAX_BATCH)
+    virtual_block_submit(vbd);
+  if (!vbd->cur)
+  {
+    vbd->cur = malloc(sizeof(*vbd->cur));
+    assert(vbd->cur != NULL);
+    vbd->cur->count = 0;
+  }
+  req = &vbd->cur->reqs[vbd->cur->count++];
+  memset(req, 0, sizeof(*req));
+  req->queue_idx = queue_idx;
+  req->desc_idx = desc_idx;
+  req->write_size = write_size;
+
+  /*
+   * A malformed chain still goes through the batch, so that it is
+   * completed in order behind the requests in flight; it gets an error
+   * if it has room for a status byte.
+   */
+  if (write_size < 1 || read_size < (int)sizeof(header) ||
+      virtual_memcpy_from_queue(device, &header, queue_idx, desc_idx, 0, sizeof(header)) < 0)
+  {
+    req->rejected = true;
+    req->status = VIRTIO_BLK_S_IOERR;
     return 0;
-  vbd->req.type = header.type;
-  vbd->req.queue_idx = queue_idx;
-  vbd->req.desc_idx = desc_idx;
+  }
+  req->type = header.type;
+  req->sector_num = header.sector_num;
+
+  /* refuse transfers past the end before any buffer is set up for them */
+  if (header.type == VIRTIO_BLK_T_IN || header.type == VIRTIO_BLK_T_OUT)
+  {
+    len = header.type == VIRTIO_BLK_T_IN ? write_size - 1 : read_size - (int)sizeof(header);
+    if (block_device_out_of_range(header.sector_num, len / SECTOR_SIZE,
+          vbd->bs->get_sector_count(vbd->bs)))
+    {
+      req->rejected = true;
+      req->status = VIRTIO_BLK_S_IOERR;
+      return 0;
+    }
+  }
+
+  /* copy everything the I/O thread needs out of guest memory now */
   switch(header.type)
   {
     case VIRTIO_BLK_T_IN:
-      vbd->req.buf = malloc(write_size);
-      vbd->req.write_size = write_size;
-      ret = bs->read_async(bs, header.sector_num, vbd->req.buf, (write_size - 1) / SECTOR_SIZE, virtual_io_block_req_cb, device);
-      if (ret > 0)
-      {
-        vbd->req_in_progress = true;
-      }
-      else
-      {
-        virtual_block_req_end(device, ret);
-      }
+      req->nb_sectors = (write_size - 1) / SECTOR_SIZE;
+      req->buf = malloc(write_size);
+      assert(req->buf != NULL);
       break;
     case VIRTIO_BLK_T_OUT:
-      assert(write_size >= 1);
       len = read_size - sizeof(header);
-      buf = malloc(len);
-      assert(buf != NULL);
-      virtual_memcpy_from_queue(device, buf, queue_idx, desc_idx, sizeof(header), len);
-      ret = bs->write_async(bs, header.sector_num, buf, len / SECTOR_SIZE, virtual_io_block_req_cb, device);
-      free(buf);
-      if (ret > 0)
+      req->nb_sectors = len / SECTOR_SIZE;
+      req->buf = malloc(len);
+      assert(req->buf != NULL);
+      virtual_memcpy_from_queue(device, req->buf, queue_idx, desc_idx, sizeof(header), len);
+      break;
+    case VIRTIO_BLK_T_DISCARD:
+    case VIRTIO_BLK_T_WRITE_ZEROES:
+      len = read_size - sizeof(header);
+      req->nb_sectors = len / sizeof(block_discard_segment_t);
+      if (req->nb_sectors < 1 || req->nb_sectors > VIRTIO_BLK_MAX_DISCARD_SEG)
+        break;
+      req->buf = malloc(req->nb_sectors * sizeof(block_discard_segment_t));
+      assert(req->buf != NULL);
+      virtual_memcpy_from_queue(device, req->buf, queue_idx, desc_idx, sizeof(header),
+          req->nb_sectors * sizeof(block_discard_segment_t));
+      break;
+    default:
+      break;
+  }
+
+  return 0;
+}
+
+/* console: port 0 uses queues 0 and 1, the control queues come next, then port 1 */
+static int virtio_console_tx_port(int queue_idx)
+{
+  if (queue_idx == 1)
+    return 0;
+  if (queue_idx > VIRTIO_CONSOLE_CTRL_TX_Q && (queue_idx & 1))
+    return (queue_idx - 3) / 2;
+  return -1;
+}
+
+static void virtio_console_send_ctrl(virtio_console_device_t *vcd, uint32_t id, uint16_t event,
+    uint16_t value, const void *data, int len)
+{
+  uint8_t *msg;
+  int slot;
+
+  if (vcd->ctrl_count == VIRTIO_CONSOLE_MAX_CTRL)
+    return;
+  slot = (vcd->ctrl_first + vcd->ctrl_count++) % VIRTIO_CONSOLE_MAX_CTRL;
+  msg = vcd->ctrl[slot];
+  put_le32(msg, id);
+  put_le16(msg + 4, event);
+  put_le16(msg + 6, value);
+  if (len > 0)
+    memcpy(msg + VIRTIO_CONSOLE_CTRL_HDR_SIZE, data, len);
+  vcd->ctrl_len[slot] = VIRTIO_CONSOLE_CTRL_HDR_SIZE + len;
+}
+
+static void virtio_console_rx_ctrl(virtio_console_device_t *vcd)
+{
+  virtual_io_device_t *dev = &vcd->common;
+  queue_state_t *qs = &dev->queue[VIRTIO_CONSOLE_CTRL_RX_Q];
+  int desc_idx, read_size, write_size, len;
+
+  if (!qs->ready)
+    return;
+  while (vcd->ctrl_count > 0 &&
+      (desc_idx = virtual_next_avail(dev, VIRTIO_CONSOLE_CTRL_RX_Q)) >= 0)
+  {
+    len = vcd->ctrl_len[vcd->ctrl_first];
+    if (get_desc_rw_size(dev->cpu_state, dev, &read_size, &write_size,
+          VIRTIO_CONSOLE_CTRL_RX_Q, desc_idx) || write_size < len)
+      len = 0;
+    else
+      virtual_memcpy_to_queue(dev, VIRTIO_CONSOLE_CTRL_RX_Q, desc_idx, 0,
+          vcd->ctrl[vcd->ctrl_first], len);
+    virtual_pop_avail(dev, VIRTIO_CONSOLE_CTRL_RX_Q, desc_idx);
+    virtual_push_used(dev, VIRTIO_CONSOLE_CTRL_RX_Q, desc_idx, len);
+    vcd->ctrl_first = (vcd->ctrl_first + 1) % VIRTIO_CONSOLE_MAX_CTRL;
+    vcd->ctrl_count--;
+  }
+  virtual_update_avail_event(dev, qs);
+}
+
+static void virtio_console_send_size(virtio_console_device_t *vcd)
+{
+  uint8_t size[4];
+
+  /* rows first, the other way round from the config space */
+  put_le16(size, get_le16(vcd->common.config_space + 2));
+  put_le16(size + 2, get_le16(vcd->common.config_space));
+  virtio_console_send_ctrl(vcd, 0, VIRTIO_CONSOLE_RESIZE, 0, size, 4);
+}
+
+static void virtio_console_control(virtio_console_device_t *vcd, const uint8_t *msg)
+{
+  uint32_t id = get_le32(msg);
+  uint16_t event = get_le16(msg + 4);
+  uint16_t value = get_le16(msg + 6);
+  virtio_console_port_t *port;
+  int i;
+
+  switch (event)
+  {
+    case VIRTIO_CONSOLE_DEVICE_READY:
+      if (!value)
+        break;
+      /* a new driver, forget what the last one was told */
+      vcd->ctrl_count = 0;
+      for (i = 0; i < vcd->nr_ports; i++)
       {
-        vbd->req_in_progress = true;
+        vcd->ports[i].ready = false;
+        virtio_console_send_ctrl(vcd, i, VIRTIO_CONSOLE_DEVICE_ADD, 0, NULL, 0);
+      }
+      break;
+    case VIRTIO_CONSOLE_PORT_READY:
+      if (id >= vcd->nr_ports || !value)
+        break;
+      port = &vcd->ports[id];
+      port->ready = true;
+      if (port->name)
+      {
+        virtio_console_send_ctrl(vcd, id, VIRTIO_CONSOLE_PORT_NAME, 1, port->name,
+            strlen(port->name));
       }
       else
       {
-        virtual_block_req_end(device, ret);
+        virtio_console_send_ctrl(vcd, id, VIRTIO_CONSOLE_CONSOLE_PORT, 1, NULL, 0);
+        virtio_console_send_size(vcd);
       }
+      virtio_console_send_ctrl(vcd, id, VIRTIO_CONSOLE_PORT_OPEN, 1, NULL, 0);
+      break;
+    case VIRTIO_CONSOLE_PORT_OPEN:
+      /* the guest closed the port, nothing more will follow soon */
+      if (id < vcd->nr_ports && !value)
+        console_out_flush(&vcd->ports[id].out, false);
       break;
     default:
       break;
   }
-
-  return 0;
 }
 
-/* console */
+/* output is gathered straight from guest memory and written in batches */
 int virtio_console_recv_request(virtual_io_device_t * dev, int queue_idx, int desc_idx,
     int read_size, int write_size)
 {
-  virtio_console_device_t *dev1 = (virtio_console_device_t*)dev;
-  character_device_t *cs = dev1->cs;
-  uint8_t *buf;
+  virtio_console_device_t *vcd = (virtio_console_device_t*)dev;
+  struct iovec iov[VIRTIO_CONSOLE_MAX_IOV];
+  uint8_t msg[VIRTIO_CONSOLE_CTRL_HDR_SIZE];
+  console_out_t *out;
+  int port, count, pos, len;
 
-  if (queue_idx == 1)
+  if (queue_idx == VIRTIO_CONSOLE_CTRL_TX_Q)
   {
-    buf = malloc(read_size);
-    virtual_memcpy_from_queue(dev, buf, queue_idx, desc_idx, 0, read_size);
-    cs->write_data(cs->opaque, buf, read_size);
-    free(buf);
-    virtual_consume_desc(dev, queue_idx, desc_idx, 0);
+    if (read_size >= VIRTIO_CONSOLE_CTRL_HDR_SIZE &&
+        virtual_memcpy_from_queue(dev, msg, queue_idx, desc_idx, 0, sizeof(msg)) >= 0)
+      virtio_console_control(vcd, msg);
   }
+  else if ((port = virtio_console_tx_port(queue_idx)) >= 0 && port < vcd->nr_ports)
+  {
+    out = &vcd->ports[port].out;
+    count = virtual_queue_iov(dev, queue_idx, desc_idx, 0, read_size, false, iov,
+        VIRTIO_CONSOLE_MAX_IOV);
+    if (count >= 0)
+    {
+      console_out_write(out, iov, count);
+    }
+    else
+    {
+      for (pos = 0; pos < read_size; pos += len)
+      {
+        len = min_int(read_size - pos, VIRTIO_CONSOLE_OUT_BUF_SIZE);
+        if (virtual_memcpy_from_queue(dev, vcd->bounce, queue_idx, desc_idx, pos, len) < 0)
+          break;
+        iov[0].iov_base = vcd->bounce;
+        iov[0].iov_len = len;
+        console_out_write(out, iov, 1);
+      }
+    }
+  }
+  virtual_push_used(dev, queue_idx, desc_idx, 0);
   return 0;
 }
 
+void virtio_console_recv_done(virtual_io_device_t *dev, int queue_idx)
+{
+  virtio_console_rx_ctrl((virtio_console_device_t*)dev);
+  virtual_publish_used(dev);
+}
+
 int virtio_console_get_write_len(virtual_io_device_t *dev)
 {
   int queue_idx = 0;
   queue_state_t *qs = &dev->queue[queue_idx];
   int desc_idx;
   int read_size, write_size;
-  uint16_t avail_idx;
   
   if (!qs->ready)
     return 0;
-  iomap_manager.read(qs->avail_addr + 2, 2, (uint8_t*)&avail_idx);
-  if (qs->last_avail_idx == avail_idx)
+  desc_idx = virtual_next_avail(dev, queue_idx);
+  if (desc_idx < 0)
     return 0;
-  iomap_manager.read(qs->avail_addr + 4 + \
-                          (qs->last_avail_idx & (qs->num - 1)) * 2, 2, (uint8_t*)&desc_idx);
   if (get_desc_rw_size(dev->cpu_state, dev, &read_size, &write_size, queue_idx, desc_idx))
   {
     return 0;
@@ -712,14 +1737,12 @@ int virtio_console_get_write_len(virtual_io_device_t *dev)
 bool virtio_console_can_write_data(virtual_io_device_t *dev)
 {
   queue_state_t *qs = &dev->queue[0];
-  uint16_t avail_idx;
 
   if (!qs->ready)
   {
     return false;
   }
-  iomap_manager.read(qs->avail_addr + 2, 2, (uint8_t*)&avail_idx);
-  return qs->last_avail_idx != avail_idx;
+  return virtual_next_avail(dev, 0) >= 0;
 }
 
 int virtio_console_write_data(virtual_io_device_t *dev, const uint8_t *buf, int buf_len)
@@ -727,24 +1750,552 @@ int virtio_console_write_data(virtual_io_device_t *dev, const uint8_t *buf, int
   int queue_idx = 0;
   queue_state_t *qs = &dev->queue[queue_idx];
   int desc_idx;
-  uint16_t avail_idx;
 
   if (!qs->ready)
     return 0;
-  iomap_manager.read(qs->avail_addr + 2, 2, (uint8_t*)&avail_idx);
-  if (qs->last_avail_idx == avail_idx)
+  desc_idx = virtual_next_avail(dev, queue_idx);
+  if (desc_idx < 0)
     return 0;
-  iomap_manager.read(qs->avail_addr + 4 + \
-                           (qs->last_avail_idx & (qs->num - 1)) * 2, 2, (uint8_t*)&desc_idx);
   virtual_memcpy_to_queue(dev, queue_idx, desc_idx, 0, buf, buf_len);
+  virtual_pop_avail(dev, queue_idx, desc_idx);
   virtual_consume_desc(dev, queue_idx, desc_idx, buf_len);
-  qs->last_avail_idx++;
+  virtual_update_avail_event(dev, qs);
 
   return buf_len;
 }
 
+static void virtio_net_flush_tx(virtio_net_device_t *net)
+{
+  int i, sent;
+
+  if (!net->tx_count)
+    return;
+  sent = net_backend_send(&net->backend, net->tx_iov, net->tx_count);
+  for (i = 0; i < net->tx_count; i++)
+  {
+    if (i < sent)
+    {
+      net->tx_packets++;
+      net->tx_bytes += net->tx_iov[i].iov_len;
+    }
+    else
+    {
+      net->tx_dropped++;
+    }
+    free(net->tx_iov[i].iov_base);
+  }
+  net->tx_count = 0;
+}
+
+/* tx queue: frames are copied out now and sent as one batch per notify */
+int virtio_net_recv_request(virtual_io_device_t *device, int queue_idx,
+    int desc_idx, int read_size, int write_size)
+{
+  virtio_net_device_t *net = (virtio_net_device_t*)device;
+  struct iovec *iov;
+  int len;
+
+  if (queue_idx != 1)
+    return 0;
+  if (net->tx_count == VIRTIO_NET_BATCH)
+    virtio_net_flush_tx(net);
+  len = read_size - VIRTIO_NET_HDR_SIZE;
+  if (len > 0 && len <= VIRTIO_NET_MAX_FRAME)
+  {
+    iov = &net->tx_iov[net->tx_count++];
+    iov->iov_base = malloc(len);
+    assert(iov->iov_base != NULL);
+    iov->iov_len = len;
+    virtual_memcpy_from_queue(device, iov->iov_base, queue_idx, desc_idx, VIRTIO_NET_HDR_SIZE, len);
+  }
+  else
+  {
+    net->tx_dropped++;
+  }
+  virtual_push_used(device, queue_idx, desc_idx, 0);
+  return 0;
+}
+
+/*
+ * Put one frame, which has VIRTIO_NET_HDR_SIZE bytes of room in front
+ * of it, into the rx queue. With mergeable buffers it may span several
+ * chains; they are only taken once the whole frame fits. Returns false
+ * when the driver has not posted enough buffers yet.
+ */
+static bool virtio_net_put_frame(virtio_net_device_t *net, uint8_t *data, int len)
+{
+  virtual_io_device_t *device = &net->common;
+  queue_state_t *qs = &device->queue[0];
+  uint16_t saved_idx = qs->last_avail_idx;
+  bool saved_wrap = qs->avail_wrap_counter;
+  bool mergeable = (device->driver_features & VIRTIO_NET_F_MRG_RXBUF) != 0;
+  uint8_t *frame = data - VIRTIO_NET_HDR_SIZE;
+  int heads[VIRTIO_NET_MAX_RX_BUFS], sizes[VIRTIO_NET_MAX_RX_BUFS];
+  int total = len + VIRTIO_NET_HDR_SIZE;
+  int i, n, pos, desc_idx, read_size, write_size;
+
+  for (n = 0, pos = 0; pos < total; pos += sizes[n++])
+  {
+    desc_idx = -1;
+    if (n < VIRTIO_NET_MAX_RX_BUFS && (n == 0 || mergeable))
+    {
+      desc_idx = virtual_next_avail(device, 0);
+      if (desc_idx < 0)
+      {
+        qs->last_avail_idx = saved_idx;
+        qs->avail_wrap_counter = saved_wrap;
+        return false;
+      }
+    }
+    if (desc_idx < 0 ||
+        get_desc_rw_size(device->cpu_state, device, &read_size, &write_size, 0, desc_idx) < 0 ||
+        write_size <= 0)
+    {
+      /* no buffer layout the driver offers can take this frame */
+      qs->last_avail_idx = saved_idx;
+      qs->avail_wrap_counter = saved_wrap;
+      net->rx_dropped++;
+      return true;
+    }
+    heads[n] = desc_idx;
+    sizes[n] = min_int(write_size, total - pos);
+    virtual_pop_avail(device, 0, desc_idx);
+  }
+
+  memset(frame, 0, VIRTIO_NET_HDR_SIZE);
+  put_le16(frame + 10, n); /* num_buffers */
+  for (i = 0, pos = 0; i < n; pos += sizes[i++])
+  {
+    virtual_memcpy_to_queue(device, 0, heads[i], 0, frame + pos, sizes[i]);
+    virtual_push_used(device, 0, heads[i], sizes[i]);
+  }
+  net->rx_packets++;
+  net->rx_bytes += len;
+  return true;
+}
+
+static void virtio_net_deliver(virtio_net_device_t *net)
+{
+  queue_state_t *qs = &net->common.queue[0];
+
+  if (!qs->ready)
+    return;
+  while (net->rx_pending > 0)
+  {
+    if (!virtio_net_put_frame(net, net->rx_data[net->rx_first], net->rx_len[net->rx_first]))
+      break;
+    net->rx_first++;
+    net->rx_pending--;
+  }
+  /* ask for a kick as soon as more buffers are posted */
+  virtual_update_avail_event(&net->common, qs);
+}
+
+void virtio_net_recv_done(virtual_io_device_t *device, int queue_idx)
+{
+  virtio_net_device_t *net = (virtio_net_device_t*)device;
+
+  if (queue_idx == 0)
+    virtio_net_deliver(net);
+  else if (queue_idx == 1)
+    virtio_net_flush_tx(net);
+  virtual_publish_used(device);
+}
+
+/* frames are only read from the backend once the last batch is in */
+bool virtio_net_can_receive(virtio_net_device_t *net)
+{
+  return net->common.queue[0].ready && net->rx_pending == 0;
+}
+
+void virtio_net_poll(virtio_net_device_t *net)
+{
+  int n;
+
+  if (!virtio_net_can_receive(net))
+    return;
+  n = net_backend_recv(&net->backend, net->rx_data, net->rx_len, VIRTIO_NET_BATCH);
+  if (n <= 0)
+    return;
+  net->rx_first = 0;
+  net->rx_pending = n;
+  virtio_net_deliver(net);
+  virtual_publish_used(&net->common);
+}
+
+/*
+ * 9p: the request is copied in up to its payload, and read and write
+ * payloads are handed to the server as iovecs into the guest buffers.
+ */
+int virtio_9p_recv_request(virtual_io_device_t *device, int queue_idx,
+    int desc_idx, int read_size, int write_size)
+{
+  virtio_9p_device_t *p9 = (virtio_9p_device_t*)device;
+  struct iovec iov[VIRTIO_9P_MAX_IOV];
+  p9_buf_t req, reply;
+  int type, len, count, iov_count = 0;
+
+  len = min_int(read_size, p9->msize);
+  if (len < P9_HDR_SIZE || write_size < P9_RLERROR_SIZE ||
+      virtual_memcpy_from_queue(device, p9->req_buf, queue_idx, desc_idx, 0, P9_HDR_SIZE) < 0)
+  {
+    virtual_push_used(device, queue_idx, desc_idx, 0);
+    return 0;
+  }
+  type = p9->req_buf[4];
+  if (type == P9_TWRITE)
+    len = min_int(len, P9_TWRITE_HDR_SIZE);
+  virtual_memcpy_from_queue(device, p9->req_buf, queue_idx, desc_idx, 0, len);
+
+  if (type == P9_TREAD && len >= P9_TREAD_SIZE)
+  {
+    count = min_int(write_size, p9->msize) - P9_RREAD_HDR_SIZE;
+    if (get_le32(p9->req_buf + 19) < count)
+      count = get_le32(p9->req_buf + 19);
+    iov_count = virtual_queue_iov(device, queue_idx, desc_idx, P9_RREAD_HDR_SIZE,
+        count, true, iov, VIRTIO_9P_MAX_IOV);
+  }
+  else if (type == P9_TWRITE && len == P9_TWRITE_HDR_SIZE)
+  {
+    count = read_size - P9_TWRITE_HDR_SIZE;
+    if (get_le32(p9->req_buf + 19) < count)
+      count = get_le32(p9->req_buf + 19);
+    iov_count = virtual_queue_iov(device, queue_idx, desc_idx, P9_TWRITE_HDR_SIZE,
+        count, false, iov, VIRTIO_9P_MAX_IOV);
+  }
+
+  req.data = p9->req_buf;
+  req.pos = P9_HDR_SIZE;
+  req.size = len;
+  req.error = false;
+  reply.data = p9->reply_buf;
+  reply.pos = 0;
+  reply.size = min_int(write_size, p9->msize);
+  reply.error = false;
+  len = virtio_9p_handle(p9, type, &req, &reply, iov, iov_count);
+  virtual_memcpy_to_queue(device, queue_idx, desc_idx, 0, p9->reply_buf, reply.pos);
+  virtual_push_used(device, queue_idx, desc_idx, len);
+  return 0;
+}
+
+void virtio_9p_recv_done(virtual_io_device_t *device, int queue_idx)
+{
+  virtual_publish_used(device);
+}
+
+/* balloon: inflated pages are released in runs of adjacent pages */
+static void virtio_balloon_inflate(virtio_balloon_device_t *vb, const uint32_t *pfns, int count)
+{
+  int page_size = 1 << VIRTIO_BALLOON_PAGE_SHIFT;
+  uint8_t *run = NULL, *ptr;
+  size_t run_len = 0;
+  int i;
+
+  for (i = 0; i < count; i++)
+  {
+    ptr = iomap_manager.get_ram_ptr((uint64_t)pfns[i] << VIRTIO_BALLOON_PAGE_SHIFT, page_size);
+    if (!ptr)
+      continue;
+    vb->inflated_pages++;
+    if (run && ptr == run + run_len)
+    {
+      run_len += page_size;
+      continue;
+    }
+    if (run)
+      virtio_balloon_release(vb, run, run_len);
+    run = ptr;
+    run_len = page_size;
+  }
+  if (run)
+    virtio_balloon_release(vb, run, run_len);
+}
+
+int virtio_balloon_recv_request(virtual_io_device_t *device, int queue_idx,
+    int desc_idx, int read_size, int write_size)
+{
+  virtio_balloon_device_t *vb = (virtio_balloon_device_t*)device;
+  uint32_t pfns[VIRTIO_BALLOON_MAX_PFNS];
+  struct iovec iov[VIRTIO_BALLOON_MAX_IOV];
+  int i, n, pos;
+
+  switch (queue_idx)
+  {
+    case VIRTIO_BALLOON_INFLATE_Q:
+      for (pos = 0; pos + 4 <= read_size; pos += n * 4)
+      {
+        n = min_int((read_size - pos) / 4, VIRTIO_BALLOON_MAX_PFNS);
+        if (virtual_memcpy_from_queue(device, pfns, queue_idx, desc_idx, pos, n * 4) < 0)
+          break;
+        virtio_balloon_inflate(vb, pfns, n);
+      }
+      break;
+    case VIRTIO_BALLOON_DEFLATE_Q:
+      /* released pages fault back in as zeroes, nothing to do */
+      vb->deflated_pages += read_size / 4;
+      break;
+    case VIRTIO_BALLOON_REPORTING_Q:
+      /* each buffer of the chain is one free range of guest memory */
+      n = virtual_queue_iov(device, queue_idx, desc_idx, 0, write_size, true, iov,
+          VIRTIO_BALLOON_MAX_IOV);
+      for (i = 0; i < n; i++)
+      {
+        vb->reported_bytes += iov[i].iov_len;
+        virtio_balloon_release(vb, iov[i].iov_base, iov[i].iov_len);
+      }
+      break;
+    default:
+      break;
+  }
+  virtual_push_used(device, queue_idx, desc_idx, 0);
+  return 0;
+}
+
+void virtio_balloon_recv_done(virtual_io_device_t *device, int queue_idx)
+{
+  virtual_publish_used(device);
+}
+
+/* vsock: control packets and socket data share the rx queue */
+bool virtio_vsock_can_receive(virtio_vsock_device_t *vs)
+{
+  virtual_io_device_t *device = &vs->common;
+
+  return device->queue[VIRTIO_VSOCK_RX_Q].ready &&
+    virtual_next_avail(device, VIRTIO_VSOCK_RX_Q) >= 0;
+}
+
+/* take the next rx chain if it can hold a header, -1 if there is none */
+static int virtio_vsock_rx_chain(virtio_vsock_device_t *vs, int *write_size)
+{
+  virtual_io_device_t *device = &vs->common;
+  int desc_idx, read_size;
+
+  if (!device->queue[VIRTIO_VSOCK_RX_Q].ready)
+    return -1;
+  for (;;)
+  {
+    desc_idx = virtual_next_avail(device, VIRTIO_VSOCK_RX_Q);
+    if (desc_idx < 0)
+      return -1;
+    if (!get_desc_rw_size(device->cpu_state, device, &read_size, write_size,
+          VIRTIO_VSOCK_RX_Q, desc_idx) && *write_size >= VIRTIO_VSOCK_HDR_SIZE)
+      return desc_idx;
+    /* hand back chains no packet fits in */
+    virtual_pop_avail(device, VIRTIO_VSOCK_RX_Q, desc_idx);
+    virtual_push_used(device, VIRTIO_VSOCK_RX_Q, desc_idx, 0);
+  }
+}
+
+static void virtio_vsock_rx_put(virtio_vsock_device_t *vs, int desc_idx,
+    const vsock_hdr_t *hdr)
+{
+  virtual_io_device_t *device = &vs->common;
+  uint8_t buf[VIRTIO_VSOCK_HDR_SIZE];
+
+  vsock_hdr_encode(buf, hdr);
+  virtual_memcpy_to_queue(device, VIRTIO_VSOCK_RX_Q, desc_idx, 0, buf, VIRTIO_VSOCK_HDR_SIZE);
+  virtual_pop_avail(device, VIRTIO_VSOCK_RX_Q, desc_idx);
+  virtual_push_used(device, VIRTIO_VSOCK_RX_Q, desc_idx, VIRTIO_VSOCK_HDR_SIZE + hdr->len);
+}
+
+void virtio_vsock_rx_ctrl(virtio_vsock_device_t *vs)
+{
+  int desc_idx, write_size;
+
+  while (vs->ctrl_count > 0)
+  {
+    desc_idx = virtio_vsock_rx_chain(vs, &write_size);
+    if (desc_idx < 0)
+      break;
+    virtio_vsock_rx_put(vs, desc_idx, &vs->ctrl[vs->ctrl_first]);
+    vs->ctrl_first = (vs->ctrl_first + 1) % VIRTIO_VSOCK_MAX_CTRL;
+    vs->ctrl_count--;
+  }
+  virtual_update_avail_event(&vs->common, &vs->common.queue[VIRTIO_VSOCK_RX_Q]);
+}
+
+/*
+ * Read from the connection's socket straight into the next rx buffer,
+ * behind the header. Returns the bytes read, 0 if nothing could be read
+ * now (host_done is set at end of file), or -1 if the socket failed.
+ */
+int virtio_vsock_rx_data(virtio_vsock_device_t *vs, vsock_conn_t *conn)
+{
+  virtual_io_device_t *device = &vs->common;
+  struct iovec iov[VIRTIO_VSOCK_MAX_IOV];
+  vsock_hdr_t hdr;
+  int desc_idx, write_size, len, iov_count;
+  ssize_t ret;
+
+  /* control packets, a RESPONSE above all, go ahead of data */
+  if (vs->ctrl_count > 0)
+    virtio_vsock_rx_ctrl(vs);
+  desc_idx = virtio_vsock_rx_chain(vs, &write_size);
+  if (desc_idx < 0)
+    return 0;
+  len = min_int(write_size - VIRTIO_VSOCK_HDR_SIZE, VIRTIO_VSOCK_MAX_PKT);
+  len = min_int(len, conn->peer_buf_alloc - (conn->rx_cnt - conn->peer_fwd_cnt));
+  if (len <= 0)
+    return 0;
+
+  iov_count = virtual_queue_iov(device, VIRTIO_VSOCK_RX_Q, desc_idx, VIRTIO_VSOCK_HDR_SIZE,
+      len, true, iov, VIRTIO_VSOCK_MAX_IOV);
+  if (iov_count > 0)
+    ret = readv(conn->fd, iov, iov_count);
+  else
+    ret = read(conn->fd, vs->bounce, len);
+  if (ret < 0)
+    return errno == EAGAIN ? 0 : -1;
+  if (ret == 0)
+  {
+    conn->host_done = true;
+    return 0;
+  }
+  if (iov_count <= 0)
+    virtual_memcpy_to_queue(device, VIRTIO_VSOCK_RX_Q, desc_idx, VIRTIO_VSOCK_HDR_SIZE,
+        vs->bounce, ret);
+
+  vsock_fill_hdr(vs, conn, &hdr, VIRTIO_VSOCK_OP_RW, 0, ret);
+  virtio_vsock_rx_put(vs, desc_idx, &hdr);
+  conn->rx_cnt += ret;
+  vs->rx_bytes += ret;
+  return ret;
+}
+
+/* one tx packet, payload written from guest memory */
+static void virtio_vsock_tx_packet(virtio_vsock_device_t *vs, int queue_idx,
+    int desc_idx, int read_size)
+{
+  virtual_io_device_t *device = &vs->common;
+  uint8_t buf[VIRTIO_VSOCK_HDR_SIZE];
+  struct iovec iov[VIRTIO_VSOCK_MAX_IOV];
+  vsock_conn_t *conn;
+  vsock_hdr_t hdr;
+  int len, iov_count;
+
+  if (read_size < VIRTIO_VSOCK_HDR_SIZE ||
+      virtual_memcpy_from_queue(device, buf, queue_idx, desc_idx, 0, VIRTIO_VSOCK_HDR_SIZE) < 0)
+    return;
+  vsock_hdr_decode(&hdr, buf);
+  if (hdr.type != VIRTIO_VSOCK_TYPE_STREAM || hdr.dst_cid != VIRTIO_VSOCK_HOST_CID ||
+      hdr.src_cid != vs->guest_cid)
+  {
+    vsock_send_rst(vs, &hdr);
+    return;
+  }
+
+  conn = vsock_conn_find(vs, hdr.dst_port, hdr.src_port);
+  if (!conn)
+  {
+    if (hdr.op == VIRTIO_VSOCK_OP_REQUEST)
+      vsock_guest_connect(vs, &hdr);
+    else
+      vsock_send_rst(vs, &hdr);
+    return;
+  }
+  /* every packet carries the guest's receive credit */
+  conn->peer_buf_alloc = hdr.buf_alloc;
+  conn->peer_fwd_cnt = hdr.fwd_cnt;
+
+  switch (hdr.op)
+  {
+    case VIRTIO_VSOCK_OP_RESPONSE:
+      if (conn->state == VSOCK_CONNECTING)
+        vsock_guest_accepted(vs, conn);
+      else
+        vsock_conn_reset(vs, conn);
+      break;
+    case VIRTIO_VSOCK_OP_RW:
+      len = min_int(hdr.len, read_size - VIRTIO_VSOCK_HDR_SIZE);
+      if (conn->state != VSOCK_CONNECTED || conn->guest_send_done)
+      {
+        vsock_conn_reset(vs, conn);
+        break;
+      }
+      if (len <= 0)
+        break;
+      iov_count = virtual_queue_iov(device, queue_idx, desc_idx, VIRTIO_VSOCK_HDR_SIZE,
+          len, false, iov, VIRTIO_VSOCK_MAX_IOV);
+      if (iov_count < 0)
+      {
+        len = min_int(len, VIRTIO_VSOCK_MAX_PKT);
+        virtual_memcpy_from_queue(device, vs->bounce, queue_idx, desc_idx,
+            VIRTIO_VSOCK_HDR_SIZE, len);
+        iov[0].iov_base = vs->bounce;
+        iov[0].iov_len = len;
+        iov_count = 1;
+      }
+      vsock_conn_write(vs, conn, iov, iov_count);
+      break;
+    case VIRTIO_VSOCK_OP_SHUTDOWN:
+      vsock_guest_shutdown(vs, conn, hdr.flags);
+      break;
+    case VIRTIO_VSOCK_OP_RST:
+      vsock_conn_free(vs, conn);
+      break;
+    case VIRTIO_VSOCK_OP_CREDIT_REQUEST:
+      vsock_send_ctrl(vs, conn, VIRTIO_VSOCK_OP_CREDIT_UPDATE, 0);
+      break;
+    case VIRTIO_VSOCK_OP_CREDIT_UPDATE:
+      break;
+    default:
+      vsock_conn_reset(vs, conn);
+      break;
+  }
+}
+
+/* tx queue: one packet per chain */
+int virtio_vsock_recv_request(virtual_io_device_t *device, int queue_idx,
+    int desc_idx, int read_size, int write_size)
+{
+  if (queue_idx != VIRTIO_VSOCK_TX_Q)
+    return 0;
+  virtio_vsock_tx_packet((virtio_vsock_device_t*)device, queue_idx, desc_idx, read_size);
+  /* only once the chain has been read: a packed ring reuses its head slot */
+  virtual_push_used(device, queue_idx, desc_idx, 0);
+  return 0;
+}
+
+/* replies to a batch of tx packets and newly posted rx buffers both go out here */
+void virtio_vsock_recv_done(virtual_io_device_t *device, int queue_idx)
+{
+  virtio_vsock_rx_ctrl((virtio_vsock_device_t*)device);
+  virtual_publish_used(device);
+}
+
+/* pmem: the data path is the mapping itself, the queue only flushes */
+int virtio_pmem_recv_request(virtual_io_device_t *device, int queue_idx,
+    int desc_idx, int read_size, int write_size)
+{
+  virtio_pmem_device_t *pm = (virtio_pmem_device_t*)device;
+  uint8_t buf[4];
+  uint32_t ret = 1;
+
+  if (read_size >= 4 && write_size >= 4 &&
+      virtual_memcpy_from_queue(device, buf, queue_idx, desc_idx, 0, 4) >= 0)
+  {
+    if (get_le32(buf) == VIRTIO_PMEM_REQ_FLUSH && virtio_pmem_flush(pm) == 0)
+      ret = 0;
+    put_le32(buf, ret);
+    virtual_memcpy_to_queue(device, queue_idx, desc_idx, 0, buf, 4);
+    virtual_push_used(device, queue_idx, desc_idx, 4);
+  }
+  else
+  {
+    virtual_push_used(device, queue_idx, desc_idx, 0);
+  }
+  return 0;
+}
+
+void virtio_pmem_recv_done(virtual_io_device_t *device, int queue_idx)
+{
+  virtual_publish_used(device);
+}
+
 void virtio_console_resize_event(virtual_io_device_t *dev, int width, int height)
 {
+  virtio_console_device_t *vcd = (virtio_console_device_t*)dev;
   uint8_t *ptr = dev->config_space + 0;  
   ptr[0] = width;
   ptr[1] = width >> 8;
@@ -752,6 +2303,17 @@ void virtio_console_resize_event(virtual_io_device_t *dev, int width, int height
   ptr[0] = height;
   ptr[1] = height >> 8;
 
+  /* multiport drivers only take sizes from control messages */
+  if (dev->driver_features & VIRTIO_CONSOLE_F_MULTIPORT)
+  {
+    if (vcd->ports[0].ready)
+    {
+      virtio_console_send_size(vcd);
+      virtio_console_rx_ctrl(vcd);
+      virtual_publish_used(dev);
+    }
+    return;
+  }
   dev->int_status |= 2;
   set_irq(dev->irq, 1);
 }
@@ -770,12 +2332,30 @@ void virtio_init(cpu_state_t *state, address_item_t *handler,
   device->cpu_state = state;
   device->device_recv = device_recv;
   handler->entity = (void*)device;
-  handler->start_address = bus->addr;
-  handler->size = VIRTIO_PAGE_SIZE;
-  handler->read_bytes = virtual_mmio_read;
-  handler->write_bytes = virtual_mmio_write;
-  iomap_manager.register_address(state, handler);
+  if (bus->pci_bus)
+  {
+    virtio_pci_init(device, bus->pci_bus, handler->name);
+  }
+  else
+  {
+    handler->start_address = bus->addr;
+    handler->size = VIRTIO_PAGE_SIZE;
+    handler->read_bytes = virtual_mmio_read;
+    handler->write_bytes = virtual_mmio_write;
+    iomap_manager.register_address(state, handler);
+  }
+  device->queue_num_max = VIRTIO_DEFAULT_QUEUE_NUM;
   virtual_io_reset(device);
 }
 
+/* called by device init code before the driver sees the device */
+void virtio_set_queue_num_max(virtual_io_device_t *device, uint32_t num)
+{
+  int i;
+
+  device->queue_num_max = num;
+  for (i = 0; i < MAX_QUEUE; i++)
+    device->queue[i].num = num;
+}
+
 
@@ -1,7 +1,9 @@
 #ifndef __VIRTIO_INTERFACE_H__
 #define __VIRTIO_INTERFACE_H__
+#include <sys/uio.h>
 #include "regs.h"
 #include "iomap.h"
+#include "pci.h"
 
 #define VIRTIO_PAGE_SIZE 4096
  /* MMIO addresses - from the Linux kernel */
@@ -60,24 +62,171 @@
 #define VIRTIO_PCI_NOTIFY_OFFSET       0x3000
 
 #define VIRTIO_PCI_CAP_LEN 16
+#define VIRTIO_PCI_NOTIFY_CAP_LEN 20
+#define VIRTIO_PCI_BAR_SIZE 0x4000
+
+/* vendor specific capability types */
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG    3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+#define VIRTIO_PCI_VENDOR_ID      0x1af4
+#define VIRTIO_PCI_DEVICE_ID_BASE 0x1040 /* plus the virtio device id */
+#define VIRTIO_MSI_NO_VECTOR      0xffff
 
 #define MAX_QUEUE 8
 #define MAX_CONFIG_SPACE_SIZE 256
-#define MAX_QUEUE_NUM 16 
+/* largest queue a device may offer, and what it offers unless configured */
+#define MAX_QUEUE_NUM 1024
+#define VIRTIO_DEFAULT_QUEUE_NUM 256
 
 #define VRING_DESC_F_NEXT	1
 #define VRING_DESC_F_WRITE	2
 #define VRING_DESC_F_INDIRECT	4
 
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+
+/* packed ring descriptor flags and event suppression modes */
+#define VRING_PACKED_DESC_F_AVAIL (1 << 7)
+#define VRING_PACKED_DESC_F_USED  (1 << 15)
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 1
+#define VRING_PACKED_EVENT_FLAG_DESC    2
+
+/* ring features offered by every device */
+#define VIRTIO_RING_F_INDIRECT_DESC (1 << 28)
+#define VIRTIO_RING_F_EVENT_IDX (1 << 29)
+#define VIRTIO_F_VERSION_1 ((uint64_t)1 << 32)
+#define VIRTIO_F_RING_PACKED ((uint64_t)1 << 34)
+
 #define VIRTIO_BLK_T_IN          0
 #define VIRTIO_BLK_T_OUT         1
 #define VIRTIO_BLK_T_FLUSH       4
 #define VIRTIO_BLK_T_FLUSH_OUT   5
+#define VIRTIO_BLK_T_DISCARD     11
+#define VIRTIO_BLK_T_WRITE_ZEROES 13
 
 #define VIRTIO_BLK_S_OK     0
 #define VIRTIO_BLK_S_IOERR  1
 #define VIRTIO_BLK_S_UNSUPP 2
 
+#define VIRTIO_BLK_F_FLUSH        (1 << 9)
+#define VIRTIO_BLK_F_DISCARD      (1 << 13)
+#define VIRTIO_BLK_F_WRITE_ZEROES (1 << 14)
+
+#define VIRTIO_BLK_WRITE_ZEROES_F_UNMAP 1
+
+/* config space up to and including write_zeroes_may_unmap */
+#define VIRTIO_BLK_CONFIG_SIZE 60
+#define VIRTIO_BLK_MAX_DISCARD_SECTORS (1 << 22)
+#define VIRTIO_BLK_MAX_DISCARD_SEG 32
+
+/* reads and writes gathered per notify, and the largest merged operation */
+#define VIRTIO_BLK_MAX_BATCH 64
+#define VIRTIO_BLK_MAX_MERGE_SECTORS 2048
+
+#define VIRTIO_NET_F_MAC       (1 << 5)
+#define VIRTIO_NET_F_MRG_RXBUF (1 << 15)
+#define VIRTIO_NET_F_STATUS    (1 << 16)
+
+#define VIRTIO_NET_S_LINK_UP 1
+
+/* mac and status */
+#define VIRTIO_NET_CONFIG_SIZE 8
+/* the version 1 header always carries num_buffers */
+#define VIRTIO_NET_HDR_SIZE 12
+#define VIRTIO_NET_MAX_FRAME 65536
+/* frames moved per backend call, and rx buffers one frame may span */
+#define VIRTIO_NET_BATCH 64
+#define VIRTIO_NET_MAX_RX_BUFS 64
+
+#define VIRTIO_9P_F_MOUNT_TAG 1
+
+/* tag_len and the tag */
+#define VIRTIO_9P_MAX_TAG 64
+#define VIRTIO_9P_CONFIG_SIZE (2 + VIRTIO_9P_MAX_TAG)
+/* largest message size offered to the driver */
+#define VIRTIO_9P_MAX_MSIZE (512 * 1024)
+/* guest buffer pieces one read or write payload may span */
+#define VIRTIO_9P_MAX_IOV 256
+
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM (1 << 2)
+#define VIRTIO_BALLOON_F_REPORTING      (1 << 5)
+
+/* without the stats and free page hint queues, reporting comes third */
+#define VIRTIO_BALLOON_INFLATE_Q   0
+#define VIRTIO_BALLOON_DEFLATE_Q   1
+#define VIRTIO_BALLOON_REPORTING_Q 2
+
+/* num_pages and actual, in 4 KiB pages */
+#define VIRTIO_BALLOON_CONFIG_SIZE 8
+#define VIRTIO_BALLOON_PAGE_SHIFT 12
+/* page numbers read per copy, and ranges in one report */
+#define VIRTIO_BALLOON_MAX_PFNS 256
+#define VIRTIO_BALLOON_MAX_IOV 64
+
+#define VIRTIO_VSOCK_RX_Q    0
+#define VIRTIO_VSOCK_TX_Q    1
+#define VIRTIO_VSOCK_EVENT_Q 2
+
+#define VIRTIO_VSOCK_HOST_CID    2
+#define VIRTIO_VSOCK_TYPE_STREAM 1
+
+#define VIRTIO_VSOCK_OP_REQUEST        1
+#define VIRTIO_VSOCK_OP_RESPONSE       2
+#define VIRTIO_VSOCK_OP_RST            3
+#define VIRTIO_VSOCK_OP_SHUTDOWN       4
+#define VIRTIO_VSOCK_OP_RW             5
+#define VIRTIO_VSOCK_OP_CREDIT_UPDATE  6
+#define VIRTIO_VSOCK_OP_CREDIT_REQUEST 7
+
+#define VIRTIO_VSOCK_SHUTDOWN_RCV  1
+#define VIRTIO_VSOCK_SHUTDOWN_SEND 2
+
+/* guest_cid */
+#define VIRTIO_VSOCK_CONFIG_SIZE 8
+#define VIRTIO_VSOCK_HDR_SIZE 44
+/* guest to host bytes a connection buffers, advertised as buf_alloc */
+#define VIRTIO_VSOCK_BUF_SIZE (256 * 1024)
+/* largest payload put in one rx buffer */
+#define VIRTIO_VSOCK_MAX_PKT (64 * 1024)
+#define VIRTIO_VSOCK_MAX_IOV 64
+/* control packets waiting for rx buffers */
+#define VIRTIO_VSOCK_MAX_CTRL 256
+
+#define VIRTIO_CONSOLE_F_SIZE      (1 << 0)
+#define VIRTIO_CONSOLE_F_MULTIPORT (1 << 1)
+
+/* cols, rows and max_nr_ports */
+#define VIRTIO_CONSOLE_CONFIG_SIZE 8
+/* every port takes a queue pair, and so do the control queues */
+#define VIRTIO_CONSOLE_MAX_PORTS (MAX_QUEUE / 2 - 1)
+#define VIRTIO_CONSOLE_CTRL_RX_Q 2
+#define VIRTIO_CONSOLE_CTRL_TX_Q 3
+
+#define VIRTIO_CONSOLE_DEVICE_READY  0
+#define VIRTIO_CONSOLE_DEVICE_ADD    1
+#define VIRTIO_CONSOLE_DEVICE_REMOVE 2
+#define VIRTIO_CONSOLE_PORT_READY    3
+#define VIRTIO_CONSOLE_CONSOLE_PORT  4
+#define VIRTIO_CONSOLE_RESIZE        5
+#define VIRTIO_CONSOLE_PORT_OPEN     6
+#define VIRTIO_CONSOLE_PORT_NAME     7
+
+/* id, event and value; a name or a size may follow */
+#define VIRTIO_CONSOLE_CTRL_HDR_SIZE 8
+#define VIRTIO_CONSOLE_MAX_NAME 31
+#define VIRTIO_CONSOLE_CTRL_MAX_LEN (VIRTIO_CONSOLE_CTRL_HDR_SIZE + VIRTIO_CONSOLE_MAX_NAME)
+#define VIRTIO_CONSOLE_MAX_CTRL 32
+/* output a port gathers before it must write */
+#define VIRTIO_CONSOLE_OUT_BUF_SIZE (64 * 1024)
+#define VIRTIO_CONSOLE_MAX_IOV 64
+
+/* start and size of the guest physical window, both le64 */
+#define VIRTIO_PMEM_CONFIG_SIZE 16
+#define VIRTIO_PMEM_REQ_FLUSH 0
+
 typedef struct virtual_io_device virtual_io_device_t;
 typedef int virtual_io_device_recieve_func(virtual_io_device_t *device, int queue_index, int desc_index, int read_size, int write_size);
 
@@ -90,6 +239,14 @@ typedef struct
   uint16_t next;
 } virtual_io_desc_t;
 
+typedef struct
+{
+  uint64_t addr;
+  uint32_t len;
+  uint16_t id;
+  uint16_t flags;
+} virtual_io_packed_desc_t;
+
 typedef struct
 {
   bool ready; /* 0 or 1 */
@@ -98,17 +255,46 @@ typedef struct
   uint64_t desc_addr;
   uint64_t avail_addr;
   uint64_t used_addr;
+  /* host views of the three areas, valid while the queue is ready */
+  uint8_t *desc_ptr;
+  uint8_t *avail_ptr;
+  uint8_t *used_ptr;
   bool manual_recv; /* if true, the device_recv() callback is not called */
+  /* used elements written but not yet published to the driver */
+  uint16_t used_pending;
+  uint16_t shadow_used_idx; /* split: used index after the pending elements */
+  uint16_t pending_flags_slot; /* packed: first pending slot, flagged last */
+  uint16_t pending_flags;
+  uint16_t signalled_used; /* used index at the last interrupt decision */
+  bool signalled_used_valid;
+
+  /*
+   * Packed ring only. Chains are handed to devices by the slot of their
+   * first descriptor; the buffer id and the chain length are kept per
+   * slot until the chain is used. Devices complete chains in the order
+   * they were made available, so a used element never overwrites a
+   * chain that is still being read.
+   */
+  bool avail_wrap_counter;
+  bool used_wrap_counter;
+  bool signalled_used_wrap;
+  uint16_t used_idx;
+  uint16_t packed_id[MAX_QUEUE_NUM];
+  uint16_t packed_ndesc[MAX_QUEUE_NUM];
 } queue_state_t;
 
 
 typedef struct
 {
   uint32_t type;
+  uint64_t sector_num;
+  int nb_sectors; /* segment count for discard and write zeroes */
   uint8_t *buf;
   int write_size;
   int queue_idx;
   int desc_idx;
+  uint8_t status;
+  bool rejected; /* status set when gathered; the I/O thread skips it */
 } block_request_t;
 
 typedef struct
@@ -118,6 +304,14 @@ typedef struct
   uint64_t sector_num;
 } block_request_header_t;
 
+/* payload of discard and write zeroes requests */
+typedef struct
+{
+  uint64_t sector_num;
+  uint32_t num_sectors;
+  uint32_t flags;
+} block_discard_segment_t;
+
 
 struct virtual_io_device
 {
@@ -126,7 +320,10 @@ struct virtual_io_device
   uint32_t int_status;
   uint32_t status;
   uint32_t device_features_select;
+  uint32_t driver_features_select;
+  uint64_t driver_features;
   uint32_t queue_select;
+  uint32_t queue_num_max;
   queue_state_t queue[MAX_QUEUE];
   cpu_state_t *cpu_state;
 
@@ -135,29 +332,60 @@ struct virtual_io_device
   uint32_t vendor_id;
   uint32_t device_features;
   virtual_io_device_recieve_func *device_recv;
+  /* optional, called once a notify has handed over every available chain */
+  void (*device_recv_done)(virtual_io_device_t *device, int queue_idx);
   void (*config_write)(virtual_io_device_t *device);
 
   uint32_t config_space_size;
   uint8_t config_space[MAX_CONFIG_SPACE_SIZE];
+
+  pci_device_t *pci_dev; /* NULL on virtio-mmio */
+
+  uint64_t notify_count;
+  uint64_t irq_count;
 };
 
 typedef struct
 {
   uint64_t addr;
   irq_signal_t *irq;
+  pci_bus_t *pci_bus; /* if set, devices go on this bus instead of virtio-mmio */
 } virtual_io_bus_t;
 
 extern bool virtio_console_can_write_data(virtual_io_device_t *dev);
 extern int virtual_block_recv_request(virtual_io_device_t *device, int queue_idx,
     int desc_idx, int read_size, int write_size);
+extern void virtual_block_recv_done(virtual_io_device_t *device, int queue_idx);
 extern int virtio_console_recv_request(virtual_io_device_t * dev, int queue_idx,
     int desc_idx, int read_size, int write_size);
+extern void virtio_console_recv_done(virtual_io_device_t *device, int queue_idx);
+extern int virtio_net_recv_request(virtual_io_device_t *device, int queue_idx,
+    int desc_idx, int read_size, int write_size);
+extern void virtio_net_recv_done(virtual_io_device_t *device, int queue_idx);
+extern int virtio_9p_recv_request(virtual_io_device_t *device, int queue_idx,
+    int desc_idx, int read_size, int write_size);
+extern void virtio_9p_recv_done(virtual_io_device_t *device, int queue_idx);
+extern int virtio_balloon_recv_request(virtual_io_device_t *device, int queue_idx,
+    int desc_idx, int read_size, int write_size);
+extern void virtio_balloon_recv_done(virtual_io_device_t *device, int queue_idx);
+extern int virtio_vsock_recv_request(virtual_io_device_t *device, int queue_idx,
+    int desc_idx, int read_size, int write_size);
+extern void virtio_vsock_recv_done(virtual_io_device_t *device, int queue_idx);
+extern int virtio_pmem_recv_request(virtual_io_device_t *device, int queue_idx,
+    int desc_idx, int read_size, int write_size);
+extern void virtio_pmem_recv_done(virtual_io_device_t *device, int queue_idx);
 extern void virtio_init(cpu_state_t *state, address_item_t *handler,
     virtual_io_device_t *device,
     virtual_io_bus_t *bus, uint32_t device_id, 
     int config_space_size,
     virtual_io_device_recieve_func *device_recv);
 
+extern void virtio_set_queue_num_max(virtual_io_device_t *device, uint32_t num);
+extern void virtual_push_used(virtual_io_device_t *device, int queue_idx, int desc_idx, int desc_len);
+extern void virtual_publish_used(virtual_io_device_t *device);
+extern int virtual_queue_iov(virtual_io_device_t *device, int queue_idx, int desc_idx,
+    int offset, int count, bool to_queue, struct iovec *iov, int max_iov);
+
 extern int virtio_console_get_write_len(virtual_io_device_t *dev);
 extern int virtio_console_write_data(virtual_io_device_t *dev, const uint8_t *buf, int buf_len);
 extern void virtio_console_resize_event(virtual_io_device_t *dev, int width, int height);
@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+#include "virtio_net_device.h"
+#include "virtio_interface.h"
+#include "machine.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include "cutils.h"
+
+int net_init(address_item_t *handler)
+{
+  return true;
+}
+
+void net_release(address_item_t *handler)
+{
+  virtio_net_device_t *net = (virtio_net_device_t*)handler->entity;
+  free(net);
+}
+
+address_item_t net_item =
+{
+  .name = "network",
+  .init = net_init,
+  .release = net_release
+};
+
+static void net_backend_open_tap(net_backend_t *nb, const char *ifname)
+{
+  struct ifreq ifr;
+
+  nb->fd = open("/dev/net/tun", O_RDWR);
+  if (nb->fd < 0)
+  {
+    perror("/dev/net/tun");
+    exit(1);
+  }
+  memset(&ifr, 0, sizeof(ifr));
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+  if (ioctl(nb->fd, TUNSETIFF, &ifr) < 0)
+  {
+    perror("TUNSETIFF");
+    exit(1);
+  }
+  nb->is_socket = false;
+}
+
+static void net_backend_open_unix(net_backend_t *nb, const char *spec)
+{
+  struct sockaddr_un local;
+  const char *peer;
+
+  peer = strchr(spec, ':');
+  if (!peer || peer == spec || !peer[1] ||
+      peer - spec >= sizeof(local.sun_path) || strlen(peer + 1) >= sizeof(nb->peer.sun_path))
+  {
+    printf("network backend: expected unix:LOCAL:PEER\n");
+    exit(1);
+  }
+  memset(&local, 0, sizeof(local));
+  local.sun_family = AF_UNIX;
+  memcpy(local.sun_path, spec, peer - spec);
+  memset(&nb->peer, 0, sizeof(nb->peer));
+  nb->peer.sun_family = AF_UNIX;
+  strcpy(nb->peer.sun_path, peer + 1);
+
+  nb->fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (nb->fd < 0)
+  {
+    perror("socket");
+    exit(1);
+  }
+  unlink(local.sun_path);
+  if (bind(nb->fd, (struct sockaddr*)&local, sizeof(local)) < 0)
+  {
+    perror(local.sun_path);
+    exit(1);
+  }
+  nb->is_socket = true;
+}
+
+static void net_backend_open(net_backend_t *nb, const char *spec)
+{
+  if (!strncmp(spec, "tap:", 4))
+  {
+    net_backend_open_tap(nb, spec + 4);
+  }
+  else if (!strncmp(spec, "unix:", 5))
+  {
+    net_backend_open_unix(nb, spec + 5);
+  }
+  else
+  {
+    printf("unknown network backend: %s\n", spec);
+    exit(1);
+  }
+  fcntl(nb->fd, F_SETFL, O_NONBLOCK);
+}
+
+/* returns how many of the frames went out; the rest are dropped */
+int net_backend_send(net_backend_t *nb, struct iovec *iov, int count)
+{
+  struct mmsghdr msgs[VIRTIO_NET_BATCH];
+  int i, ret, sent;
+
+  if (!nb->is_socket)
+  {
+    for (i = 0; i < count; i++)
+    {
+      if (write(nb->fd, iov[i].iov_base, iov[i].iov_len) < 0)
+        break;
+    }
+    return i;
+  }
+
+  memset(msgs, 0, count * sizeof(msgs[0]));
+  for (i = 0; i < count; i++)
+  {
+    msgs[i].msg_hdr.msg_name = &nb->peer;
+    msgs[i].msg_hdr.msg_namelen = sizeof(nb->peer);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  for (sent = 0; sent < count; sent += ret)
+  {
+    ret = sendmmsg(nb->fd, msgs + sent, count - sent, 0);
+    if (ret <= 0)
+      break;
+  }
+  return sent;
+}
+
+/* read up to count frames without blocking, returns how many */
+int net_backend_recv(net_backend_t *nb, uint8_t **bufs, int *lens, int count)
+{
+  struct mmsghdr msgs[VIRTIO_NET_BATCH];
+  struct iovec iov[VIRTIO_NET_BATCH];
+  int i, ret;
+
+  if (!nb->is_socket)
+  {
+    for (i = 0; i < count; i++)
+    {
+      ret = read(nb->fd, bufs[i], VIRTIO_NET_MAX_FRAME);
+      if (ret <= 0)
+        break;
+      lens[i] = ret;
+    }
+    return i;
+  }
+
+  memset(msgs, 0, count * sizeof(msgs[0]));
+  for (i = 0; i < count; i++)
+  {
+    iov[i].iov_base = bufs[i];
+    iov[i].iov_len = VIRTIO_NET_MAX_FRAME;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  ret = recvmmsg(nb->fd, msgs, count, MSG_DONTWAIT, NULL);
+  for (i = 0; i < ret; i++)
+    lens[i] = msgs[i].msg_len;
+  return max_int(ret, 0);
+}
+
+void virtio_net_device_init(cpu_state_t *state, const virtio_net_config_t *config,
+    virtual_io_bus_t *bus)
+{
+  virtio_net_device_t *net;
+  int i;
+
+  net = malloc(sizeof(*net));
+  memset(net, 0, sizeof(*net));
+  net->name = config->backend;
+  net_backend_open(&net->backend, config->backend);
+  for (i = 0; i < VIRTIO_NET_BATCH; i++)
+  {
+    net->rx_buf[i] = malloc(VIRTIO_NET_HDR_SIZE + VIRTIO_NET_MAX_FRAME);
+    if (!net->rx_buf[i])
+    {
+      printf("virtio-net: malloc error\n");
+      exit(1);
+    }
+    net->rx_data[i] = net->rx_buf[i] + VIRTIO_NET_HDR_SIZE;
+  }
+
+  net->item = net_item;
+  virtio_init(state, &net->item, &net->common, bus, 1, VIRTIO_NET_CONFIG_SIZE, virtio_net_recv_request);
+  net->common.device_features = VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS;
+  net->common.device_recv_done = virtio_net_recv_done;
+  /* rx buffers are filled when frames arrive, not when they are posted */
+  net->common.queue[0].manual_recv = true;
+  memcpy(net->common.config_space, config->mac, 6);
+  put_le16(net->common.config_space + 6, VIRTIO_NET_S_LINK_UP);
+
+  net->start_ms = get_time_ms();
+  riscv_machine.net = net;
+}
+
+void virtio_net_print_stats(virtio_net_device_t *net, FILE *f)
+{
+  uint64_t ms = get_time_ms() - net->start_ms;
+  double secs = (ms ? ms : 1) / 1000.0;
+
+  fprintf(f, "virtio-net %s: rx %" PRIu64 " packets (%.0f/s, %.1f KiB/s), %" PRIu64 " dropped; "
+      "tx %" PRIu64 " packets (%.0f/s, %.1f KiB/s), %" PRIu64 " dropped; "
+      "%" PRIu64 " notifies, %" PRIu64 " interrupts\n",
+      net->name,
+      net->rx_packets, net->rx_packets / secs, net->rx_bytes / secs / 1024, net->rx_dropped,
+      net->tx_packets, net->tx_packets / secs, net->tx_bytes / secs / 1024, net->tx_dropped,
+      net->common.notify_count, net->common.irq_count);
+}
@@ -0,0 +1,65 @@
+#ifndef __VIRTIO_NET_H__
+#define __VIRTIO_NET_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "virtio_interface.h"
+#include "riscv_definations.h"
+
+typedef struct
+{
+  /* "tap:IFNAME" or "unix:LOCAL:PEER", one Ethernet frame per datagram */
+  const char *backend;
+  uint8_t mac[6];
+} virtio_net_config_t;
+
+/*
+ * The backend is a file descriptor that carries one frame per read and
+ * write: a tap device, or a UNIX datagram socket bound to LOCAL that
+ * sends to PEER. Sockets move whole batches with sendmmsg/recvmmsg.
+ */
+typedef struct
+{
+  int fd;
+  bool is_socket;
+  struct sockaddr_un peer;
+} net_backend_t;
+
+typedef struct virtio_net_device
+{
+  virtual_io_device_t common;
+  address_item_t item;
+  net_backend_t backend;
+  const char *name;
+
+  /* frames gathered from the tx queue during one notify */
+  struct iovec tx_iov[VIRTIO_NET_BATCH];
+  int tx_count;
+
+  /*
+   * Frames read from the backend, each behind room for its header so
+   * it goes to the guest in one piece. The rx_pending frames from
+   * rx_first on still wait for buffers.
+   */
+  uint8_t *rx_buf[VIRTIO_NET_BATCH];
+  uint8_t *rx_data[VIRTIO_NET_BATCH];
+  int rx_len[VIRTIO_NET_BATCH];
+  int rx_pending;
+  int rx_first;
+
+  uint64_t start_ms;
+  uint64_t rx_packets, rx_bytes, rx_dropped;
+  uint64_t tx_packets, tx_bytes, tx_dropped;
+} virtio_net_device_t;
+
+extern void virtio_net_device_init(cpu_state_t *state, const virtio_net_config_t *config,
+    virtual_io_bus_t *bus);
+extern bool virtio_net_can_receive(virtio_net_device_t *net);
+extern void virtio_net_poll(virtio_net_device_t *net);
+extern int net_backend_send(net_backend_t *nb, struct iovec *iov, int count);
+extern int net_backend_recv(net_backend_t *nb, uint8_t **bufs, int *lens, int count);
+extern void virtio_net_print_stats(virtio_net_device_t *net, FILE *f);
+#endif
@@ -0,0 +1,127 @@
+#include "virtio_pmem_device.h"
+#include "virtio_interface.h"
+#include "memory.h"
+#include "machine.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cutils.h"
+
+/* Linux hot-plugs device memory in 2 MiB subsections */
+#define PMEM_ALIGN (2 << 20)
+
+int pmem_init(address_item_t *handler)
+{
+  return true;
+}
+
+void pmem_release(address_item_t *handler)
+{
+  virtio_pmem_device_t *pm = (virtio_pmem_device_t*)handler->entity;
+
+  close(pm->fd);
+  free(pm);
+}
+
+address_item_t pmem_item =
+{
+  .name = "pmem",
+  .init = pmem_init,
+  .release = pmem_release
+};
+
+static void pmem_window_release(address_item_t *handler)
+{
+  munmap(handler->entity, handler->size);
+}
+
+int virtio_pmem_flush(virtio_pmem_device_t *pm)
+{
+  pm->flushes++;
+  /* stores went straight into the page cache, only the disk lags behind */
+  if (pm->readonly || fdatasync(pm->fd) == 0)
+    return 0;
+  pm->flush_errors++;
+  return -1;
+}
+
+void virtio_pmem_device_init(cpu_state_t *state, const virtio_pmem_config_t *config,
+    virtual_io_bus_t *bus)
+{
+  virtio_pmem_device_t *pm;
+  struct stat st;
+  uint64_t window_size;
+  uint8_t *window;
+
+  pm = malloc(sizeof(*pm));
+  memset(pm, 0, sizeof(*pm));
+  pm->path = config->path;
+  pm->readonly = config->readonly;
+
+  pm->fd = open(config->path, config->readonly ? O_RDONLY : O_RDWR);
+  if (pm->fd < 0)
+  {
+    perror(config->path);
+    exit(1);
+  }
+  if (fstat(pm->fd, &st) < 0)
+  {
+    perror(config->path);
+    exit(1);
+  }
+  pm->file_size = st.st_size;
+  window_size = (pm->file_size + PMEM_ALIGN - 1) & ~(uint64_t)(PMEM_ALIGN - 1);
+  if (window_size == 0 || window_size > PMEM_MAX_SIZE)
+  {
+    printf("pmem file %s must be non-empty and at most %d MiB\n", config->path,
+        PMEM_MAX_SIZE >> 20);
+    exit(1);
+  }
+
+  /*
+   * Reserve the whole window first so the tail past the end of the file
+   * reads as zeroes instead of faulting, then map the file over it.
+   */
+  window = mmap(NULL, window_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (window == MAP_FAILED ||
+      mmap(window, pm->file_size, PROT_READ | PROT_WRITE,
+        (config->readonly ? MAP_PRIVATE : MAP_SHARED) | MAP_FIXED, pm->fd, 0) == MAP_FAILED)
+  {
+    perror("mmap");
+    exit(1);
+  }
+
+  /* registered first so it is released before the device frees pm */
+  pm->mem_item.name = "pmem window";
+  pm->mem_item.start_address = PMEM_BASE_ADDR;
+  pm->mem_item.size = window_size;
+  pm->mem_item.entity = window;
+  pm->mem_item.ram = true;
+  pm->mem_item.read_bytes = memory_read;
+  pm->mem_item.write_bytes = memory_write;
+  pm->mem_item.release = pmem_window_release;
+  iomap_manager.register_address(state, &pm->mem_item);
+
+  pm->item = pmem_item;
+  virtio_init(state, &pm->item, &pm->common, bus, 27, VIRTIO_PMEM_CONFIG_SIZE,
+      virtio_pmem_recv_request);
+  pm->common.device_recv_done = virtio_pmem_recv_done;
+  put_le64(pm->common.config_space, PMEM_BASE_ADDR);
+  put_le64(pm->common.config_space + 8, window_size);
+
+  riscv_machine.pmem = pm;
+}
+
+void virtio_pmem_print_stats(virtio_pmem_device_t *pm, FILE *f)
+{
+  fprintf(f, "virtio-pmem %s: %" PRIu64 " MiB%s, %" PRIu64 " flushes, %" PRIu64 " failed, "
+      "%" PRIu64 " notifies, %" PRIu64 " interrupts\n",
+      pm->path, pm->file_size >> 20, pm->readonly ? " read-only" : "", pm->flushes,
+      pm->flush_errors, pm->common.notify_count, pm->common.irq_count);
+}
@@ -0,0 +1,39 @@
+#ifndef __VIRTIO_PMEM_H__
+#define __VIRTIO_PMEM_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "virtio_interface.h"
+#include "riscv_definations.h"
+
+typedef struct
+{
+  const char *path;
+  bool readonly; /* guest writes stay in private pages, the file is untouched */
+} virtio_pmem_config_t;
+
+/*
+ * A host file mapped straight into guest physical memory at
+ * PMEM_BASE_ADDR. Guest loads and stores reach the host page cache
+ * without any request going through the queue; the queue only carries
+ * flushes, which sync the file.
+ */
+typedef struct virtio_pmem_device
+{
+  virtual_io_device_t common;
+  address_item_t item;
+  address_item_t mem_item; /* the window, entity is the mapping */
+  const char *path;
+  int fd;
+  bool readonly;
+  uint64_t file_size;
+
+  uint64_t flushes;
+  uint64_t flush_errors;
+} virtio_pmem_device_t;
+
+extern void virtio_pmem_device_init(cpu_state_t *state, const virtio_pmem_config_t *config,
+    virtual_io_bus_t *bus);
+extern int virtio_pmem_flush(virtio_pmem_device_t *pm);
+extern void virtio_pmem_print_stats(virtio_pmem_device_t *pm, FILE *f);
+#endif
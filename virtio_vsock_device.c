@@ -0,0 +1,491 @@
+#include "virtio_vsock_device.h"
+#include "virtio_interface.h"
+#include "machine.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "cutils.h"
+
+/* host ports handed out to host initiated connections, as firecracker does */
+#define VSOCK_FIRST_HOST_PORT (1u << 30)
+
+int vsock_init(address_item_t *handler)
+{
+  return true;
+}
+
+void vsock_release(address_item_t *handler)
+{
+  virtio_vsock_device_t *vs = (virtio_vsock_device_t*)handler->entity;
+
+  while (vs->conns)
+    vsock_conn_free(vs, vs->conns);
+  if (vs->listen_fd >= 0)
+  {
+    close(vs->listen_fd);
+    unlink(vs->path);
+  }
+  free(vs->bounce);
+  free(vs);
+}
+
+address_item_t vsock_item =
+{
+  .name = "vsock",
+  .init = vsock_init,
+  .release = vsock_release
+};
+
+void vsock_hdr_decode(vsock_hdr_t *hdr, const uint8_t *buf)
+{
+  hdr->src_cid = get_le64(buf);
+  hdr->dst_cid = get_le64(buf + 8);
+  hdr->src_port = get_le32(buf + 16);
+  hdr->dst_port = get_le32(buf + 20);
+  hdr->len = get_le32(buf + 24);
+  hdr->type = get_le16(buf + 28);
+  hdr->op = get_le16(buf + 30);
+  hdr->flags = get_le32(buf + 32);
+  hdr->buf_alloc = get_le32(buf + 36);
+  hdr->fwd_cnt = get_le32(buf + 40);
+}
+
+void vsock_hdr_encode(uint8_t *buf, const vsock_hdr_t *hdr)
+{
+  put_le64(buf, hdr->src_cid);
+  put_le64(buf + 8, hdr->dst_cid);
+  put_le32(buf + 16, hdr->src_port);
+  put_le32(buf + 20, hdr->dst_port);
+  put_le32(buf + 24, hdr->len);
+  put_le16(buf + 28, hdr->type);
+  put_le16(buf + 30, hdr->op);
+  put_le32(buf + 32, hdr->flags);
+  put_le32(buf + 36, hdr->buf_alloc);
+  put_le32(buf + 40, hdr->fwd_cnt);
+}
+
+/* a host to guest header for conn; it also tells the guest our credit */
+void vsock_fill_hdr(virtio_vsock_device_t *vs, vsock_conn_t *conn, vsock_hdr_t *hdr,
+    uint16_t op, uint32_t flags, uint32_t len)
+{
+  hdr->src_cid = VIRTIO_VSOCK_HOST_CID;
+  hdr->dst_cid = vs->guest_cid;
+  hdr->src_port = conn->host_port;
+  hdr->dst_port = conn->guest_port;
+  hdr->len = len;
+  hdr->type = VIRTIO_VSOCK_TYPE_STREAM;
+  hdr->op = op;
+  hdr->flags = flags;
+  hdr->buf_alloc = VIRTIO_VSOCK_BUF_SIZE;
+  hdr->fwd_cnt = conn->fwd_cnt;
+  conn->last_fwd_cnt = conn->fwd_cnt;
+}
+
+static vsock_conn_t *vsock_conn_new(virtio_vsock_device_t *vs, int fd, vsock_state_enum state)
+{
+  vsock_conn_t *conn = malloc(sizeof(*conn));
+
+  assert(conn != NULL);
+  memset(conn, 0, sizeof(*conn));
+  conn->fd = fd;
+  conn->state = state;
+  conn->next = vs->conns;
+  vs->conns = conn;
+  vs->connections++;
+  return conn;
+}
+
+vsock_conn_t *vsock_conn_find(virtio_vsock_device_t *vs, uint32_t host_port, uint32_t guest_port)
+{
+  vsock_conn_t *conn;
+
+  for (conn = vs->conns; conn; conn = conn->next)
+  {
+    if (conn->state != VSOCK_HANDSHAKE &&
+        conn->host_port == host_port && conn->guest_port == guest_port)
+      return conn;
+  }
+  return NULL;
+}
+
+void vsock_conn_free(virtio_vsock_device_t *vs, vsock_conn_t *conn)
+{
+  vsock_conn_t **pc;
+
+  for (pc = &vs->conns; *pc != conn; pc = &(*pc)->next)
+    ;
+  *pc = conn->next;
+  close(conn->fd);
+  free(conn->tx_buf);
+  free(conn);
+}
+
+void vsock_send_ctrl(virtio_vsock_device_t *vs, vsock_conn_t *conn, uint16_t op, uint32_t flags)
+{
+  vsock_hdr_t *hdr;
+
+  if (vs->ctrl_count == VIRTIO_VSOCK_MAX_CTRL)
+    return;
+  hdr = &vs->ctrl[(vs->ctrl_first + vs->ctrl_count++) % VIRTIO_VSOCK_MAX_CTRL];
+  vsock_fill_hdr(vs, conn, hdr, op, flags, 0);
+}
+
+/* reset whatever the guest addressed with to, connection or not */
+void vsock_send_rst(virtio_vsock_device_t *vs, const vsock_hdr_t *to)
+{
+  vsock_hdr_t *hdr;
+
+  if (to->op == VIRTIO_VSOCK_OP_RST || vs->ctrl_count == VIRTIO_VSOCK_MAX_CTRL)
+    return;
+  hdr = &vs->ctrl[(vs->ctrl_first + vs->ctrl_count++) % VIRTIO_VSOCK_MAX_CTRL];
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->src_cid = to->dst_cid;
+  hdr->dst_cid = to->src_cid;
+  hdr->src_port = to->dst_port;
+  hdr->dst_port = to->src_port;
+  hdr->type = VIRTIO_VSOCK_TYPE_STREAM;
+  hdr->op = VIRTIO_VSOCK_OP_RST;
+  vs->resets++;
+}
+
+void vsock_conn_reset(virtio_vsock_device_t *vs, vsock_conn_t *conn)
+{
+  if (conn->state != VSOCK_HANDSHAKE)
+  {
+    vsock_send_ctrl(vs, conn, VIRTIO_VSOCK_OP_RST, 0);
+    vs->resets++;
+  }
+  vsock_conn_free(vs, conn);
+}
+
+/* the guest connects to host port P: open "path_P" */
+void vsock_guest_connect(virtio_vsock_device_t *vs, const vsock_hdr_t *hdr)
+{
+  struct sockaddr_un addr;
+  vsock_conn_t *conn;
+  int fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s_%u", vs->path, hdr->dst_port);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+  {
+    if (fd >= 0)
+      close(fd);
+    vsock_send_rst(vs, hdr);
+    return;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  conn = vsock_conn_new(vs, fd, VSOCK_CONNECTED);
+  conn->host_port = hdr->dst_port;
+  conn->guest_port = hdr->src_port;
+  conn->peer_buf_alloc = hdr->buf_alloc;
+  conn->peer_fwd_cnt = hdr->fwd_cnt;
+  vsock_send_ctrl(vs, conn, VIRTIO_VSOCK_OP_RESPONSE, 0);
+}
+
+/* the guest accepted a host initiated connection */
+void vsock_guest_accepted(virtio_vsock_device_t *vs, vsock_conn_t *conn)
+{
+  char reply[32];
+  int len;
+
+  len = snprintf(reply, sizeof(reply), "OK %u\n", conn->host_port);
+  conn->state = VSOCK_CONNECTED;
+  if (send(conn->fd, reply, len, MSG_NOSIGNAL) != len)
+    vsock_conn_reset(vs, conn);
+}
+
+/* once both sides are done the connection goes away */
+static bool vsock_conn_check_done(virtio_vsock_device_t *vs, vsock_conn_t *conn)
+{
+  if (conn->tx_len > 0)
+    return false;
+  if (conn->guest_send_done && conn->guest_recv_done)
+  {
+    vsock_conn_reset(vs, conn);
+    return true;
+  }
+  if (conn->guest_send_done)
+    shutdown(conn->fd, SHUT_WR);
+  return false;
+}
+
+void vsock_guest_shutdown(virtio_vsock_device_t *vs, vsock_conn_t *conn, uint32_t flags)
+{
+  if (flags & VIRTIO_VSOCK_SHUTDOWN_SEND)
+    conn->guest_send_done = true;
+  if (flags & VIRTIO_VSOCK_SHUTDOWN_RCV)
+    conn->guest_recv_done = true;
+  vsock_conn_check_done(vs, conn);
+}
+
+/* tell the guest about freed buffer space before it runs out of credit */
+static void vsock_conn_forwarded(virtio_vsock_device_t *vs, vsock_conn_t *conn, int len)
+{
+  conn->fwd_cnt += len;
+  vs->tx_bytes += len;
+  if (conn->fwd_cnt - conn->last_fwd_cnt >= VIRTIO_VSOCK_BUF_SIZE / 4)
+    vsock_send_ctrl(vs, conn, VIRTIO_VSOCK_OP_CREDIT_UPDATE, 0);
+}
+
+/*
+ * Guest data goes straight to the socket; what it does not take waits
+ * in tx_buf, which the guest's credit keeps from overflowing. Sockets
+ * are written with MSG_NOSIGNAL so a vanished peer is an error, not a
+ * SIGPIPE.
+ */
+void vsock_conn_write(virtio_vsock_device_t *vs, vsock_conn_t *conn,
+    const struct iovec *iov, int iov_count)
+{
+  struct msghdr msg;
+  ssize_t ret = 0;
+  size_t skip, len;
+  int i;
+
+  if (conn->tx_len == 0)
+  {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec*)iov;
+    msg.msg_iovlen = iov_count;
+    ret = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+    if (ret < 0 && errno != EAGAIN)
+    {
+      vsock_conn_reset(vs, conn);
+      return;
+    }
+    ret = max_int(ret, 0);
+    vsock_conn_forwarded(vs, conn, ret);
+  }
+
+  skip = ret;
+  for (i = 0; i < iov_count; i++)
+  {
+    if (skip >= iov[i].iov_len)
+    {
+      skip -= iov[i].iov_len;
+      continue;
+    }
+    len = iov[i].iov_len - skip;
+    if (conn->tx_len + len > VIRTIO_VSOCK_BUF_SIZE)
+    {
+      /* the guest ignored our credit */
+      vsock_conn_reset(vs, conn);
+      return;
+    }
+    if (!conn->tx_buf)
+    {
+      conn->tx_buf = malloc(VIRTIO_VSOCK_BUF_SIZE);
+      assert(conn->tx_buf != NULL);
+    }
+    if (conn->tx_start + conn->tx_len + len > VIRTIO_VSOCK_BUF_SIZE)
+    {
+      memmove(conn->tx_buf, conn->tx_buf + conn->tx_start, conn->tx_len);
+      conn->tx_start = 0;
+    }
+    memcpy(conn->tx_buf + conn->tx_start + conn->tx_len, (uint8_t*)iov[i].iov_base + skip, len);
+    conn->tx_len += len;
+    skip = 0;
+  }
+}
+
+/* returns false if the connection went away */
+static bool vsock_conn_flush(virtio_vsock_device_t *vs, vsock_conn_t *conn)
+{
+  ssize_t ret;
+
+  ret = send(conn->fd, conn->tx_buf + conn->tx_start, conn->tx_len, MSG_NOSIGNAL);
+  if (ret < 0)
+  {
+    if (errno == EAGAIN)
+      return true;
+    vsock_conn_reset(vs, conn);
+    return false;
+  }
+  conn->tx_start += ret;
+  conn->tx_len -= ret;
+  if (conn->tx_len == 0)
+    conn->tx_start = 0;
+  vsock_conn_forwarded(vs, conn, ret);
+  return !vsock_conn_check_done(vs, conn);
+}
+
+static void vsock_accept(virtio_vsock_device_t *vs)
+{
+  int fd = accept(vs->listen_fd, NULL, NULL);
+
+  if (fd < 0)
+    return;
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  vsock_conn_new(vs, fd, VSOCK_HANDSHAKE);
+}
+
+/* read the client's "CONNECT <port>\n" a byte at a time, nothing may follow it */
+static void vsock_handshake(virtio_vsock_device_t *vs, vsock_conn_t *conn)
+{
+  unsigned int port;
+  ssize_t ret;
+  char c;
+
+  for (;;)
+  {
+    ret = read(conn->fd, &c, 1);
+    if (ret < 0 && errno == EAGAIN)
+      return;
+    if (ret <= 0 || conn->line_len == sizeof(conn->line) - 1)
+    {
+      vsock_conn_free(vs, conn);
+      return;
+    }
+    if (c == '\n')
+      break;
+    conn->line[conn->line_len++] = c;
+  }
+  conn->line[conn->line_len] = '\0';
+  if (sscanf(conn->line, "CONNECT %u", &port) != 1)
+  {
+    vsock_conn_free(vs, conn);
+    return;
+  }
+  conn->state = VSOCK_CONNECTING;
+  conn->host_port = vs->next_port++;
+  conn->guest_port = port;
+  vsock_send_ctrl(vs, conn, VIRTIO_VSOCK_OP_REQUEST, 0);
+}
+
+/* does conn have data to give the guest, and room for it there */
+static bool vsock_conn_wants_rx(vsock_conn_t *conn)
+{
+  return conn->state == VSOCK_CONNECTED && !conn->host_done && !conn->guest_recv_done &&
+    conn->rx_cnt - conn->peer_fwd_cnt < conn->peer_buf_alloc;
+}
+
+int virtio_vsock_set_fds(virtio_vsock_device_t *vs, fd_set *rfds, fd_set *wfds, int fd_max)
+{
+  bool can_receive = virtio_vsock_can_receive(vs);
+  vsock_conn_t *conn;
+
+  FD_SET(vs->listen_fd, rfds);
+  fd_max = max_int(fd_max, vs->listen_fd);
+  for (conn = vs->conns; conn; conn = conn->next)
+  {
+    if (conn->state == VSOCK_HANDSHAKE || (can_receive && vsock_conn_wants_rx(conn)))
+    {
+      FD_SET(conn->fd, rfds);
+      fd_max = max_int(fd_max, conn->fd);
+    }
+    if (conn->tx_len > 0)
+    {
+      FD_SET(conn->fd, wfds);
+      fd_max = max_int(fd_max, conn->fd);
+    }
+  }
+  return fd_max;
+}
+
+void virtio_vsock_poll(virtio_vsock_device_t *vs, fd_set *rfds, fd_set *wfds)
+{
+  vsock_conn_t *conn, *next;
+  int ret;
+
+  for (conn = vs->conns; conn; conn = next)
+  {
+    next = conn->next;
+    if (FD_ISSET(conn->fd, wfds) && !vsock_conn_flush(vs, conn))
+      continue;
+    if (!FD_ISSET(conn->fd, rfds))
+      continue;
+    if (conn->state == VSOCK_HANDSHAKE)
+    {
+      vsock_handshake(vs, conn);
+      continue;
+    }
+    /* fill rx buffers until the socket, the credit or the buffers run dry */
+    do
+    {
+      ret = virtio_vsock_rx_data(vs, conn);
+    } while (ret > 0 && vsock_conn_wants_rx(conn));
+    if (ret < 0)
+    {
+      vsock_conn_reset(vs, conn);
+    }
+    else if (ret == 0 && conn->host_done)
+    {
+      vsock_send_ctrl(vs, conn, VIRTIO_VSOCK_OP_SHUTDOWN,
+          VIRTIO_VSOCK_SHUTDOWN_RCV | VIRTIO_VSOCK_SHUTDOWN_SEND);
+    }
+  }
+  if (FD_ISSET(vs->listen_fd, rfds))
+    vsock_accept(vs);
+  virtio_vsock_rx_ctrl(vs);
+  virtual_publish_used(&vs->common);
+}
+
+void virtio_vsock_device_init(cpu_state_t *state, const virtio_vsock_config_t *config,
+    virtual_io_bus_t *bus)
+{
+  virtio_vsock_device_t *vs;
+  struct sockaddr_un addr;
+
+  vs = malloc(sizeof(*vs));
+  memset(vs, 0, sizeof(*vs));
+  vs->path = config->path;
+  vs->guest_cid = config->guest_cid;
+  vs->next_port = VSOCK_FIRST_HOST_PORT;
+  vs->bounce = malloc(VIRTIO_VSOCK_MAX_PKT);
+  if (!vs->bounce)
+  {
+    printf("virtio-vsock: malloc error\n");
+    exit(1);
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(config->path) >= sizeof(addr.sun_path) - 12)
+  {
+    printf("vsock socket path too long: %s\n", config->path);
+    exit(1);
+  }
+  strcpy(addr.sun_path, config->path);
+  vs->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (vs->listen_fd < 0)
+  {
+    perror("socket");
+    exit(1);
+  }
+  unlink(addr.sun_path);
+  if (bind(vs->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(vs->listen_fd, 16) < 0)
+  {
+    perror(config->path);
+    exit(1);
+  }
+  fcntl(vs->listen_fd, F_SETFL, O_NONBLOCK);
+
+  vs->item = vsock_item;
+  virtio_init(state, &vs->item, &vs->common, bus, 19, VIRTIO_VSOCK_CONFIG_SIZE,
+      virtio_vsock_recv_request);
+  vs->common.device_recv_done = virtio_vsock_recv_done;
+  /* rx buffers are filled as data arrives; event buffers are only held */
+  vs->common.queue[VIRTIO_VSOCK_RX_Q].manual_recv = true;
+  vs->common.queue[VIRTIO_VSOCK_EVENT_Q].manual_recv = true;
+  put_le64(vs->common.config_space, config->guest_cid);
+
+  riscv_machine.vsock = vs;
+}
+
+void virtio_vsock_print_stats(virtio_vsock_device_t *vs, FILE *f)
+{
+  fprintf(f, "virtio-vsock %s: %" PRIu64 " connections, %" PRIu64 " KiB to the guest, "
+      "%" PRIu64 " KiB from the guest, %" PRIu64 " resets, %" PRIu64 " notifies, %" PRIu64 " interrupts\n",
+      vs->path, vs->connections, vs->rx_bytes / 1024, vs->tx_bytes / 1024, vs->resets,
+      vs->common.notify_count, vs->common.irq_count);
+}
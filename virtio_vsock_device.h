@@ -0,0 +1,124 @@
+#ifndef __VIRTIO_VSOCK_H__
+#define __VIRTIO_VSOCK_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include "virtio_interface.h"
+#include "riscv_definations.h"
+
+typedef struct
+{
+  const char *path; /* UNIX socket the host side is reached through */
+  uint64_t guest_cid;
+} virtio_vsock_config_t;
+
+typedef struct
+{
+  uint64_t src_cid;
+  uint64_t dst_cid;
+  uint32_t src_port;
+  uint32_t dst_port;
+  uint32_t len;
+  uint16_t type;
+  uint16_t op;
+  uint32_t flags;
+  uint32_t buf_alloc;
+  uint32_t fwd_cnt;
+} vsock_hdr_t;
+
+typedef enum
+{
+  VSOCK_HANDSHAKE,  /* host client accepted, waiting for its CONNECT line */
+  VSOCK_CONNECTING, /* request sent to the guest */
+  VSOCK_CONNECTED,
+} vsock_state_enum;
+
+/*
+ * One stream between a guest port and a host UNIX socket. Credit works
+ * as in the virtio spec: the guest may have at most buf_alloc bytes in
+ * flight beyond fwd_cnt, and rx_cnt may run at most peer_buf_alloc bytes
+ * ahead of peer_fwd_cnt.
+ */
+typedef struct vsock_conn
+{
+  int fd;
+  vsock_state_enum state;
+  uint32_t host_port;
+  uint32_t guest_port;
+
+  uint32_t peer_buf_alloc;
+  uint32_t peer_fwd_cnt;
+  uint32_t rx_cnt;       /* bytes put in the rx queue */
+  uint32_t fwd_cnt;      /* guest bytes written to fd */
+  uint32_t last_fwd_cnt; /* fwd_cnt the guest was last told about */
+
+  /* guest bytes the socket did not take yet */
+  uint8_t *tx_buf;
+  int tx_start;
+  int tx_len;
+
+  bool guest_send_done; /* the guest will not send any more */
+  bool guest_recv_done; /* the guest will not receive any more */
+  bool host_done;       /* fd reached end of file */
+
+  char line[32]; /* CONNECT line of a host client */
+  int line_len;
+
+  struct vsock_conn *next;
+} vsock_conn_t;
+
+/*
+ * The guest reaches host port P by connecting to CID 2, which opens the
+ * UNIX socket "path_P". Host programs reach guest port P by connecting
+ * to path and sending "CONNECT P\n"; they get "OK <host port>\n" once
+ * the guest accepts. Everything runs on the main thread; rx data is read
+ * from the sockets straight into guest buffers and tx data is written
+ * from them.
+ */
+typedef struct virtio_vsock_device
+{
+  virtual_io_device_t common;
+  address_item_t item;
+  const char *path;
+  uint64_t guest_cid;
+  int listen_fd;
+  uint32_t next_port; /* host ports for host initiated connections */
+  vsock_conn_t *conns;
+
+  vsock_hdr_t ctrl[VIRTIO_VSOCK_MAX_CTRL];
+  int ctrl_first;
+  int ctrl_count;
+
+  uint8_t *bounce; /* for buffers that are not plain guest RAM */
+
+  uint64_t connections;
+  uint64_t rx_bytes;
+  uint64_t tx_bytes;
+  uint64_t resets;
+} virtio_vsock_device_t;
+
+extern void virtio_vsock_device_init(cpu_state_t *state, const virtio_vsock_config_t *config,
+    virtual_io_bus_t *bus);
+extern void vsock_hdr_decode(vsock_hdr_t *hdr, const uint8_t *buf);
+extern void vsock_hdr_encode(uint8_t *buf, const vsock_hdr_t *hdr);
+extern void vsock_fill_hdr(virtio_vsock_device_t *vs, vsock_conn_t *conn, vsock_hdr_t *hdr,
+    uint16_t op, uint32_t flags, uint32_t len);
+extern vsock_conn_t *vsock_conn_find(virtio_vsock_device_t *vs, uint32_t host_port, uint32_t guest_port);
+extern void vsock_conn_free(virtio_vsock_device_t *vs, vsock_conn_t *conn);
+extern void vsock_send_ctrl(virtio_vsock_device_t *vs, vsock_conn_t *conn, uint16_t op, uint32_t flags);
+extern void vsock_send_rst(virtio_vsock_device_t *vs, const vsock_hdr_t *to);
+extern void vsock_conn_reset(virtio_vsock_device_t *vs, vsock_conn_t *conn);
+extern void vsock_guest_connect(virtio_vsock_device_t *vs, const vsock_hdr_t *hdr);
+extern void vsock_guest_accepted(virtio_vsock_device_t *vs, vsock_conn_t *conn);
+extern void vsock_guest_shutdown(virtio_vsock_device_t *vs, vsock_conn_t *conn, uint32_t flags);
+extern void vsock_conn_write(virtio_vsock_device_t *vs, vsock_conn_t *conn,
+    const struct iovec *iov, int iov_count);
+extern bool virtio_vsock_can_receive(virtio_vsock_device_t *vs);
+extern void virtio_vsock_rx_ctrl(virtio_vsock_device_t *vs);
+extern int virtio_vsock_rx_data(virtio_vsock_device_t *vs, vsock_conn_t *conn);
+extern int virtio_vsock_set_fds(virtio_vsock_device_t *vs, fd_set *rfds, fd_set *wfds, int fd_max);
+extern void virtio_vsock_poll(virtio_vsock_device_t *vs, fd_set *rfds, fd_set *wfds);
+extern void virtio_vsock_print_stats(virtio_vsock_device_t *vs, FILE *f);
+#endif